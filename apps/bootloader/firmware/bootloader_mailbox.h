@@ -0,0 +1,61 @@
+/*
+ * M-Stack USB Bootloader
+ *
+ * This file may be used under the terms of the Simplified BSD License
+ * (2-clause), which can be found in LICENSE-bsd.txt in the parent
+ * directory.
+ *
+ * It is worth noting that M-Stack itself is not under the same license as
+ * this file.  See the top-level README.txt for more information.
+ */
+
+#ifndef BOOTLOADER_MAILBOX_H__
+#define BOOTLOADER_MAILBOX_H__
+
+#include <stdint.h>
+#include <xc.h>
+
+/* Entering the bootloader from the application.
+ *
+ * The bootloader starts a valid application on any reset, so an
+ * application which is to be updated without a power cycle has to ask
+ * for the bootloader. It does this by putting BOOTLOADER_MAILBOX_ENTER
+ * in the mailbox, a word of RAM which the linker script keeps at the
+ * same address for the bootloader and the application and which isn't
+ * initialized at startup, and resetting. The bootloader clears the
+ * mailbox, so the reset after that starts the application again.
+ *
+ * The bootloader software asks for this with the ENTER_BOOTLOADER vendor
+ * request (OUT, recipient other, no data), sent to the application's
+ * VID/PID. The application should call bootloader_enter() once the
+ * request's status stage has gone out, for example:
+ *
+ *	static void enter_bootloader_cb(bool transfer_ok, void *context)
+ *	{
+ *		if (transfer_ok)
+ *			bootloader_enter();
+ *	}
+ *
+ * and in its unknown setup request callback:
+ *
+ *	if (setup->bRequest == ENTER_BOOTLOADER) {
+ *		usb_send_data_stage(NULL, 0, enter_bootloader_cb, NULL);
+ *		return 0;
+ *	}
+ */
+
+#define ENTER_BOOTLOADER 112 /* Vendor request to the application */
+
+#define BOOTLOADER_MAILBOX_ENTER 0x544f4f42UL /* "BOOT" */
+
+/* Defined by the linker script */
+extern volatile uint32_t bootloader_mailbox;
+
+/* Reset into the bootloader. Doesn't return. */
+static inline void bootloader_enter(void)
+{
+	bootloader_mailbox = BOOTLOADER_MAILBOX_ENTER;
+	asm("reset");
+}
+
+#endif /* BOOTLOADER_MAILBOX_H__ */
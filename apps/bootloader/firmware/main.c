@@ -18,6 +18,7 @@
 #include <string.h>
 #include "usb_config.h"
 #include "usb_ch9.h"
+#include "bootloader_mailbox.h"
 
 #ifdef __PIC24FJ64GB002__
 _CONFIG1(WDTPS_PS16 & FWPSA_PR32 & WINDIS_OFF & FWDTEN_OFF & ICS_PGx1 & GWRP_OFF & GCP_OFF & JTAGEN_OFF)
@@ -44,6 +45,9 @@ _CONFIG3(WPFP_WPFP255 & SOSCSEL_SOSC & WUTSEL_LEG & ALTPMP_ALPMPDIS & WPDIS_WPDI
 #pragma config IOL1WAY = OFF
 #pragma config WPDIS = OFF /* This pragma seems backwards */
 
+#elif __linux__
+	/* Host simulation (sim/). There are no configuration bits. */
+
 #else
 	#error "Set Configuration bits for your platform"
 #endif
@@ -67,20 +71,28 @@ _CONFIG3(WPFP_WPFP255 & SOSCSEL_SOSC & WUTSEL_LEG & ALTPMP_ALPMPDIS & WPDIS_WPDI
  * use that value as an initializer for a constant.  Becaause of this, the
  * assignment of the uint32_t "constants" below has to be done in main().
  */
+#ifdef __linux__
+/* The host simulation has no linker script. The simulated part's memory
+ * map is in sim/include/xc.h. */
+#define LINKER_VAR(X) SIM_##X
+#else
 const extern __prog__ uint8_t _IVT_MAP_BASE;
 const extern __prog__ uint8_t _APP_BASE;
 const extern __prog__ uint8_t _APP_LENGTH;
+const extern __prog__ uint8_t _APP_HEADER_BASE;
 const extern __prog__ uint8_t _FLASH_BLOCK_SIZE;
 const extern __prog__ uint8_t _FLASH_TOP;
 const extern __prog__ uint8_t _CONFIG_WORDS_BASE;
 const extern __prog__ uint8_t _CONFIG_WORDS_TOP;
 
 #define LINKER_VAR(X) (((uint32_t) &_##X) & 0x00ffffff)
+#endif
 /* "Constants" for linker script values. These are assigned in main() using the
  * LINKER_VAR() macro. See the above comment for rationale. */
 static uint32_t IVT_MAP_BASE;
 static uint32_t APP_BASE;
 static uint32_t APP_LENGTH;
+static uint32_t APP_HEADER_BASE;
 static uint32_t FLASH_BLOCK_SIZE;
 static uint32_t FLASH_TOP;
 static uint32_t CONFIG_WORDS_BASE;
@@ -102,13 +114,87 @@ static uint32_t CONFIG_WORDS_TOP;
 
 #define BUFFER_LENGTH (INSTRUCTIONS_PER_ROW * WORDS_PER_INSTRUCTION)
 
+#define MIN(X,Y) ((X)<(Y)?(X):(Y))
+
+/* Read each row back as soon as it's written, while it's still in RAM,
+ * and compare it with what was received. Rows which don't match are
+ * reported by GET_FLASH_STATUS, so that the host doesn't have to read
+ * them back itself. Comment this out to save the time it takes. */
+#define VERIFY_ROWS
+
 /* Protocol commands */
 #define CLEAR_FLASH 100
 #define SEND_DATA 101
 #define GET_CHIP_INFO 102
 #define REQUEST_DATA 103
+#define ERASE_PAGES 104
 #define SEND_RESET 105
+#define GET_FLASH_STATUS 106
+#define SET_CRC_RANGE 107
+#define GET_CRC 108
+#define GET_PAGE_CRCS 109
+#define SEND_DATA_LZ 110
+#define WRITE_APP_HEADER 111
+
+/* Bulk programming commands (EP 1).
+ *
+ * Instead of one SEND_DATA control transfer per row, the host can stream
+ * rows to EP 1 OUT.  Each command is an 8-byte header followed, for
+ * BULK_PROGRAM, by length bytes of row data:
+ *	byte 0     command
+ *	byte 1     reserved (0)
+ *	bytes 2-3  length, in bytes (little-endian)
+ *	bytes 4-7  address, in bytes as for SEND_DATA (little-endian)
+ * A transfer can carry any number of commands, but must end with a short
+ * packet (or a zero-length packet) at the end of a command.  Rows are
+ * written as they arrive; EP 1 OUT NAKs while a row is being written.
+ *
+ * Nothing is sent back until the host sends BULK_STATUS, which is
+ * answered on EP 1 IN with an 8-byte struct bulk_status.  After an error
+ * the rest of the transfer is discarded and no more rows are written
+ * until BULK_STATUS has reported the error. */
+#define BULK_PROGRAM 1
+#define BULK_STATUS 2
+
+#define BULK_HEADER_LEN 8
 
+/* bulk_status.status */
+#define BULK_OK 0
+#define BULK_BAD_COMMAND 1 /* Unknown command, bad length, or short transfer */
+#define BULK_BAD_ADDRESS 2 /* Outside the writable region */
+
+/* Reply to BULK_STATUS, 8 bytes, little-endian */
+struct bulk_status {
+	uint8_t status;
+	uint8_t command;    /* Command which failed */
+	uint16_t rows;      /* Rows written since the last BULK_STATUS */
+	uint32_t address;   /* Address of the command which failed */
+};
+
+/* chip_info.flags */
+#define CHIP_INFO_BULK 0x01      /* Supports the bulk programming commands */
+#define CHIP_INFO_MULTI_ROW 0x02 /* SEND_DATA can carry more than one row */
+#define CHIP_INFO_ERASE_PAGES 0x04 /* Supports ERASE_PAGES */
+#define CHIP_INFO_ASYNC_ERASE 0x08 /* Erases finish in the background;
+                                     poll GET_FLASH_STATUS */
+#define CHIP_INFO_CRC 0x10         /* Supports SET_CRC_RANGE and GET_CRC */
+#define CHIP_INFO_PAGE_CRCS 0x20   /* Supports GET_PAGE_CRCS */
+#define CHIP_INFO_SEND_DATA_LZ 0x40 /* Supports SEND_DATA_LZ */
+#define CHIP_INFO_LONG_READ 0x80   /* REQUEST_DATA can read more than a row */
+
+/* chip_info.capabilities: the flags above, and these */
+#define CHIP_INFO_VERIFY_ROWS 0x100 /* Rows are verified as they're written;
+                                      GET_FLASH_STATUS reports failures */
+#define CHIP_INFO_APP_HEADER 0x200  /* Supports WRITE_APP_HEADER */
+#define CHIP_INFO_MAILBOX 0x400     /* Stays in USB mode when asked through
+                                      bootloader_mailbox */
+
+/* chip_info.version. Firmware from before it was there sends 0, and
+ * only the fields up to app_header_address. */
+#define CHIP_INFO_VERSION 1
+
+/* Reply to GET_CHIP_INFO, little-endian. A host which asks for fewer
+ * bytes gets the start of it. */
 struct chip_info {
 	uint32_t user_region_base;
 	uint32_t user_region_top;
@@ -117,54 +203,217 @@ struct chip_info {
 
 	uint8_t bytes_per_instruction;
 	uint8_t instructions_per_row;
-	uint8_t pad0;
+	uint8_t flags;
+	uint8_t version;
+
+	uint32_t erase_page_size; /* Bytes, for ERASE_PAGES */
+	uint32_t app_header_address; /* Bytes, for WRITE_APP_HEADER */
+
+	/* Version 1 */
+	uint32_t capabilities;
+	uint16_t max_transfer;  /* Largest wLength for SEND_DATA,
+	                           SEND_DATA_LZ and REQUEST_DATA */
+	uint16_t max_page_crcs; /* Most pages for one GET_PAGE_CRCS */
+};
+
+/* Application header, 12 bytes, little-endian.
+ *
+ * Once the application has been programmed, the host sends this with
+ * WRITE_APP_HEADER. The bootloader checks the CRC-32 (as for GET_CRC) of
+ * the length bytes of the user region, and only if it matches, writes
+ * the header to the row at APP_HEADER_BASE, which the linker script keeps
+ * the application out of, and which SEND_DATA can't write. The CRC is
+ * worked out from the main loop, a page at a time, and until the header
+ * is written, GET_FLASH_STATUS shows busy and REQUEST_DATA waits, so the
+ * host can read the header back to see whether it took. On any reset,
+ * the bootloader checks the marker and the length, and if they're good,
+ * starts the application without bringing up USB. The CRC isn't checked
+ * again there, since that takes a pass over the whole application.
+ * Instead, erasing any page of the user region erases the header's page
+ * too, and before the others, and rows can't be written (by SEND_DATA,
+ * SEND_DATA_LZ or BULK_PROGRAM) while the header is there, so a partly
+ * erased, partly programmed or overwritten application has no header,
+ * and the bootloader stays in USB mode.
+ *
+ * SEND_RESET starts the application only through this check too, so a
+ * host which never sends WRITE_APP_HEADER (such as software from before
+ * it was added) leaves the device in the bootloader after SEND_RESET.
+ *
+ * In flash, each 16 bits of the header are in the low word of an
+ * instruction. */
+#define APP_HEADER_MARKER 0x3142534dUL /* "MSB1" */
+
+struct app_header {
+	uint32_t marker;
+	uint32_t length; /* Bytes, from the base of the user region */
+	uint32_t crc;
+};
+
+/* Reply to GET_FLASH_STATUS, little-endian.
+ *
+ * CLEAR_FLASH and ERASE_PAGES return as soon as the erase is queued, and
+ * the main loop erases one page at a time. The host polls this until
+ * erase_pages_left is 0 (or just sends the next command, which waits
+ * for the erase). erase_pages_done counts the pages erased since the
+ * last time there were none left.
+ *
+ * With VERIFY_ROWS, it also counts the rows which didn't read back as
+ * written since the last GET_FLASH_STATUS; without it, those fields are 0
+ * (CHIP_INFO_VERIFY_ROWS tells the host which). Firmware from before
+ * chip_info version 1 sent only the first 8 bytes without VERIFY_ROWS,
+ * and 12 with it.
+ *
+ * blank_rows counts the rows since the last GET_FLASH_STATUS which were
+ * all 0xff, and so weren't programmed (see row_blank()). */
+struct flash_status {
+	uint8_t busy;              /* An erase, row write or
+	                              WRITE_APP_HEADER is pending */
 	uint8_t pad1;
+	uint16_t erase_pages_left; /* Including the one being erased */
+	uint16_t erase_pages_done;
+	uint16_t verify_failures;  /* Rows which didn't verify */
+	uint32_t verify_address;   /* Byte address of the first of them */
+	uint16_t blank_rows;       /* Rows skipped as blank */
+};
+
+#define FLASH_STATUS_LEN 14
+
+/* Data-to-program: buffer and attributes. There are two rows, so that
+ * one can be received while the main loop programs the other. */
+struct row {
+	uint32_t address; /* program space word address */
+	size_t length;    /* number of words, not bytes */
+	bool full;        /* Waiting to be (or being) programmed */
+	uint16_t data[BUFFER_LENGTH];
+};
+
+static struct row rows[2];
+static uint8_t fill_row;  /* Row being received into */
+static uint8_t write_row; /* Next row to program */
+static bool writing;      /* NVM write of rows[write_row] in progress */
+static uint16_t blank_rows; /* Rows skipped since the last GET_FLASH_STATUS */
+
+/* Pages waiting to be erased, one bit per page of the user region, the
+ * LSB of the first byte being the page at USER_REGION_BASE. This is
+ * enough for the 256 KB PIC24F parts. */
+#define MAX_ERASE_PAGES 256
+static uint8_t erase_bitmap[MAX_ERASE_PAGES / 8];
+static uint16_t erase_pages_left;
+static uint16_t erase_pages_done;
+static bool erasing;      /* NVM erase in progress */
+
+#define ROW_BYTES sizeof(rows[0].data)
+
+static struct flash_status flash_status;
+
+#ifdef VERIFY_ROWS
+/* Rows which didn't verify since the last GET_FLASH_STATUS */
+static uint16_t verify_failures;
+static uint32_t verify_address;
+#endif
+
+/* Data stage of SET_CRC_RANGE, 8 bytes, little-endian. GET_CRC returns
+ * the CRC-32 (as for zlib and Ethernet) of the length bytes of flash
+ * starting at address, read as REQUEST_DATA would read them, so that
+ * the host can compare it with the CRC of the hex file's data. */
+struct crc_range {
+	uint32_t address; /* Bytes, as for REQUEST_DATA */
+	uint32_t length;  /* Bytes */
 };
 
-/* Data-to-program: buffer and attributes. */
-static uint32_t write_address; /* program space word address */
-static size_t write_length;    /* number of words, not bytes */
+static struct crc_range crc_range;
+static uint32_t crc_result;
+
+/* The CRCs for GET_PAGE_CRCS */
 static uint16_t prog_buf[BUFFER_LENGTH];
 
-static struct chip_info chip_info = { };
+/* A CRC-32 of flash being worked out a page at a time */
+struct crc_job {
+	uint32_t address; /* Bytes, as for REQUEST_DATA */
+	uint32_t left;    /* Bytes */
+	uint32_t crc;
+};
 
-void clear_flash()
-{
-	uint32_t prog_addr = USER_REGION_BASE;
-	size_t offset;
+/* IN request (GET_CRC, GET_PAGE_CRCS or REQUEST_DATA) whose data stage
+ * waits for the main loop, or 0. service_requests() works it out a page
+ * of flash at a time, once the erases, row writes and WRITE_APP_HEADER
+ * queued before it are done, and starts the data stage when it's
+ * finished. Until then the host gets NAKs. If the host gives up and
+ * sends another request, of any kind, the stack calls
+ * deferred_abandoned_cb(). */
+static uint8_t deferred_request;
+static uint16_t deferred_len; /* wLength */
+static struct crc_job crc_job; /* GET_CRC */
+static uint16_t page_crcs_first;
+static uint16_t page_crcs_done;
 
-	/* Clear each flash block. TBLPAG/offset is set to the
-	 * base address (lowest address) of each block. */
-	while (prog_addr < USER_REGION_TOP) {
-		TBLPAG = prog_addr >> 16;
-		offset = prog_addr & 0xffff;
+/* WRITE_APP_HEADER received, with its CRC being checked from the main
+ * loop before the header is written */
+static bool app_header_pending;
+static struct crc_job app_header_crc;
 
-		__builtin_tblwtl(offset, 0x00);
-		NVMCON = 0x4042;
-		asm("DISI #5");
-		__builtin_write_NVM();
+/* Byte address of the next byte of a REQUEST_DATA data stage */
+static uint32_t read_address;
 
-		while (NVMCONbits.WR == 1)
-			;
+/* State of a SEND_DATA data stage */
+static uint32_t send_address;   /* Byte address of the row being received */
+static uint16_t send_remaining; /* Bytes still to come, from send_address */
+static uint16_t send_row_len;   /* Bytes in the row being received */
+static uint16_t send_pos;       /* Bytes of it received so far */
 
-		prog_addr += FLASH_BLOCK_SIZE;
-	}
-}
+/* State of a SEND_DATA_LZ data stage.
+ *
+ * SEND_DATA_LZ is SEND_DATA with the data compressed. wValue is the row
+ * number to start at (the byte address divided by the row size) and
+ * wIndex is the length of the data once decompressed. The data stage is
+ * a series of tokens, each starting with a control byte c:
+ *	0x00-0x7f  c + 1 literal bytes follow
+ *	0x80-0xff  a match: the next byte is the distance back (minus 1,
+ *	           so 1-256) to copy (c & 0x7f) + 3 bytes from
+ * Tokens can span packets. Matches come from the last 256 bytes of
+ * output, which covers runs of 0xff and repeated instructions. */
+#define LZ_HISTORY_LEN 256
+static struct {
+	uint8_t history[LZ_HISTORY_LEN];
+	uint8_t pos;       /* Where the next output byte goes in history */
+	uint8_t literals;  /* Literal bytes still to come */
+	uint8_t match_len; /* Length of the match whose distance is next */
+} lz;
+
+static struct chip_info chip_info = { };
+static struct app_header app_header;
+
+/* The application header is in flash, and no erase which removes it has
+ * been queued. Nothing is written to the user region while it is. */
+static bool app_header_present;
+
+/* State of the EP 1 command stream */
+static struct {
+	uint8_t header[BULK_HEADER_LEN];
+	uint8_t header_len;   /* Header bytes received so far */
+	uint16_t data_len;    /* Data bytes in the current command */
+	uint16_t data_pos;    /* Data bytes received so far */
+	bool skip;            /* Don't write the current row */
+	bool discard;         /* Discard until the end of the transfer */
+	struct bulk_status status;
+} bulk;
 
-void write_flash_row()
+/* Start programming a row. This doesn't wait for the write to finish;
+ * service_flash() checks NVMCONbits.WR. */
+static void start_row_write(const struct row *row)
 {
 	size_t offset;
 	uint8_t i;
-	uint32_t prog_addr = write_address;
+	uint32_t prog_addr = row->address;
 
 	NVMCON = 0x4001;
 	TBLPAG = prog_addr >> 16;
 	offset = prog_addr & 0xffff;
 
 	/* Write the data provided */
-	for (i = 0; i < write_length; i++) {
-		__builtin_tblwtl(offset, prog_buf[i]);
-		__builtin_tblwth(offset, prog_buf[++i]);
+	for (i = 0; i < row->length; i++) {
+		__builtin_tblwtl(offset, row->data[i]);
+		__builtin_tblwth(offset, row->data[++i]);
 		offset += 2;
 	}
 
@@ -177,9 +426,84 @@ void write_flash_row()
 
 	asm("DISI #5");
 	__builtin_write_NVM();
+}
 
-	while (NVMCONbits.WR == 1)
-		;
+/* Start erasing the flash block starting at prog_addr. This doesn't
+ * wait for the erase to finish; service_flash() checks NVMCONbits.WR. */
+static void start_erase(uint32_t prog_addr)
+{
+	size_t offset;
+
+	TBLPAG = prog_addr >> 16;
+	offset = prog_addr & 0xffff;
+
+	__builtin_tblwtl(offset, 0x00);
+	NVMCON = 0x4042;
+	asm("DISI #5");
+	__builtin_write_NVM();
+}
+
+/* Number of pages in the user region which can be erased */
+static uint16_t user_region_pages(void)
+{
+	uint32_t pages = (USER_REGION_TOP - USER_REGION_BASE) / FLASH_BLOCK_SIZE;
+	return MIN(pages, MAX_ERASE_PAGES);
+}
+
+/* Add page (of the user region) to the pages to erase */
+static void set_erase(uint16_t page)
+{
+	uint8_t mask = 1 << (page % 8);
+
+	if (erase_bitmap[page / 8] & mask)
+		return;
+	if (erase_pages_left == 0)
+		erase_pages_done = 0;
+	erase_bitmap[page / 8] |= mask;
+	erase_pages_left++;
+}
+
+/* Add page to the pages to erase, along with the application header's
+ * page, so that erasing any of the application removes the header. */
+static void queue_erase(uint16_t page)
+{
+	uint16_t header_page = (APP_HEADER_BASE - USER_REGION_BASE) / FLASH_BLOCK_SIZE;
+
+	set_erase(page);
+	if (header_page < user_region_pages())
+		set_erase(header_page);
+	app_header_present = false;
+	app_header_pending = false;
+}
+
+/* Start erasing page, if it's waiting to be erased */
+static bool start_page_erase(uint16_t page)
+{
+	uint8_t mask = 1 << (page % 8);
+
+	if (page >= MAX_ERASE_PAGES || !(erase_bitmap[page / 8] & mask))
+		return false;
+
+	erase_bitmap[page / 8] &= ~mask;
+	start_erase(USER_REGION_BASE + (uint32_t) page * FLASH_BLOCK_SIZE);
+	erasing = true;
+	return true;
+}
+
+/* Start erasing the next page waiting to be erased: the application
+ * header's page if it's waiting, so that the header is gone before any
+ * of the application is, and otherwise the lowest. */
+static void start_next_erase(void)
+{
+	uint16_t page;
+
+	if (start_page_erase((APP_HEADER_BASE - USER_REGION_BASE) / FLASH_BLOCK_SIZE))
+		return;
+
+	for (page = 0; page < MAX_ERASE_PAGES; page++) {
+		if (start_page_erase(page))
+			return;
+	}
 }
 
 /* Read an instruction from flash. word_addr is the word address, not
@@ -191,15 +515,498 @@ static void read_flash(uint32_t word_addr, uint16_t *low, uint16_t *high)
 	*low  = __builtin_tblrdl(word_addr & 0xffff);
 }
 
-/* Read data starting at prog_addr into the global prog_buf. prog_addr
- * and len are in words, not bytes. */
-static void read_prog_data(uint32_t prog_addr, uint32_t len/*words*/)
+#ifdef VERIFY_ROWS
+/* Check that row reads back as it was written, recording it for
+ * GET_FLASH_STATUS if not. Padding isn't checked, nor is the upper (phantom)
+ * byte of each instruction, which reads as 0. */
+static void verify_row(const struct row *row)
+{
+	uint8_t i;
+
+	for (i = 0; i < row->length; i += 2) {
+		uint16_t low, high;
+
+		read_flash(row->address + i, &low, &high);
+		if (low != row->data[i] ||
+		    (high & 0xff) != (row->data[i+1] & 0xff)) {
+			if (verify_failures++ == 0)
+				verify_address = row->address * 2;
+			return;
+		}
+	}
+}
+#endif
+
+/* Whether row is all 0xff. Programming can only clear bits, so writing
+ * such a row would leave flash as it is, and it's skipped. The upper
+ * (phantom) byte of each instruction isn't programmed, so it doesn't
+ * count. */
+static bool row_blank(const struct row *row)
+{
+	uint8_t i;
+
+	for (i = 0; i < row->length; i += 2) {
+		if (row->data[i] != 0xffff || (row->data[i+1] & 0xff) != 0xff)
+			return false;
+	}
+
+	return true;
+}
+
+/* Move erasing and row programming along: finish the erase or write in
+ * progress, if it's done, and start the next one. Called from the main
+ * loop. Pending erases go first, since any rows received since they were
+ * queued are for the pages being erased. */
+static void service_flash(void)
+{
+	if (writing || erasing) {
+		if (NVMCONbits.WR == 1)
+			return;
+		if (writing) {
+#ifdef VERIFY_ROWS
+			verify_row(&rows[write_row]);
+#endif
+			rows[write_row].full = false;
+			write_row ^= 1;
+		}
+		if (erasing) {
+			erase_pages_left--;
+			erase_pages_done++;
+		}
+		writing = false;
+		erasing = false;
+	}
+
+	if (erase_pages_left > 0) {
+		start_next_erase();
+	}
+	else if (rows[write_row].full) {
+		if (row_blank(&rows[write_row])) {
+			/* Still check that the row is erased, as
+			 * programming it would have. */
+#ifdef VERIFY_ROWS
+			verify_row(&rows[write_row]);
+#endif
+			rows[write_row].full = false;
+			write_row ^= 1;
+			blank_rows++;
+		}
+		else {
+			start_row_write(&rows[write_row]);
+			writing = true;
+		}
+	}
+}
+
+/* Program all the rows which have been received (doing any erase
+ * queued before them first). Anything which reads or erases flash, or
+ * resets, calls this first. */
+static void flush_rows(void)
+{
+	while (rows[0].full || rows[1].full)
+		service_flash();
+}
+
+/* Finish all the pending erases and row writes */
+static void finish_flash(void)
+{
+	while (erase_pages_left > 0 || rows[0].full || rows[1].full)
+		service_flash();
+}
+
+/* Queue the erase of the whole user region */
+static void clear_flash(void)
+{
+	uint16_t page;
+
+	flush_rows();
+
+	for (page = 0; page < user_region_pages(); page++)
+		queue_erase(page);
+}
+
+/* Number of the page (flash block of the user region) which the next bit
+ * of an ERASE_PAGES bitmap is for */
+static uint16_t erase_page;
+
+/* Called for each packet of an ERASE_PAGES data stage, which is a bitmap
+ * of the pages of the user region to erase, in the same form as
+ * erase_bitmap. Bits past the end of the user region are ignored. The
+ * pages are queued for the main loop to erase. */
+static void erase_pages_packet_cb(const unsigned char *data, uint8_t len, void *context)
+{
+	uint8_t i, bit;
+
+	for (i = 0; i < len; i++) {
+		for (bit = 0; bit < 8; bit++, erase_page++) {
+			if ((data[i] & (1 << bit)) && erase_page < user_region_pages())
+				queue_erase(erase_page);
+		}
+	}
+}
+
+/* Hand the row being received to the main loop for programming, and
+ * move on to the other one, waiting for it to be programmed if it
+ * hasn't been yet. */
+static void queue_row(void)
+{
+	rows[fill_row].full = true;
+	fill_row ^= 1;
+
+	while (rows[fill_row].full)
+		service_flash();
+}
+
+/* Check that a write of len bytes at byte address addr is within the
+ * writable region (ie: doesn't overwrite the bootloader or config
+ * words), and that there's no application header, which would start
+ * the application over what was written. */
+static int8_t check_write_range(uint32_t addr, uint32_t len)
+{
+	uint32_t word_addr = addr / 2; /* Convert to word address. */
+	uint32_t word_len = len / 2;   /* Convert to word length. */
+
+	if (app_header_present || app_header_pending)
+		return -1;
+
+	if (word_addr < USER_REGION_BASE)
+		return -1;
+	if (word_addr + word_len > USER_REGION_TOP)
+		return -1;
+
+	/* Check for overflow (unlikely on known MCUs) */
+	if (word_addr + word_len < word_addr)
+		return -1;
+
+	/* Only WRITE_APP_HEADER writes the header's row. */
+	if (word_addr < APP_HEADER_BASE + BUFFER_LENGTH &&
+	    word_addr + word_len > APP_HEADER_BASE)
+		return -1;
+
+	return 0;
+}
+
+/* Set up the row being received for a write of len bytes (at most a
+ * row) at byte address addr. */
+static void start_row(uint32_t addr, uint16_t len)
+{
+	struct row *row = &rows[fill_row];
+
+	row->address = addr / 2; /* Convert to word address. */
+	row->length = len / 2;   /* Convert to word length. */
+	memset(row->data, 0xff, sizeof(row->data));
+}
+
+/* Start receiving the next row of a SEND_DATA data stage */
+static void start_send_row(void)
+{
+	send_row_len = MIN(send_remaining, ROW_BYTES);
+	send_pos = 0;
+	start_row(send_address, send_row_len);
+}
+
+/* Read len bytes of flash starting at byte address addr into buf. Each
+ * instruction is four bytes: the low word, then the high word, whose
+ * upper (phantom) byte reads as 0. */
+static void read_flash_bytes(uint32_t addr, uint8_t *buf, uint16_t len)
+{
+	while (len > 0) {
+		uint16_t words[2];
+		uint8_t i;
+
+		read_flash(addr / BYTES_PER_INSTRUCTION * WORDS_PER_INSTRUCTION,
+		           &words[0], &words[1]);
+
+		for (i = addr % BYTES_PER_INSTRUCTION;
+		     i < BYTES_PER_INSTRUCTION && len > 0;
+		     i++, addr++, len--) {
+			uint16_t w = words[i / 2];
+			*buf++ = (i & 1)? w >> 8: w & 0xff;
+		}
+	}
+}
+
+/* CRC-32 (reflected, polynomial 0xedb88320), a nibble at a time, to
+ * keep the table small. */
+static const uint32_t crc32_table[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+	0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+	0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+static uint32_t crc32_byte(uint32_t crc, uint8_t byte)
+{
+	crc = (crc >> 4) ^ crc32_table[(crc ^ byte) & 0xf];
+	crc = (crc >> 4) ^ crc32_table[(crc ^ (byte >> 4)) & 0xf];
+	return crc;
+}
+
+/* Add len bytes of flash starting at byte address addr to crc */
+static uint32_t crc32_flash_update(uint32_t crc, uint32_t addr, uint32_t len)
+{
+	while (len > 0) {
+		uint8_t buf[16];
+		uint8_t i, n = MIN(len, sizeof(buf));
+
+		read_flash_bytes(addr, buf, n);
+		for (i = 0; i < n; i++)
+			crc = crc32_byte(crc, buf[i]);
+		addr += n;
+		len -= n;
+	}
+
+	return crc;
+}
+
+/* CRC-32 of len bytes of flash starting at byte address addr */
+static uint32_t crc32_flash(uint32_t addr, uint32_t len)
+{
+	return ~crc32_flash_update(0xffffffff, addr, len);
+}
+
+static void start_crc_job(struct crc_job *job, uint32_t addr, uint32_t len)
+{
+	job->address = addr;
+	job->left = len;
+	job->crc = 0xffffffff;
+}
+
+/* Add up to a page of flash to job's CRC. Returns true once it's done,
+ * when the CRC-32 is ~job->crc. */
+static bool run_crc_job(struct crc_job *job)
+{
+	uint32_t n = MIN(job->left, FLASH_BLOCK_SIZE * 2);
+
+	job->crc = crc32_flash_update(job->crc, job->address, n);
+	job->address += n;
+	job->left -= n;
+	return job->left == 0;
+}
+
+static void empty_cb(bool transfer_ok, void *context);
+
+/* Called for each packet of a REQUEST_DATA data stage */
+static void request_data_packet_cb(unsigned char *buf, uint8_t len, void *context)
+{
+	read_flash_bytes(read_address, buf, len);
+	read_address += len;
+}
+
+static void deferred_abandoned_cb(bool transfer_ok, void *context)
+{
+	deferred_request = 0;
+}
+
+/* Whether there are erases or row writes still to do */
+static bool flash_busy(void)
+{
+	return erase_pages_left > 0 || rows[0].full || rows[1].full;
+}
+
+static void write_app_header(void)
+{
+	struct row *row = &rows[fill_row];
+	const uint16_t *h = (const uint16_t*) &app_header;
+	uint8_t i;
+
+	start_row(APP_HEADER_BASE * 2, sizeof(app_header) * 2);
+	for (i = 0; i < sizeof(app_header) / 2; i++)
+		row->data[i * 2] = h[i];
+	queue_row();
+	app_header_present = true;
+}
+
+/* Move the work for WRITE_APP_HEADER and the deferred IN request along,
+ * a page of flash at a time, so that the main loop gets back to USB in
+ * between. Nothing is read until the erases and row writes queued before
+ * them are done, as finish_flash() would wait for. */
+static void service_requests(void)
+{
+	uint32_t addr, crc;
+
+	if (flash_busy())
+		return;
+
+	if (app_header_pending) {
+		if (!run_crc_job(&app_header_crc))
+			return;
+		app_header_pending = false;
+
+		/* Only write a header which the application matches. */
+		if (~app_header_crc.crc == app_header.crc)
+			write_app_header();
+		return;
+	}
+
+	switch (deferred_request) {
+	case GET_CRC:
+		if (!run_crc_job(&crc_job))
+			return;
+		crc_result = ~crc_job.crc;
+		deferred_request = 0;
+		usb_send_data_stage((char*)&crc_result, sizeof(crc_result), empty_cb, NULL);
+		break;
+
+	case GET_PAGE_CRCS:
+		if (page_crcs_done < deferred_len / sizeof(uint32_t)) {
+			addr = USER_REGION_BASE +
+			       (uint32_t) (page_crcs_first + page_crcs_done) * FLASH_BLOCK_SIZE;
+			crc = crc32_flash(addr * 2, FLASH_BLOCK_SIZE * 2);
+			memcpy((uint8_t*) prog_buf + page_crcs_done * sizeof(crc), &crc, sizeof(crc));
+			page_crcs_done++;
+			return;
+		}
+		deferred_request = 0;
+		usb_send_data_stage((char*)prog_buf, deferred_len, empty_cb, NULL);
+		break;
+
+	case REQUEST_DATA:
+		deferred_request = 0;
+		usb_send_data_stage_packets(deferred_len, &request_data_packet_cb, empty_cb, NULL);
+		break;
+	}
+}
+
+/* Finish writing the header from WRITE_APP_HEADER, if there is one, and
+ * any erases and row writes */
+static void finish_app_header(void)
+{
+	while (app_header_pending) {
+		finish_flash();
+		service_requests();
+	}
+	finish_flash();
+}
+
+/* Whether the application header is there. Only the header is read, not
+ * the application: WRITE_APP_HEADER writes it only once the application
+ * matches its CRC, an update erases it before anything else, and nothing
+ * can be written while it's there, so there is no pass over all of flash
+ * on every reset. */
+static bool app_valid(void)
+{
+	uint16_t *h = (uint16_t*) &app_header;
+	uint8_t i;
+
+	for (i = 0; i < sizeof(app_header) / 2; i++) {
+		uint16_t high;
+		read_flash(APP_HEADER_BASE + i * WORDS_PER_INSTRUCTION, &h[i], &high);
+	}
+
+	if (app_header.marker != APP_HEADER_MARKER)
+		return false;
+	if (app_header.length > (APP_HEADER_BASE - USER_REGION_BASE) * 2)
+		return false;
+
+	return true;
+}
+
+static void bulk_error(uint8_t status, uint8_t command, uint32_t address)
+{
+	/* Only the first error is reported. */
+	if (bulk.status.status == BULK_OK) {
+		bulk.status.status = status;
+		bulk.status.command = command;
+		bulk.status.address = address;
+	}
+}
+
+/* Start the command whose header is in bulk.header. Returns true if it
+ * was BULK_STATUS. */
+static bool bulk_start_command(void)
+{
+	uint8_t command = bulk.header[0];
+	uint16_t len = bulk.header[2] | (uint16_t) bulk.header[3] << 8;
+	uint32_t address = bulk.header[4] |
+	                   (uint32_t) bulk.header[5] << 8 |
+	                   (uint32_t) bulk.header[6] << 16 |
+	                   (uint32_t) bulk.header[7] << 24;
+
+	bulk.header_len = 0;
+
+	if (command == BULK_STATUS)
+		return true;
+
+	if (command != BULK_PROGRAM || len == 0 || len > ROW_BYTES) {
+		/* There's no telling where the next command starts. */
+		bulk_error(BULK_BAD_COMMAND, command, address);
+		bulk.discard = true;
+		return false;
+	}
+
+	bulk.header_len = BULK_HEADER_LEN;
+	bulk.data_len = len;
+	bulk.data_pos = 0;
+	bulk.skip = (bulk.status.status != BULK_OK);
+
+	if (!bulk.skip && check_write_range(address, len) < 0) {
+		bulk_error(BULK_BAD_ADDRESS, command, address);
+		bulk.skip = true;
+	}
+
+	if (!bulk.skip)
+		start_row(address, len);
+
+	return false;
+}
+
+/* Handle a packet from EP 1 OUT */
+static void bulk_receive(const unsigned char *data, uint8_t len)
 {
-	int i;
-	for (i = 0; i < len; i += 2) {
-		read_flash(prog_addr + i,
-		           &prog_buf[i]   /*low*/,
-		           &prog_buf[i+1] /*high*/);
+	bool status_requested = false;
+	uint8_t i = 0;
+
+	while (i < len && !bulk.discard) {
+		uint16_t n;
+
+		if (bulk.header_len < BULK_HEADER_LEN) {
+			bulk.header[bulk.header_len++] = data[i++];
+			if (bulk.header_len == BULK_HEADER_LEN)
+				status_requested |= bulk_start_command();
+			continue;
+		}
+
+		n = MIN(len - i, bulk.data_len - bulk.data_pos);
+		if (!bulk.skip)
+			memcpy((uint8_t*) rows[fill_row].data + bulk.data_pos, data + i, n);
+		bulk.data_pos += n;
+		i += n;
+
+		if (bulk.data_pos == bulk.data_len) {
+			if (!bulk.skip) {
+				queue_row();
+				bulk.status.rows++;
+			}
+			bulk.header_len = 0;
+		}
+	}
+
+	/* A short packet ends the transfer, which must end on a command
+	 * boundary. */
+	if (len < EP_1_OUT_LEN) {
+		if (bulk.header_len != 0 && !bulk.discard)
+			bulk_error(BULK_BAD_COMMAND, bulk.header[0], 0);
+		bulk.header_len = 0;
+		bulk.discard = false;
+	}
+
+	if (status_requested && !usb_in_endpoint_halted(1)) {
+		unsigned char *buf = usb_get_in_buffer(1);
+
+		flush_rows();
+
+		buf[0] = bulk.status.status;
+		buf[1] = bulk.status.command;
+		buf[2] = bulk.status.rows & 0xff;
+		buf[3] = bulk.status.rows >> 8;
+		buf[4] = bulk.status.address & 0xff;
+		buf[5] = bulk.status.address >> 8 & 0xff;
+		buf[6] = bulk.status.address >> 16 & 0xff;
+		buf[7] = bulk.status.address >> 24 & 0xff;
+		usb_send_in_buffer(1, sizeof(struct bulk_status));
+
+		memset(&bulk.status, 0, sizeof(bulk.status));
 	}
 }
 
@@ -208,6 +1015,7 @@ int main(void)
 	IVT_MAP_BASE = LINKER_VAR(IVT_MAP_BASE);
 	APP_BASE = LINKER_VAR(APP_BASE);
 	APP_LENGTH = LINKER_VAR(APP_LENGTH);
+	APP_HEADER_BASE = LINKER_VAR(APP_HEADER_BASE);
 	FLASH_BLOCK_SIZE = LINKER_VAR(FLASH_BLOCK_SIZE);
 	FLASH_TOP = LINKER_VAR(FLASH_TOP);
 	CONFIG_WORDS_BASE = LINKER_VAR(CONFIG_WORDS_BASE);
@@ -230,12 +1038,22 @@ int main(void)
 	INTCONbits.GIE = 1;
 #endif
 
-	if (!(RCONbits.POR || RCONbits.BOR)) {
+	/* Stay in the bootloader if the application asked for it (see
+	 * bootloader_mailbox.h), but only for this one reset. */
+	app_header_present = app_valid();
+	if (bootloader_mailbox == BOOTLOADER_MAILBOX_ENTER) {
+		bootloader_mailbox = 0;
+	}
+	else if (app_header_present) {
 		/* Jump to application */
+#ifdef __linux__
+		sim_goto(IVT_MAP_BASE);
+#else
 		__asm__("goto %0"
 		        : /* no outputs */
 			: "r" (IVT_MAP_BASE)
 			: /* no clobber*/);
+#endif
 	}
 	RCONbits.POR = 0;
 	RCONbits.BOR = 0;
@@ -243,6 +1061,21 @@ int main(void)
 	usb_init();
 	
 	while (1) {
+		service_flash();
+		service_requests();
+
+		/* EP 1 OUT is left un-armed (NAKing) until the status for
+		 * the previous packet has gone out on EP 1 IN. */
+		if (usb_is_configured() &&
+		    usb_out_endpoint_has_data(1) &&
+		    !usb_in_endpoint_busy(1)) {
+			const unsigned char *data;
+			uint8_t len = usb_get_out_buffer(1, &data);
+
+			bulk_receive(data, len);
+			usb_arm_out_endpoint(1);
+		}
+
 		#ifndef USB_USE_INTERRUPTS
 		usb_service();
 		#endif
@@ -256,24 +1089,115 @@ static void empty_cb(bool transfer_ok, void *context)
 	/* Nothing to do here. */
 }
 
+/* Called once the header from WRITE_APP_HEADER has been received. The
+ * application's CRC is checked, and the header written, from the main
+ * loop (service_requests()), and GET_FLASH_STATUS shows busy until then. */
+static void write_app_header_cb(bool transfer_ok, void *context)
+{
+	if (!transfer_ok)
+		return;
+
+	/* Only over an erased header */
+	if (app_header_present ||
+	    app_header.marker != APP_HEADER_MARKER ||
+	    app_header.length > (APP_HEADER_BASE - USER_REGION_BASE) * 2)
+		return;
+
+	start_crc_job(&app_header_crc, USER_REGION_BASE * 2, app_header.length);
+	app_header_pending = true;
+}
+
 static void reset_cb(bool transfer_ok, void *context)
 {
+	finish_app_header();
 	asm("reset");
 }
 
-static void write_data_cb(bool transfer_ok, void *context)
+/* Add len bytes of SEND_DATA data. Each row is handed to the main loop
+ * for programming as soon as it has all arrived, and the next one is
+ * received into the other row. */
+static void send_data_bytes(const unsigned char *data, uint16_t len)
 {
-	/* For OUT control transfers, data from the data stage of the request
-	 * is in buf[]. */
+	while (len > 0 && send_row_len > 0) {
+		uint16_t n = MIN(len, send_row_len - send_pos);
+
+		memcpy((uint8_t*) rows[fill_row].data + send_pos, data, n);
+		send_pos += n;
+		data += n;
+		len -= n;
 
-	if (transfer_ok)
-		write_flash_row();
+		if (send_pos == send_row_len) {
+			queue_row();
+			send_address += send_row_len;
+			send_remaining -= send_row_len;
+			if (send_remaining)
+				start_send_row();
+			else
+				send_row_len = 0;
+		}
+	}
 }
 
-int8_t app_unknown_setup_request_callback(const struct setup_packet *setup)
+/* Called for each packet of a SEND_DATA data stage */
+static void send_data_packet_cb(const unsigned char *data, uint8_t len, void *context)
 {
-#define MIN(X,Y) ((X)<(Y)?(X):(Y))
+	send_data_bytes(data, len);
+}
+
+/* Called for each packet of a SEND_DATA_LZ data stage. Output past the
+ * length from the SETUP packet is dropped. */
+static void send_data_lz_packet_cb(const unsigned char *data, uint8_t len, void *context)
+{
+	while (len > 0) {
+		if (lz.literals > 0) {
+			uint8_t n = MIN(len, lz.literals);
+			uint8_t i;
+
+			for (i = 0; i < n; i++)
+				lz.history[lz.pos++] = data[i];
+			send_data_bytes(data, n);
+			data += n;
+			len -= n;
+			lz.literals -= n;
+		}
+		else if (lz.match_len > 0) {
+			uint8_t from = lz.pos - *data - 1;
+
+			while (lz.match_len > 0) {
+				uint8_t b = lz.history[from++];
+
+				lz.history[lz.pos++] = b;
+				send_data_bytes(&b, 1);
+				lz.match_len--;
+			}
+			data++;
+			len--;
+		}
+		else {
+			uint8_t c = *data++;
 
+			len--;
+			if (c & 0x80)
+				lz.match_len = (c & 0x7f) + 3;
+			else
+				lz.literals = c + 1;
+		}
+	}
+}
+
+static void write_data_cb(bool transfer_ok, void *context)
+{
+	/* A short packet can end the data stage early. Program what
+	 * there is of the last row. */
+	if (transfer_ok && send_row_len > 0 && send_pos > 0) {
+		rows[fill_row].length = send_pos / 2;
+		queue_row();
+	}
+	send_row_len = 0;
+}
+
+int8_t app_unknown_setup_request_callback(const struct setup_packet *setup)
+{
 	/* This handler handles request 254/dest=other/type=vendor only.*/
 	if (setup->REQUEST.destination == DEST_OTHER_ELEMENT &&
 	    setup->REQUEST.type == REQUEST_TYPE_VENDOR &&
@@ -284,36 +1208,64 @@ int8_t app_unknown_setup_request_callback(const struct setup_packet *setup)
 			clear_flash();
 			
 			/* There will be NO data stage. This sends back the
-			 * STATUS stage packet. */
+			 * STATUS stage packet. The erase continues from the
+			 * main loop. */
 			usb_send_data_stage(NULL, 0, empty_cb, NULL);
 		}
+		else if (setup->bRequest == ERASE_PAGES) {
+			/* Erase Pages Request */
+			uint16_t pages = user_region_pages();
+
+			if (setup->wLength == 0 || setup->wLength > (pages + 7) / 8)
+				return -1;
+
+			flush_rows();
+			erase_page = 0;
+			usb_start_receive_ep0_data_stage_packets(setup->wLength, &erase_pages_packet_cb, &empty_cb, NULL);
+		}
 		else if (setup->bRequest == SEND_DATA) {
 			/* Write Data Request */
-			if (setup->wLength > sizeof(prog_buf))
+			uint32_t addr = setup->wValue | ((uint32_t) setup->wIndex) << 16;
+
+			/* More than one row must start at a row boundary. */
+			if (setup->wLength > ROW_BYTES && addr % ROW_BYTES != 0)
+				return -1;
+			if (check_write_range(addr, setup->wLength) < 0)
 				return -1;
 
-			write_address = setup->wValue | ((uint32_t) setup->wIndex) << 16;
-			write_address /= 2; /* Convert to word address. */
-			write_length = setup->wLength;
-			write_length /= 2;  /* Convert to word length. */
+			send_address = addr;
+			send_remaining = setup->wLength;
+			start_send_row();
+			usb_start_receive_ep0_data_stage_packets(setup->wLength, &send_data_packet_cb, &write_data_cb, NULL);
+		}
+		else if (setup->bRequest == SEND_DATA_LZ) {
+			/* Write Compressed Data Request */
+			uint32_t addr = (uint32_t) setup->wValue * ROW_BYTES;
 
-			/* Make sure it is within writable range (ie: don't
-			 * overwrite the bootloader or config words). */
-			if (write_address < USER_REGION_BASE)
+			if (setup->wIndex == 0 || setup->wLength == 0)
 				return -1;
-			if (write_address + write_length > USER_REGION_TOP)
+			if (check_write_range(addr, setup->wIndex) < 0)
 				return -1;
 
-			/* Check for overflow (unlikely on known MCUs) */
-			if (write_address + write_length < write_address)
+			send_address = addr;
+			send_remaining = setup->wIndex;
+			start_send_row();
+			memset(&lz, 0, sizeof(lz));
+			usb_start_receive_ep0_data_stage_packets(setup->wLength, &send_data_lz_packet_cb, &write_data_cb, NULL);
+		}
+		else if (setup->bRequest == WRITE_APP_HEADER) {
+			/* Write Application Header Request */
+			if (setup->wLength != sizeof(struct app_header))
 				return -1;
 
-			/* Check length */
-			if (setup->wLength > sizeof(prog_buf))
+			usb_start_receive_ep0_data_stage((char*)&app_header, sizeof(struct app_header), &write_app_header_cb, NULL);
+		}
+		else if (setup->bRequest == SET_CRC_RANGE) {
+			/* Set the range for GET_CRC. It's checked there. */
+			if (setup->wLength != sizeof(struct crc_range))
 				return -1;
 
-			memset(prog_buf, 0xff, sizeof(prog_buf));
-			usb_start_receive_ep0_data_stage((char*)prog_buf, setup->wLength, &write_data_cb, NULL);
+			usb_start_receive_ep0_data_stage((char*)&crc_range, sizeof(struct crc_range), &empty_cb, NULL);
 		}
 		else if (setup->bRequest == SEND_RESET) {
 			/* Reset to Application Request*/
@@ -337,39 +1289,110 @@ int8_t app_unknown_setup_request_callback(const struct setup_packet *setup)
 
 			chip_info.bytes_per_instruction = BYTES_PER_INSTRUCTION;
 			chip_info.instructions_per_row = INSTRUCTIONS_PER_ROW;
+			chip_info.flags = CHIP_INFO_BULK | CHIP_INFO_MULTI_ROW |
+			                  CHIP_INFO_ERASE_PAGES | CHIP_INFO_ASYNC_ERASE |
+			                  CHIP_INFO_CRC | CHIP_INFO_PAGE_CRCS |
+			                  CHIP_INFO_SEND_DATA_LZ | CHIP_INFO_LONG_READ;
+			chip_info.version = CHIP_INFO_VERSION;
+			chip_info.erase_page_size = FLASH_BLOCK_SIZE * 2;
+			chip_info.app_header_address = APP_HEADER_BASE * 2;
+
+			chip_info.capabilities = chip_info.flags |
+			                         CHIP_INFO_APP_HEADER |
+			                         CHIP_INFO_MAILBOX;
+#ifdef VERIFY_ROWS
+			chip_info.capabilities |= CHIP_INFO_VERIFY_ROWS;
+#endif
+			chip_info.max_transfer = 0xffff;
+			chip_info.max_page_crcs = sizeof(prog_buf) / sizeof(uint32_t);
 
 			usb_send_data_stage((char*)&chip_info, sizeof(struct chip_info), empty_cb/*TODO*/, NULL);
 		}
 
 		if (setup->bRequest == REQUEST_DATA) {
-			/* Request program data */
-			uint32_t read_address;
-
-			read_address = setup->wValue | ((uint32_t) setup->wIndex) << 16;
-			read_address /= 2;
+			/* Request program data. Any length (up to wLength's
+			 * 64 KB) can be read; flash is read a packet at a
+			 * time as the host asks for it. */
+			uint32_t addr = setup->wValue | ((uint32_t) setup->wIndex) << 16;
 
-			/* Range-check address */
-			if (read_address + setup->wLength > FLASH_TOP)
+			/* Range-check address, in bytes */
+			if (addr + setup->wLength > FLASH_TOP * 2)
 				return -1;
 
 			/* Check for overflow (unlikely on known MCUs) */
-			if (read_address + setup->wLength < read_address)
+			if (addr + setup->wLength < addr)
 				return -1;
 
-			/* Check length */
-			if (setup->wLength > sizeof(prog_buf))
+			/* The data stage is started by service_requests(),
+			 * once the flash isn't busy. */
+			read_address = addr;
+			deferred_len = setup->wLength;
+			deferred_request = REQUEST_DATA;
+			usb_defer_data_stage(deferred_abandoned_cb, NULL);
+		}
+
+		if (setup->bRequest == GET_CRC) {
+			/* Request the CRC of the range from SET_CRC_RANGE */
+			uint32_t end = crc_range.address + crc_range.length;
+
+			/* Range-check, in bytes */
+			if (end > FLASH_TOP * 2 || end < crc_range.address)
 				return -1;
 
-			read_prog_data(read_address, setup->wLength / 2);
-			usb_send_data_stage((char*)prog_buf, setup->wLength, empty_cb/*TODO*/, NULL);
+			/* Worked out by service_requests(), which sends
+			 * the data stage. */
+			start_crc_job(&crc_job, crc_range.address, crc_range.length);
+			deferred_request = GET_CRC;
+			usb_defer_data_stage(deferred_abandoned_cb, NULL);
+		}
+
+		if (setup->bRequest == GET_PAGE_CRCS) {
+			/* Request the CRC-32 of each of wLength/4 pages of
+			 * the user region, starting at page wValue, as
+			 * erase_page_size bytes read as for GET_CRC. Up to
+			 * 64 pages fit in prog_buf. The data stage is sent by
+			 * service_requests(). */
+			uint16_t first = setup->wValue;
+			uint16_t num = setup->wLength / sizeof(uint32_t);
+
+			if (setup->wLength % sizeof(uint32_t) != 0 ||
+			    setup->wLength > sizeof(prog_buf))
+				return -1;
+			if (first + (uint32_t) num > user_region_pages())
+				return -1;
+
+			page_crcs_first = first;
+			page_crcs_done = 0;
+			deferred_len = setup->wLength;
+			deferred_request = GET_PAGE_CRCS;
+			usb_defer_data_stage(deferred_abandoned_cb, NULL);
+		}
+
+		if (setup->bRequest == GET_FLASH_STATUS) {
+			/* Request erase and programming progress */
+			flash_status.busy = flash_busy() || app_header_pending;
+			flash_status.erase_pages_left = erase_pages_left;
+			flash_status.erase_pages_done = erase_pages_done;
+#ifdef VERIFY_ROWS
+			/* Report the verify failures, and start counting
+			 * them again. */
+			flash_status.verify_failures = verify_failures;
+			flash_status.verify_address = verify_address;
+			verify_failures = 0;
+			verify_address = 0;
+#endif
+			flash_status.blank_rows = blank_rows;
+			blank_rows = 0;
+
+			usb_send_data_stage((char*)&flash_status, FLASH_STATUS_LEN, empty_cb, NULL);
 		}
 	}
 
 	return 0; /* 0 = can handle this request. */
-#undef MIN
 }
 
 void app_usb_reset_callback(void)
 {
-
+	memset(&bulk, 0, sizeof(bulk));
+	deferred_request = 0;
 }
@@ -35,6 +35,12 @@
    then for calling usb_service() periodically from your application. */
 //#define USB_USE_INTERRUPTS
 
+/* SEND_DATA data stages, which can be many rows long, are taken a packet
+   at a time, and REQUEST_DATA data stages are read from flash a packet at
+   a time (see usb_start_receive_ep0_data_stage_packets() and
+   usb_send_data_stage_packets() in usb.h). */
+#define USB_EP0_DATA_STAGE_PACKETS
+
 /* Objects from usb_descriptors.c */
 #define USB_DEVICE_DESCRIPTOR this_device_descriptor
 #define USB_CONFIG_DESCRIPTOR_MAP usb_application_config_descs
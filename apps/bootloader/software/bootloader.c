@@ -17,6 +17,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#ifdef _WIN32
+	#include <windows.h>
+#endif
 
 #include <libusb.h>
 
@@ -28,11 +32,80 @@
 #define SEND_DATA 101
 #define GET_CHIP_INFO 102
 #define REQUEST_DATA 103
+#define ERASE_PAGES 104
 #define SEND_RESET 105
+#define GET_FLASH_STATUS 106
+#define SET_CRC_RANGE 107
+#define GET_CRC 108
+#define GET_PAGE_CRCS 109
+#define SEND_DATA_LZ 110
+#define WRITE_APP_HEADER 111
+
+/* To the application. See the firmware's bootloader_mailbox.h. */
+#define ENTER_BOOTLOADER 112
+
+/* Bulk programming commands (EP 1). See the firmware's main.c. */
+#define BULK_PROGRAM 1
+#define BULK_STATUS 2
+
+#define BULK_HEADER_LEN 8
+#define BULK_STATUS_LEN 8
+#define BULK_EP_OUT 0x01
+#define BULK_EP_IN 0x81
+#define BULK_PACKET_LEN 64 /* EP 1 wMaxPacketSize */
+#define BULK_ROWS_PER_TRANSFER 16
+
+/* bulk status */
+#define BULK_OK 0
+#define BULK_BAD_COMMAND 1
+#define BULK_BAD_ADDRESS 2
+
+/* chip_info.flags */
+#define CHIP_INFO_BULK 0x01
+#define CHIP_INFO_MULTI_ROW 0x02
+#define CHIP_INFO_ERASE_PAGES 0x04
+#define CHIP_INFO_ASYNC_ERASE 0x08
+#define CHIP_INFO_CRC 0x10
+#define CHIP_INFO_PAGE_CRCS 0x20
+#define CHIP_INFO_SEND_DATA_LZ 0x40
+#define CHIP_INFO_LONG_READ 0x80
+
+/* chip_info.capabilities: the flags above, and these */
+#define CHIP_INFO_VERIFY_ROWS 0x100
+#define CHIP_INFO_APP_HEADER 0x200
+#define CHIP_INFO_MAILBOX 0x400
+
+/* Length of the GET_CHIP_INFO reply, as of chip_info version 1 */
+#define CHIP_INFO_LEN 36
+
+/* How long the device can stay busy with the flash without making
+ * progress, and how often to ask it how it's getting on */
+#define FLASH_STALL_SECONDS 10
+#define FLASH_STATUS_POLL_MS 5
+
+/* How long the bootloader can take to show up after ENTER_BOOTLOADER */
+#define ENTER_BOOTLOADER_SECONDS 10
+
+#define MAX_SEND_DATA_LEN 0xffff /* wLength */
+#define MAX_PAGE_CRCS 64 /* Per GET_PAGE_CRCS */
+#define MAX_REQUEST_DATA_LEN 0xfffc /* wLength, in whole instructions */
+#define SHORT_REQUEST_DATA_LEN 128 /* For firmware without long reads */
+
+/* SEND_DATA_LZ tokens. See the firmware's main.c. */
+#define LZ_MAX_LITERALS 128
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH 130
+#define LZ_MAX_DISTANCE 256
+
+/* Application header: marker, length, CRC. See the firmware's main.c. */
+#define APP_HEADER_MARKER 0x3142534d /* "MSB1" */
+#define APP_HEADER_WORDS 3
 
 #define MIN(X,Y) ((X)<(Y)? (X): (Y))
+#define MAX(X,Y) ((X)>(Y)? (X): (Y))
 
-/* Shared with the firmware */
+/* The reply to GET_CHIP_INFO, decoded by get_chip_info(). See the
+ * firmware's struct chip_info. */
 struct chip_info {
 	uint32_t user_region_base;
 	uint32_t user_region_top;
@@ -41,16 +114,81 @@ struct chip_info {
 
 	uint8_t bytes_per_instruction;
 	uint8_t instructions_per_row;
-	uint8_t pad0;
-	uint8_t pad1;
+	uint8_t flags;
+	uint8_t version;
+
+	/* Older firmware doesn't send these */
+	uint32_t erase_page_size;
+	uint32_t app_header_address;
+
+	/* Version 1. For older firmware, get_chip_info() fills these in
+	 * from the flags and what that firmware can do. */
+	uint32_t capabilities;
+	uint16_t max_transfer;
+	uint16_t max_page_crcs;
+};
+
+/* The reply to GET_FLASH_STATUS, decoded by get_flash_status(). See the
+ * firmware's struct flash_status. */
+struct flash_status {
+	uint8_t busy;
+	uint16_t erase_pages_left;
+	uint16_t erase_pages_done;
+
+	/* Firmware which doesn't verify rows doesn't send these */
+	uint16_t verify_failures;
+	uint32_t verify_address;
+
+	/* Nor does firmware from before chip_info version 1 send this */
+	uint16_t blank_rows;
 };
 
+#define FLASH_STATUS_VERIFY_LEN 12
+#define FLASH_STATUS_LEN 14
+
 /* Bootloader Object */
 struct bootloader {
 	struct hex_data *hd;
 	libusb_device_handle *handle;
 	struct chip_info chip_info;
 	int bytes_per_row;
+
+	/* Bulk programming: commands waiting to be sent */
+	unsigned char *bulk_buf;
+	size_t bulk_len;
+	size_t bulk_buf_len;
+
+	/* Multi-row SEND_DATA: contiguous rows waiting to be sent */
+	unsigned char *rows_buf;
+	size_t rows_len;
+	size_t rows_buf_len;
+	size_t rows_address;
+	unsigned char *lz_buf; /* Compressed rows_buf, for SEND_DATA_LZ */
+	int ep0_packet_len;    /* bMaxPacketSize0, to count SEND_DATA_LZ's packets */
+	unsigned int rows_compressed;   /* Rows sent with SEND_DATA_LZ, */
+	unsigned int rows_uncompressed; /* and without, by flush_rows() */
+
+	/* An erase was started which hasn't been seen to finish */
+	int erase_pending;
+
+	/* The device verifies each row as it writes it. Failures are
+	 * added up here as GET_FLASH_STATUS reports them. */
+	int device_verifies;
+	unsigned int verify_failures;
+	uint32_t verify_address;
+	int verified; /* Everything programmed was verified by the device */
+
+	/* Rows the device didn't program because they were all 0xff, as
+	 * GET_FLASH_STATUS reports them */
+	unsigned int blank_rows;
+
+	/* Pages of the user region to program, as for ERASE_PAGES. If
+	 * this is NULL, everything is programmed. */
+	unsigned char *program_pages;
+
+	/* The device's application header is already right for the hex
+	 * file, so it isn't erased or written again. */
+	int app_header_current;
 };
 
 /* Open a libusb device.
@@ -122,6 +260,168 @@ static int clear_flash(libusb_device_handle *handle)
 	return 0;
 }
 
+/* Erase the pages of the user region set in bitmap (the LSB of the first
+ * byte being the page at user_region_base). */
+static int erase_pages(libusb_device_handle *handle, const unsigned char *bitmap, size_t len)
+{
+	int res;
+
+	res = libusb_control_transfer(handle,
+		LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
+		ERASE_PAGES /* bRequest */,
+		0, /* wValue */
+		0, /* wIndex */
+		(unsigned char*) bitmap, len/*wLength*/,
+		10000/*timeout millis*/);
+
+	if (res < 0) {
+		fprintf(stderr, "Error erasing pages : %s\n", libusb_error_name(res));
+		return res;
+	}
+
+	return 0;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 |
+	       (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint16_t get_le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+/* Get the flash status, adding any verify failures it reports to
+ * bl's (the device only reports them once). The reply is little-endian,
+ * and is decoded field by field; fields which older firmware doesn't
+ * send are left 0. Returns the length of the reply, or a negative number
+ * on error. */
+static int get_flash_status(struct bootloader *bl, struct flash_status *status)
+{
+	unsigned char buf[FLASH_STATUS_LEN];
+	int res;
+
+	memset(status, 0, sizeof(*status));
+	memset(buf, 0, sizeof(buf));
+
+	res = libusb_control_transfer(bl->handle,
+		LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
+		GET_FLASH_STATUS /* bRequest */,
+		0, /* wValue */
+		0, /* wIndex */
+		buf, sizeof(buf)/*wLength*/,
+		1000/*timeout millis*/);
+
+	if (res < 0) {
+		fprintf(stderr, "Error requesting flash status: %s\n", libusb_error_name(res));
+		return res;
+	}
+
+	status->busy = buf[0];
+	status->erase_pages_left = get_le16(buf + 2);
+	status->erase_pages_done = get_le16(buf + 4);
+	status->verify_failures = get_le16(buf + 6);
+	status->verify_address = get_le32(buf + 8);
+	status->blank_rows = get_le16(buf + 12);
+
+	if (status->verify_failures > 0) {
+		if (bl->verify_failures == 0)
+			bl->verify_address = status->verify_address;
+		bl->verify_failures += status->verify_failures;
+	}
+	bl->blank_rows += status->blank_rows;
+
+	return res;
+}
+
+static void sleep_ms(unsigned int ms)
+{
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+/* Wait for an erase started by bootloader_erase() to finish. The device
+ * answers GET_FLASH_STATUS while it erases, so rather than one long
+ * timeout, this gives up only if the erase stops making progress. It's
+ * called just before data is sent, so the first transfer's rows are
+ * prepared while the device erases. */
+static int wait_for_erase(struct bootloader *bl)
+{
+	struct flash_status status;
+	unsigned int left = ~0u;
+	time_t last_progress = time(NULL);
+	int res;
+
+	while (bl->erase_pending) {
+		res = get_flash_status(bl, &status);
+		if (res < 0)
+			return res;
+
+		if (status.erase_pages_left == 0)
+			bl->erase_pending = 0;
+		else if (status.erase_pages_left < left) {
+			left = status.erase_pages_left;
+			last_progress = time(NULL);
+		}
+		else if (time(NULL) - last_progress > FLASH_STALL_SECONDS) {
+			fprintf(stderr, "Erase stalled with %u pages left\n", left);
+			return -1;
+		}
+
+		if (bl->erase_pending)
+			sleep_ms(FLASH_STATUS_POLL_MS);
+	}
+
+	return 0;
+}
+
+/* Wait for the device to write (and verify) all the rows it's been
+ * sent. As in wait_for_erase(), this gives up if the device stays busy
+ * without making progress. Returns -1 if any of them didn't verify. */
+static int finish_device_verify(struct bootloader *bl)
+{
+	struct flash_status status;
+	unsigned int left = ~0u;
+	time_t last_progress = time(NULL);
+	int res;
+
+	while (1) {
+		res = get_flash_status(bl, &status);
+		if (res < 0)
+			return res;
+		if (!status.busy)
+			break;
+
+		if (status.erase_pages_left < left) {
+			left = status.erase_pages_left;
+			last_progress = time(NULL);
+		}
+		else if (time(NULL) - last_progress > FLASH_STALL_SECONDS) {
+			fprintf(stderr, "Device stayed busy writing rows\n");
+			return -1;
+		}
+
+		sleep_ms(FLASH_STATUS_POLL_MS);
+	}
+
+	if (bl->verify_failures > 0) {
+		fprintf(stderr, "Verify Failed: %u rows, the first at %lx\n",
+		        bl->verify_failures, (unsigned long) bl->verify_address);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int send_data(libusb_device_handle *handle, size_t address, const unsigned char *buf, size_t len)
 {
 	int res;
@@ -132,7 +432,7 @@ static int send_data(libusb_device_handle *handle, size_t address, const unsigne
 		address & 0xffff, /* wValue: Low Address */
 		(address & 0xffff0000) >> 16, /* wIndex: High Address */
 		(unsigned char*) buf, len/*wLength*/,
-		1000/*timeout millis*/);
+		5000/*timeout millis*/);
 
 	if (res < 0) {
 		fprintf(stderr, "Error Sending Data : %s\n", libusb_error_name(res));
@@ -142,25 +442,368 @@ static int send_data(libusb_device_handle *handle, size_t address, const unsigne
 	return 0;
 }
 
+static int send_data_lz(libusb_device_handle *handle, size_t row, size_t len, const unsigned char *buf, size_t compressed_len)
+{
+	int res;
+
+	res = libusb_control_transfer(handle,
+		LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
+		SEND_DATA_LZ /* bRequest */,
+		row, /* wValue: Row (address / bytes per row) */
+		len, /* wIndex: Decompressed length */
+		(unsigned char*) buf, compressed_len/*wLength*/,
+		5000/*timeout millis*/);
+
+	if (res < 0) {
+		fprintf(stderr, "Error Sending Data : %s\n", libusb_error_name(res));
+		return res;
+	}
+
+	return 0;
+}
+
+/* Compress len bytes of buf for SEND_DATA_LZ into out, which has room
+ * for out_len bytes. This is a greedy search of the whole window, which
+ * is plenty fast enough for a firmware image. Returns the compressed
+ * length, or 0 if it didn't fit. */
+static size_t lz_compress(const unsigned char *buf, size_t len, unsigned char *out, size_t out_len)
+{
+	size_t pos = 0, literal_start = 0, o = 0;
+
+	while (pos <= len) {
+		size_t best_len = 0, best_distance = 0, d;
+
+		for (d = 1; d <= LZ_MAX_DISTANCE && d <= pos && pos < len; d++) {
+			size_t l = 0;
+
+			while (l < LZ_MAX_MATCH && pos + l < len &&
+			       buf[pos + l] == buf[pos + l - d])
+				l++;
+			if (l > best_len) {
+				best_len = l;
+				best_distance = d;
+			}
+		}
+
+		/* Send the literals before a match, or at the end. */
+		if (best_len >= LZ_MIN_MATCH || pos == len) {
+			while (literal_start < pos) {
+				size_t n = MIN(pos - literal_start, LZ_MAX_LITERALS);
+
+				if (o + 1 + n > out_len)
+					return 0;
+				out[o++] = n - 1;
+				memcpy(out + o, buf + literal_start, n);
+				o += n;
+				literal_start += n;
+			}
+		}
+
+		if (pos == len)
+			break;
+
+		if (best_len >= LZ_MIN_MATCH) {
+			if (o + 2 > out_len)
+				return 0;
+			out[o++] = 0x80 | (best_len - LZ_MIN_MATCH);
+			out[o++] = best_distance - 1;
+			pos += best_len;
+			literal_start = pos;
+		}
+		else
+			pos++;
+	}
+
+	return o;
+}
+
+/* Send the commands in bl->bulk_buf in one transfer. The transfer must
+ * end with a short packet. */
+static int bulk_flush(struct bootloader *bl)
+{
+	int res, transferred;
+
+	if (bl->bulk_len == 0)
+		return 0;
+
+	res = wait_for_erase(bl);
+	if (res < 0)
+		return res;
+
+	res = libusb_bulk_transfer(bl->handle, BULK_EP_OUT,
+		bl->bulk_buf, bl->bulk_len, &transferred,
+		5000/*timeout millis*/);
+	if (res == 0 && bl->bulk_len % BULK_PACKET_LEN == 0)
+		res = libusb_bulk_transfer(bl->handle, BULK_EP_OUT,
+			NULL, 0, &transferred, 1000/*timeout millis*/);
+
+	bl->bulk_len = 0;
+
+	if (res < 0) {
+		fprintf(stderr, "Error sending bulk data: %s\n", libusb_error_name(res));
+		return res;
+	}
+
+	return 0;
+}
+
+static void bulk_header(unsigned char *buf, uint8_t command, size_t address, size_t len)
+{
+	buf[0] = command;
+	buf[1] = 0;
+	buf[2] = len & 0xff;
+	buf[3] = (len >> 8) & 0xff;
+	buf[4] = address & 0xff;
+	buf[5] = (address >> 8) & 0xff;
+	buf[6] = (address >> 16) & 0xff;
+	buf[7] = (address >> 24) & 0xff;
+}
+
+/* Queue a BULK_PROGRAM command, sending the queue when it's full. */
+static int bulk_send_data(struct bootloader *bl, size_t address, const unsigned char *buf, size_t len)
+{
+	if (bl->bulk_len + BULK_HEADER_LEN + len > bl->bulk_buf_len) {
+		int res = bulk_flush(bl);
+		if (res < 0)
+			return res;
+	}
+
+	bulk_header(bl->bulk_buf + bl->bulk_len, BULK_PROGRAM, address, len);
+	memcpy(bl->bulk_buf + bl->bulk_len + BULK_HEADER_LEN, buf, len);
+	bl->bulk_len += BULK_HEADER_LEN + len;
+
+	return 0;
+}
+
+/* Send what's queued and ask the device how it went. Returns 0 if all
+ * the rows were written, or -1 if not. */
+static int bulk_finish(struct bootloader *bl)
+{
+	unsigned char status[BULK_STATUS_LEN];
+	uint32_t address;
+	int res, transferred;
+
+	res = bulk_flush(bl);
+	if (res < 0)
+		return -1;
+
+	bulk_header(bl->bulk_buf, BULK_STATUS, 0, 0);
+	bl->bulk_len = BULK_HEADER_LEN;
+	res = bulk_flush(bl);
+	if (res < 0)
+		return -1;
+
+	res = libusb_bulk_transfer(bl->handle, BULK_EP_IN,
+		status, sizeof(status), &transferred,
+		5000/*timeout millis*/);
+	if (res < 0) {
+		fprintf(stderr, "Error reading bulk status: %s\n", libusb_error_name(res));
+		return -1;
+	}
+	if (transferred != BULK_STATUS_LEN) {
+		fprintf(stderr, "Bad bulk status length: %d\n", transferred);
+		return -1;
+	}
+
+	address = get_le32(status + 4);
+
+	if (status[0] == BULK_BAD_ADDRESS) {
+		fprintf(stderr, "Sending data block %lx failed: address not writable\n", (unsigned long) address);
+		return -1;
+	}
+	else if (status[0] != BULK_OK) {
+		fprintf(stderr, "Sending bulk data failed: bad command %d (status %d)\n", status[1], status[0]);
+		return -1;
+	}
+
+	return 0;
+}
+
+#define DIV_ROUND_UP(X,Y) (((X) + (Y) - 1) / (Y))
+
+/* Packets on the bus for a control transfer with len bytes of data */
+static size_t control_packets(struct bootloader *bl, size_t len)
+{
+	return 2 /* SETUP and status */ + DIV_ROUND_UP(len, bl->ep0_packet_len);
+}
+
+/* Packets on the bus for the rows in bl->rows_buf, sent uncompressed:
+ * by BULK_PROGRAM if the device has it, or else SEND_DATA */
+static size_t plain_packets(struct bootloader *bl)
+{
+	size_t rows = DIV_ROUND_UP(bl->rows_len, bl->bytes_per_row);
+
+	if (bl->bulk_buf)
+		return DIV_ROUND_UP(rows * BULK_HEADER_LEN + bl->rows_len,
+		                    BULK_PACKET_LEN);
+	return control_packets(bl, bl->rows_len);
+}
+
+/* Send the rows in bl->rows_buf with one SEND_DATA_LZ, if that's fewer
+ * packets, or else as they are. */
+static int flush_rows(struct bootloader *bl)
+{
+	size_t pos, rows;
+	int res;
+
+	if (bl->rows_len == 0)
+		return 0;
+	rows = DIV_ROUND_UP(bl->rows_len, bl->bytes_per_row);
+
+	/* SEND_DATA_LZ starts at a row. */
+	if (bl->lz_buf && bl->rows_address % bl->bytes_per_row == 0) {
+		size_t len = lz_compress(bl->rows_buf, bl->rows_len,
+		                         bl->lz_buf, bl->rows_len - 1);
+		if (len > 0 && control_packets(bl, len) < plain_packets(bl)) {
+			/* Keep the rows in order with the bulk ones. */
+			res = bulk_flush(bl);
+			if (res < 0)
+				return res;
+			res = wait_for_erase(bl);
+			if (res < 0)
+				return res;
+			res = send_data_lz(bl->handle,
+			                   bl->rows_address / bl->bytes_per_row,
+			                   bl->rows_len, bl->lz_buf, len);
+			bl->rows_len = 0;
+			bl->rows_compressed += rows;
+			return res;
+		}
+	}
+	bl->rows_uncompressed += rows;
+
+	if (bl->bulk_buf) {
+		for (pos = 0; pos < bl->rows_len; pos += bl->bytes_per_row) {
+			res = bulk_send_data(bl, bl->rows_address + pos,
+			                     bl->rows_buf + pos,
+			                     MIN(bl->bytes_per_row, bl->rows_len - pos));
+			if (res < 0)
+				return res;
+		}
+		bl->rows_len = 0;
+		return 0;
+	}
+
+	res = wait_for_erase(bl);
+	if (res < 0)
+		return res;
+
+	res = send_data(bl->handle, bl->rows_address, bl->rows_buf, bl->rows_len);
+	bl->rows_len = 0;
+	return res;
+}
+
+/* Queue a row for a multi-row SEND_DATA. The queue is sent first if the
+ * row doesn't follow on from it, or won't fit. */
+static int queue_row(struct bootloader *bl, size_t address, const unsigned char *buf, size_t len)
+{
+	if (bl->rows_len > 0 &&
+	    (address != bl->rows_address + bl->rows_len ||
+	     bl->rows_len % bl->bytes_per_row != 0 ||
+	     bl->rows_len + len > bl->rows_buf_len)) {
+		int res = flush_rows(bl);
+		if (res < 0)
+			return res;
+	}
+
+	if (bl->rows_len == 0)
+		bl->rows_address = address;
+	memcpy(bl->rows_buf + bl->rows_len, buf, len);
+	bl->rows_len += len;
+
+	return 0;
+}
+
+/* Whether the row at address is in a page which needs programming */
+static int page_changed(struct bootloader *bl, size_t address)
+{
+	const struct chip_info *info = &bl->chip_info;
+	size_t page;
+
+	if (!bl->program_pages ||
+	    address < info->user_region_base ||
+	    address >= info->user_region_top)
+		return 1;
+
+	page = (address - info->user_region_base) / info->erase_page_size;
+	return bl->program_pages[page / 8] & (1 << page % 8);
+}
+
+/* Program one row (or part of one), by bulk or control transfer. Rows
+ * in pages which are already up to date are skipped. With SEND_DATA_LZ,
+ * rows are gathered in rows_buf even if the device has bulk programming,
+ * for flush_rows() to choose between the two. */
+static int program_row(struct bootloader *bl, size_t address, const unsigned char *buf, size_t len)
+{
+	if (!page_changed(bl, address))
+		return 0;
+
+	if (bl->rows_buf)
+		return queue_row(bl, address, buf, len);
+	else if (bl->bulk_buf)
+		return bulk_send_data(bl, address, buf, len);
+	else if (wait_for_erase(bl) < 0)
+		return -1;
+	else
+		return send_data(bl->handle, address, buf, len);
+}
+
 static int get_chip_info(libusb_device_handle *handle, struct chip_info *info)
 {
+	unsigned char buf[CHIP_INFO_LEN];
 	int res;
 
+	memset(info, 0, sizeof(*info));
+	memset(buf, 0, sizeof(buf));
+
 	res = libusb_control_transfer(handle,
 		LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
 		GET_CHIP_INFO /* bRequest */,
 		0, /* wValue */
 		0, /* wIndex */
-		(unsigned char*)info, sizeof(*info)/*wLength*/,
+		buf, sizeof(buf)/*wLength*/,
 		1000/*timeout millis*/);
 
-	/* TODO: Take care of byte swapping issues in chip_info. */
-
 	if (res < 0) {
 		fprintf(stderr, "Error request chip info: %s\n", libusb_error_name(res));
 		return res;
 	}
 
+	/* The reply is little-endian. Older firmware sends less of it, and
+	 * the rest reads as 0. */
+	info->user_region_base = get_le32(buf);
+	info->user_region_top = get_le32(buf + 4);
+	info->config_words_base = get_le32(buf + 8);
+	info->config_words_top = get_le32(buf + 12);
+	info->bytes_per_instruction = buf[16];
+	info->instructions_per_row = buf[17];
+	info->flags = buf[18];
+	info->version = buf[19];
+	info->erase_page_size = get_le32(buf + 20);
+	info->app_header_address = get_le32(buf + 24);
+
+	if (info->version >= 1) {
+		info->capabilities = get_le32(buf + 28);
+		info->max_transfer = get_le16(buf + 32);
+		info->max_page_crcs = get_le16(buf + 34);
+
+		if (!(info->capabilities & CHIP_INFO_APP_HEADER))
+			info->app_header_address = 0;
+	}
+	else {
+		info->capabilities = info->flags;
+		if (info->app_header_address)
+			info->capabilities |= CHIP_INFO_APP_HEADER;
+		info->max_transfer = MAX_SEND_DATA_LEN;
+		info->max_page_crcs = MAX_PAGE_CRCS;
+	}
+
+	info->max_page_crcs = MIN(info->max_page_crcs, MAX_PAGE_CRCS);
+	if (info->max_page_crcs == 0)
+		info->capabilities &= ~CHIP_INFO_PAGE_CRCS;
+	if (info->max_transfer < info->bytes_per_instruction * info->instructions_per_row)
+		info->capabilities &= ~(CHIP_INFO_MULTI_ROW | CHIP_INFO_SEND_DATA_LZ);
+
 	return 0;
 }
 
@@ -174,7 +817,7 @@ static int request_data(libusb_device_handle *handle, size_t address, unsigned c
 		address & 0xffff, /* wValue: Low Address */
 		(address & 0xffff0000) >> 16, /* wIndex: High Address */
 		buf, len/*wLength*/,
-		1000/*timeout millis*/);
+		5000/*timeout millis*/);
 
 	if (res < 0) {
 		fprintf(stderr, "Error requesting data: %s\n", libusb_error_name(res));
@@ -184,6 +827,90 @@ static int request_data(libusb_device_handle *handle, size_t address, unsigned c
 	return 0;
 }
 
+/* CRC-32, as computed by the firmware for GET_CRC */
+static uint32_t crc32(const unsigned char *buf, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	size_t i;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+/* Have the device compute the CRC-32 of len bytes of flash at address. */
+static int request_crc(libusb_device_handle *handle, size_t address, size_t len, uint32_t *crc)
+{
+	unsigned char range[8], buf[4];
+	int res;
+
+	range[0] = address & 0xff;
+	range[1] = (address >> 8) & 0xff;
+	range[2] = (address >> 16) & 0xff;
+	range[3] = (address >> 24) & 0xff;
+	range[4] = len & 0xff;
+	range[5] = (len >> 8) & 0xff;
+	range[6] = (len >> 16) & 0xff;
+	range[7] = (len >> 24) & 0xff;
+
+	res = libusb_control_transfer(handle,
+		LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
+		SET_CRC_RANGE /* bRequest */,
+		0, /* wValue */
+		0, /* wIndex */
+		range, sizeof(range)/*wLength*/,
+		1000/*timeout millis*/);
+	if (res < 0) {
+		fprintf(stderr, "Error setting CRC range: %s\n", libusb_error_name(res));
+		return res;
+	}
+
+	res = libusb_control_transfer(handle,
+		LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
+		GET_CRC /* bRequest */,
+		0, /* wValue */
+		0, /* wIndex */
+		buf, sizeof(buf)/*wLength*/,
+		5000/*timeout millis*/);
+	if (res < 0) {
+		fprintf(stderr, "Error requesting CRC: %s\n", libusb_error_name(res));
+		return res;
+	}
+
+	*crc = get_le32(buf);
+	return 0;
+}
+
+/* Get the CRC-32s of num pages of the user region, starting at first. */
+static int request_page_crcs(libusb_device_handle *handle, size_t first, size_t num, uint32_t *crcs)
+{
+	unsigned char buf[MAX_PAGE_CRCS * 4];
+	size_t i;
+	int res;
+
+	res = libusb_control_transfer(handle,
+		LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
+		GET_PAGE_CRCS /* bRequest */,
+		first, /* wValue: First page */
+		0, /* wIndex */
+		buf, num * 4/*wLength*/,
+		5000/*timeout millis*/);
+	if (res < 0) {
+		fprintf(stderr, "Error requesting page CRCs: %s\n", libusb_error_name(res));
+		return res;
+	}
+
+	for (i = 0; i < num; i++)
+		crcs[i] = get_le32(buf + i * 4);
+
+	return 0;
+}
+
 static int send_reset(libusb_device_handle *handle)
 {
 	int res;
@@ -222,23 +949,62 @@ static void print_data(const unsigned char *data, size_t len)
 int bootloader_verify(struct bootloader *bl)
 {
 	struct hex_data_region *region;
+	unsigned char *buf;
+	size_t buf_len;
 	int res = 0;
 
+	res = wait_for_erase(bl);
+	if (res < 0)
+		return -1;
+
+	if (bl->verified) {
+		printf("Verified by the device while programming\n");
+		return 0;
+	}
+
+	/* Read back as much of a region as wLength allows at once, if the
+	 * firmware can. */
+	if (bl->chip_info.capabilities & CHIP_INFO_LONG_READ)
+		buf_len = MIN(MAX_REQUEST_DATA_LEN,
+		              bl->chip_info.max_transfer /
+		              bl->chip_info.bytes_per_instruction *
+		              bl->chip_info.bytes_per_instruction);
+	else
+		buf_len = SHORT_REQUEST_DATA_LEN;
+	buf = malloc(buf_len);
+	if (!buf)
+		return -1;
+
 	region = bl->hd->regions;
 	while (region) {
 		const unsigned char *ptr = region->data;
 		const unsigned char *endptr = region->data + region->len;
 		size_t address = region->address;
-		unsigned char buf[128]; /* This array size is arbitrary */
 
 		if (address >= bl->chip_info.config_words_base &&
 		    address < bl->chip_info.config_words_top) {
 			printf("Skipping Config words at %lx\n", address);
 			goto end_region_verify;
 		}
+
+		/* If the device's CRC of the region matches, there's no
+		 * need to read it back. If it doesn't, read it back to
+		 * find where it differs. */
+		if (bl->chip_info.capabilities & CHIP_INFO_CRC) {
+			uint32_t crc;
+
+			res = request_crc(bl->handle, address, region->len, &crc);
+			if (res < 0) {
+				res = -1;
+				goto failure;
+			}
+			if (crc == crc32(region->data, region->len))
+				goto end_region_verify;
+		}
 		
 		while (ptr < endptr) {
-			size_t len_to_request = MIN(sizeof(buf), endptr-ptr);
+			size_t len_to_request = MIN(buf_len, endptr-ptr);
+			size_t i;
 
 			res = request_data(bl->handle, address, buf, len_to_request);
 			if (res < 0) {
@@ -248,13 +1014,20 @@ int bootloader_verify(struct bootloader *bl)
 			}
 			
 			if (memcmp(ptr, buf, len_to_request) != 0) {
-				fprintf(stderr, "Verify Failed on block starting at %lx\n", address);
+				/* Show the 128 bytes from the first
+				 * difference (from a 16-byte boundary). */
+				for (i = 0; ptr[i] == buf[i]; i++)
+					;
+				i &= ~0xf;
+				len_to_request = MIN(SHORT_REQUEST_DATA_LEN, len_to_request - i);
+
+				fprintf(stderr, "Verify Failed on block starting at %lx\n", address + i);
 
 				printf("Read from device: \n");
-				print_data(ptr, len_to_request);
+				print_data(buf + i, len_to_request);
 				
 				printf("\nExpected:\n");
-				print_data(buf, len_to_request);
+				print_data(ptr + i, len_to_request);
 				
 				res = -1;
 				goto failure;
@@ -269,9 +1042,195 @@ end_region_verify:
 	}
 
 failure:
+	free(buf);
 	return res;
 }
 
+/* Fill buf with what len bytes of flash at start will read back as once
+ * the hex file is programmed: its data over erased flash. */
+static void flash_image(struct bootloader *bl, size_t start, size_t len, unsigned char *buf)
+{
+	const struct chip_info *info = &bl->chip_info;
+	size_t end = start + len;
+	struct hex_data_region *region;
+	size_t i;
+
+	/* Erased flash reads as 0xff, except for the phantom byte of each
+	 * instruction, which reads as 0. */
+	for (i = 0; i < len; i++)
+		buf[i] = ((start + i) % info->bytes_per_instruction == 3)? 0x00: 0xff;
+
+	region = bl->hd->regions;
+	while (region) {
+		size_t s = MAX(start, region->address);
+		size_t e = MIN(end, region->address + region->len);
+
+		if (s < e)
+			memcpy(buf + (s - start), region->data + (s - region->address), e - s);
+		region = region->next;
+	}
+}
+
+
+/* The length of the image for the application header, from the start of
+ * the user region to the end of the last data below the header. Regions
+ * at or above the header, such as the config words, aren't part of it. */
+static uint32_t image_app_length(struct bootloader *bl)
+{
+	const struct chip_info *info = &bl->chip_info;
+	struct hex_data_region *region;
+	size_t end = info->user_region_base;
+
+	region = bl->hd->regions;
+	while (region) {
+		size_t e = MIN(region->address + region->len, info->app_header_address);
+
+		if (region->address < info->app_header_address && e > end)
+			end = e;
+		region = region->next;
+	}
+
+	/* Whole instructions only */
+	end = (end + info->bytes_per_instruction - 1) /
+	      info->bytes_per_instruction * info->bytes_per_instruction;
+	return end - info->user_region_base;
+}
+
+/* The application header for the hex file: the length of the image, and
+ * the CRC-32 of that much flash once it's programmed. */
+static int image_app_header(struct bootloader *bl, uint32_t *length, uint32_t *crc)
+{
+	const struct chip_info *info = &bl->chip_info;
+	unsigned char *image;
+
+	*length = image_app_length(bl);
+
+	image = malloc(*length + 1);
+	if (!image)
+		return -1;
+	flash_image(bl, info->user_region_base, *length, image);
+	*crc = crc32(image, *length);
+	free(image);
+
+	return 0;
+}
+
+/* Read the application header back from the device. Each 16 bits of it
+ * is in the low word of an instruction. */
+static int read_app_header(struct bootloader *bl, uint32_t header[APP_HEADER_WORDS])
+{
+	unsigned char buf[APP_HEADER_WORDS * 8];
+	size_t i;
+	int res;
+
+	res = request_data(bl->handle, bl->chip_info.app_header_address, buf, sizeof(buf));
+	if (res < 0)
+		return res;
+
+	for (i = 0; i < APP_HEADER_WORDS; i++) {
+		const unsigned char *p = buf + i * 8;
+		header[i] = get_le16(p) | (uint32_t) get_le16(p + 4) << 16;
+	}
+
+	return 0;
+}
+
+/* Returns 1 if the device already has the header for the hex file, 0 if
+ * not, or a negative number on error. */
+static int device_has_app_header(struct bootloader *bl)
+{
+	uint32_t header[APP_HEADER_WORDS];
+	uint32_t length, crc;
+	int res;
+
+	res = image_app_header(bl, &length, &crc);
+	if (res < 0)
+		return res;
+	res = read_app_header(bl, header);
+	if (res < 0)
+		return res;
+
+	return header[0] == APP_HEADER_MARKER &&
+	       header[1] == length &&
+	       header[2] == crc;
+}
+
+/* Write the application header, so the device boots the application
+ * straight away from then on. The device only writes it if the CRC
+ * matches what's in flash, so read it back to see that it did. */
+static int write_app_header(struct bootloader *bl)
+{
+	unsigned char buf[APP_HEADER_WORDS * 4];
+	uint32_t header[APP_HEADER_WORDS];
+	size_t i;
+	int res;
+
+	header[0] = APP_HEADER_MARKER;
+	res = image_app_header(bl, &header[1], &header[2]);
+	if (res < 0)
+		return res;
+
+	for (i = 0; i < APP_HEADER_WORDS; i++) {
+		buf[i * 4] = header[i] & 0xff;
+		buf[i * 4 + 1] = (header[i] >> 8) & 0xff;
+		buf[i * 4 + 2] = (header[i] >> 16) & 0xff;
+		buf[i * 4 + 3] = (header[i] >> 24) & 0xff;
+	}
+
+	res = libusb_control_transfer(bl->handle,
+		LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
+		WRITE_APP_HEADER /* bRequest */,
+		0, /* wValue */
+		0, /* wIndex */
+		buf, sizeof(buf)/*wLength*/,
+		5000/*timeout millis*/);
+	if (res < 0) {
+		fprintf(stderr, "Error writing application header: %s\n", libusb_error_name(res));
+		return res;
+	}
+
+	res = device_has_app_header(bl);
+	if (res < 0)
+		return res;
+	if (!res) {
+		fprintf(stderr, "Application header not written: the device's CRC of the application doesn't match\n");
+		return -1;
+	}
+
+	printf("Wrote application header: %lu bytes, CRC %08lx\n",
+	       (unsigned long) header[1], (unsigned long) header[2]);
+	return 0;
+}
+
+/* Fill buf with what page (of the user region) will read back as once
+ * it's programmed, with the application header if it's in that page. */
+static void page_image(struct bootloader *bl, size_t page, unsigned char *buf)
+{
+	const struct chip_info *info = &bl->chip_info;
+	size_t start = info->user_region_base + page * info->erase_page_size;
+	uint32_t header[APP_HEADER_WORDS];
+	size_t i;
+
+	flash_image(bl, start, info->erase_page_size, buf);
+
+	if (!info->app_header_address ||
+	    info->app_header_address < start ||
+	    info->app_header_address >= start + info->erase_page_size)
+		return;
+
+	header[0] = APP_HEADER_MARKER;
+	if (image_app_header(bl, &header[1], &header[2]) < 0)
+		return;
+
+	for (i = 0; i < APP_HEADER_WORDS; i++) {
+		unsigned char *p = buf + (info->app_header_address - start) + i * 8;
+		p[0] = header[i] & 0xff;
+		p[1] = (header[i] >> 8) & 0xff;
+		p[4] = (header[i] >> 16) & 0xff;
+		p[5] = (header[i] >> 24) & 0xff;
+	}
+}
+
 int bootloader_program(struct bootloader *bl)
 {
 	struct hex_data_region *region;
@@ -310,7 +1269,7 @@ int bootloader_program(struct bootloader *bl)
 			memcpy(buf+bytes_to_add, region->data, data_bytes_to_send);
 
 			printf("Padding block at %lx down to %lx\n", region->address, address);
-			res = send_data(bl->handle, address, buf, total_bytes_to_send);
+			res = program_row(bl, address, buf, total_bytes_to_send);
 			if (res < 0) {
 				fprintf(stderr, "Sending data block %lx failed: %s\n", region->address, libusb_error_name(res));
 				res = -1;
@@ -326,7 +1285,7 @@ int bootloader_program(struct bootloader *bl)
 		while (ptr < endptr) {
 			size_t len_to_send = MIN(bl->bytes_per_row, endptr-ptr);
 
-			res = send_data(bl->handle, address, ptr, len_to_send);
+			res = program_row(bl, address, ptr, len_to_send);
 			if (res < 0) {
 				fprintf(stderr, "Sending data block %lx failed: %s\n", address, libusb_error_name(res));
 				res = -1;
@@ -341,20 +1300,293 @@ end_region:
 		region = region->next;
 	}
 
+	/* The last rows may go by bulk, so before bulk_finish() */
+	res = flush_rows(bl);
+	if (res < 0) {
+		fprintf(stderr, "Sending data block %lx failed: %s\n", bl->rows_address, libusb_error_name(res));
+		res = -1;
+		goto failure;
+	}
+
+	if (bl->bulk_buf) {
+		res = bulk_finish(bl);
+		if (res < 0)
+			goto failure;
+	}
+
+	if (bl->device_verifies) {
+		res = finish_device_verify(bl);
+		if (res < 0)
+			goto failure;
+		bl->verified = 1;
+	}
+
+	if (bl->blank_rows > 0)
+		printf("%u blank rows skipped by the device\n", bl->blank_rows);
+	if (bl->lz_buf)
+		printf("%u rows sent compressed, %u uncompressed\n",
+		       bl->rows_compressed, bl->rows_uncompressed);
+
+	if (bl->chip_info.app_header_address && !bl->app_header_current) {
+		res = write_app_header(bl);
+		if (res < 0)
+			goto failure;
+	}
+
 failure:
+	bl->bulk_len = 0;
+	bl->rows_len = 0;
 	return res;
 }
 
+/* Clear the bits in bitmap of the pages which already hold what the hex
+ * file has for them, going by the CRCs from the device. Returns the
+ * number of them, or a negative number on error. */
+static int skip_unchanged_pages(struct bootloader *bl, unsigned char *bitmap, size_t num_pages)
+{
+	const struct chip_info *info = &bl->chip_info;
+	uint32_t crcs[MAX_PAGE_CRCS];
+	unsigned char *image;
+	size_t first, i;
+	int unchanged = 0;
+	int res = 0;
+
+	image = malloc(info->erase_page_size);
+	if (!image)
+		return -1;
+
+	for (first = 0; first < num_pages; first += info->max_page_crcs) {
+		size_t num = MIN(num_pages - first, info->max_page_crcs);
+
+		res = request_page_crcs(bl->handle, first, num, crcs);
+		if (res < 0)
+			goto out;
+
+		for (i = 0; i < num; i++) {
+			size_t page = first + i;
+
+			if (!(bitmap[page / 8] & (1 << page % 8)))
+				continue;
+
+			page_image(bl, page, image);
+			if (crc32(image, info->erase_page_size) == crcs[i]) {
+				bitmap[page / 8] &= ~(1 << page % 8);
+				unchanged++;
+			}
+		}
+	}
+
+out:
+	free(image);
+	return res < 0? res: unchanged;
+}
+
+/* Set page in an ERASE_PAGES bitmap, counting it in pages if it wasn't
+ * set already, and growing len (in bytes of the bitmap) to cover it. */
+static void set_page(unsigned char *bitmap, size_t page, size_t *pages, size_t *len)
+{
+	if (!(bitmap[page / 8] & (1 << page % 8)))
+		(*pages)++;
+	bitmap[page / 8] |= 1 << page % 8;
+	if (page / 8 + 1 > *len)
+		*len = page / 8 + 1;
+}
+
+/* Erase the pages which the hex file has data for, and any others under
+ * the application header, or the whole user region if the device can't
+ * erase single pages. If the device can send
+ * the CRC of each page, pages which already hold the right data are
+ * neither erased nor programmed. On devices which erase
+ * in the background, this returns once the erase has started, and
+ * bootloader_program() waits for it to finish. */
 int bootloader_erase(struct bootloader *bl)
 {
-	return clear_flash(bl->handle);
+	const struct chip_info *info = &bl->chip_info;
+	struct hex_data_region *region;
+	unsigned char *bitmap;
+	size_t num_pages, len = 0, pages = 0, header_page = 0, i;
+	int res;
+
+	if (!(info->capabilities & CHIP_INFO_ERASE_PAGES) || info->erase_page_size == 0) {
+		res = clear_flash(bl->handle);
+		goto started;
+	}
+
+	num_pages = (info->user_region_top - info->user_region_base) /
+	            info->erase_page_size;
+	bitmap = calloc(1, (num_pages + 7) / 8);
+	if (!bitmap)
+		return -1;
+
+	region = bl->hd->regions;
+	while (region) {
+		size_t start = region->address;
+		size_t end = region->address + region->len;
+
+		/* Only the user region can be erased (or written). */
+		if (start < info->user_region_base)
+			start = info->user_region_base;
+		if (end > info->user_region_top)
+			end = info->user_region_top;
+
+		for (i = start; i < end; i = (i / info->erase_page_size + 1) * info->erase_page_size)
+			set_page(bitmap, (i - info->user_region_base) / info->erase_page_size, &pages, &len);
+
+		region = region->next;
+	}
+
+	/* The application header covers everything from the start of the
+	 * user region, gaps included, so every page under it is erased
+	 * (unless its CRC shows that it's already right), or what's left of
+	 * an earlier, larger image would fail the header's CRC. The header
+	 * has to be erased before it can be written again, so its page is
+	 * always erased (and the rest of it programmed), unless its CRC shows
+	 * that it already holds the header for the hex file. */
+	if (info->app_header_address) {
+		size_t app_pages = DIV_ROUND_UP(image_app_length(bl), info->erase_page_size);
+
+		for (i = 0; i < app_pages; i++)
+			set_page(bitmap, i, &pages, &len);
+
+		header_page = (info->app_header_address - info->user_region_base) /
+		              info->erase_page_size;
+		set_page(bitmap, header_page, &pages, &len);
+	}
+
+	if (info->capabilities & CHIP_INFO_PAGE_CRCS) {
+		res = skip_unchanged_pages(bl, bitmap, num_pages);
+		if (res < 0) {
+			free(bitmap);
+			return res;
+		}
+		printf("%d of %lu pages unchanged\n", res, (unsigned long) pages);
+		pages -= res;
+
+		/* The device erases the header along with any other page
+		 * (it starts the application whenever the header is there,
+		 * without checking the CRC), so it has to be programmed
+		 * and written again too. */
+		if (pages > 0 && info->app_header_address)
+			set_page(bitmap, header_page, &pages, &len);
+
+		/* Only program the pages being erased. */
+		free(bl->program_pages);
+		bl->program_pages = bitmap;
+
+		if (info->app_header_address)
+			bl->app_header_current =
+				!(bitmap[header_page / 8] & (1 << header_page % 8));
+	}
+
+	printf("Erasing %lu of %lu pages\n", (unsigned long) pages, (unsigned long) num_pages);
+	res = pages ? erase_pages(bl->handle, bitmap, len) : 0;
+	if (bitmap != bl->program_pages)
+		free(bitmap);
+
+started:
+	if (res == 0 && (info->capabilities & CHIP_INFO_ASYNC_ERASE))
+		bl->erase_pending = 1;
+	return res;
 }
 
 int bootloader_reset(struct bootloader *bl)
 {
+	int res;
+
+	res = wait_for_erase(bl);
+	if (res < 0)
+		return res;
+
 	return send_reset(bl->handle);
 }
 
+/* The number of devices attached with vid/pid */
+static int count_devices(uint16_t vid, uint16_t pid)
+{
+	libusb_device **devs;
+	libusb_device *usb_dev;
+	int count = 0;
+	int d = 0;
+
+	if (libusb_get_device_list(NULL, &devs) < 0)
+		return 0;
+
+	while ((usb_dev = devs[d++]) != NULL) {
+		struct libusb_device_descriptor desc;
+
+		libusb_get_device_descriptor(usb_dev, &desc);
+		if (desc.idVendor == vid && desc.idProduct == pid)
+			count++;
+	}
+
+	libusb_free_device_list(devs, 1/*unref devices*/);
+	return count;
+}
+
+/* Ask the application at app_vid/app_pid to reset into the bootloader,
+ * and wait for the bootloader at vid/pid to show up. Does nothing if the
+ * bootloader is already there. */
+int bootloader_enter(uint16_t app_vid, uint16_t app_pid, uint16_t vid, uint16_t pid)
+{
+	libusb_device_handle *handle;
+	time_t start;
+	int res;
+
+	if (libusb_init(NULL))
+		return BOOTLOADER_CANT_OPEN_DEVICE;
+
+	/* Nothing to do if it's already in the bootloader. */
+	if (count_devices(vid, pid) > 0) {
+		res = 0;
+		goto out;
+	}
+
+	if (count_devices(app_vid, app_pid) > 1) {
+		res = BOOTLOADER_MULTIPLE_CONNECTED;
+		goto out;
+	}
+
+	handle = libusb_open_device_with_vid_pid(NULL, app_vid, app_pid);
+	if (!handle) {
+		res = BOOTLOADER_CANT_OPEN_DEVICE;
+		goto out;
+	}
+
+	res = libusb_control_transfer(handle,
+		LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
+		ENTER_BOOTLOADER /* bRequest */,
+		0, /* wValue */
+		0, /* wIndex */
+		NULL, 0/*wLength*/,
+		1000/*timeout millis*/);
+	libusb_close(handle);
+
+	/* The application can reset before the host sees the status
+	 * stage, so only a stall means it didn't take the request. */
+	if (res < 0 && res != LIBUSB_ERROR_NO_DEVICE && res != LIBUSB_ERROR_IO &&
+	    res != LIBUSB_ERROR_TIMEOUT) {
+		fprintf(stderr, "Error asking the application for the bootloader: %s\n", libusb_error_name(res));
+		res = BOOTLOADER_ERROR;
+		goto out;
+	}
+
+	printf("Waiting for the bootloader\n");
+	start = time(NULL);
+	while (count_devices(vid, pid) == 0) {
+		if (time(NULL) - start > ENTER_BOOTLOADER_SECONDS) {
+			fprintf(stderr, "The bootloader didn't show up\n");
+			res = BOOTLOADER_CANT_OPEN_DEVICE;
+			goto out;
+		}
+		sleep_ms(100);
+	}
+	res = 0;
+
+out:
+	libusb_exit(NULL);
+	return res;
+}
+
 int bootloader_init(struct bootloader **bootl, const char *filename, uint16_t vid, uint16_t pid)
 {
 	struct bootloader *bl;
@@ -412,6 +1644,64 @@ int bootloader_init(struct bootloader **bootl, const char *filename, uint16_t vi
 	printf("bytes per inst: %d\n inst per row %d\n",
 	       bl->chip_info.bytes_per_instruction,
 	       bl->chip_info.instructions_per_row);
+	printf("chip info version %d, capabilities %04lx\n",
+	       bl->chip_info.version,
+	       (unsigned long) bl->chip_info.capabilities);
+
+	/* Firmware which verifies rows as it writes them says so, or
+	 * before chip_info version 1, sends a longer flash status. This
+	 * also clears any failures left over from before. */
+	if (bl->chip_info.capabilities & CHIP_INFO_ASYNC_ERASE) {
+		struct flash_status status;
+
+		res = get_flash_status(bl, &status);
+		if (res < 0) {
+			res = BOOTLOADER_CANT_QUERY_DEVICE;
+			goto free_usb;
+		}
+		if (bl->chip_info.version >= 1)
+			bl->device_verifies = !!(bl->chip_info.capabilities & CHIP_INFO_VERIFY_ROWS);
+		else
+			bl->device_verifies = (res >= FLASH_STATUS_VERIFY_LEN);
+		bl->verify_failures = 0;
+		bl->blank_rows = 0;
+	}
+
+	/* Use the bulk programming commands if the device has them, since
+	 * they carry 64 bytes to a packet, against EP 0's 8 (on the PIC24
+	 * firmware). Compressed SEND_DATA goes over EP 0, so with bulk it's
+	 * only used for a batch of rows which compresses to fewer packets
+	 * than bulk would take, such as runs of 0xff or repeated
+	 * instructions, and without bulk for any batch it makes smaller
+	 * (see flush_rows()). Older firmware sends 0 for the flags. */
+	if (bl->chip_info.capabilities & CHIP_INFO_BULK) {
+		bl->bulk_buf_len = BULK_ROWS_PER_TRANSFER *
+		                   (BULK_HEADER_LEN + bl->bytes_per_row);
+		bl->bulk_buf = malloc(bl->bulk_buf_len);
+		printf("Using bulk programming\n");
+	}
+	if (bl->chip_info.capabilities & CHIP_INFO_MULTI_ROW) {
+		struct libusb_device_descriptor desc;
+
+		libusb_get_device_descriptor(libusb_get_device(bl->handle), &desc);
+		bl->ep0_packet_len = desc.bMaxPacketSize0;
+
+		/* As many whole rows as the device takes at once */
+		if ((bl->chip_info.capabilities & CHIP_INFO_SEND_DATA_LZ) &&
+		    bl->ep0_packet_len > 0) {
+			bl->rows_buf_len = bl->chip_info.max_transfer / bl->bytes_per_row *
+			                   bl->bytes_per_row;
+			bl->rows_buf = malloc(bl->rows_buf_len);
+			bl->lz_buf = malloc(bl->rows_buf_len);
+			printf("Using compressed programming%s\n",
+			       bl->bulk_buf? " where it's fewer packets": "");
+		}
+		else if (!bl->bulk_buf) {
+			bl->rows_buf_len = bl->chip_info.max_transfer / bl->bytes_per_row *
+			                   bl->bytes_per_row;
+			bl->rows_buf = malloc(bl->rows_buf_len);
+		}
+	}
 
 	return 0;
 
@@ -424,6 +1714,10 @@ free_hex:
 
 void bootloader_free(struct bootloader *bl)
 {
+	free(bl->bulk_buf);
+	free(bl->rows_buf);
+	free(bl->lz_buf);
+	free(bl->program_pages);
 	libusb_close(bl->handle);
 	hex_free(bl->hd);
 }
@@ -40,6 +40,10 @@
 
 struct bootloader; /* opaque struct */
 
+int  bootloader_enter(uint16_t app_vid,
+                      uint16_t app_pid,
+                      uint16_t vid,
+                      uint16_t pid);
 int  bootloader_init(struct bootloader **bootl,
                      const char *filename,
                      uint16_t vid,
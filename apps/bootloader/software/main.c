@@ -42,6 +42,8 @@ static void print_usage(const char *prog_name)
 	printf("Flash firmware file.\n\n");
 	printf("OPTIONS can be one of:\n");
 	printf("  -d  --dev=VID:PID     USB VID/PID of the device to program\n");
+	printf("  -a  --app=VID:PID     USB VID/PID of the application to switch\n");
+	printf("                        into the bootloader first\n");
 	printf("  -v, --verify          verify program write\n");
 	printf("  -r, --reset           reset device when done\n");
 	printf("  -h, --help            print help message and exit\n\n");
@@ -92,7 +94,9 @@ int main(int argc, char **argv)
 	const char *opt;
 	const char *filename = NULL;
 	uint16_t vid = 0, pid = 0;
-	bool vidpid_valid;
+	bool vidpid_valid = false;
+	uint16_t app_vid = 0, app_pid = 0;
+	bool app_vidpid_valid = false;
 	struct bootloader *bl;
 	int res;
 
@@ -117,6 +121,17 @@ int main(int argc, char **argv)
 					do_reset = true;
 				else if (!strcmp(opt, "--verify"))
 					do_verify = true;
+				else if (!strncmp(opt, "--app", 5)) {
+					if (opt[5] != '=') {
+						fprintf(stderr, "--app requires vid/pid pair\n\n");
+						return 1;
+					}
+					app_vidpid_valid = parse_vid_pid(opt+6, &app_vid, &app_pid);
+					if (!app_vidpid_valid) {
+						fprintf(stderr, "Invalid VID/PID pair\n\n");
+						return 1;
+					}
+				}
 				else if (!strncmp(opt, "--dev", 5)) {
 					if (opt[5] != '=') {
 						fprintf(stderr, "--dev requires vid/pid pair\n\n");
@@ -163,6 +178,19 @@ int main(int argc, char **argv)
 							return 1;
 						}
 						break;
+					case 'a':
+						itr++;
+						opt = *itr;
+						if (!opt) {
+							fprintf(stderr, "Must specify vid:pid after -a\n\n");
+							return 1;
+						}
+						app_vidpid_valid = parse_vid_pid(opt, &app_vid, &app_pid);
+						if (!app_vidpid_valid) {
+							fprintf(stderr, "Invalid VID/PID pair\n\n");
+							return 1;
+						}
+						break;
 					default:
 						fprintf(stderr, "Invalid parameter '%c'\n\n", *c);
 						return 1;
@@ -194,6 +222,20 @@ int main(int argc, char **argv)
 
 	/* Command line parsing is done. Do the programming of the device. */
 
+	/* Switch the application into the bootloader */
+	if (app_vidpid_valid) {
+		res = bootloader_enter(app_vid, app_pid, vid, pid);
+		if (res == BOOTLOADER_MULTIPLE_CONNECTED) {
+			fprintf(stderr, "Multiple devices are connected. Remove all but one.\n");
+			return 1;
+		}
+		else if (res < 0) {
+			fprintf(stderr, "Unable to switch %04hx:%04hx into the bootloader\n",
+				app_vid, app_pid);
+			return 1;
+		}
+	}
+
 	/* Open the device */
 	res = bootloader_init(&bl, filename, vid, pid);
 	if (res == BOOTLOADER_CANT_OPEN_FILE) {
@@ -220,6 +262,13 @@ int main(int argc, char **argv)
 		return 1;
 	}
 	
+	/* Erase the pages being programmed */
+	res = bootloader_erase(bl);
+	if (res < 0) {
+		fprintf(stderr, "Erasing the device failed\n");
+		return 1;
+	}
+
 	/* Program */
 	res = bootloader_program(bl);
 	if (res < 0) {
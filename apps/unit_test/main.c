@@ -18,6 +18,42 @@
 #include "usb_config.h"
 #include "usb_ch9.h"
 
+#ifdef USB_FRAME_SCHEDULER
+/* Frame tasks registered with request 247, to test the frame scheduler.
+ * running_frame_tasks tells the runs from usb_run_frame_tasks() apart from
+ * the ones from usb_service(). Using interrupts, an ISR task which preempts
+ * usb_run_frame_tasks() would be counted as deferred, so the simulation
+ * builds this firmware polled for the test. */
+struct frame_test {
+	uint16_t runs;
+	uint16_t deferred_runs;
+	uint16_t last_frame;
+	uint16_t overruns;
+};
+
+struct frame_test_report {
+	uint16_t frame_number;
+	uint16_t missed_frames;
+	struct frame_test tasks[USB_FRAME_SCHEDULER_MAX_TASKS];
+};
+
+static struct frame_test frame_tests[USB_FRAME_SCHEDULER_MAX_TASKS];
+static struct frame_test_report frame_test_report;
+static int8_t frame_test_handles[USB_FRAME_SCHEDULER_MAX_TASKS];
+static uint8_t num_frame_tests;
+static bool running_frame_tasks;
+
+static void frame_test_task(uint16_t frame, void *context)
+{
+	struct frame_test *t = context;
+
+	t->runs++;
+	if (running_frame_tasks)
+		t->deferred_runs++;
+	t->last_frame = frame;
+}
+#endif
+
 #ifdef __PIC24FJ64GB002__
 _CONFIG1(WDTPS_PS16 & FWPSA_PR32 & WINDIS_OFF & FWDTEN_OFF & ICS_PGx1 & GWRP_OFF & GCP_OFF & JTAGEN_OFF)
 _CONFIG2(POSCMOD_NONE & I2C1SEL_PRI & IOL1WAY_OFF & OSCIOFNC_OFF & FCKSM_CSDCMD & FNOSC_FRCPLL & PLL96MHZ_ON & PLLDIV_NODIV & IESO_OFF)
@@ -63,11 +99,28 @@ _CONFIG3(WPFP_WPFP255 & SOSCSEL_SOSC & WUTSEL_LEG & ALTPMP_ALPMPDIS & WPDIS_WPDI
 #pragma config LPBOR = ON
 #pragma config LVP = OFF
 
+#elif __linux__
+	/* Host simulation (sim/). There are no configuration bits. */
+
 #else
 	#error "Config flags for your device not defined"
 
 #endif
 
+#ifdef USB_ENDPOINT_WATCHDOG
+/* What app_endpoint_watchdog_callback() does and what it last saw, set and
+ * read with request 248, to test the endpoint watchdog. */
+struct watchdog_test_report {
+	uint16_t ep1_out_incidents;
+	uint16_t ep1_in_incidents;
+	uint8_t last_endpoint;
+	uint8_t last_sie_owned;
+};
+
+static int8_t watchdog_test_action = USB_WATCHDOG_IGNORE;
+static struct watchdog_test_report watchdog_test_report;
+#endif
+
 int main(void)
 {
 #if defined(__PIC24FJ64GB002__) || defined(__PIC24FJ256DA206__)
@@ -119,6 +172,12 @@ int main(void)
 		#ifndef USB_USE_INTERRUPTS
 		usb_service();
 		#endif
+
+		#ifdef USB_FRAME_SCHEDULER
+		running_frame_tasks = true;
+		usb_run_frame_tasks();
+		running_frame_tasks = false;
+		#endif
 	}
 
 	return 0;
@@ -161,6 +220,110 @@ int8_t app_unknown_setup_request_callback(const struct setup_packet *setup)
 {
 #define MIN(X,Y) ((X)<(Y)?(X):(Y))
 
+#ifdef USB_BANDWIDTH_STATS
+	/* Request 246/dest=other/type=vendor reads (IN) or clears (OUT) the
+	 * USB stack's bandwidth statistics. This callback runs from
+	 * usb_service(), so the statistics can't change while being copied. */
+	if (setup->bRequest == 246 &&
+	    setup->REQUEST.destination == 3 /*other*/ &&
+	    setup->REQUEST.type == 2 /*vendor*/) {
+		if (setup->REQUEST.direction == 1/*IN*/) {
+			size_t len = sizeof(struct usb_bandwidth_stats);
+			if (len > sizeof(buf))
+				return -1;
+			memcpy(buf, usb_get_bandwidth_stats(), len);
+			usb_send_data_stage(buf, MIN(len, setup->wLength), data_cb, NULL);
+		}
+		else {
+			if (setup->wLength != 0)
+				return -1;
+			usb_clear_bandwidth_stats();
+			usb_send_data_stage(NULL, 0, data_cb, NULL);
+		}
+		return 0;
+	}
+#endif
+
+#ifdef USB_ENDPOINT_WATCHDOG
+	/* Request 248/dest=other/type=vendor tests the endpoint watchdog. OUT
+	 * starts (high byte of wValue 1) or stops (0) watching the endpoint in
+	 * wIndex, and sets what app_endpoint_watchdog_callback() returns from
+	 * the low byte of wValue. IN returns a struct watchdog_test_report. */
+	if (setup->bRequest == 248 &&
+	    setup->REQUEST.destination == 3 /*other*/ &&
+	    setup->REQUEST.type == 2 /*vendor*/) {
+		if (setup->REQUEST.direction == 1/*IN*/) {
+			struct watchdog_test_report *r = &watchdog_test_report;
+
+			r->ep1_out_incidents = usb_get_endpoint_watchdog_incidents(0x01);
+			r->ep1_in_incidents = usb_get_endpoint_watchdog_incidents(0x81);
+			usb_send_data_stage((char*) r, MIN(sizeof(*r), setup->wLength), data_cb, NULL);
+			return 0;
+		}
+
+		if (setup->wLength != 0)
+			return -1;
+		watchdog_test_action = setup->wValue & 0xff;
+		usb_set_endpoint_watchdog(setup->wIndex, setup->wValue >> 8);
+		usb_send_data_stage(NULL, 0, data_cb, NULL);
+		return 0;
+	}
+#endif
+
+#ifdef USB_FRAME_SCHEDULER
+	/* Request 247/dest=other/type=vendor tests the frame scheduler. OUT
+	 * registers a task which runs every wValue frames, with the phase in
+	 * the low byte of wIndex and the flags in the high byte, or removes
+	 * all of them if wValue is 0. IN returns a struct frame_test_report. */
+	if (setup->bRequest == 247 &&
+	    setup->REQUEST.destination == 3 /*other*/ &&
+	    setup->REQUEST.type == 2 /*vendor*/) {
+		uint8_t i;
+
+		if (setup->REQUEST.direction == 1/*IN*/) {
+			struct frame_test_report *r = &frame_test_report;
+
+			memset(r, 0, sizeof(*r));
+			r->frame_number = usb_get_frame_number();
+			r->missed_frames = usb_get_missed_frames();
+			for (i = 0; i < num_frame_tests; i++) {
+				r->tasks[i] = frame_tests[i];
+				r->tasks[i].overruns =
+					usb_get_frame_task_overruns(frame_test_handles[i]);
+			}
+			usb_send_data_stage((char*) r, MIN(sizeof(*r), setup->wLength), data_cb, NULL);
+			return 0;
+		}
+
+		if (setup->wLength != 0)
+			return -1;
+
+		if (setup->wValue == 0) {
+			for (i = 0; i < num_frame_tests; i++)
+				usb_remove_frame_task(frame_test_handles[i]);
+			num_frame_tests = 0;
+		}
+		else {
+			int8_t handle;
+
+			if (num_frame_tests >= USB_FRAME_SCHEDULER_MAX_TASKS)
+				return -1;
+			i = num_frame_tests;
+			memset(&frame_tests[i], 0, sizeof(frame_tests[i]));
+			handle = usb_add_frame_task(frame_test_task, &frame_tests[i],
+			                            setup->wValue,
+			                            setup->wIndex & 0xff,
+			                            setup->wIndex >> 8);
+			if (handle < 0)
+				return -1;
+			frame_test_handles[i] = handle;
+			num_frame_tests++;
+		}
+		usb_send_data_stage(NULL, 0, data_cb, NULL);
+		return 0;
+	}
+#endif
+
 	/* This handler handles request 254/dest=other/type=vendor only.*/
 	if (setup->bRequest != 245 ||
 	    setup->REQUEST.destination != 3 /*other*/ ||
@@ -219,6 +382,15 @@ void app_usb_reset_callback(void)
 
 }
 
+#ifdef USB_ENDPOINT_WATCHDOG
+int8_t app_endpoint_watchdog_callback(uint8_t endpoint, bool sie_owned)
+{
+	watchdog_test_report.last_endpoint = endpoint;
+	watchdog_test_report.last_sie_owned = sie_owned;
+	return watchdog_test_action;
+}
+#endif
+
 #ifdef _PIC14E
 void interrupt isr()
 {
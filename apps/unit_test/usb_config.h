@@ -38,6 +38,28 @@
    then for calling usb_service() periodically from your application. */
 #define USB_USE_INTERRUPTS
 
+/* Uncomment the following lines to enable the SOF-synchronized frame
+   scheduler (see usb_add_frame_task() in usb.h). */
+//#define USB_FRAME_SCHEDULER
+//#define USB_FRAME_SCHEDULER_MAX_TASKS 4
+
+/* Uncomment the following lines to enable the endpoint watchdog. The limits
+   are in frames. Set a limit to 0 to disable that check. Endpoints are only
+   checked once they are passed to usb_set_endpoint_watchdog(). */
+//#define USB_ENDPOINT_WATCHDOG
+//#define USB_ENDPOINT_WATCHDOG_CPU_FRAMES 1000
+//#define USB_ENDPOINT_WATCHDOG_SIE_FRAMES 0
+
+/* Uncomment the following line to keep per-frame bandwidth statistics. The
+   unit test firmware returns them for vendor request 246. */
+//#define USB_BANDWIDTH_STATS
+
+/* Uncomment the following line to be able to handle the data stage of
+   control transfers a packet at a time (see
+   usb_start_receive_ep0_data_stage_packets() and
+   usb_send_data_stage_packets() in usb.h). */
+//#define USB_EP0_DATA_STAGE_PACKETS
+
 /* Objects from usb_descriptors.c */
 #define USB_DEVICE_DESCRIPTOR this_device_descriptor
 #define USB_CONFIG_DESCRIPTOR_MAP usb_application_config_descs
@@ -55,6 +77,7 @@
 #define UNKNOWN_GET_DESCRIPTOR_CALLBACK app_unknown_get_descriptor_callback
 #define START_OF_FRAME_CALLBACK    app_start_of_frame_callback
 #define USB_RESET_CALLBACK         app_usb_reset_callback
+//#define ENDPOINT_WATCHDOG_CALLBACK app_endpoint_watchdog_callback
 
 
 #endif /* USB_CONFIG_H__ */
@@ -0,0 +1,145 @@
+/*
+ * Libusb Bandwidth Statistics Test for M-Stack
+ *
+ * This file may be used by anyone for any purpose and may be used as a
+ * starting point making your own application using M-Stack.
+ *
+ * It is worth noting that M-Stack itself is not under the same license as
+ * this file.  See the top-level README.txt for more information.
+ */
+
+/*
+Libusb Bandwidth Statistics Test for M-Stack
+
+This program reads the per-frame bandwidth statistics which the unit test
+firmware keeps when it is built with USB_BANDWIDTH_STATS (as it is for
+libusb-features.so in sim/), and prints the
+average and peak bytes per frame for each endpoint.  Run with a single
+parameter of "clear" to clear the statistics on the device.
+
+What I do:
+ ./bandwidth clear # start a new measurement
+ ./test 64         # (or run the real workload)
+ ./bandwidth       # see how many bytes moved in each frame
+*/
+
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* GNU / LibUSB */
+#include "libusb.h"
+
+#define BANDWIDTH_STATS_REQUEST 246
+
+/* The statistics are sent as struct usb_bandwidth_stats (usb.h), which
+ * is little-endian: a 32-bit frame count followed by an 8-byte record for
+ * each endpoint direction, EP 0 OUT first. */
+#define HEADER_LEN 4
+#define RECORD_LEN 8
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint16_t get_le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+int main(int argc, char **argv)
+{
+	libusb_device_handle *handle;
+	unsigned char buf[1024];
+	uint32_t frames;
+	int num_records;
+	int clear = 0;
+	int i;
+	int res;
+
+	if (argc == 2) {
+		if (!strcmp(argv[1], "clear"))
+			clear = 1;
+		else {
+			fprintf(stderr, "invalid arg\n");
+			return 1;
+		}
+	}
+
+	/* Init Libusb */
+	if (libusb_init(NULL))
+		return -1;
+
+	handle = libusb_open_device_with_vid_pid(NULL, 0xa0a0, 0x0001);
+	if (!handle) {
+		perror("libusb_open failed: ");
+		return 1;
+	}
+
+	res = libusb_claim_interface(handle, 0);
+	if (res < 0) {
+		perror("claim interface");
+		return 1;
+	}
+
+	if (clear) {
+		res = libusb_control_transfer(handle,
+			LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
+			BANDWIDTH_STATS_REQUEST,
+			0, /*wValue*/
+			0, /*wIndex*/
+			NULL, 0/*wLength*/,
+			1000/*timeout millis*/);
+		if (res < 0) {
+			fprintf(stderr, "control transfer (clear stats): %s\n", libusb_error_name(res));
+			return 1;
+		}
+		printf("Statistics cleared\n");
+		return 0;
+	}
+
+	res = libusb_control_transfer(handle,
+		LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_OTHER,
+		BANDWIDTH_STATS_REQUEST,
+		0, /*wValue*/
+		0, /*wIndex*/
+		buf, sizeof(buf)/*wLength*/,
+		1000/*timeout millis*/);
+
+	if (res < 0) {
+		fprintf(stderr, "control transfer (read stats): %s\n", libusb_error_name(res));
+		return 1;
+	}
+	if (res < HEADER_LEN) {
+		fprintf(stderr, "Short statistics packet (%d bytes)\n", res);
+		return 1;
+	}
+
+	frames = get_le32(buf);
+	num_records = (res - HEADER_LEN) / RECORD_LEN;
+
+	printf("Frames: %u\n", frames);
+	printf("Endpoint  Total bytes  Avg bytes/frame  Peak bytes/frame  IN not ready\n");
+	for (i = 0; i < num_records; i++) {
+		const unsigned char *rec = buf + HEADER_LEN + i * RECORD_LEN;
+		uint32_t total = get_le32(rec);
+		uint16_t peak = get_le16(rec + 4);
+		uint16_t not_ready = get_le16(rec + 6);
+		int ep = i / 2;
+		int in = i % 2;
+
+		printf("EP %2d %-3s %11u  %15.2f  %16hu  ",
+		       ep, in? "IN": "OUT", total,
+		       frames? (double) total / frames: 0.0,
+		       peak);
+		if (in && ep > 0)
+			printf("%12hu\n", not_ready);
+		else
+			printf("%12s\n", "-");
+	}
+
+	return 0;
+}
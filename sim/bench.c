@@ -0,0 +1,610 @@
+/*
+ *  M-Stack Host Simulation: Microbenchmarks
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Time the hot paths of usb.c, built for the host against the virtual
+ * SIE. This is linked with the unit_test firmware's objects, but its
+ * main() is never run: the benchmarks call the stack's API directly, and
+ * the stack's interrupt handler runs synchronously from each bus event.
+ *
+ * Each operation is run -n times per repetition, and the best of -r
+ * repetitions is reported, as wall-clock ns/op and, where the kernel
+ * allows a hardware counter to be opened (perf_event_open()), user-space
+ * instructions/op. The cost of reading the counters is measured first
+ * and subtracted. The times include the virtual SIE's work for each
+ * transaction; sie_in_nak, a transaction which never reaches usb.c, is
+ * there to show how much that is.
+ *
+ * With -w file, the results are written to a baseline file. With
+ * -b file, they are compared to one, and the run fails if any operation
+ * is slower than its baseline by more than the tolerance (-t for time,
+ * -T for instructions). Instruction counts are far more repeatable than
+ * times, so their tolerance is much tighter; they are only compared if
+ * both the baseline and this run have them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <usb_config.h>
+#include <usb.h>
+#include <usb_ch9.h>
+
+#include "sim.h"
+#include "host.h"
+
+#define MAX_BENCHES 16
+#define BATCH 100
+#define VENDOR_REQUEST 245  /* unit_test's vendor request */
+#define VENDOR_LEN 512
+
+struct counters {
+	double ns;
+	double instructions;
+};
+
+struct bench {
+	const char *name;
+	const char *description;
+	/* Runs some operations, timing them with timer_start() and
+	 * timer_stop(). Returns the number of operations timed. */
+	unsigned int (*batch)(void);
+};
+
+struct result {
+	char name[32];
+	double ns;
+	double instructions; /* < 0 if not available */
+};
+
+static struct sim_host host;
+static uint16_t config_len;
+
+static int perf_fd = -1;
+static struct counters overhead;
+static struct counters started;
+static struct counters elapsed;
+
+static void fail(const char *what, int res)
+{
+	fprintf(stderr, "bench: %s failed (%d)\n", what, res);
+	exit(1);
+}
+
+/* User-space instructions retired by this thread. */
+static int open_instruction_counter(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static inline void sample(struct counters *c)
+{
+	struct timespec ts;
+	uint64_t count = 0;
+
+	if (perf_fd >= 0 && read(perf_fd, &count, sizeof(count)) != sizeof(count))
+		count = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	c->ns = ts.tv_sec * 1e9 + ts.tv_nsec;
+	c->instructions = count;
+}
+
+static inline void timer_start(void)
+{
+	sample(&started);
+}
+
+static inline void timer_stop(void)
+{
+	struct counters now;
+
+	sample(&now);
+	elapsed.ns += now.ns - started.ns - overhead.ns;
+	elapsed.instructions += now.instructions - started.instructions -
+	                        overhead.instructions;
+}
+
+/* The least a timer_start()/timer_stop() pair costs with nothing
+ * between them. */
+static void calibrate(void)
+{
+	struct counters best = { 1e18, 1e18 };
+	int i;
+
+	for (i = 0; i < 10000; i++) {
+		elapsed.ns = 0;
+		elapsed.instructions = 0;
+		timer_start();
+		timer_stop();
+		if (elapsed.ns < best.ns)
+			best.ns = elapsed.ns;
+		if (elapsed.instructions < best.instructions)
+			best.instructions = elapsed.instructions;
+	}
+
+	overhead = best;
+}
+
+static void enumerate(void)
+{
+	uint8_t buf[256];
+	int res;
+
+	sim_host_init(&host);
+	res = sim_host_bus_reset(&host);
+	if (res != SIM_ACK)
+		fail("bus reset", res);
+	res = sim_host_control(&host, 0x80, GET_DESCRIPTOR, DESC_DEVICE << 8,
+	                       0, buf, 18);
+	if (res < 8)
+		fail("GET_DESCRIPTOR(device)", res);
+	res = sim_host_control(&host, 0x00, SET_ADDRESS, 1, 0, NULL, 0);
+	if (res < 0)
+		fail("SET_ADDRESS", res);
+	res = sim_host_control(&host, 0x80, GET_DESCRIPTOR,
+	                       DESC_CONFIGURATION << 8, 0, buf, 9);
+	if (res != 9)
+		fail("GET_DESCRIPTOR(configuration)", res);
+	config_len = buf[2] | buf[3] << 8;
+	if (config_len > sizeof(buf))
+		fail("configuration descriptor size", config_len);
+	res = sim_host_control(&host, 0x00, SET_CONFIGURATION, buf[5], 0,
+	                       NULL, 0);
+	if (res < 0)
+		fail("SET_CONFIGURATION", res);
+}
+
+/* An IN to an endpoint with nothing to send. The SIE NAKs it without
+ * the firmware seeing it. */
+static unsigned int sie_in_nak(void)
+{
+	uint8_t pkt[64];
+	uint8_t pid;
+	size_t len;
+	int i, res;
+
+	timer_start();
+	for (i = 0; i < BATCH; i++) {
+		res = sim_sie_in(host.addr, 1, pkt, sizeof(pkt), &len, &pid);
+		if (res != SIM_NAK)
+			fail("IN NAK", res);
+	}
+	timer_stop();
+
+	return BATCH;
+}
+
+/* A whole GET_DESCRIPTOR(configuration) control transfer: the SETUP,
+ * every IN of the data stage, and the status stage. */
+static unsigned int setup_get_config(void)
+{
+	uint8_t buf[256];
+	int i, res;
+
+	timer_start();
+	for (i = 0; i < BATCH; i++) {
+		res = sim_host_control(&host, 0x80, GET_DESCRIPTOR,
+		                       DESC_CONFIGURATION << 8, 0,
+		                       buf, config_len);
+		if (res != config_len)
+			fail("GET_DESCRIPTOR(configuration)", res);
+	}
+	timer_stop();
+
+	return BATCH;
+}
+
+static void vendor_setup(uint8_t bmRequestType)
+{
+	const uint8_t setup[8] = {
+		bmRequestType, VENDOR_REQUEST, 0, 0, 0, 0,
+		VENDOR_LEN & 0xff, VENDOR_LEN >> 8,
+	};
+	int res;
+
+	res = sim_sie_setup(host.addr, setup);
+	if (res != SIM_ACK)
+		fail("vendor SETUP", res);
+}
+
+/* The IN packets of a control read's data stage. The completion of each
+ * one has handle_ep0_in() queue the next. */
+static unsigned int ep0_in_packet(void)
+{
+	uint8_t pkt[EP_0_LEN];
+	unsigned int i;
+	uint8_t pid;
+	size_t len;
+	int res;
+
+	vendor_setup(0xc3); /* IN, vendor, other */
+
+	timer_start();
+	for (i = 0; i < VENDOR_LEN / EP_0_LEN; i++) {
+		res = sim_sie_in(host.addr, 0, pkt, sizeof(pkt), &len, &pid);
+		if (res != SIM_ACK || len != EP_0_LEN)
+			fail("EP 0 IN", res);
+	}
+	timer_stop();
+
+	res = sim_sie_out(host.addr, 0, 1, NULL, 0);
+	if (res != SIM_ACK)
+		fail("EP 0 IN status stage", res);
+
+	return VENDOR_LEN / EP_0_LEN;
+}
+
+/* The OUT packets of a control write's data stage, each handled by
+ * handle_ep0_out(). */
+static unsigned int ep0_out_packet(void)
+{
+	uint8_t pkt[EP_0_LEN];
+	unsigned int i;
+	uint8_t pid;
+	size_t len;
+	int res;
+
+	memset(pkt, 0x5a, sizeof(pkt));
+	vendor_setup(0x43); /* OUT, vendor, other */
+
+	timer_start();
+	for (i = 0; i < VENDOR_LEN / EP_0_LEN; i++) {
+		res = sim_sie_out(host.addr, 0, !(i & 1), pkt, sizeof(pkt));
+		if (res != SIM_ACK)
+			fail("EP 0 OUT", res);
+	}
+	timer_stop();
+
+	res = sim_sie_in(host.addr, 0, pkt, sizeof(pkt), &len, &pid);
+	if (res != SIM_ACK || len != 0)
+		fail("EP 0 OUT status stage", res);
+
+	return VENDOR_LEN / EP_0_LEN;
+}
+
+/* One packet each way on EP 1, as an application moving data does it:
+ * usb_send_in_buffer(), the IN transaction, the OUT transaction, and
+ * usb_arm_out_endpoint(). */
+static unsigned int bulk_cycle(void)
+{
+	uint8_t pkt[EP_1_IN_LEN];
+	uint8_t pid;
+	size_t len;
+	int i, res;
+
+	memset(pkt, 0xa5, sizeof(pkt));
+
+	timer_start();
+	for (i = 0; i < BATCH; i++) {
+		usb_send_in_buffer(1, EP_1_IN_LEN);
+		res = sim_sie_in(host.addr, 1, pkt, sizeof(pkt), &len, &pid);
+		if (res != SIM_ACK)
+			fail("EP 1 IN", res);
+		res = sim_sie_out(host.addr, 1, host.toggle[1][0], pkt,
+		                  EP_1_OUT_LEN);
+		if (res != SIM_ACK)
+			fail("EP 1 OUT", res);
+		host.toggle[1][0] ^= 1;
+		usb_arm_out_endpoint(1);
+	}
+	timer_stop();
+
+	return BATCH;
+}
+
+/* A bus reset, which runs usb_init() from the interrupt handler. */
+static unsigned int bus_reset(void)
+{
+	int i, res;
+
+	timer_start();
+	for (i = 0; i < BATCH; i++) {
+		res = sim_sie_bus_reset();
+		if (res != SIM_ACK)
+			fail("bus reset", res);
+	}
+	timer_stop();
+
+	enumerate();
+	return BATCH;
+}
+
+static const struct bench benches[] = {
+	{ "sie_in_nak", "NAK'd IN (virtual SIE only)", sie_in_nak },
+	{ "setup_get_config", "GET_DESCRIPTOR(config), SETUP to status", setup_get_config },
+	{ "ep0_in_packet", "EP 0 IN data stage packet", ep0_in_packet },
+	{ "ep0_out_packet", "EP 0 OUT data stage packet", ep0_out_packet },
+	{ "bulk_cycle", "EP 1 send/IN/OUT/arm cycle", bulk_cycle },
+	{ "bus_reset", "Bus reset and usb_init()", bus_reset },
+};
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static void run(const struct bench *b, unsigned int ops,
+                unsigned int repetitions, struct result *r)
+{
+	unsigned int rep, done;
+
+	snprintf(r->name, sizeof(r->name), "%s", b->name);
+	r->ns = 1e18;
+	r->instructions = 1e18;
+
+	enumerate();
+	b->batch(); /* Warm up */
+
+	for (rep = 0; rep < repetitions; rep++) {
+		elapsed.ns = 0;
+		elapsed.instructions = 0;
+		for (done = 0; done < ops; )
+			done += b->batch();
+
+		if (elapsed.ns / done < r->ns)
+			r->ns = elapsed.ns / done;
+		if (elapsed.instructions / done < r->instructions)
+			r->instructions = elapsed.instructions / done;
+	}
+
+	if (perf_fd < 0)
+		r->instructions = -1;
+}
+
+static int read_baseline(const char *file, struct result *base, int max)
+{
+	char line[256], instructions[32];
+	int n = 0;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		fprintf(stderr, "bench: %s: %s\n", file, strerror(errno));
+		exit(1);
+	}
+
+	while (n < max && fgets(line, sizeof(line), fp)) {
+		struct result *r = &base[n];
+
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%31s %lf %31s", r->name, &r->ns,
+		           instructions) != 3) {
+			fprintf(stderr, "bench: %s: bad line: %s", file, line);
+			exit(1);
+		}
+		r->instructions = (instructions[0] == '-') ? -1 :
+		                  strtod(instructions, NULL);
+		n++;
+	}
+
+	fclose(fp);
+	return n;
+}
+
+static void write_baseline(const char *file, const struct result *results,
+                           int n)
+{
+	FILE *fp;
+	int i;
+
+	fp = fopen(file, "w");
+	if (!fp) {
+		fprintf(stderr, "bench: %s: %s\n", file, strerror(errno));
+		exit(1);
+	}
+
+	fprintf(fp, "# M-Stack usb.c benchmark baseline\n");
+	fprintf(fp, "# operation ns/op instructions/op\n");
+	for (i = 0; i < n; i++) {
+		if (results[i].instructions < 0)
+			fprintf(fp, "%s %.1f -\n", results[i].name,
+			        results[i].ns);
+		else
+			fprintf(fp, "%s %.1f %.1f\n", results[i].name,
+			        results[i].ns, results[i].instructions);
+	}
+
+	fclose(fp);
+}
+
+static const struct result *find(const struct result *results, int n,
+                                 const char *name)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!strcmp(results[i].name, name))
+			return &results[i];
+	}
+
+	return NULL;
+}
+
+static bool selected(const char *name, char **names, int num_names)
+{
+	int i;
+
+	if (num_names == 0)
+		return true;
+
+	for (i = 0; i < num_names; i++) {
+		if (!strcmp(names[i], name))
+			return true;
+	}
+
+	return false;
+}
+
+static void usage(const char *prog)
+{
+	unsigned int i;
+
+	fprintf(stderr,
+	        "usage: %s [options] [operation...]\n"
+	        "Options:\n"
+	        "  -n ops       Operations per repetition (default 100000)\n"
+	        "  -r reps      Repetitions; the best is kept (default 5)\n"
+	        "  -b file      Compare against a baseline file\n"
+	        "  -w file      Write the results as a baseline file\n"
+	        "  -t percent   Time tolerance over the baseline (default 25)\n"
+	        "  -T percent   Instruction tolerance over the baseline\n"
+	        "               (default 2)\n"
+	        "Operations:\n",
+	        prog);
+	for (i = 0; i < NUM_BENCHES; i++)
+		fprintf(stderr, "  %-18s %s\n", benches[i].name,
+		        benches[i].description);
+}
+
+int main(int argc, char **argv)
+{
+	struct result results[MAX_BENCHES], base[MAX_BENCHES];
+	const char *baseline = NULL, *output = NULL;
+	double ns_tolerance = 25, instruction_tolerance = 2;
+	unsigned int ops = 100000, repetitions = 5;
+	int num_results = 0, num_base = 0;
+	int regressions = 0;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:b:w:t:T:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			repetitions = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'w':
+			output = optarg;
+			break;
+		case 't':
+			ns_tolerance = strtod(optarg, NULL);
+			break;
+		case 'T':
+			instruction_tolerance = strtod(optarg, NULL);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (ops == 0 || repetitions == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (i = optind; i < (unsigned int) argc; i++) {
+		unsigned int j;
+		for (j = 0; j < NUM_BENCHES; j++) {
+			if (!strcmp(argv[i], benches[j].name))
+				break;
+		}
+		if (j == NUM_BENCHES) {
+			fprintf(stderr, "bench: unknown operation: %s\n",
+			        argv[i]);
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (baseline)
+		num_base = read_baseline(baseline, base, MAX_BENCHES);
+
+	perf_fd = open_instruction_counter();
+	if (perf_fd < 0)
+		fprintf(stderr, "bench: instruction counter unavailable (%s); "
+		        "reporting time only\n", strerror(errno));
+	calibrate();
+
+	sim_sie_power_on();
+	usb_init();
+
+	printf("%-18s %10s %12s", "operation", "ns/op", "instr/op");
+	if (baseline)
+		printf(" %9s %9s", "ns", "instr");
+	printf("\n");
+
+	for (i = 0; i < NUM_BENCHES; i++) {
+		const struct result *b;
+		struct result *r;
+		bool regressed = false;
+
+		if (!selected(benches[i].name, argv + optind, argc - optind))
+			continue;
+
+		r = &results[num_results++];
+		run(&benches[i], ops, repetitions, r);
+
+		printf("%-18s %10.1f", r->name, r->ns);
+		if (r->instructions < 0)
+			printf(" %12s", "-");
+		else
+			printf(" %12.1f", r->instructions);
+
+		b = baseline ? find(base, num_base, r->name) : NULL;
+		if (b) {
+			double ns_change = (r->ns / b->ns - 1) * 100;
+			printf(" %+8.1f%%", ns_change);
+			regressed |= ns_change > ns_tolerance;
+
+			if (b->instructions > 0 && r->instructions >= 0) {
+				double change = (r->instructions /
+				                 b->instructions - 1) * 100;
+				printf(" %+8.1f%%", change);
+				regressed |= change > instruction_tolerance;
+			}
+			else {
+				printf(" %9s", "-");
+			}
+		}
+
+		if (regressed) {
+			printf("  REGRESSION");
+			regressions++;
+		}
+		printf("\n");
+	}
+
+	if (output)
+		write_baseline(output, results, num_results);
+
+	if (regressions) {
+		fprintf(stderr, "bench: %d operation%s slower than %s\n",
+		        regressions, regressions == 1 ? "" : "s", baseline);
+		return 1;
+	}
+
+	return 0;
+}
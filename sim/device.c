@@ -0,0 +1,225 @@
+/*
+ *  M-Stack Host Simulation: Simulated MCU
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The firmware's main() (built with -Dmain=firmware_main) runs in its own
+ * thread, which stands in for the CPU.  For interrupt-driven firmware,
+ * the interrupt vector is called from the thread which runs the bus
+ * (see sie.c), in the same way an interrupt preempts the main loop.
+ *
+ * A software reset unwinds the firmware thread and runs main() again.
+ * RAM is not re-initialized, so the firmware's static variables keep the
+ * values they had, except for what main() and usb_init() set up.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <xc.h>
+#include "sim.h"
+
+extern int firmware_main(void);
+extern void sim_usb_interrupt(void) __attribute__((weak));
+
+enum exit_reason {
+	EXIT_NONE,
+	EXIT_RESET,
+	EXIT_GOTO,
+};
+
+static pthread_t thread;
+static bool running;
+static jmp_buf restart;
+static volatile enum exit_reason pending;
+static volatile uint32_t pending_address;
+static volatile unsigned int resets;
+static volatile uint32_t app_address;
+
+volatile uint32_t bootloader_mailbox;
+
+static bool on_firmware_thread(void)
+{
+	return running && pthread_equal(pthread_self(), thread);
+}
+
+static void *firmware_thread(void *arg)
+{
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+	while (1) {
+		switch (setjmp(restart)) {
+		case EXIT_RESET:
+			resets++;
+			RCONbits.POR = 0;
+			RCONbits.BOR = 0;
+			sim_sie_power_on();
+			break;
+		case EXIT_GOTO:
+			app_address = pending_address;
+			return NULL;
+		}
+
+		firmware_main();
+		return NULL;
+	}
+}
+
+static int start(void)
+{
+	if (pthread_create(&thread, NULL, firmware_thread, NULL) != 0)
+		return -1;
+	running = true;
+	return 0;
+}
+
+static void stop(void)
+{
+	if (!running)
+		return;
+	pthread_cancel(thread);
+	pthread_join(thread, NULL);
+	running = false;
+}
+
+/* Wait for the firmware to finish usb_init(). */
+static int wait_for_usb(void)
+{
+	struct timespec ts;
+	unsigned int i;
+
+	for (i = 0; i < 2000; i++) {
+		if (sim_sie_attached() &&
+		    (!sim_usb_interrupt || USBINTbits.USBIE))
+			return 0;
+		if (app_address)
+			return -1;
+		ts.tv_sec = 0;
+		ts.tv_nsec = 1000000;
+		nanosleep(&ts, NULL);
+	}
+
+	return -1;
+}
+
+int sim_device_power_on(void)
+{
+	stop();
+	sim_sie_power_on();
+	RCONbits.POR = 1;
+	RCONbits.BOR = 1;
+	resets = 0;
+	app_address = 0;
+	bootloader_mailbox = 0;
+	pending = EXIT_NONE;
+
+	if (start() < 0)
+		return -1;
+
+	return wait_for_usb();
+}
+
+int sim_device_app_reset(void)
+{
+	/* Only the application can do this, and it has the CPU. */
+	if (!app_address)
+		return -1;
+
+	stop();
+	sim_sie_power_on();
+	resets++;
+	RCONbits.POR = 0;
+	RCONbits.BOR = 0;
+	app_address = 0;
+	pending = EXIT_NONE;
+
+	if (start() < 0)
+		return -1;
+
+	return wait_for_usb();
+}
+
+void sim_device_power_off(void)
+{
+	stop();
+	sim_sie_power_on();
+}
+
+unsigned int sim_device_reset_count(void)
+{
+	return resets;
+}
+
+uint32_t sim_device_app_address(void)
+{
+	return app_address;
+}
+
+/* Leave the firmware through reset or a jump to the application. From the
+ * firmware thread this happens right away. From an interrupt handler,
+ * it happens once the SIE is done with the current bus event. */
+static void leave(enum exit_reason reason)
+{
+	/* The device drops off the bus right away. */
+	UCONbits.USBEN = 0;
+
+	if (on_firmware_thread())
+		longjmp(restart, reason);
+
+	pending = reason;
+}
+
+void sim_device_after_event(void)
+{
+	enum exit_reason reason = pending;
+
+	if (reason == EXIT_NONE)
+		return;
+	pending = EXIT_NONE;
+
+	stop();
+	sim_sie_power_on();
+	if (reason == EXIT_RESET) {
+		resets++;
+		RCONbits.POR = 0;
+		RCONbits.BOR = 0;
+		start();
+		wait_for_usb();
+	}
+	else {
+		app_address = pending_address;
+	}
+}
+
+void sim_asm(const char *instruction)
+{
+	if (strcmp(instruction, "reset") == 0)
+		leave(EXIT_RESET);
+	else if (strncmp(instruction, "DISI", 4) == 0)
+		; /* Interrupts are never nested in the simulation. */
+	else
+		fprintf(stderr, "sim: unsupported instruction: %s\n", instruction);
+}
+
+void sim_goto(uint32_t address)
+{
+	pending_address = address;
+	leave(EXIT_GOTO);
+}
@@ -0,0 +1,493 @@
+/*
+ *  M-Stack Host Simulation: Enumeration Benchmark
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Time how long it takes to enumerate a device, from plugging it in to
+ * SET_CONFIGURATION, for an application's descriptors and an EP 0 size.
+ * This is built with an application's usb_config.h and usb_descriptors.c,
+ * with EP_0_LEN overridden (see enum_ep0.h and the Makefile), and a stub
+ * application which accepts whatever the host asks of it.
+ *
+ * The host enumerates the device the way Linux does, in stages:
+ *
+ *   reset, GET_DESCRIPTOR(device, 8 bytes), reset
+ *   SET_ADDRESS
+ *   GET_DESCRIPTOR(device)
+ *   GET_DESCRIPTOR(configuration, 9 bytes)
+ *   GET_DESCRIPTOR(configuration, wTotalLength)
+ *   GET_DESCRIPTOR(string 0), then each string the device descriptor
+ *     names, 255 bytes each
+ *   SET_CONFIGURATION
+ *
+ * For each stage, it reports the transactions (and how many of them were
+ * NAK'd), the bus time and 1 ms frames they take on a full-speed bus, and
+ * the CPU time spent in the stack. Bus time uses the transaction times of
+ * the timing model (model.c), with worst-case bit stuffing, transactions
+ * back to back, and a transaction only started if one of EP 0's largest
+ * packets would fit in the rest of the frame. The waits the USB
+ * specification requires are included at their minimum: 10 ms of reset
+ * signalling (TDRST) and 10 ms of reset recovery (TRSTRCY), and 2 ms after
+ * SET_ADDRESS (9.2.6.3). Polled firmware is serviced after every bus
+ * event, so NAKs only come from the stack itself.
+ *
+ * CPU time is wall-clock time around each transaction, including the
+ * virtual SIE's share of it, averaged over -n enumerations; the best of
+ * -r repetitions is reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <usb_config.h>
+#include <usb.h>
+#include <usb_ch9.h>
+
+#include "sim.h"
+#include "host.h"
+
+#define MIN(X,Y) ((X)<(Y)?(X):(Y))
+#define MAX(X,Y) ((X)>(Y)?(X):(Y))
+
+#define FRAME_NS 1000000.0
+#define SOF_NS (37 * 83.54)
+#define RESET_NS 10e6           /* TDRST */
+#define RESET_RECOVERY_NS 10e6  /* TRSTRCY */
+#define SET_ADDRESS_NS 2e6
+#define STRING_LEN 255
+
+#ifdef USB_USE_INTERRUPTS
+#define FIRMWARE_TYPE "interrupts"
+#else
+#define FIRMWARE_TYPE "polled"
+#endif
+
+enum stage_id {
+	STAGE_DEVICE_8,
+	STAGE_SET_ADDRESS,
+	STAGE_DEVICE,
+	STAGE_CONFIG_SHORT,
+	STAGE_CONFIG,
+	STAGE_STRINGS,
+	STAGE_SET_CONFIGURATION,
+	NUM_STAGES,
+};
+
+struct stage {
+	const char *name;
+	unsigned int transactions;
+	unsigned int naks;
+	double bus_ns;
+	double start_ns;
+	double end_ns;
+	double cpu_ns;      /* This repetition */
+	double best_cpu_ns; /* Per enumeration, best repetition */
+};
+
+static struct stage stages[NUM_STAGES] = {
+	[STAGE_DEVICE_8] = { "reset, device (8)" },
+	[STAGE_SET_ADDRESS] = { "SET_ADDRESS" },
+	[STAGE_DEVICE] = { "device" },
+	[STAGE_CONFIG_SHORT] = { "configuration (9)" },
+	[STAGE_CONFIG] = { "configuration" },
+	[STAGE_STRINGS] = { "strings" },
+	[STAGE_SET_CONFIGURATION] = { "SET_CONFIGURATION" },
+};
+
+static struct sim_host host;
+static struct stage *stage;
+static double bus_ns;       /* Modeled time since the device was attached */
+static double frame_end_ns;
+static double timer_overhead_ns;
+
+static void fail(const char *what, int res)
+{
+	fprintf(stderr, "enum_bench: %s failed (%d)\n", what, res);
+	exit(1);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The least a pair of now_ns() calls costs. */
+static void calibrate(void)
+{
+	double best = 1e18, start;
+	int i;
+
+	for (i = 0; i < 10000; i++) {
+		start = now_ns();
+		if (now_ns() - start < best)
+			best = now_ns() - start;
+	}
+	timer_overhead_ns = best;
+}
+
+static double transaction_ns(size_t len)
+{
+	return 9107 + 83.54 * floor(3.167 + 7.0 / 6.0 * 8 * len);
+}
+
+static void begin_stage(enum stage_id id)
+{
+	stage = &stages[id];
+	stage->transactions = 0;
+	stage->naks = 0;
+	stage->bus_ns = 0;
+	stage->start_ns = bus_ns;
+}
+
+static void end_stage(void)
+{
+	stage->end_ns = bus_ns;
+}
+
+/* Let modeled time pass, with an SOF at the start of each frame. */
+static void wait_ns(double ns, bool sofs)
+{
+	double start, end = bus_ns + ns;
+
+	while (frame_end_ns <= end) {
+		bus_ns = frame_end_ns;
+		frame_end_ns += FRAME_NS;
+		if (sofs) {
+			start = now_ns();
+			sim_sie_sof();
+			stage->cpu_ns += now_ns() - start - timer_overhead_ns;
+			bus_ns += SOF_NS;
+		}
+	}
+	if (end > bus_ns)
+		bus_ns = end;
+}
+
+static void bus_reset(void)
+{
+	double start;
+	int res;
+
+	wait_ns(RESET_NS, false);
+	start = now_ns();
+	res = sim_host_bus_reset(&host);
+	stage->cpu_ns += now_ns() - start - timer_overhead_ns;
+	if (res != SIM_ACK)
+		fail("bus reset", res);
+	wait_ns(RESET_RECOVERY_NS, true);
+}
+
+/* A control transfer, one transaction at a time. Returns the data stage
+ * length or a negative enum sim_result. */
+static int control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                   uint16_t wIndex, uint8_t *data, uint16_t wLength)
+{
+	const uint8_t setup[8] = {
+		bmRequestType, bRequest, wValue, wValue >> 8,
+		wIndex, wIndex >> 8, wLength, wLength >> 8,
+	};
+	struct sim_transfer t;
+	double max_ns = transaction_ns(MAX(8, host.ep0_len)), start, ns;
+	int res;
+
+	sim_host_control_transfer(&t, setup, data);
+	do {
+		if (bus_ns + max_ns > frame_end_ns)
+			wait_ns(frame_end_ns - bus_ns, true);
+
+		start = now_ns();
+		res = sim_host_step(&host, &t);
+		stage->cpu_ns += now_ns() - start - timer_overhead_ns;
+
+		stage->transactions++;
+		if (res == SIM_NAK) {
+			stage->naks++;
+			if (stage->naks > 1000)
+				return SIM_TIMEOUT;
+		}
+		/* A NAK'd IN has no data packet. */
+		if (res == SIM_NAK && t.token == SIM_TOKEN_IN)
+			ns = transaction_ns(0);
+		else
+			ns = transaction_ns(t.packet_len);
+		bus_ns += ns;
+		stage->bus_ns += ns;
+	} while ((res == SIM_ACK || res == SIM_NAK) && !t.done);
+
+	return res == SIM_ACK ? (int) t.actual : res;
+}
+
+/* Attach the device and enumerate it. */
+static void enumerate(void)
+{
+	uint8_t device[18], buf[1024];
+	uint16_t langid = 0, len;
+	uint8_t config;
+	int i, res;
+
+	sim_sie_power_on();
+#ifndef USB_USE_INTERRUPTS
+	sim_sie_set_service_hook(usb_service);
+#endif
+	usb_init();
+	sim_host_init(&host);
+	bus_ns = 0;
+	frame_end_ns = FRAME_NS;
+
+	begin_stage(STAGE_DEVICE_8);
+	bus_reset();
+	res = control(0x80, GET_DESCRIPTOR, DESC_DEVICE << 8, 0, device, 8);
+	if (res != 8)
+		fail("GET_DESCRIPTOR(device, 8)", res);
+	bus_reset();
+	host.ep0_len = device[7];
+	end_stage();
+
+	begin_stage(STAGE_SET_ADDRESS);
+	res = control(0x00, SET_ADDRESS, 1, 0, NULL, 0);
+	if (res < 0)
+		fail("SET_ADDRESS", res);
+	host.addr = 1;
+	wait_ns(SET_ADDRESS_NS, true);
+	end_stage();
+
+	begin_stage(STAGE_DEVICE);
+	res = control(0x80, GET_DESCRIPTOR, DESC_DEVICE << 8, 0,
+	              device, sizeof(device));
+	if (res != sizeof(device))
+		fail("GET_DESCRIPTOR(device)", res);
+	end_stage();
+
+	begin_stage(STAGE_CONFIG_SHORT);
+	res = control(0x80, GET_DESCRIPTOR, DESC_CONFIGURATION << 8, 0, buf, 9);
+	if (res != 9)
+		fail("GET_DESCRIPTOR(configuration, 9)", res);
+	end_stage();
+
+	begin_stage(STAGE_CONFIG);
+	len = MIN(buf[2] | buf[3] << 8, sizeof(buf));
+	res = control(0x80, GET_DESCRIPTOR, DESC_CONFIGURATION << 8, 0,
+	              buf, len);
+	if (res != len)
+		fail("GET_DESCRIPTOR(configuration)", res);
+	config = buf[5];
+	end_stage();
+
+	/* A device without strings stalls string 0. */
+	begin_stage(STAGE_STRINGS);
+	res = control(0x80, GET_DESCRIPTOR, DESC_STRING << 8, 0,
+	              buf, STRING_LEN);
+	if (res >= 4)
+		langid = buf[2] | buf[3] << 8;
+	for (i = 14; i <= 16 && res >= 4; i++) {
+		if (!device[i])
+			continue;
+		res = control(0x80, GET_DESCRIPTOR, DESC_STRING << 8 | device[i],
+		              langid, buf, STRING_LEN);
+		if (res < 0)
+			fail("GET_DESCRIPTOR(string)", res);
+	}
+	end_stage();
+
+	begin_stage(STAGE_SET_CONFIGURATION);
+	res = control(0x00, SET_CONFIGURATION, config, 0, NULL, 0);
+	if (res < 0)
+		fail("SET_CONFIGURATION", res);
+	end_stage();
+
+	sim_sie_set_service_hook(NULL);
+}
+
+/* The 1 ms frames a stage touches. */
+static unsigned int frames(const struct stage *s)
+{
+	if (s->end_ns <= s->start_ns)
+		return 0;
+	return (unsigned int) (floor((s->end_ns - 1) / FRAME_NS) -
+	                       floor(s->start_ns / FRAME_NS) + 1);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [options]\n"
+	        "Options:\n"
+	        "  -n count     Enumerations per repetition (default 1000)\n"
+	        "  -r reps      Repetitions; the best is kept (default 5)\n"
+	        "  -s           Print a one-line summary\n"
+	        "  -H           Print the summary's header and exit\n",
+	        prog);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int count = 1000, repetitions = 5, rep, n, i;
+	unsigned int transactions = 0, naks = 0;
+	double cpu_ns = 0;
+	bool summary = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:sHh")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			repetitions = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			summary = true;
+			break;
+		case 'H':
+			printf("%-12s %8s %-10s %12s %5s %6s %11s %9s\n",
+			       "descriptors", "EP_0_LEN", "firmware",
+			       "transactions", "NAKs", "frames", "enum (ms)",
+			       "stack us");
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (count == 0 || repetitions == 0 || optind != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	calibrate();
+	for (i = 0; i < NUM_STAGES; i++)
+		stages[i].best_cpu_ns = 1e18;
+
+	enumerate(); /* Warm up */
+	for (rep = 0; rep < repetitions; rep++) {
+		for (i = 0; i < NUM_STAGES; i++)
+			stages[i].cpu_ns = 0;
+		for (n = 0; n < count; n++)
+			enumerate();
+		for (i = 0; i < NUM_STAGES; i++) {
+			if (stages[i].cpu_ns / count < stages[i].best_cpu_ns)
+				stages[i].best_cpu_ns = stages[i].cpu_ns / count;
+		}
+	}
+
+	for (i = 0; i < NUM_STAGES; i++) {
+		transactions += stages[i].transactions;
+		naks += stages[i].naks;
+		cpu_ns += stages[i].best_cpu_ns;
+	}
+
+	if (summary) {
+		printf("%-12s %8d %-10s %12u %5u %6u %11.3f %9.2f\n",
+		       ENUM_APP, EP_0_LEN, FIRMWARE_TYPE, transactions, naks,
+		       (unsigned int) ceil(bus_ns / FRAME_NS), bus_ns / 1e6,
+		       cpu_ns / 1e3);
+		return 0;
+	}
+
+	printf("%s descriptors, EP_0_LEN %d, %s\n\n", ENUM_APP, EP_0_LEN,
+	       FIRMWARE_TYPE);
+	printf("%-20s %12s %5s %9s %6s %9s\n", "stage", "transactions",
+	       "NAKs", "bus us", "frames", "stack us");
+	for (i = 0; i < NUM_STAGES; i++) {
+		const struct stage *s = &stages[i];
+		printf("%-20s %12u %5u %9.1f %6u %9.2f\n", s->name,
+		       s->transactions, s->naks, s->bus_ns / 1e3, frames(s),
+		       s->best_cpu_ns / 1e3);
+	}
+	printf("%-20s %12u %5u %9s %6u %9.2f\n", "total", transactions, naks,
+	       "", (unsigned int) ceil(bus_ns / FRAME_NS), cpu_ns / 1e3);
+	printf("\nconfigured %.3f ms after attach, including %.0f ms of "
+	       "required waits\n", bus_ns / 1e6,
+	       (2 * (RESET_NS + RESET_RECOVERY_NS) + SET_ADDRESS_NS) / 1e6);
+
+	return 0;
+}
+
+/* Callbacks named in usb_config.h. The stub application accepts whatever
+ * the host asks of it and has no requests of its own. */
+#ifdef SET_CONFIGURATION_CALLBACK
+void SET_CONFIGURATION_CALLBACK(uint8_t configuration)
+{
+}
+#endif
+
+#ifdef GET_DEVICE_STATUS_CALLBACK
+uint16_t GET_DEVICE_STATUS_CALLBACK()
+{
+	return 0x0000;
+}
+#endif
+
+#ifdef ENDPOINT_HALT_CALLBACK
+void ENDPOINT_HALT_CALLBACK(uint8_t endpoint, bool halted)
+{
+}
+#endif
+
+#ifdef SET_INTERFACE_CALLBACK
+int8_t SET_INTERFACE_CALLBACK(uint8_t interface, uint8_t alt_setting)
+{
+	return 0;
+}
+#endif
+
+#ifdef GET_INTERFACE_CALLBACK
+int8_t GET_INTERFACE_CALLBACK(uint8_t interface)
+{
+	return 0;
+}
+#endif
+
+#ifdef UNKNOWN_SETUP_REQUEST_CALLBACK
+int8_t UNKNOWN_SETUP_REQUEST_CALLBACK(const struct setup_packet *setup)
+{
+	return -1;
+}
+#endif
+
+#ifdef UNKNOWN_GET_DESCRIPTOR_CALLBACK
+int16_t UNKNOWN_GET_DESCRIPTOR_CALLBACK(const struct setup_packet *pkt,
+                                        const void **descriptor)
+{
+	return -1;
+}
+#endif
+
+#ifdef START_OF_FRAME_CALLBACK
+void START_OF_FRAME_CALLBACK(void)
+{
+}
+#endif
+
+#ifdef ENDPOINT_WATCHDOG_CALLBACK
+int8_t ENDPOINT_WATCHDOG_CALLBACK(uint8_t endpoint, bool sie_owned)
+{
+	return USB_WATCHDOG_IGNORE;
+}
+#endif
+
+#ifdef USB_RESET_CALLBACK
+void USB_RESET_CALLBACK(void)
+{
+}
+#endif
@@ -0,0 +1,31 @@
+/*
+ *  M-Stack Host Simulation: EP 0 Size Override
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Included ahead of each source file (gcc -include) to build an
+ * application's usb_config.h with EP_0_LEN set to ENUM_EP_0_LEN, for
+ * enum_bench. The include guard in usb_config.h stops the sources' own
+ * #include of it from setting EP_0_LEN back. */
+
+#ifndef SIM_ENUM_EP0_H__
+#define SIM_ENUM_EP0_H__
+
+#include <usb_config.h>
+
+#undef EP_0_LEN
+#define EP_0_LEN ENUM_EP_0_LEN
+
+#endif /* SIM_ENUM_EP0_H__ */
@@ -0,0 +1,43 @@
+/*
+ *  M-Stack Host Simulation: Optional Feature Build
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Included ahead of each source file (gcc -include) to build the unit_test
+ * firmware with the optional features of usb.c which its usb_config.h
+ * leaves off, for features_sim and the scripts in scripts/features/.
+ *
+ * The firmware is built polled, so that its main loop runs between any
+ * two bus events from the script, and deferred frame tasks have always
+ * run by the time the next event is handled. */
+
+#ifndef SIM_FEATURES_H__
+#define SIM_FEATURES_H__
+
+#include <usb_config.h>
+
+#undef USB_USE_INTERRUPTS
+
+#define USB_FRAME_SCHEDULER
+#define USB_FRAME_SCHEDULER_MAX_TASKS 4
+
+#define USB_ENDPOINT_WATCHDOG
+#define USB_ENDPOINT_WATCHDOG_CPU_FRAMES 10
+#define USB_ENDPOINT_WATCHDOG_SIE_FRAMES 20
+#define ENDPOINT_WATCHDOG_CALLBACK app_endpoint_watchdog_callback
+
+#define USB_BANDWIDTH_STATS
+
+#endif /* SIM_FEATURES_H__ */
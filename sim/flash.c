@@ -0,0 +1,165 @@
+/*
+ *  M-Stack Host Simulation: Program Memory
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Program memory of a PIC24FJ64GB002, as seen through the table
+ * read/write instructions and the NVM controller.
+ *
+ * Table writes go to the row write latches. Writing NVMCON and calling
+ * __builtin_write_NVM() then either programs the latches into the row
+ * containing the last table write address (NVMCON = 0x4001), or erases
+ * the page (erase block) containing it (NVMCON = 0x4042).  Programming
+ * can only clear bits, as on the real part.
+ *
+ * The operation completes right away (NVMCON.WR reads back as 0), but
+ * the time the real part would have taken is added to busy_us.
+ */
+
+#include <string.h>
+#include <xc.h>
+#include "sim.h"
+
+#define INSTRUCTIONS (SIM_FLASH_TOP / 2)
+#define ROW_INSTRUCTIONS 64
+#define ERASED 0xffffff
+
+/* Typical times from the PIC24FJ64GB004 datasheet */
+#define ROW_WRITE_US  1600
+#define PAGE_ERASE_US 20000
+
+volatile uint16_t TBLPAG;
+volatile uint16_t NVMCON;
+volatile struct sim_nvmcon_bits NVMCONbits;
+volatile struct sim_rcon_bits RCONbits;
+
+static uint32_t flash[INSTRUCTIONS];
+static uint32_t latches[ROW_INSTRUCTIONS];
+static uint32_t table_address; /* Address of the last table write */
+static struct sim_flash_stats stats;
+static bool initialized;
+
+static void init(void)
+{
+	if (!initialized)
+		sim_flash_erase_chip();
+}
+
+static uint32_t address(uint16_t offset)
+{
+	return ((uint32_t) TBLPAG << 16 | offset) & ~1UL;
+}
+
+void sim_tblwtl(uint16_t offset, uint16_t value)
+{
+	uint32_t *latch;
+
+	init();
+	table_address = address(offset);
+	latch = &latches[table_address / 2 % ROW_INSTRUCTIONS];
+	*latch = (*latch & 0xff0000) | value;
+}
+
+void sim_tblwth(uint16_t offset, uint16_t value)
+{
+	uint32_t *latch;
+
+	init();
+	table_address = address(offset);
+	latch = &latches[table_address / 2 % ROW_INSTRUCTIONS];
+	*latch = (*latch & 0x00ffff) | (uint32_t) (value & 0xff) << 16;
+}
+
+uint16_t sim_tblrdl(uint16_t offset)
+{
+	return sim_flash_read(address(offset)) & 0xffff;
+}
+
+uint16_t sim_tblrdh(uint16_t offset)
+{
+	return sim_flash_read(address(offset)) >> 16;
+}
+
+void sim_write_nvm(void)
+{
+	uint32_t first, i;
+
+	init();
+
+	switch (NVMCON) {
+	case 0x4001: /* Row program */
+		first = table_address / 2 / ROW_INSTRUCTIONS * ROW_INSTRUCTIONS;
+		for (i = 0; i < ROW_INSTRUCTIONS; i++) {
+			if (first + i < INSTRUCTIONS)
+				flash[first + i] &= latches[i];
+			latches[i] = ERASED;
+		}
+		stats.row_writes++;
+		stats.busy_us += ROW_WRITE_US;
+		break;
+	case 0x4042: /* Page erase */
+		first = table_address / SIM_FLASH_BLOCK_SIZE * SIM_FLASH_BLOCK_SIZE / 2;
+		for (i = 0; i < SIM_FLASH_BLOCK_SIZE / 2; i++) {
+			if (first + i < INSTRUCTIONS)
+				flash[first + i] = ERASED;
+		}
+		for (i = 0; i < ROW_INSTRUCTIONS; i++)
+			latches[i] = ERASED;
+		stats.page_erases++;
+		stats.busy_us += PAGE_ERASE_US;
+		break;
+	}
+
+	NVMCONbits.WR = 0;
+}
+
+void sim_flash_erase_chip(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < INSTRUCTIONS; i++)
+		flash[i] = ERASED;
+	for (i = 0; i < ROW_INSTRUCTIONS; i++)
+		latches[i] = ERASED;
+	initialized = true;
+}
+
+uint32_t sim_flash_read(uint32_t address)
+{
+	init();
+
+	/* Unimplemented program memory reads as zero. */
+	if (address / 2 >= INSTRUCTIONS)
+		return 0;
+	return flash[address / 2];
+}
+
+void sim_flash_write(uint32_t address, uint32_t instruction)
+{
+	init();
+
+	if (address / 2 < INSTRUCTIONS)
+		flash[address / 2] = instruction & 0xffffff;
+}
+
+const struct sim_flash_stats *sim_flash_get_stats(void)
+{
+	return &stats;
+}
+
+void sim_flash_clear_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
@@ -0,0 +1,749 @@
+/*
+ *  M-Stack Host Simulation: EP 0 Fuzzer
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Fuzz the control endpoint state machine in usb.c (handle_ep0_setup(),
+ * handle_ep0_in() and handle_ep0_out()) with arbitrary sequences of
+ * SETUP, IN, OUT, SOF and bus reset tokens, run through the virtual SIE.
+ *
+ * usb.c is #included here, with the unit_test firmware's usb_config.h, so
+ * that its EP 0 state can be checked directly. The application is a
+ * stand-in for main.c with three vendor requests:
+ *
+ *   1  IN:  send MIN(wValue, 600) bytes of a known pattern
+ *   2  OUT: receive into a 512 byte buffer
+ *   3  either direction: no data stage
+ *
+ * Each byte of input starts a token, taking its parameters from the
+ * bytes which follow (see run_input()). After every token the following
+ * must hold, or the fuzzer aborts:
+ *
+ * Work done in the interrupt handler for one token is bounded: at most
+ * one call into the interrupt vector, at most EP_0_LEN bytes copied by
+ * usb.c, at most one data stage callback, and at most two application
+ * callbacks in all (a SETUP can cancel one transfer and start another).
+ *
+ * The EP 0 state is consistent: the OUT buffer descriptor is always
+ * owned by the SIE so a SETUP can be received, PKTDIS is clear, the IN
+ * buffer descriptor never holds more than EP_0_LEN bytes, no more data
+ * stage is pending than the last SETUP asked for, a ZLP is never pending
+ * alongside more data, and everything is clear after a bus reset.
+ *
+ * The protocol is followed: a data stage callback is called exactly once
+ * for each data stage started (unless the bus is reset first), the
+ * address only changes at the end of a SET_ADDRESS status stage, vendor
+ * IN data arrives in order and no more than wLength of it, and a short
+ * IN data stage ending on a full packet is terminated by a ZLP.
+ *
+ * Each input must also finish within a time budget (-t, default 250 ms),
+ * to catch inputs which make the stack do far more work than they should.
+ *
+ * Built with clang and -fsanitize=fuzzer (make fuzz_ep0-libfuzzer), this
+ * is a libFuzzer target. Built without it (make fuzz_ep0), it has its own
+ * main(), which runs the files given on the command line, or -n random
+ * inputs. A failing input is saved to fuzz_ep0-crash for replaying.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* Count the bytes usb.c copies. */
+static size_t bytes_copied;
+#define memcpy(dst, src, n) (bytes_copied += (n), memcpy(dst, src, n))
+
+#include "usb.c"
+
+#undef memcpy
+
+#include "sim.h"
+#include "host.h" /* SIM_MAX_PACKET */
+
+#define MAX_INPUT 4096
+#define IN_DATA_LEN 600
+#define OUT_DATA_LEN 512
+
+#define VENDOR_IN 1
+#define VENDOR_OUT 2
+#define VENDOR_NO_DATA 3
+
+/* Application state */
+static uint8_t in_data[IN_DATA_LEN];
+static char out_data[OUT_DATA_LEN];
+static unsigned int data_stage_id;  /* The registered data stage, or 0 */
+static unsigned int next_data_stage_id;
+static unsigned int data_callbacks;
+static unsigned int app_callbacks;
+
+/* Host state */
+static struct setup_packet last_setup;
+static bool have_setup;
+static bool vendor_in;        /* last_setup is VENDOR_IN, and was accepted */
+static size_t vendor_in_len;  /* The bytes it will send */
+static size_t in_received;
+static bool expect_zlp;
+static bool addr_expected;
+static uint8_t expected_addr;
+
+static unsigned int budget_ms = 250;
+static unsigned int token_num;
+static const uint8_t *cur_input;
+static size_t cur_len;
+static bool verbose;
+
+/* Save the input which failed, for the standalone build (libFuzzer does
+ * this itself). This runs from the SIGABRT handler, so it also catches
+ * errors found by the sanitizers, which are set to abort. */
+static void save_input(int sig)
+{
+	FILE *fp;
+
+	if (cur_input) {
+		fp = fopen("fuzz_ep0-crash", "wb");
+		if (fp) {
+			fwrite(cur_input, 1, cur_len, fp);
+			fclose(fp);
+			fprintf(stderr, "fuzz_ep0: input saved to "
+			        "fuzz_ep0-crash\n");
+		}
+	}
+
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+const char *__asan_default_options(void)
+{
+	return "abort_on_error=1";
+}
+
+const char *__ubsan_default_options(void)
+{
+	return "abort_on_error=1:print_stacktrace=1";
+}
+
+static void fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "fuzz_ep0: token %u: ", token_num);
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+
+	abort();
+}
+
+static void trace(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!verbose)
+		return;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "%4u: ", token_num);
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+}
+
+/* Application callbacks, for the unit_test usb_config.h */
+
+static void data_cb(bool transfer_ok, void *context)
+{
+	data_callbacks++;
+	app_callbacks++;
+
+	if (data_stage_id == 0)
+		fail("data stage callback with no data stage registered");
+	if ((uintptr_t) context != data_stage_id)
+		fail("data stage callback for data stage %u; %u is registered",
+		     (unsigned int) (uintptr_t) context, data_stage_id);
+	data_stage_id = 0;
+}
+
+static void register_data_stage(void)
+{
+	if (data_stage_id)
+		fail("data stage %u was never completed", data_stage_id);
+	data_stage_id = ++next_data_stage_id;
+}
+
+void app_set_configuration_callback(uint8_t configuration)
+{
+	app_callbacks++;
+}
+
+uint16_t app_get_device_status_callback()
+{
+	app_callbacks++;
+	return 0;
+}
+
+void app_endpoint_halt_callback(uint8_t endpoint, bool halted)
+{
+	app_callbacks++;
+}
+
+int8_t app_set_interface_callback(uint8_t interface, uint8_t alt_setting)
+{
+	app_callbacks++;
+	return (interface == 0 && alt_setting == 0) ? 0 : -1;
+}
+
+int8_t app_get_interface_callback(uint8_t interface)
+{
+	app_callbacks++;
+	return (interface == 0) ? 0 : -1;
+}
+
+int8_t app_unknown_setup_request_callback(const struct setup_packet *setup)
+{
+	void *context;
+
+	app_callbacks++;
+
+	if (setup->REQUEST.type != REQUEST_TYPE_VENDOR)
+		return -1;
+
+	context = (void*) (uintptr_t) (next_data_stage_id + 1);
+
+	if (setup->bRequest == VENDOR_IN && setup->REQUEST.direction == 1) {
+		size_t len = MIN(setup->wValue, IN_DATA_LEN);
+		register_data_stage();
+		usb_send_data_stage((char*) in_data, len, data_cb, context);
+	}
+	else if (setup->bRequest == VENDOR_OUT &&
+	         setup->REQUEST.direction == 0) {
+		size_t len = MIN(setup->wLength, OUT_DATA_LEN);
+		register_data_stage();
+		usb_start_receive_ep0_data_stage(out_data, len, data_cb,
+		                                 context);
+	}
+	else if (setup->bRequest == VENDOR_NO_DATA) {
+		register_data_stage();
+		usb_send_data_stage(NULL, 0, data_cb, context);
+	}
+	else {
+		return -1;
+	}
+
+	return 0;
+}
+
+int16_t app_unknown_get_descriptor_callback(const struct setup_packet *pkt,
+                                            const void **descriptor)
+{
+	app_callbacks++;
+	return -1;
+}
+
+void app_start_of_frame_callback(void)
+{
+	app_callbacks++;
+}
+
+void app_usb_reset_callback(void)
+{
+	app_callbacks++;
+
+	/* The stack drops any control transfer on a reset. */
+	data_stage_id = 0;
+}
+
+/* Checks run after every token */
+
+static void check_state(void)
+{
+	if (!bds[0].ep_out.STAT.UOWN)
+		fail("EP 0 OUT buffer descriptor not given back to the SIE");
+	if (UCONbits.PKTDIS)
+		fail("PKTDIS left set");
+	if (bds[0].ep_in.STAT.UOWN && BDN_LENGTH(bds[0].ep_in) > EP_0_LEN)
+		fail("EP 0 IN armed with %u bytes",
+		     (unsigned int) BDN_LENGTH(bds[0].ep_in));
+	if (control_need_zlp && ep0_data_stage_buf_remaining)
+		fail("ZLP pending with %zu bytes still to send",
+		     ep0_data_stage_buf_remaining);
+	if (ep0_data_stage_buf_remaining >
+	    (have_setup ? last_setup.wLength : 0))
+		fail("%zu bytes of data stage pending; %u asked for",
+		     ep0_data_stage_buf_remaining,
+		     have_setup ? last_setup.wLength : 0);
+	if (addr_pending && !addr_expected)
+		fail("address change pending without a SET_ADDRESS");
+}
+
+static void check_reset(void)
+{
+	if (ep0_data_stage_buf_remaining || control_need_zlp ||
+	    addr_pending || ep0_data_stage_callback || g_configuration ||
+	    UADDR)
+		fail("EP 0 state not cleared by bus reset");
+}
+
+static void check_in_packet(const uint8_t *pkt, size_t len)
+{
+	size_t limit = MIN(vendor_in_len, last_setup.wLength);
+
+	if (expect_zlp) {
+		if (len != 0)
+			fail("%zu byte packet where a ZLP should end the "
+			     "data stage", len);
+		expect_zlp = false;
+		vendor_in = false;
+		return;
+	}
+
+	if (in_received + len > limit)
+		fail("data stage of %zu bytes; only %zu to send",
+		     in_received + len, limit);
+	if (memcmp(pkt, in_data + in_received, len))
+		fail("wrong IN data at offset %zu", in_received);
+	in_received += len;
+
+	if (in_received == limit) {
+		expect_zlp = len == EP_0_LEN && limit < last_setup.wLength;
+		if (!expect_zlp)
+			vendor_in = false;
+	}
+	else if (len < EP_0_LEN) {
+		fail("short packet at %zu of %zu bytes", in_received, limit);
+	}
+}
+
+/* Tokens */
+
+static void start_token(uint32_t *interrupts)
+{
+	token_num++;
+	bytes_copied = 0;
+	data_callbacks = 0;
+	app_callbacks = 0;
+	*interrupts = sim_sie_get_stats()->interrupts;
+}
+
+static void end_token(int res, uint32_t interrupts)
+{
+	uint32_t isr_calls = sim_sie_get_stats()->interrupts - interrupts;
+
+	if (res != SIM_ACK && res != SIM_NAK && res != SIM_STALL)
+		fail("transaction failed (%d)", res);
+	if (isr_calls > 1)
+		fail("%u interrupts for one token", isr_calls);
+	if (bytes_copied > EP_0_LEN)
+		fail("%zu bytes copied for one token", bytes_copied);
+	if (data_callbacks > 1)
+		fail("%u data stage callbacks for one token", data_callbacks);
+	if (app_callbacks > 2)
+		fail("%u application callbacks for one token", app_callbacks);
+
+	check_state();
+}
+
+static void do_setup(const uint8_t setup[8])
+{
+	uint32_t interrupts;
+	uint8_t old_addr = UADDR;
+	int res;
+
+	start_token(&interrupts);
+	res = sim_sie_setup(UADDR, setup);
+	trace("SETUP %02x %02x %02x%02x %02x%02x %02x%02x: %d",
+	      setup[0], setup[1], setup[3], setup[2], setup[5], setup[4],
+	      setup[7], setup[6], res);
+
+	memcpy(&last_setup, setup, sizeof(last_setup));
+	have_setup = true;
+	vendor_in = false;
+	expect_zlp = false;
+	in_received = 0;
+	addr_expected = false;
+
+	if (last_setup.REQUEST.type == REQUEST_TYPE_STANDARD &&
+	    last_setup.bRequest == SET_ADDRESS) {
+		addr_expected = true;
+		expected_addr = last_setup.wValue;
+	}
+	else if (last_setup.REQUEST.type == REQUEST_TYPE_VENDOR &&
+	         last_setup.bRequest == VENDOR_IN &&
+	         last_setup.REQUEST.direction == 1) {
+		vendor_in = true;
+		vendor_in_len = MIN(last_setup.wValue, IN_DATA_LEN);
+	}
+
+	end_token(res, interrupts);
+	if (res != SIM_ACK)
+		fail("SETUP not accepted (%d)", res);
+	if (UADDR != old_addr)
+		fail("address changed by a SETUP");
+}
+
+static void do_in(uint8_t ep)
+{
+	uint8_t pkt[SIM_MAX_PACKET];
+	uint32_t interrupts;
+	uint8_t old_addr = UADDR;
+	uint8_t pid;
+	size_t len;
+	int res;
+
+	start_token(&interrupts);
+	res = sim_sie_in(UADDR, ep, pkt, sizeof(pkt), &len, &pid);
+	trace("IN %u: %d, %zu bytes", ep, res, res == SIM_ACK ? len : 0);
+	end_token(res, interrupts);
+
+	if (ep != 0)
+		return;
+
+	if (res == SIM_ACK && vendor_in)
+		check_in_packet(pkt, len);
+	else if (expect_zlp)
+		fail("no ZLP at the end of a short data stage (%d)", res);
+
+	if (UADDR != old_addr) {
+		if (!addr_expected || res != SIM_ACK || UADDR != expected_addr)
+			fail("address changed to %u outside a SET_ADDRESS "
+			     "status stage", UADDR);
+		addr_expected = false;
+	}
+}
+
+static void do_out(uint8_t ep, uint8_t pid, size_t len)
+{
+	uint8_t pkt[SIM_MAX_PACKET];
+	uint32_t interrupts;
+	uint8_t old_addr = UADDR;
+	size_t i;
+	int res;
+
+	for (i = 0; i < len; i++)
+		pkt[i] = i;
+
+	start_token(&interrupts);
+	res = sim_sie_out(UADDR, ep, pid, pkt, len);
+	trace("OUT %u DATA%u, %zu bytes: %d", ep, pid, len, res);
+	end_token(res, interrupts);
+
+	if (ep == 0) {
+		/* The status stage, or an OUT the host shouldn't have
+		 * sent. Either way, the IN data stage is over. */
+		vendor_in = false;
+		expect_zlp = false;
+	}
+	if (UADDR != old_addr)
+		fail("address changed by an OUT");
+}
+
+static void do_bus_reset(void)
+{
+	uint32_t interrupts;
+	int res;
+
+	start_token(&interrupts);
+	res = sim_sie_bus_reset();
+	trace("reset: %d", res);
+	have_setup = false;
+	vendor_in = false;
+	expect_zlp = false;
+	addr_expected = false;
+	end_token(res, interrupts);
+	check_reset();
+}
+
+static void do_sof(void)
+{
+	uint32_t interrupts;
+	int res;
+
+	start_token(&interrupts);
+	res = sim_sie_sof();
+	trace("SOF: %d", res);
+	end_token(res, interrupts);
+}
+
+/* SETUP packets for the requests usb.c and the application handle. A
+ * wValue or wLength of 0xffff is taken from the input instead. */
+static const uint8_t templates[][8] = {
+	{ 0x80, GET_DESCRIPTOR, 0, DESC_DEVICE, 0, 0, 0xff, 0xff },
+	{ 0x80, GET_DESCRIPTOR, 0, DESC_CONFIGURATION, 0, 0, 0xff, 0xff },
+	{ 0x80, GET_DESCRIPTOR, 0, DESC_STRING, 0, 0, 0xff, 0xff },
+	{ 0x80, GET_DESCRIPTOR, 2, DESC_STRING, 0x09, 0x04, 0xff, 0xff },
+	{ 0x00, SET_ADDRESS, 0xff, 0xff, 0, 0, 0, 0 },
+	{ 0x00, SET_CONFIGURATION, 1, 0, 0, 0, 0, 0 },
+	{ 0x80, GET_CONFIGURATION, 0, 0, 0, 0, 1, 0 },
+	{ 0x80, GET_STATUS, 0, 0, 0, 0, 2, 0 },
+	{ 0x82, GET_STATUS, 0, 0, 0x81, 0, 2, 0 },
+	{ 0x02, SET_FEATURE, 0, 0, 0x01, 0, 0, 0 },
+	{ 0x02, CLEAR_FEATURE, 0, 0, 0x01, 0, 0, 0 },
+	{ 0x02, SET_FEATURE, 0, 0, 0x81, 0, 0, 0 },
+	{ 0x02, CLEAR_FEATURE, 0, 0, 0x81, 0, 0, 0 },
+	{ 0x01, SET_INTERFACE, 0, 0, 0, 0, 0, 0 },
+	{ 0x81, GET_INTERFACE, 0, 0, 0, 0, 1, 0 },
+	{ 0xc3, VENDOR_IN, 0xff, 0xff, 0, 0, 0xff, 0xff },
+	{ 0x43, VENDOR_OUT, 0, 0, 0, 0, 0xff, 0xff },
+	{ 0x43, VENDOR_NO_DATA, 0, 0, 0, 0, 0, 0 },
+	{ 0xc3, VENDOR_NO_DATA, 0, 0, 0, 0, 0xff, 0xff },
+};
+#define NUM_TEMPLATES (sizeof(templates) / sizeof(templates[0]))
+
+struct input {
+	const uint8_t *data;
+	size_t len;
+	size_t pos;
+};
+
+static uint8_t next_byte(struct input *in)
+{
+	return in->pos < in->len ? in->data[in->pos++] : 0;
+}
+
+static uint16_t next_word(struct input *in)
+{
+	uint16_t w = next_byte(in);
+	return w | next_byte(in) << 8;
+}
+
+/* Token encoding. The low three bits of each byte choose the token:
+ *   0  SETUP, with the 8 bytes which follow
+ *   1  SETUP from templates[] (next byte), with wValue and wLength of
+ *      up to 1023 from the next two words where the template has 0xffff
+ *   2  IN on EP 0
+ *   3  OUT on EP 0: next byte has the PID (bit 7) and length
+ *   4  Zero-length DATA1 OUT on EP 0 (a status stage)
+ *   5  Bus reset
+ *   6  SOF
+ *   7  IN or OUT (bit 3 of this byte) on EP 1
+ */
+static void run_input(const uint8_t *data, size_t len)
+{
+	struct input in = { data, len, 0 };
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (in.pos < in.len) {
+		uint8_t op = next_byte(&in);
+		uint8_t setup[8];
+		uint8_t b;
+		int i;
+
+		switch (op & 7) {
+		case 0:
+			for (i = 0; i < 8; i++)
+				setup[i] = next_byte(&in);
+			do_setup(setup);
+			break;
+		case 1:
+			memcpy(setup, templates[next_byte(&in) % NUM_TEMPLATES], 8);
+			if (setup[2] == 0xff && setup[3] == 0xff) {
+				uint16_t w = next_word(&in) & 0x3ff;
+				setup[2] = w & 0xff;
+				setup[3] = w >> 8;
+			}
+			if (setup[6] == 0xff && setup[7] == 0xff) {
+				uint16_t w = next_word(&in) & 0x3ff;
+				setup[6] = w & 0xff;
+				setup[7] = w >> 8;
+			}
+			do_setup(setup);
+			break;
+		case 2:
+			do_in(0);
+			break;
+		case 3:
+			b = next_byte(&in);
+			do_out(0, b >> 7, (b & 0x7f) % (EP_0_LEN + 1));
+			break;
+		case 4:
+			do_out(0, 1, 0);
+			break;
+		case 5:
+			do_bus_reset();
+			break;
+		case 6:
+			do_sof();
+			break;
+		case 7:
+			if (op & 0x08)
+				do_in(1);
+			else
+				do_out(1, (op >> 4) & 1, (op >> 5) * 8);
+			break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - start.tv_sec) * 1000 +
+		    (now.tv_nsec - start.tv_nsec) / 1000000 > budget_ms)
+			fail("input took over %u ms", budget_ms);
+	}
+}
+
+/* Power on: the C runtime zeroes usb.c's variables, then main() calls
+ * usb_init(). */
+static void power_on(void)
+{
+	size_t i;
+
+	sim_sie_power_on();
+
+	addr_pending = 0;
+	addr = 0;
+	g_configuration = 0;
+	control_need_zlp = 0;
+	returning_short = 0;
+	ep0_data_stage_callback = NULL;
+	ep0_data_stage_in_buffer = NULL;
+	ep0_data_stage_out_buffer = NULL;
+	ep0_data_stage_buf_remaining = 0;
+	ep0_data_stage_context = NULL;
+	ep0_data_stage_direc = 0;
+	ep0_setup_wlength = 0;
+
+	for (i = 0; i < sizeof(in_data); i++)
+		in_data[i] = i * 7 + 3;
+	data_stage_id = 0;
+	have_setup = false;
+	vendor_in = false;
+	expect_zlp = false;
+	addr_expected = false;
+	token_num = 0;
+
+	usb_init();
+	check_reset();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t len)
+{
+	cur_input = data;
+	cur_len = len;
+
+	power_on();
+	run_input(data, len);
+
+	return 0;
+}
+
+#ifndef USE_LIBFUZZER
+static uint32_t rand_state;
+
+static uint32_t next_rand(void)
+{
+	/* xorshift32 */
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+static int run_file(const char *name)
+{
+	static uint8_t buf[MAX_INPUT];
+	size_t len;
+	FILE *fp;
+
+	fp = fopen(name, "rb");
+	if (!fp) {
+		perror(name);
+		return -1;
+	}
+	len = fread(buf, 1, sizeof(buf), fp);
+	fclose(fp);
+
+	LLVMFuzzerTestOneInput(buf, len);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [options] [file...]\n"
+	        "Run the files given, or random inputs.\n"
+	        "Options:\n"
+	        "  -n inputs    Random inputs to run (default 10000)\n"
+	        "  -l bytes     Maximum random input length (default 256)\n"
+	        "  -s seed      Random seed (default 1)\n"
+	        "  -t ms        Time budget per input (default 250)\n"
+	        "  -v           Print each token\n",
+	        prog);
+}
+
+int main(int argc, char **argv)
+{
+	static uint8_t buf[MAX_INPUT];
+	unsigned long inputs = 10000, n;
+	size_t max_len = 256;
+	int opt, i;
+
+	rand_state = 1;
+	signal(SIGABRT, save_input);
+	signal(SIGSEGV, save_input);
+
+	while ((opt = getopt(argc, argv, "n:l:s:t:vh")) != -1) {
+		switch (opt) {
+		case 'n':
+			inputs = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			max_len = strtoul(optarg, NULL, 0);
+			if (max_len == 0 || max_len > MAX_INPUT) {
+				fprintf(stderr, "bad length\n");
+				return 1;
+			}
+			break;
+		case 's':
+			rand_state = strtoul(optarg, NULL, 0);
+			if (rand_state == 0)
+				rand_state = 1;
+			break;
+		case 't':
+			budget_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind < argc) {
+		for (i = optind; i < argc; i++) {
+			if (run_file(argv[i]) < 0)
+				return 1;
+		}
+		printf("fuzz_ep0: %d inputs passed\n", argc - optind);
+		return 0;
+	}
+
+	for (n = 0; n < inputs; n++) {
+		size_t len = next_rand() % max_len + 1, j;
+		for (j = 0; j < len; j++)
+			buf[j] = next_rand();
+		LLVMFuzzerTestOneInput(buf, len);
+	}
+
+	printf("fuzz_ep0: %lu random inputs passed\n", inputs);
+	return 0;
+}
+#endif
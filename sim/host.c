@@ -0,0 +1,368 @@
+/*
+ *  M-Stack Host Simulation: Host Controller
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <sched.h>
+
+#include "host.h"
+
+#define MIN(X,Y) ((X)<(Y)?(X):(Y))
+
+#define DEFAULT_NAK_LIMIT 100000
+#define MAX_PACKET 1023
+
+void sim_host_init(struct sim_host *host)
+{
+	int i;
+
+	memset(host, 0, sizeof(*host));
+	host->ep0_len = 8;
+	host->nak_limit = DEFAULT_NAK_LIMIT;
+	for (i = 0; i < 16; i++) {
+		host->max_packet[i][0] = 64;
+		host->max_packet[i][1] = 64;
+	}
+}
+
+int sim_host_bus_reset(struct sim_host *host)
+{
+	host->addr = 0;
+	host->ep0_len = 8;
+	memset(host->toggle, 0, sizeof(host->toggle));
+
+	return sim_sie_bus_reset();
+}
+
+/* Run one OUT or SETUP transaction, retrying while it's NAK'd. */
+static int do_out(struct sim_host *host, uint8_t ep, uint8_t pid,
+                  const uint8_t *data, size_t len, int setup)
+{
+	unsigned int naks = 0;
+	int res;
+
+	do {
+		if (setup)
+			res = sim_sie_setup(host->addr, data);
+		else
+			res = sim_sie_out(host->addr, ep, pid, data, len);
+		if (res != SIM_NAK)
+			return res;
+		sched_yield();
+	} while (++naks < host->nak_limit);
+
+	return SIM_TIMEOUT;
+}
+
+/* Run IN transactions until one has the expected data toggle. A packet
+ * with the wrong toggle is a retransmission of one already received. */
+static int do_in(struct sim_host *host, uint8_t ep, uint8_t pid,
+                 uint8_t *buf, size_t max_len, size_t *len)
+{
+	unsigned int naks = 0;
+	uint8_t got_pid;
+	int res;
+
+	do {
+		res = sim_sie_in(host->addr, ep, buf, max_len, len, &got_pid);
+		if (res == SIM_ACK && got_pid == pid)
+			return res;
+		if (res != SIM_NAK && res != SIM_ACK)
+			return res;
+		sched_yield();
+	} while (++naks < host->nak_limit);
+
+	return SIM_TIMEOUT;
+}
+
+int sim_host_control(struct sim_host *host, uint8_t bmRequestType,
+                     uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                     uint8_t *data, uint16_t wLength)
+{
+	uint8_t setup[8];
+	uint8_t pkt[MAX_PACKET];
+	size_t pos = 0, len;
+	uint8_t pid = 1;
+	int res;
+
+	setup[0] = bmRequestType;
+	setup[1] = bRequest;
+	setup[2] = wValue & 0xff;
+	setup[3] = wValue >> 8;
+	setup[4] = wIndex & 0xff;
+	setup[5] = wIndex >> 8;
+	setup[6] = wLength & 0xff;
+	setup[7] = wLength >> 8;
+
+	res = do_out(host, 0, 0, setup, sizeof(setup), 1);
+	if (res < 0)
+		return res;
+
+	if (bmRequestType & 0x80) {
+		/* IN data stage. It ends with a short packet or when
+		 * wLength bytes have been received. */
+		while (pos < wLength) {
+			res = do_in(host, 0, pid, pkt, host->ep0_len, &len);
+			if (res < 0)
+				return res;
+			memcpy(data + pos, pkt, MIN(len, wLength - pos));
+			pos += MIN(len, wLength - pos);
+			pid = !pid;
+			if (len < host->ep0_len)
+				break;
+		}
+
+		/* Status stage */
+		res = do_out(host, 0, 1, NULL, 0, 0);
+		if (res < 0)
+			return res;
+	}
+	else {
+		/* OUT data stage */
+		while (pos < wLength) {
+			len = MIN(host->ep0_len, wLength - pos);
+			res = do_out(host, 0, pid, data + pos, len, 0);
+			if (res < 0)
+				return res;
+			pos += len;
+			pid = !pid;
+		}
+
+		/* Status stage */
+		res = do_in(host, 0, 1, pkt, host->ep0_len, &len);
+		if (res < 0)
+			return res;
+		if (len != 0)
+			return SIM_ERROR;
+	}
+
+	/* Standard requests which change the state of the host. */
+	if (bmRequestType == 0x00 && bRequest == 5 /* SET_ADDRESS */) {
+		host->addr = wValue & 0x7f;
+	}
+	else if (bmRequestType == 0x00 && bRequest == 9 /* SET_CONFIGURATION */) {
+		memset(host->toggle, 0, sizeof(host->toggle));
+	}
+	else if (bmRequestType == 0x02 && bRequest == 1 /* CLEAR_FEATURE */ &&
+	         wValue == 0 /* ENDPOINT_HALT */) {
+		host->toggle[wIndex & 0xf][wIndex >> 7 & 1] = 0;
+	}
+	else if (bmRequestType == 0x80 && bRequest == 6 /* GET_DESCRIPTOR */ &&
+	         wValue >> 8 == 1 /* DEVICE */ && pos >= 8) {
+		host->ep0_len = data[7];
+	}
+
+	return pos;
+}
+
+int sim_host_out(struct sim_host *host, uint8_t ep,
+                 const uint8_t *data, size_t len)
+{
+	size_t pos = 0, pkt_len;
+	uint16_t max = host->max_packet[ep][0];
+	int res;
+
+	do {
+		pkt_len = MIN(max, len - pos);
+		res = do_out(host, ep, host->toggle[ep][0], data + pos, pkt_len, 0);
+		if (res < 0)
+			return res;
+		host->toggle[ep][0] = !host->toggle[ep][0];
+		pos += pkt_len;
+	} while (pos < len);
+
+	return pos;
+}
+
+int sim_host_in(struct sim_host *host, uint8_t ep, uint8_t *data, size_t len)
+{
+	uint8_t pkt[MAX_PACKET];
+	size_t pos = 0, pkt_len;
+	uint16_t max = host->max_packet[ep][1];
+	int res;
+
+	do {
+		res = do_in(host, ep, host->toggle[ep][1], pkt, max, &pkt_len);
+		if (res < 0)
+			return res;
+		host->toggle[ep][1] = !host->toggle[ep][1];
+		memcpy(data + pos, pkt, MIN(pkt_len, len - pos));
+		pos += MIN(pkt_len, len - pos);
+		if (pkt_len < max)
+			break;
+	} while (pos < len);
+
+	return pos;
+}
+
+void sim_host_parse_config(struct sim_host *host,
+                           const uint8_t *desc, size_t len)
+{
+	size_t pos = 0;
+
+	while (pos + 2 <= len && desc[pos] >= 2) {
+		/* Endpoint descriptor */
+		if (desc[pos+1] == 5 && pos + 7 <= len) {
+			uint8_t addr = desc[pos+2];
+			host->max_packet[addr & 0xf][addr >> 7] =
+				(desc[pos+4] | desc[pos+5] << 8) & 0x7ff;
+		}
+		pos += desc[pos];
+	}
+}
+
+void sim_host_control_transfer(struct sim_transfer *t, const uint8_t setup[8],
+                               uint8_t *buf)
+{
+	memset(t, 0, sizeof(*t));
+	t->control = true;
+	t->dir = setup[0] >> 7;
+	memcpy(t->setup, setup, sizeof(t->setup));
+	t->buf = buf;
+	t->len = setup[6] | setup[7] << 8;
+	t->stage = SIM_STAGE_SETUP;
+}
+
+void sim_host_data_transfer(struct sim_transfer *t, uint8_t ep, uint8_t dir,
+                            uint8_t *buf, size_t len)
+{
+	memset(t, 0, sizeof(*t));
+	t->ep = ep;
+	t->dir = dir;
+	t->buf = buf;
+	t->len = len;
+}
+
+static int control_step(struct sim_host *host, struct sim_transfer *t)
+{
+	size_t len;
+	uint8_t pid;
+	int res;
+
+	switch (t->stage) {
+	case SIM_STAGE_SETUP:
+		t->token = SIM_TOKEN_SETUP;
+		t->packet_len = sizeof(t->setup);
+		memcpy(t->packet, t->setup, sizeof(t->setup));
+		res = sim_sie_setup(host->addr, t->setup);
+		if (res == SIM_ACK) {
+			t->stage = t->len ? SIM_STAGE_DATA : SIM_STAGE_STATUS;
+			t->pid = 1;
+		}
+		return res;
+
+	case SIM_STAGE_DATA:
+		if (t->dir) {
+			t->token = SIM_TOKEN_IN;
+			res = sim_sie_in(host->addr, 0, t->packet, host->ep0_len,
+			                 &len, &pid);
+			t->packet_len = len;
+			if (res != SIM_ACK || pid != t->pid)
+				return res; /* Wrong PID is a retransmission */
+			if (len > t->len - t->actual) {
+				t->overflow = true;
+				return SIM_ERROR;
+			}
+			memcpy(t->buf + t->actual, t->packet, len);
+		}
+		else {
+			t->token = SIM_TOKEN_OUT;
+			len = MIN(host->ep0_len, t->len - t->actual);
+			t->packet_len = len;
+			memcpy(t->packet, t->buf + t->actual, len);
+			res = sim_sie_out(host->addr, 0, t->pid, t->packet, len);
+			if (res != SIM_ACK)
+				return res;
+		}
+
+		t->actual += len;
+		t->pid = !t->pid;
+		if (t->actual == t->len || (t->dir && len < host->ep0_len))
+			t->stage = SIM_STAGE_STATUS;
+		return SIM_ACK;
+
+	case SIM_STAGE_STATUS:
+		t->packet_len = 0;
+		if (t->dir) {
+			t->token = SIM_TOKEN_OUT;
+			res = sim_sie_out(host->addr, 0, 1, NULL, 0);
+		}
+		else {
+			t->token = SIM_TOKEN_IN;
+			res = sim_sie_in(host->addr, 0, t->packet, host->ep0_len,
+			                 &len, &pid);
+			t->packet_len = len;
+			if (res == SIM_ACK && len != 0)
+				return SIM_ERROR;
+		}
+		if (res == SIM_ACK)
+			t->done = true;
+		return res;
+	}
+
+	return SIM_ERROR;
+}
+
+static int data_step(struct sim_host *host, struct sim_transfer *t)
+{
+	uint8_t *toggle = &host->toggle[t->ep][t->dir];
+	uint16_t max = host->max_packet[t->ep][t->dir];
+	size_t len;
+	uint8_t pid;
+	int res;
+
+	if (t->dir) {
+		t->token = SIM_TOKEN_IN;
+		res = sim_sie_in(host->addr, t->ep, t->packet, max, &len, &pid);
+		t->packet_len = len;
+		if (res != SIM_ACK || pid != *toggle)
+			return res; /* Wrong PID is a retransmission */
+		*toggle = !*toggle;
+		if (len > t->len - t->actual) {
+			t->overflow = true;
+			return SIM_ERROR;
+		}
+		memcpy(t->buf + t->actual, t->packet, len);
+		t->actual += len;
+		if (t->actual == t->len || len < max)
+			t->done = true;
+	}
+	else {
+		t->token = SIM_TOKEN_OUT;
+		len = MIN(max, t->len - t->actual);
+		t->packet_len = len;
+		memcpy(t->packet, t->buf + t->actual, len);
+		res = sim_sie_out(host->addr, t->ep, *toggle, t->packet, len);
+		if (res != SIM_ACK)
+			return res;
+		*toggle = !*toggle;
+		t->actual += len;
+
+		/* A transfer which is a multiple of the packet size ends
+		 * with a zero-length packet if one was asked for. */
+		if (t->actual == t->len && (len < max || !t->zero_packet))
+			t->done = true;
+	}
+
+	return SIM_ACK;
+}
+
+int sim_host_step(struct sim_host *host, struct sim_transfer *t)
+{
+	if (t->control)
+		return control_step(host, t);
+	return data_step(host, t);
+}
@@ -0,0 +1,120 @@
+/*
+ *  M-Stack Host Simulation: Host Controller
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A host controller for the virtual SIE. It breaks control and bulk
+ * transfers into transactions, keeps track of the device address, EP0
+ * size, and data toggles, and retries NAK'd transactions.
+ */
+
+#ifndef SIM_HOST_H__
+#define SIM_HOST_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "sim.h"
+
+struct sim_host {
+	uint8_t addr;
+	uint8_t ep0_len;
+	uint8_t toggle[16][2];   /* [endpoint][0=OUT, 1=IN] */
+	uint16_t max_packet[16][2];
+	unsigned int nak_limit;  /* NAKs before a transaction times out */
+};
+
+/* Reset the bus, and forget the device's address and data toggles. */
+void sim_host_init(struct sim_host *host);
+int sim_host_bus_reset(struct sim_host *host);
+
+/* Control transfer on EP0. For an IN transfer (bit 7 of bmRequestType
+ * set), up to wLength bytes are read into data.  Returns the number of
+ * bytes transferred in the data stage, or a negative enum sim_result.
+ *
+ * SET_ADDRESS, SET_CONFIGURATION, and CLEAR_FEATURE(ENDPOINT_HALT) update
+ * the host's state when they succeed, as does reading the device
+ * descriptor (bMaxPacketSize0).
+ */
+int sim_host_control(struct sim_host *host, uint8_t bmRequestType,
+                     uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                     uint8_t *data, uint16_t wLength);
+
+/* Bulk or interrupt transfers. The transfer ends with a short packet or
+ * after len bytes. Returns the number of bytes transferred or a negative
+ * enum sim_result. */
+int sim_host_out(struct sim_host *host, uint8_t ep,
+                 const uint8_t *data, size_t len);
+int sim_host_in(struct sim_host *host, uint8_t ep, uint8_t *data, size_t len);
+
+/* Set the maximum packet size of non-control endpoints from a
+ * configuration descriptor. */
+void sim_host_parse_config(struct sim_host *host,
+                           const uint8_t *desc, size_t len);
+
+/* Transfers run one transaction at a time, for callers which schedule
+ * transactions across endpoints the way a host controller does. Set one
+ * up with sim_host_control_transfer() or sim_host_data_transfer(), then
+ * call sim_host_step() until it returns an error or sets done. */
+#define SIM_MAX_PACKET 1023
+
+enum sim_stage {
+	SIM_STAGE_SETUP,
+	SIM_STAGE_DATA,
+	SIM_STAGE_STATUS,
+};
+
+enum sim_token {
+	SIM_TOKEN_SETUP,
+	SIM_TOKEN_OUT,
+	SIM_TOKEN_IN,
+};
+
+struct sim_transfer {
+	uint8_t ep;
+	uint8_t dir;           /* 0=OUT, 1=IN. For control, the data stage */
+	bool control;
+	bool zero_packet;      /* End an OUT of whole packets with a ZLP */
+	uint8_t setup[8];
+	uint8_t *buf;
+	size_t len;
+
+	size_t actual;
+	bool done;
+	bool overflow;         /* The device sent more than len bytes */
+	enum sim_stage stage;  /* Control only */
+	uint8_t pid;           /* Control only */
+
+	/* The last transaction */
+	enum sim_token token;
+	size_t packet_len;
+	uint8_t packet[SIM_MAX_PACKET];
+};
+
+void sim_host_control_transfer(struct sim_transfer *t, const uint8_t setup[8],
+                               uint8_t *buf);
+void sim_host_data_transfer(struct sim_transfer *t, uint8_t ep, uint8_t dir,
+                            uint8_t *buf, size_t len);
+
+/* Run the next transaction. Returns its handshake: SIM_ACK if it went
+ * through (which may be a retransmission with no progress), SIM_NAK to
+ * retry later, or an error. An IN with more data than the transfer has
+ * room for sets overflow and returns SIM_ERROR. Data toggles are kept
+ * in host. Control transfers don't update host's address or toggles;
+ * the caller does that for the requests which need it. */
+int sim_host_step(struct sim_host *host, struct sim_transfer *t);
+
+#endif /* SIM_HOST_H__ */
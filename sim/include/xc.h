@@ -0,0 +1,166 @@
+/*
+ *  M-Stack Host Simulation Device Header
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file takes the place of the XC compilers' <xc.h> when M-Stack and
+ * its applications are built for a Linux host.  It declares the Special
+ * Function Registers (SFRs) of a simulated USB peripheral, which are plain
+ * variables driven by the virtual SIE in sim/sie.c, and the program memory
+ * interface of a simulated PIC24F part (sim/flash.c), which is enough to
+ * run the bootloader firmware.
+ *
+ * Unlike on real hardware, each flag bit is held in its own byte.  This
+ * way the SIE (which may run in another thread) and the firmware never
+ * race on a read-modify-write of a shared register.
+ */
+
+#ifndef SIM_XC_H__
+#define SIM_XC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* The simulated part is a PIC24F as far as program memory is concerned. */
+#ifndef __PIC24F__
+#define __PIC24F__
+#endif
+
+/* USB Interrupt Flags (UIR) */
+struct sim_uir_bits {
+	uint8_t URSTIF;
+	uint8_t UERRIF;
+	uint8_t SOFIF;
+	uint8_t TRNIF;
+	uint8_t IDLEIF;
+	uint8_t RESUMEIF;
+	uint8_t ATTACHIF;
+	uint8_t STALLIF;
+};
+
+/* USB Interrupt Enables (UIE). The whole register can be written at once
+ * through UIE. */
+union sim_uie {
+	uint64_t reg;
+	struct {
+		uint8_t URSTIE;
+		uint8_t UERRIE;
+		uint8_t SOFIE;
+		uint8_t TRNIE;
+		uint8_t IDLEIE;
+		uint8_t RESUMEIE;
+		uint8_t ATTACHIE;
+		uint8_t STALLIE;
+	} bits;
+};
+
+/* Endpoint Control Registers (UEPn) */
+typedef struct {
+	uint8_t EPHSHK;
+	uint8_t EPCONDIS;
+	uint8_t EPOUTEN;
+	uint8_t EPINEN;
+	uint8_t EPSTALL;
+} sim_uep_bits_t;
+
+/* USB Control Register (UCON) */
+struct sim_ucon_bits {
+	uint8_t USBEN;
+	uint8_t PKTDIS;
+};
+
+/* USB Configuration Register (UCFG) */
+struct sim_ucfg_bits {
+	uint8_t PPB;
+};
+
+/* USB Status Register (USTAT). This is the head of the SIE's USTAT FIFO. */
+struct sim_ustat_bits {
+	uint8_t ENDP;
+	uint8_t DIR;
+	uint8_t PPBI;
+};
+
+/* USB interrupt in the CPU's interrupt controller */
+struct sim_usbint_bits {
+	uint8_t USBIF;
+	uint8_t USBIE;
+};
+
+extern volatile struct sim_uir_bits   UIRbits;
+extern volatile union sim_uie         sim_uie;
+extern volatile uint8_t               UEIR;
+extern volatile uint8_t               UEIE;
+extern volatile sim_uep_bits_t        UEPbits[16];
+extern volatile struct sim_ucon_bits  UCONbits;
+extern volatile struct sim_ucfg_bits  UCFGbits;
+extern volatile struct sim_ustat_bits USTATbits;
+extern volatile uint8_t               UADDR;
+extern volatile uint8_t               UFRML;
+extern volatile uint8_t               UFRMH;
+extern volatile struct sim_usbint_bits USBINTbits;
+extern void * volatile                UBDTP; /* Buffer Descriptor Table pointer */
+
+#define UIE      sim_uie.reg
+#define UIEbits  sim_uie.bits
+
+/* Register writes which have side effects in the SIE. */
+void sim_clear_uir(void);    /* Clear all interrupt flags */
+void sim_clear_trnif(void);  /* Clear TRNIF, advancing the USTAT FIFO */
+
+
+/* Program memory (PIC24F). Addresses are program counter (word)
+ * addresses.  See sim/flash.c. */
+#define SIM_IVT_MAP_BASE      0x1400UL
+#define SIM_APP_BASE          0x1500UL
+#define SIM_APP_LENGTH        0x9280UL
+#define SIM_APP_HEADER_BASE   0xa780UL
+#define SIM_FLASH_BLOCK_SIZE  0x400UL
+#define SIM_FLASH_TOP         0xac00UL
+#define SIM_CONFIG_WORDS_BASE 0xabf8UL
+#define SIM_CONFIG_WORDS_TOP  0xac00UL
+
+extern volatile uint16_t TBLPAG;
+extern volatile uint16_t NVMCON;
+extern volatile struct sim_nvmcon_bits {
+	uint8_t WR;
+} NVMCONbits;
+
+extern volatile struct sim_rcon_bits {
+	uint8_t POR;
+	uint8_t BOR;
+} RCONbits;
+
+void     sim_tblwtl(uint16_t offset, uint16_t value);
+void     sim_tblwth(uint16_t offset, uint16_t value);
+uint16_t sim_tblrdl(uint16_t offset);
+uint16_t sim_tblrdh(uint16_t offset);
+void     sim_write_nvm(void);
+
+#define __builtin_tblwtl(offset, value) sim_tblwtl(offset, value)
+#define __builtin_tblwth(offset, value) sim_tblwth(offset, value)
+#define __builtin_tblrdl(offset)        sim_tblrdl(offset)
+#define __builtin_tblrdh(offset)        sim_tblrdh(offset)
+#define __builtin_write_NVM()           sim_write_nvm()
+
+/* Instructions the applications use through inline assembly. Only
+ * "reset" and "DISI #n" are understood. */
+void sim_asm(const char *instruction);
+#define asm(instruction) sim_asm(instruction)
+
+/* Jump to the application at the given program memory address. */
+void sim_goto(uint32_t address);
+
+#endif /* SIM_XC_H__ */
@@ -0,0 +1,677 @@
+/*
+ *  M-Stack Host Simulation: libusb-1.0 Compatible Interface
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A libusb-1.0 replacement which connects a host program to a simulated
+ * device running in the same process. The simulated device is whatever
+ * firmware this is linked with (see the Makefile).
+ *
+ * libusb_init() powers on the device and enumerates it the way Linux
+ * does, including setting the first configuration. There is then at most
+ * one device on the bus.  If the firmware resets itself, the device is
+ * enumerated again the next time the device list is read. If it drops off
+ * the bus (for example when the bootloader starts the application),
+ * transfers fail with LIBUSB_ERROR_NO_DEVICE.
+ *
+ * There is no bus clock in the simulation, so a transfer's timeout is
+ * applied as a count of NAK'd transactions, one per microsecond.
+ *
+ * If MSTACK_SIM_STATS is set in the environment, the SIE and flash
+ * statistics are printed to stderr when the program exits. If
+ * MSTACK_SIM_USBMON is set to a file name, the transfers are written to it
+ * as a usbmon capture (see usbmon.h), for replaying with *_replay. If
+ * MSTACK_SIM_FLASH is set to a file name, program memory is loaded from it
+ * (if it exists) at power-on and saved to it when the program exits, so
+ * that one run can program over what an earlier one left.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <xc.h>
+
+#include "libusb/libusb.h"
+#include "sim.h"
+#include "host.h"
+#include "usbmon.h"
+
+#define DEVICE_ADDRESS 1
+
+struct libusb_device {
+	int refcnt;
+};
+
+struct libusb_device_handle {
+	libusb_device *dev;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static bool powered;
+static bool enumerated;
+static unsigned int enumerated_resets;
+static struct sim_host host;
+static struct libusb_device device;
+static uint8_t device_desc[18];
+static int configuration;
+static struct usbmon_writer *usbmon;
+static uint64_t urb_tag;
+
+static int error_from_sim(int res)
+{
+	switch (res) {
+	case SIM_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case SIM_NAK:
+		return LIBUSB_ERROR_TIMEOUT;
+	case SIM_TIMEOUT:
+		return sim_sie_attached() ? LIBUSB_ERROR_TIMEOUT :
+		                            LIBUSB_ERROR_NO_DEVICE;
+	case SIM_ERROR:
+		return LIBUSB_ERROR_IO;
+	default:
+		return res < 0 ? LIBUSB_ERROR_OTHER : res;
+	}
+}
+
+/* The URB status Linux would report. A timed out transfer is unlinked by
+ * libusb. */
+static int status_from_sim(int res)
+{
+	switch (res) {
+	case SIM_STALL:
+		return -EPIPE;
+	case SIM_NAK:
+		return -ENOENT;
+	case SIM_TIMEOUT:
+		return sim_sie_attached() ? -ENOENT : -ENODEV;
+	default:
+		return res < 0 ? -EPROTO : 0;
+	}
+}
+
+/* Write one event of a transfer to the MSTACK_SIM_USBMON capture. */
+static void record(char type, uint8_t xfer, uint8_t dev, uint8_t ep,
+                   const uint8_t *setup, int status, uint32_t len,
+                   const uint8_t *data, uint32_t data_len)
+{
+	struct usbmon_event ev;
+	struct timespec ts;
+
+	if (!usbmon)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memset(&ev, 0, sizeof(ev));
+	ev.id = urb_tag;
+	ev.type = type;
+	ev.xfer = xfer;
+	ev.ep = ep;
+	ev.dev = dev;
+	ev.bus = 1;
+	ev.ts_us = (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	ev.status = status;
+	ev.len = len;
+	if (setup) {
+		ev.setup_valid = true;
+		memcpy(ev.setup, setup, 8);
+	}
+	ev.data = (uint8_t *) data;
+	ev.data_len = data ? data_len : 0;
+	usbmon_write(usbmon, &ev);
+}
+
+/* sim_host_control(), recorded. */
+static int control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                   uint16_t wIndex, uint8_t *data, uint16_t wLength)
+{
+	uint8_t setup[8] = { bmRequestType, bRequest, wValue, wValue >> 8,
+	                     wIndex, wIndex >> 8, wLength, wLength >> 8 };
+	bool in = bmRequestType & 0x80;
+	uint8_t addr = host.addr;
+	int res;
+
+	urb_tag++;
+	record('S', USBMON_CONTROL, addr, in ? 0x80 : 0, setup, -EINPROGRESS,
+	       wLength, in ? NULL : data, wLength);
+	res = sim_host_control(&host, bmRequestType, bRequest, wValue, wIndex,
+	                       data, wLength);
+	record('C', USBMON_CONTROL, addr, in ? 0x80 : 0, NULL,
+	       status_from_sim(res), res > 0 ? res : 0,
+	       in ? data : NULL, res > 0 ? res : 0);
+
+	return res;
+}
+
+static void set_timeout(unsigned int timeout)
+{
+	host.nak_limit = timeout ? timeout * 1000 : UINT_MAX;
+}
+
+static void print_stats(void)
+{
+	const struct sim_sie_stats *s = sim_sie_get_stats();
+	const struct sim_flash_stats *f = sim_flash_get_stats();
+
+	fprintf(stderr, "sim: setup %u in %u out %u sof %u reset %u\n",
+	        s->setups, s->ins, s->outs, s->sofs, s->resets);
+	fprintf(stderr, "sim: ack %u nak %u stall %u timeout %u interrupts %u\n",
+	        s->acks, s->naks, s->stalls, s->timeouts, s->interrupts);
+	fprintf(stderr, "sim: flash page erases %u row writes %u busy %u us\n",
+	        f->page_erases, f->row_writes, f->busy_us);
+}
+
+/* Program memory is saved as one 32-bit instruction after another, in
+ * host byte order, from address 0. */
+static void load_flash(void)
+{
+	FILE *fp = fopen(getenv("MSTACK_SIM_FLASH"), "rb");
+	uint32_t address, instruction;
+
+	if (!fp)
+		return;
+	for (address = 0; address < SIM_FLASH_TOP; address += 2) {
+		if (fread(&instruction, sizeof(instruction), 1, fp) != 1)
+			break;
+		sim_flash_write(address, instruction);
+	}
+	fclose(fp);
+}
+
+static void save_flash(void)
+{
+	FILE *fp = fopen(getenv("MSTACK_SIM_FLASH"), "wb");
+	uint32_t address, instruction;
+
+	if (!fp) {
+		perror("sim: MSTACK_SIM_FLASH");
+		return;
+	}
+	for (address = 0; address < SIM_FLASH_TOP; address += 2) {
+		instruction = sim_flash_read(address);
+		fwrite(&instruction, sizeof(instruction), 1, fp);
+	}
+	fclose(fp);
+}
+
+static void finish_usbmon(void)
+{
+	usbmon_finish(usbmon);
+	usbmon = NULL;
+}
+
+/* Enumerate the device as Linux does. Called with the lock held. */
+static int enumerate(void)
+{
+	uint8_t buf[1024];
+	size_t len;
+	int res;
+
+	enumerated = false;
+	enumerated_resets = sim_device_reset_count();
+	sim_host_init(&host);
+
+	if (!sim_sie_attached())
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	/* Get the first 64 bytes of the device descriptor (the device will
+	 * send 18), then reset and set the address. */
+	res = sim_host_bus_reset(&host);
+	if (res == SIM_ACK)
+		res = control(0x80, LIBUSB_REQUEST_GET_DESCRIPTOR,
+		              LIBUSB_DT_DEVICE << 8, 0, buf, 64);
+	if (res >= 0)
+		res = sim_host_bus_reset(&host);
+	if (res >= 0)
+		res = control(0x00, LIBUSB_REQUEST_SET_ADDRESS,
+		              DEVICE_ADDRESS, 0, NULL, 0);
+	if (res >= 0)
+		res = control(0x80, LIBUSB_REQUEST_GET_DESCRIPTOR,
+		              LIBUSB_DT_DEVICE << 8, 0,
+		              device_desc, sizeof(device_desc));
+	if (res >= 0 && res != sizeof(device_desc))
+		res = SIM_ERROR;
+	if (res < 0)
+		return error_from_sim(res);
+
+	/* Configuration descriptor: the header, then all of it. */
+	res = control(0x80, LIBUSB_REQUEST_GET_DESCRIPTOR,
+	              LIBUSB_DT_CONFIG << 8, 0, buf, 9);
+	if (res == 9) {
+		len = buf[2] | buf[3] << 8;
+		if (len > sizeof(buf))
+			len = sizeof(buf);
+		res = control(0x80, LIBUSB_REQUEST_GET_DESCRIPTOR,
+		              LIBUSB_DT_CONFIG << 8, 0, buf, len);
+	}
+	if (res < 9)
+		return res < 0 ? error_from_sim(res) : LIBUSB_ERROR_IO;
+	sim_host_parse_config(&host, buf, res);
+
+	res = control(0x00, LIBUSB_REQUEST_SET_CONFIGURATION,
+	              buf[5], 0, NULL, 0);
+	if (res < 0)
+		return error_from_sim(res);
+	configuration = buf[5];
+
+	enumerated = true;
+	return 0;
+}
+
+/* Bring the device up, or re-enumerate it after a software reset.
+ * Called with the lock held. */
+static void update_device(void)
+{
+	if (!powered) {
+		powered = true;
+		if (getenv("MSTACK_SIM_FLASH")) {
+			load_flash();
+			atexit(save_flash);
+		}
+		sim_device_power_on();
+		if (getenv("MSTACK_SIM_STATS"))
+			atexit(print_stats);
+		if (getenv("MSTACK_SIM_USBMON")) {
+			usbmon = usbmon_create(getenv("MSTACK_SIM_USBMON"));
+			atexit(finish_usbmon);
+		}
+		enumerate();
+	}
+	else if (sim_device_reset_count() != enumerated_resets) {
+		enumerate();
+	}
+}
+
+int LIBUSB_CALL libusb_init(libusb_context **ctx)
+{
+	if (ctx)
+		*ctx = NULL;
+
+	pthread_mutex_lock(&lock);
+	update_device();
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+void LIBUSB_CALL libusb_exit(libusb_context *ctx)
+{
+}
+
+void LIBUSB_CALL libusb_set_debug(libusb_context *ctx, int level)
+{
+}
+
+const char * LIBUSB_CALL libusb_error_name(int errcode)
+{
+	switch (errcode) {
+	case LIBUSB_SUCCESS:
+		return "LIBUSB_SUCCESS";
+	case LIBUSB_ERROR_IO:
+		return "LIBUSB_ERROR_IO";
+	case LIBUSB_ERROR_INVALID_PARAM:
+		return "LIBUSB_ERROR_INVALID_PARAM";
+	case LIBUSB_ERROR_ACCESS:
+		return "LIBUSB_ERROR_ACCESS";
+	case LIBUSB_ERROR_NO_DEVICE:
+		return "LIBUSB_ERROR_NO_DEVICE";
+	case LIBUSB_ERROR_NOT_FOUND:
+		return "LIBUSB_ERROR_NOT_FOUND";
+	case LIBUSB_ERROR_BUSY:
+		return "LIBUSB_ERROR_BUSY";
+	case LIBUSB_ERROR_TIMEOUT:
+		return "LIBUSB_ERROR_TIMEOUT";
+	case LIBUSB_ERROR_OVERFLOW:
+		return "LIBUSB_ERROR_OVERFLOW";
+	case LIBUSB_ERROR_PIPE:
+		return "LIBUSB_ERROR_PIPE";
+	case LIBUSB_ERROR_INTERRUPTED:
+		return "LIBUSB_ERROR_INTERRUPTED";
+	case LIBUSB_ERROR_NO_MEM:
+		return "LIBUSB_ERROR_NO_MEM";
+	case LIBUSB_ERROR_NOT_SUPPORTED:
+		return "LIBUSB_ERROR_NOT_SUPPORTED";
+	case LIBUSB_ERROR_OTHER:
+		return "LIBUSB_ERROR_OTHER";
+	}
+	return "**UNKNOWN**";
+}
+
+ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context *ctx,
+	libusb_device ***list)
+{
+	ssize_t count = 0;
+
+	*list = calloc(2, sizeof(libusb_device *));
+	if (!*list)
+		return LIBUSB_ERROR_NO_MEM;
+
+	pthread_mutex_lock(&lock);
+	update_device();
+	if (enumerated && sim_sie_attached()) {
+		device.refcnt++;
+		(*list)[count++] = &device;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return count;
+}
+
+void LIBUSB_CALL libusb_free_device_list(libusb_device **list,
+	int unref_devices)
+{
+	libusb_device **dev;
+
+	if (!list)
+		return;
+	if (unref_devices) {
+		for (dev = list; *dev; dev++)
+			libusb_unref_device(*dev);
+	}
+	free(list);
+}
+
+libusb_device * LIBUSB_CALL libusb_ref_device(libusb_device *dev)
+{
+	dev->refcnt++;
+	return dev;
+}
+
+void LIBUSB_CALL libusb_unref_device(libusb_device *dev)
+{
+	dev->refcnt--;
+}
+
+int LIBUSB_CALL libusb_get_device_descriptor(libusb_device *dev,
+	struct libusb_device_descriptor *desc)
+{
+	desc->bLength = device_desc[0];
+	desc->bDescriptorType = device_desc[1];
+	desc->bcdUSB = device_desc[2] | device_desc[3] << 8;
+	desc->bDeviceClass = device_desc[4];
+	desc->bDeviceSubClass = device_desc[5];
+	desc->bDeviceProtocol = device_desc[6];
+	desc->bMaxPacketSize0 = device_desc[7];
+	desc->idVendor = device_desc[8] | device_desc[9] << 8;
+	desc->idProduct = device_desc[10] | device_desc[11] << 8;
+	desc->bcdDevice = device_desc[12] | device_desc[13] << 8;
+	desc->iManufacturer = device_desc[14];
+	desc->iProduct = device_desc[15];
+	desc->iSerialNumber = device_desc[16];
+	desc->bNumConfigurations = device_desc[17];
+
+	return 0;
+}
+
+uint8_t LIBUSB_CALL libusb_get_bus_number(libusb_device *dev)
+{
+	return 1;
+}
+
+uint8_t LIBUSB_CALL libusb_get_device_address(libusb_device *dev)
+{
+	return DEVICE_ADDRESS;
+}
+
+int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **handle)
+{
+	*handle = calloc(1, sizeof(**handle));
+	if (!*handle)
+		return LIBUSB_ERROR_NO_MEM;
+
+	(*handle)->dev = libusb_ref_device(dev);
+	return 0;
+}
+
+void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle)
+{
+	if (!dev_handle)
+		return;
+	libusb_unref_device(dev_handle->dev);
+	free(dev_handle);
+}
+
+libusb_device * LIBUSB_CALL libusb_get_device(libusb_device_handle *dev_handle)
+{
+	return dev_handle->dev;
+}
+
+libusb_device_handle * LIBUSB_CALL libusb_open_device_with_vid_pid(
+	libusb_context *ctx, uint16_t vendor_id, uint16_t product_id)
+{
+	libusb_device **list;
+	libusb_device_handle *handle = NULL;
+	struct libusb_device_descriptor desc;
+	ssize_t count, i;
+
+	count = libusb_get_device_list(ctx, &list);
+	for (i = 0; i < count; i++) {
+		libusb_get_device_descriptor(list[i], &desc);
+		if (desc.idVendor == vendor_id && desc.idProduct == product_id) {
+			if (libusb_open(list[i], &handle) < 0)
+				handle = NULL;
+			break;
+		}
+	}
+	libusb_free_device_list(list, 1);
+
+	return handle;
+}
+
+int LIBUSB_CALL libusb_get_configuration(libusb_device_handle *dev,
+	int *config)
+{
+	*config = configuration;
+	return 0;
+}
+
+int LIBUSB_CALL libusb_set_configuration(libusb_device_handle *dev,
+	int config)
+{
+	int res;
+
+	res = libusb_control_transfer(dev, 0x00,
+		LIBUSB_REQUEST_SET_CONFIGURATION, config, 0, NULL, 0, 1000);
+	if (res < 0)
+		return res;
+
+	configuration = config;
+	return 0;
+}
+
+int LIBUSB_CALL libusb_claim_interface(libusb_device_handle *dev,
+	int interface_number)
+{
+	return 0;
+}
+
+int LIBUSB_CALL libusb_release_interface(libusb_device_handle *dev,
+	int interface_number)
+{
+	return 0;
+}
+
+int LIBUSB_CALL libusb_set_interface_alt_setting(libusb_device_handle *dev,
+	int interface_number, int alternate_setting)
+{
+	int res;
+
+	res = libusb_control_transfer(dev, LIBUSB_RECIPIENT_INTERFACE,
+		LIBUSB_REQUEST_SET_INTERFACE, alternate_setting,
+		interface_number, NULL, 0, 1000);
+
+	return res < 0 ? res : 0;
+}
+
+int LIBUSB_CALL libusb_clear_halt(libusb_device_handle *dev,
+	unsigned char endpoint)
+{
+	int res;
+
+	res = libusb_control_transfer(dev, LIBUSB_RECIPIENT_ENDPOINT,
+		LIBUSB_REQUEST_CLEAR_FEATURE, 0 /* ENDPOINT_HALT */,
+		endpoint, NULL, 0, 1000);
+
+	return res < 0 ? res : 0;
+}
+
+int LIBUSB_CALL libusb_reset_device(libusb_device_handle *dev)
+{
+	int res;
+
+	pthread_mutex_lock(&lock);
+	res = enumerate();
+	pthread_mutex_unlock(&lock);
+
+	return res;
+}
+
+int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle *dev,
+	int interface_number)
+{
+	return 0;
+}
+
+int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev,
+	int interface_number)
+{
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_attach_kernel_driver(libusb_device_handle *dev,
+	int interface_number)
+{
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_control_transfer(libusb_device_handle *dev_handle,
+	uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+	unsigned char *data, uint16_t wLength, unsigned int timeout)
+{
+	int res;
+
+	pthread_mutex_lock(&lock);
+	if (!enumerated) {
+		pthread_mutex_unlock(&lock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	set_timeout(timeout);
+	res = control(request_type, bRequest, wValue, wIndex, data, wLength);
+	pthread_mutex_unlock(&lock);
+
+	return error_from_sim(res);
+}
+
+static int transfer(libusb_device_handle *dev_handle, uint8_t xfer,
+	unsigned char endpoint, unsigned char *data, int length,
+	int *actual_length, unsigned int timeout)
+{
+	bool in = endpoint & LIBUSB_ENDPOINT_IN;
+	int res;
+
+	*actual_length = 0;
+
+	pthread_mutex_lock(&lock);
+	if (!enumerated) {
+		pthread_mutex_unlock(&lock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	set_timeout(timeout);
+	urb_tag++;
+	record('S', xfer, host.addr, endpoint, NULL, -EINPROGRESS, length,
+	       in ? NULL : data, length);
+	if (in)
+		res = sim_host_in(&host, endpoint & 0xf, data, length);
+	else
+		res = sim_host_out(&host, endpoint & 0xf, data, length);
+	record('C', xfer, host.addr, endpoint, NULL, status_from_sim(res),
+	       res > 0 ? res : 0, in ? data : NULL, res > 0 ? res : 0);
+	pthread_mutex_unlock(&lock);
+
+	if (res < 0)
+		return error_from_sim(res);
+
+	*actual_length = res;
+	return 0;
+}
+
+int LIBUSB_CALL libusb_bulk_transfer(libusb_device_handle *dev_handle,
+	unsigned char endpoint, unsigned char *data, int length,
+	int *actual_length, unsigned int timeout)
+{
+	return transfer(dev_handle, USBMON_BULK, endpoint, data, length,
+	                actual_length, timeout);
+}
+
+int LIBUSB_CALL libusb_interrupt_transfer(libusb_device_handle *dev_handle,
+	unsigned char endpoint, unsigned char *data, int length,
+	int *actual_length, unsigned int timeout)
+{
+	return transfer(dev_handle, USBMON_INTERRUPT, endpoint, data, length,
+	                actual_length, timeout);
+}
+
+int LIBUSB_CALL libusb_get_descriptor(libusb_device_handle *dev,
+	uint8_t desc_type, uint8_t desc_index, unsigned char *data, int length)
+{
+	return libusb_control_transfer(dev, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_DESCRIPTOR, desc_type << 8 | desc_index,
+		0, data, length, 1000);
+}
+
+int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
+	uint8_t desc_index, unsigned char *data, int length)
+{
+	unsigned char buf[255];
+	uint16_t langid;
+	int res, i, di;
+
+	if (desc_index == 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	res = libusb_control_transfer(dev, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_STRING << 8,
+		0, buf, sizeof(buf), 1000);
+	if (res < 0)
+		return res;
+	if (res < 4)
+		return LIBUSB_ERROR_IO;
+	langid = buf[2] | buf[3] << 8;
+
+	res = libusb_control_transfer(dev, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_STRING << 8 | desc_index,
+		langid, buf, sizeof(buf), 1000);
+	if (res < 0)
+		return res;
+	if (res < 2 || buf[1] != LIBUSB_DT_STRING || buf[0] > res)
+		return LIBUSB_ERROR_IO;
+
+	for (di = 0, i = 2; i + 1 < buf[0] && di < length - 1; i += 2) {
+		if (buf[i+1])
+			data[di++] = '?';
+		else
+			data[di++] = buf[i];
+	}
+	data[di] = 0;
+
+	return di;
+}
@@ -0,0 +1,674 @@
+/*
+ *  M-Stack Host Simulation: Full-Speed Bus Timing Model
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Predict the throughput and latency a firmware configuration can reach
+ * on a full-speed bus, before there is hardware to measure it on.
+ *
+ * This is built with an application's usb_config.h and usb_descriptors.c
+ * (see MODEL_APP in the Makefile), but not its main.c. In its place is a
+ * synthetic application which, each time it is serviced, consumes the
+ * data on its OUT endpoints and refills its IN endpoints with full
+ * packets. It is serviced every -r microseconds of simulated time, which
+ * stands for the main loop's period. Polled (non-interrupt) firmware also
+ * calls usb_service() once per service, so EP 0 and the USTAT FIFO are
+ * only handled that often, as on the part.
+ *
+ * The host side schedules transactions in 1 ms frames as a host
+ * controller does: an SOF, then interrupt endpoints which are due (within
+ * 90% of the frame), then control and bulk transfers round-robin, with
+ * control first in each pass, until no more transactions fit before the
+ * end of the frame. NAK'd transactions are retried on the next pass and
+ * cost bus time like any other. A transaction only starts if one of its
+ * largest packets would fit in what is left of the frame.
+ *
+ * Transaction times come from the USB 2.0 specification (5.11.3):
+ *
+ *   9107 + 83.54 * floor(3.167 + BitStuffTime(bytes)) + Host_Delay  ns
+ *
+ * where BitStuffTime is 7/6 of the data bits (worst-case bit stuffing),
+ * or with -s data, the data bits plus the stuffed bits actually needed
+ * for the packet's data. The firmware's own CPU time is not modelled.
+ *
+ * usb.c does not use ping-pong buffering. With -P, it is emulated: each
+ * data endpoint gets a second buffer which is moved to and from the
+ * endpoint by the "hardware" right after every transaction, so the SIE
+ * can take or give one more packet before the application is serviced.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <usb_config.h>
+#include <usb.h>
+#include <usb_ch9.h>
+
+#include "sim.h"
+#include "host.h"
+
+#define FRAME_NS 1000000.0
+#define PERIODIC_NS (FRAME_NS * 0.9)
+#define SOF_NS (37 * 83.54) /* SYNC, PID, frame number, CRC5, EOP, gap */
+#define MAX_STREAMS 16
+#define MAX_TRANSFER 65536
+
+enum stream_type {
+	CONTROL,
+	BULK,
+	INTERRUPT,
+};
+
+struct stream {
+	char name[32];
+	enum stream_type type;
+	uint8_t ep;
+	uint8_t dir;
+	unsigned int interval;  /* Frames, for interrupt */
+	size_t len;             /* Bytes per transfer */
+	uint16_t max_packet;
+	uint8_t *buf;
+
+	struct sim_transfer t;
+	bool active;
+	double started_ns;
+
+	/* Ping-pong emulation: the second buffer */
+	bool spare_full;
+	uint8_t spare_len;
+
+	/* Statistics */
+	uint64_t bytes;
+	uint64_t packets;
+	uint64_t naks;
+	uint64_t errors;
+	uint64_t transfers;
+	double latency_sum;
+	double latency_max;
+};
+
+static struct sim_host host;
+static struct stream streams[MAX_STREAMS];
+static int num_streams;
+
+static unsigned int frames = 1000;
+static double service_ns;
+static bool ping_pong;
+static bool count_stuffing;
+static double host_delay_ns;
+static int fill_byte = -1;
+static uint32_t rand_state = 1;
+
+static double now_ns;
+static double next_service_ns;
+static double data_ns, nak_ns, sof_ns;
+
+/* Test data, from a fixed LCG or a fixed byte. */
+static void fill(uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (fill_byte >= 0) {
+			buf[i] = fill_byte;
+		}
+		else {
+			rand_state = rand_state * 1103515245 + 12345;
+			buf[i] = rand_state >> 16;
+		}
+	}
+}
+
+/* Bits in a packet's data, including the bits which will be stuffed
+ * after each run of six 1s. */
+static double stuffed_bits(const uint8_t *data, size_t len)
+{
+	unsigned int ones = 0, stuffed = 0;
+	size_t i;
+	int bit;
+
+	if (!count_stuffing)
+		return 7.0 / 6.0 * 8 * len;
+
+	for (i = 0; i < len; i++) {
+		for (bit = 0; bit < 8; bit++) {
+			if (data[i] & (1 << bit)) {
+				if (++ones == 6) {
+					stuffed++;
+					ones = 0;
+				}
+			}
+			else {
+				ones = 0;
+			}
+		}
+	}
+
+	return 8.0 * len + stuffed;
+}
+
+static double transaction_ns(const uint8_t *data, size_t len)
+{
+	return 9107 + 83.54 * floor(3.167 + stuffed_bits(data, len)) +
+	       host_delay_ns;
+}
+
+/* The longest a transaction on the stream can take. */
+static double max_transaction_ns(const struct stream *s)
+{
+	return 9107 + 83.54 * floor(3.167 + 7.0 / 6.0 * 8 * s->max_packet) +
+	       host_delay_ns;
+}
+
+/* The synthetic application, serviced every service_ns. */
+static void app_service(void)
+{
+	int i;
+
+	for (i = 0; i < num_streams && usb_is_configured(); i++) {
+		struct stream *s = &streams[i];
+		const unsigned char *data;
+
+		if (s->type == CONTROL)
+			continue;
+
+		if (s->dir == 0) {
+			s->spare_full = false;
+			if (usb_out_endpoint_has_data(s->ep)) {
+				usb_get_out_buffer(s->ep, &data);
+				usb_arm_out_endpoint(s->ep);
+			}
+		}
+		else {
+			if (!usb_in_endpoint_busy(s->ep) &&
+			    !usb_in_endpoint_halted(s->ep)) {
+				fill(usb_get_in_buffer(s->ep), s->max_packet);
+				usb_send_in_buffer(s->ep, s->max_packet);
+			}
+			if (ping_pong && !s->spare_full) {
+				s->spare_full = true;
+				s->spare_len = s->max_packet;
+			}
+		}
+	}
+
+#ifndef USB_USE_INTERRUPTS
+	usb_service();
+#endif
+}
+
+/* Emulated ping-pong: swap buffers as soon as a transaction completes. */
+static void ping_pong_swap(void)
+{
+	int i;
+
+	if (!ping_pong || !usb_is_configured())
+		return;
+
+	for (i = 0; i < num_streams; i++) {
+		struct stream *s = &streams[i];
+		const unsigned char *data;
+
+		if (s->type == CONTROL)
+			continue;
+
+		if (s->dir == 0) {
+			if (!s->spare_full && usb_out_endpoint_has_data(s->ep)) {
+				s->spare_len = usb_get_out_buffer(s->ep, &data);
+				s->spare_full = true;
+				usb_arm_out_endpoint(s->ep);
+			}
+		}
+		else {
+			if (s->spare_full && !usb_in_endpoint_busy(s->ep) &&
+			    !usb_in_endpoint_halted(s->ep)) {
+				fill(usb_get_in_buffer(s->ep), s->spare_len);
+				usb_send_in_buffer(s->ep, s->spare_len);
+				s->spare_full = false;
+			}
+		}
+	}
+}
+
+/* Advance simulated time, servicing the application on the way. */
+static void advance(double ns)
+{
+	now_ns += ns;
+	ping_pong_swap();
+
+	if (service_ns == 0) {
+		app_service();
+		return;
+	}
+
+	while (next_service_ns <= now_ns) {
+		app_service();
+		next_service_ns += service_ns;
+	}
+}
+
+static void start_transfer(struct stream *s)
+{
+	uint8_t setup[8];
+
+	if (s->type == CONTROL) {
+		setup[0] = 0x80;
+		setup[1] = GET_DESCRIPTOR;
+		setup[2] = 0;
+		setup[3] = DESC_CONFIGURATION;
+		setup[4] = 0;
+		setup[5] = 0;
+		setup[6] = s->len & 0xff;
+		setup[7] = s->len >> 8;
+		sim_host_control_transfer(&s->t, setup, s->buf);
+	}
+	else {
+		if (s->dir == 0)
+			fill(s->buf, s->len);
+		sim_host_data_transfer(&s->t, s->ep, s->dir, s->buf, s->len);
+	}
+
+	s->active = true;
+	s->started_ns = now_ns;
+}
+
+/* Run one transaction on the stream, if it fits in the frame. Returns
+ * false if it didn't fit. */
+static bool run_transaction(struct stream *s, double frame_end_ns)
+{
+	size_t before;
+	double ns;
+	int res;
+
+	if (now_ns + max_transaction_ns(s) > frame_end_ns)
+		return false;
+
+	if (!s->active)
+		start_transfer(s);
+
+	before = s->t.actual;
+	res = sim_host_step(&host, &s->t);
+
+	/* A NAK'd IN has no data packet. A NAK'd OUT or SETUP sent its
+	 * data before the device refused it. */
+	if (res == SIM_NAK && s->t.token == SIM_TOKEN_IN)
+		ns = transaction_ns(NULL, 0);
+	else
+		ns = transaction_ns(s->t.packet, s->t.packet_len);
+
+	if (res == SIM_NAK) {
+		s->naks++;
+		nak_ns += ns;
+	}
+	else {
+		data_ns += ns;
+		if (res == SIM_ACK && s->t.token != SIM_TOKEN_SETUP &&
+		    s->t.actual != before)
+			s->packets++;
+		s->bytes += s->t.actual - before;
+	}
+
+	if (res != SIM_ACK && res != SIM_NAK) {
+		s->errors++;
+		s->active = false;
+	}
+	else if (s->t.done) {
+		double latency = now_ns + ns - s->started_ns;
+		s->transfers++;
+		s->latency_sum += latency;
+		if (latency > s->latency_max)
+			s->latency_max = latency;
+		s->active = false;
+	}
+
+	advance(ns);
+	return true;
+}
+
+static void run_frame(unsigned int frame)
+{
+	double frame_end_ns = now_ns + FRAME_NS;
+	double periodic_end_ns;
+	bool ran;
+	int i;
+
+	sim_sie_sof();
+	sof_ns += SOF_NS;
+	advance(SOF_NS);
+
+	/* Periodic schedule */
+	periodic_end_ns = now_ns + PERIODIC_NS;
+	for (i = 0; i < num_streams; i++) {
+		struct stream *s = &streams[i];
+		if (s->type == INTERRUPT && frame % s->interval == 0)
+			run_transaction(s, periodic_end_ns);
+	}
+
+	/* Asynchronous schedule. streams[] has control first. */
+	do {
+		ran = false;
+		for (i = 0; i < num_streams; i++) {
+			struct stream *s = &streams[i];
+			if (s->type != INTERRUPT)
+				ran |= run_transaction(s, frame_end_ns);
+		}
+	} while (ran);
+
+	advance(frame_end_ns - now_ns);
+}
+
+static int enumerate(void)
+{
+	uint8_t buf[MAX_TRANSFER];
+	int res;
+
+	sim_host_init(&host);
+	res = sim_host_bus_reset(&host);
+	if (res == SIM_ACK)
+		res = sim_host_control(&host, 0x80, GET_DESCRIPTOR,
+		                       DESC_DEVICE << 8, 0, buf, 8);
+	if (res >= 0)
+		res = sim_host_control(&host, 0x00, SET_ADDRESS, 1, 0, NULL, 0);
+	if (res >= 0)
+		res = sim_host_control(&host, 0x80, GET_DESCRIPTOR,
+		                       DESC_CONFIGURATION << 8, 0, buf, 9);
+	if (res == 9)
+		res = sim_host_control(&host, 0x80, GET_DESCRIPTOR,
+		                       DESC_CONFIGURATION << 8, 0, buf,
+		                       buf[2] | buf[3] << 8);
+	if (res < 9)
+		return -1;
+	sim_host_parse_config(&host, buf, res);
+
+	res = sim_host_control(&host, 0x00, SET_CONFIGURATION, buf[5], 0,
+	                       NULL, 0);
+	return res < 0 ? -1 : 0;
+}
+
+static struct stream *add_stream(enum stream_type type, const char *arg,
+                                 uint8_t dir)
+{
+	static const char *types[] = { "control", "bulk", "interrupt" };
+	struct stream *s;
+	char *end;
+
+	if (num_streams >= MAX_STREAMS) {
+		fprintf(stderr, "too many streams\n");
+		exit(1);
+	}
+
+	s = &streams[num_streams++];
+	s->type = type;
+	s->dir = dir;
+	if (type == CONTROL) {
+		s->len = strtoul(arg, &end, 0);
+		if (*end || s->len > MAX_TRANSFER)
+			goto bad;
+		snprintf(s->name, sizeof(s->name), "control IN");
+		return s;
+	}
+
+	s->ep = strtoul(arg, &end, 0);
+	if (type == INTERRUPT) {
+		if (*end != ':')
+			goto bad;
+		s->interval = strtoul(end + 1, &end, 0);
+		if (s->interval == 0)
+			goto bad;
+	}
+	if (*end || s->ep == 0 || s->ep > NUM_ENDPOINT_NUMBERS)
+		goto bad;
+	snprintf(s->name, sizeof(s->name), "%s %s %u", types[type],
+	         dir ? "IN" : "OUT", s->ep);
+	return s;
+
+bad:
+	fprintf(stderr, "bad stream: %s\n", arg);
+	exit(1);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [options] stream...\n"
+	        "Streams:\n"
+	        "  -c len       Back-to-back control reads of len bytes\n"
+	        "  -o ep        Bulk OUT stream to ep\n"
+	        "  -i ep        Bulk IN stream from ep\n"
+	        "  -O ep:int    Interrupt OUT to ep every int frames\n"
+	        "  -I ep:int    Interrupt IN from ep every int frames\n"
+	        "Options:\n"
+	        "  -b bytes     Bulk transfer size (default 4096)\n"
+	        "  -f frames    Frames to simulate (default 1000)\n"
+	        "  -r us        Application service interval (default 0:\n"
+	        "               after every transaction)\n"
+	        "  -P           Emulate ping-pong buffering\n"
+	        "  -s data      Count bit stuffing in the data, rather than\n"
+	        "               assuming the worst case\n"
+	        "  -d byte      Fill data with byte, rather than random data\n"
+	        "  -H ns        Host delay per transaction (default 0)\n",
+	        prog);
+}
+
+int main(int argc, char **argv)
+{
+	size_t bulk_len = 4096;
+	double total_ns;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:o:i:O:I:b:f:r:Ps:d:H:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			add_stream(CONTROL, optarg, 1);
+			break;
+		case 'o':
+			add_stream(BULK, optarg, 0);
+			break;
+		case 'i':
+			add_stream(BULK, optarg, 1);
+			break;
+		case 'O':
+			add_stream(INTERRUPT, optarg, 0);
+			break;
+		case 'I':
+			add_stream(INTERRUPT, optarg, 1);
+			break;
+		case 'b':
+			bulk_len = strtoul(optarg, NULL, 0);
+			if (bulk_len == 0 || bulk_len > MAX_TRANSFER) {
+				fprintf(stderr, "bad transfer size\n");
+				return 1;
+			}
+			break;
+		case 'f':
+			frames = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			service_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'P':
+			ping_pong = true;
+			break;
+		case 's':
+			count_stuffing = (strcmp(optarg, "data") == 0);
+			break;
+		case 'd':
+			fill_byte = strtoul(optarg, NULL, 16) & 0xff;
+			break;
+		case 'H':
+			host_delay_ns = strtod(optarg, NULL);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (num_streams == 0 || optind != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* Control streams go first, for the asynchronous schedule. */
+	for (i = 1; i < (unsigned int) num_streams; i++) {
+		if (streams[i].type == CONTROL) {
+			struct stream tmp = streams[i];
+			memmove(&streams[1], &streams[0], i * sizeof(streams[0]));
+			streams[0] = tmp;
+		}
+	}
+
+	/* Bring up the stack and enumerate it with usb_service() run for
+	 * every event. After that, polled firmware only gets serviced when
+	 * the application is. */
+	sim_sie_power_on();
+#ifndef USB_USE_INTERRUPTS
+	sim_sie_set_service_hook(usb_service);
+#endif
+	usb_init();
+	if (enumerate() < 0) {
+		fprintf(stderr, "enumeration failed\n");
+		return 1;
+	}
+	sim_sie_set_service_hook(NULL);
+	sim_sie_set_no_wait(true);
+
+	for (i = 0; i < (unsigned int) num_streams; i++) {
+		struct stream *s = &streams[i];
+		if (s->type == CONTROL) {
+			s->max_packet = EP_0_LEN;
+		}
+		else {
+			s->max_packet = host.max_packet[s->ep][s->dir];
+			s->len = (s->type == BULK) ? bulk_len : s->max_packet;
+		}
+		s->buf = malloc(s->len ? s->len : 1);
+		if (!s->buf)
+			return 1;
+	}
+
+	sim_sie_clear_stats();
+	next_service_ns = service_ns;
+	app_service();
+	for (i = 0; i < frames; i++)
+		run_frame(i);
+
+	total_ns = now_ns;
+	printf("EP_0_LEN %d, %s, ping-pong %s, service every %.1f us\n",
+	       EP_0_LEN,
+#ifdef USB_USE_INTERRUPTS
+	       "interrupts",
+#else
+	       "polled",
+#endif
+	       ping_pong ? "emulated" : "off", service_ns / 1000);
+	printf("%u frames, %s bit stuffing, host delay %.0f ns\n\n", frames,
+	       count_stuffing ? "data" : "worst-case", host_delay_ns);
+
+	printf("%-18s %9s %9s %8s %8s %9s %12s %12s\n", "stream", "kB/s",
+	       "pkt/frame", "NAKs", "errors", "transfers", "latency(us)",
+	       "max(us)");
+	for (i = 0; i < (unsigned int) num_streams; i++) {
+		struct stream *s = &streams[i];
+		printf("%-18s %9.1f %9.2f %8llu %8llu %9llu %12.1f %12.1f\n",
+		       s->name, s->bytes / (total_ns / 1e6),
+		       (double) s->packets / frames,
+		       (unsigned long long) s->naks,
+		       (unsigned long long) s->errors,
+		       (unsigned long long) s->transfers,
+		       s->transfers ? s->latency_sum / s->transfers / 1000 : 0,
+		       s->latency_max / 1000);
+	}
+
+	printf("\nbus time: %.1f%% data, %.1f%% NAK'd, %.1f%% SOF, %.1f%% idle\n",
+	       100 * data_ns / total_ns, 100 * nak_ns / total_ns,
+	       100 * sof_ns / total_ns,
+	       100 * (total_ns - data_ns - nak_ns - sof_ns) / total_ns);
+
+	return 0;
+}
+
+/* Callbacks named in usb_config.h. The synthetic application accepts
+ * whatever the host asks of it and has no requests of its own. */
+#ifdef SET_CONFIGURATION_CALLBACK
+void SET_CONFIGURATION_CALLBACK(uint8_t configuration)
+{
+}
+#endif
+
+#ifdef GET_DEVICE_STATUS_CALLBACK
+uint16_t GET_DEVICE_STATUS_CALLBACK()
+{
+	return 0x0000;
+}
+#endif
+
+#ifdef ENDPOINT_HALT_CALLBACK
+void ENDPOINT_HALT_CALLBACK(uint8_t endpoint, bool halted)
+{
+}
+#endif
+
+#ifdef SET_INTERFACE_CALLBACK
+int8_t SET_INTERFACE_CALLBACK(uint8_t interface, uint8_t alt_setting)
+{
+	return 0;
+}
+#endif
+
+#ifdef GET_INTERFACE_CALLBACK
+int8_t GET_INTERFACE_CALLBACK(uint8_t interface)
+{
+	return 0;
+}
+#endif
+
+#ifdef UNKNOWN_SETUP_REQUEST_CALLBACK
+int8_t UNKNOWN_SETUP_REQUEST_CALLBACK(const struct setup_packet *setup)
+{
+	return -1;
+}
+#endif
+
+#ifdef UNKNOWN_GET_DESCRIPTOR_CALLBACK
+int16_t UNKNOWN_GET_DESCRIPTOR_CALLBACK(const struct setup_packet *pkt,
+                                        const void **descriptor)
+{
+	return -1;
+}
+#endif
+
+#ifdef START_OF_FRAME_CALLBACK
+void START_OF_FRAME_CALLBACK(void)
+{
+}
+#endif
+
+#ifdef ENDPOINT_WATCHDOG_CALLBACK
+int8_t ENDPOINT_WATCHDOG_CALLBACK(uint8_t endpoint, bool sie_owned)
+{
+	return USB_WATCHDOG_IGNORE;
+}
+#endif
+
+#ifdef USB_RESET_CALLBACK
+void USB_RESET_CALLBACK(void)
+{
+}
+#endif
@@ -0,0 +1,974 @@
+/*
+ *  M-Stack Host Simulation: usbmon Capture Replay
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Replay the host side of a usbmon capture (see usbmon.h) of traffic to a
+ * real device against the simulated one, which is the firmware this is
+ * linked with. For example, with a capture taken on bus 3 with
+ *
+ *   tcpdump -i usbmon3 -w traffic.pcap
+ *
+ * or read from /sys/kernel/debug/usb/usbmon/3u,
+ *
+ *   ./unit_test_replay traffic.pcap
+ *
+ * URBs are submitted at their times in the capture, scaled by -x, or with
+ * the time when no URB is pending skipped for -x 0, but not before the
+ * URBs which had completed by then in the capture have completed in the
+ * replay (a host program waiting for one transfer before starting the
+ * next one, on another endpoint, does the same). They're
+ * queued and scheduled per endpoint as the USB/IP server does, with an SOF
+ * every millisecond of replay time.
+ *
+ * Each completion is compared with the capture's: the status, the length,
+ * and for IN transfers the data (as much of it as the capture has; the
+ * kernel's text interface keeps only 32 bytes). A URB which the capture
+ * shows being unlinked is unlinked at the same time in the replay, and a
+ * URB which takes some time (-t) longer than it did in the capture, from
+ * when it reaches the head of its endpoint's queue, is a divergence, and
+ * is unlinked. The device address, and bus resets,
+ * aren't visible in the capture, so the simulated device is enumerated
+ * before the replay and whenever the captured device's address changes,
+ * and is configured if the capture doesn't show that happening before it
+ * uses other endpoints.
+ *
+ * At the end, the URBs are summarized by request or endpoint, with their
+ * latency in the capture and in the replay, and the time spent running
+ * transactions through the stack. The exit status is 1 if anything
+ * diverged.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "sim.h"
+#include "host.h"
+#include "usbmon.h"
+
+#define MIN(X,Y) ((X)<(Y)?(X):(Y))
+
+#define DEVICE_ADDRESS 1
+#define MAX_CONFIG_LEN 1024
+#define MAX_DEVICES 64
+#define MAX_CATEGORIES 64
+
+struct record {
+	struct usbmon_event s;
+	struct usbmon_event c;   /* The completion, if has_c */
+	bool has_c;
+	bool done;               /* Completed in the replay */
+	size_t after;            /* URBs in by_completion to wait for */
+	struct stats *stats;
+};
+
+struct urb {
+	struct urb *next;
+	struct record *rec;
+	uint8_t dir;             /* 0=OUT, 1=IN */
+	uint8_t *buf;
+	struct sim_transfer t;
+	int status;              /* Set when failing for a non-bus reason */
+	int64_t submitted;       /* Replay time, us */
+	int64_t started;         /* When it reached the head of its queue */
+	uint64_t stack_ns;
+	bool expired;            /* Unlinked for taking too long */
+};
+
+struct stats {
+	char name[32];
+	unsigned int urbs;
+	unsigned int diverged;
+	unsigned int timed;      /* URBs with latencies in both */
+	int64_t capture_us;
+	int64_t replay_us;
+	uint64_t stack_ns;
+	uint64_t stack_max_ns;
+};
+
+static struct sim_host host;
+static uint8_t device_desc[18];
+static uint8_t config_desc[MAX_CONFIG_LEN];
+static unsigned int enumerated_resets;
+
+static struct record *records;
+static size_t num_records;
+static size_t *by_completion;    /* Records in order of capture completion */
+static size_t num_completed;     /* Leading by_completion records done */
+static struct stats categories[MAX_CATEGORIES];
+static size_t num_categories;
+
+/* URB queues, by endpoint and direction. Control transfers in either
+ * direction are queued on [0][0]. */
+static struct urb *queues[16][2];
+
+static int64_t t0;               /* Capture time of the first URB */
+static int64_t t_end;            /* and of its last event, from t0 */
+static int64_t timeout_us = 1000000;
+static bool quiet;
+static unsigned int divergences;
+static unsigned int incomplete;
+static unsigned int truncated;
+static uint64_t total_stack_ns;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int enumerate(void)
+{
+	int res;
+
+	enumerated_resets = sim_device_reset_count();
+	sim_host_init(&host);
+
+	res = sim_host_bus_reset(&host);
+	if (res == SIM_ACK)
+		res = sim_host_control(&host, 0x80, 6 /* GET_DESCRIPTOR */,
+		                       0x0100 /* DEVICE */, 0, device_desc, 8);
+	if (res >= 0)
+		res = sim_host_control(&host, 0x00, 5 /* SET_ADDRESS */,
+		                       DEVICE_ADDRESS, 0, NULL, 0);
+	if (res >= 0)
+		res = sim_host_control(&host, 0x80, 6 /* GET_DESCRIPTOR */,
+		                       0x0100 /* DEVICE */, 0,
+		                       device_desc, sizeof(device_desc));
+	if (res >= 0 && res != sizeof(device_desc))
+		return -1;
+	if (res >= 0)
+		res = sim_host_control(&host, 0x80, 6 /* GET_DESCRIPTOR */,
+		                       0x0200 /* CONFIGURATION */, 0,
+		                       config_desc, 9);
+	if (res == 9)
+		res = sim_host_control(&host, 0x80, 6 /* GET_DESCRIPTOR */,
+		                       0x0200 /* CONFIGURATION */, 0, config_desc,
+		                       MIN(config_desc[2] | config_desc[3] << 8,
+		                           sizeof(config_desc)));
+	if (res < 9)
+		return -1;
+
+	sim_host_parse_config(&host, config_desc, res);
+	return 0;
+}
+
+static int set_configuration(int config)
+{
+	int res;
+
+	res = sim_host_control(&host, 0x00, 9 /* SET_CONFIGURATION */,
+	                       config, 0, NULL, 0);
+	if (res < 0)
+		return -1;
+	memset(host.toggle, 0, sizeof(host.toggle));
+	return 0;
+}
+
+static bool is_unlink(int status)
+{
+	return status == -ENOENT || status == -ECONNRESET;
+}
+
+/* Describe a URB for messages. */
+static const char *describe(const struct record *rec)
+{
+	static const char *xfer[] = { "iso", "interrupt", "control", "bulk" };
+	static char buf[64];
+	const uint8_t *s = rec->s.setup;
+
+	if (rec->s.xfer == USBMON_CONTROL && rec->s.setup_valid)
+		snprintf(buf, sizeof(buf), "control %02x %02x %04x %04x %04x",
+		         s[0], s[1], s[2] | s[3] << 8, s[4] | s[5] << 8,
+		         s[6] | s[7] << 8);
+	else
+		snprintf(buf, sizeof(buf), "%s %s EP %u, %u bytes",
+		         xfer[rec->s.xfer], rec->s.ep & 0x80 ? "IN" : "OUT",
+		         rec->s.ep & 0x7f, rec->s.len);
+	return buf;
+}
+
+/* The summary groups URBs by standard request, class or vendor request,
+ * or endpoint. */
+static struct stats *category(const struct record *rec)
+{
+	static const char *requests[] = {
+		"GET_STATUS", "CLEAR_FEATURE", NULL, "SET_FEATURE", NULL,
+		"SET_ADDRESS", "GET_DESCRIPTOR", "SET_DESCRIPTOR",
+		"GET_CONFIGURATION", "SET_CONFIGURATION", "GET_INTERFACE",
+		"SET_INTERFACE", "SYNCH_FRAME",
+	};
+	static const char *types[] = { "standard", "class", "vendor", "reserved" };
+	static const char *xfer[] = { "iso", "interrupt", "control", "bulk" };
+	const struct usbmon_event *s = &rec->s;
+	char name[32];
+	size_t i;
+
+	if (s->xfer == USBMON_CONTROL && s->setup_valid) {
+		uint8_t type = s->setup[0] >> 5 & 3;
+		if (type == 0 && s->setup[1] < sizeof(requests) / sizeof(*requests) &&
+		    requests[s->setup[1]])
+			snprintf(name, sizeof(name), "%s", requests[s->setup[1]]);
+		else
+			snprintf(name, sizeof(name), "%s %u %s", types[type],
+			         s->setup[1], s->setup[0] & 0x80 ? "IN" : "OUT");
+	}
+	else {
+		snprintf(name, sizeof(name), "%s EP %u %s", xfer[s->xfer],
+		         s->ep & 0x7f, s->ep & 0x80 ? "IN" : "OUT");
+	}
+
+	for (i = 0; i < num_categories; i++) {
+		if (strcmp(categories[i].name, name) == 0)
+			return &categories[i];
+	}
+	if (num_categories == MAX_CATEGORIES)
+		i--;
+	else
+		num_categories++;
+	snprintf(categories[i].name, sizeof(categories[i].name), "%s", name);
+	return &categories[i];
+}
+
+static void diverged(const struct record *rec, const char *fmt, ...)
+{
+	va_list ap;
+
+	divergences++;
+	rec->stats->diverged++;
+	if (quiet)
+		return;
+
+	printf("replay: %.6f dev %u-%u %s: ", (rec->s.ts_us - t0) / 1e6,
+	       rec->s.bus, rec->s.dev, describe(rec));
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+}
+
+/* Compare a URB's completion with the capture's. */
+static void compare(struct urb *urb, int64_t now)
+{
+	struct record *rec = urb->rec;
+	const struct usbmon_event *c = &rec->c;
+	int status = urb->status;
+	size_t i;
+
+	if (status == -EREMOTEIO || (status == 0 && c->status == -EREMOTEIO &&
+	                             urb->t.actual < urb->t.len))
+		status = c->status;
+
+	if (is_unlink(c->status)) {
+		if (!is_unlink(status))
+			diverged(rec, "completed with status %d, %zu bytes; "
+			         "unlinked in the capture",
+			         status, urb->t.actual);
+		return;
+	}
+	if (status != c->status) {
+		diverged(rec, "status %d, expected %d", status, c->status);
+		return;
+	}
+
+	if (urb->t.actual != c->len) {
+		diverged(rec, "%zu bytes, expected %u", urb->t.actual, c->len);
+	}
+	else if (urb->dir) {
+		for (i = 0; i < MIN(c->data_len, urb->t.actual); i++) {
+			if (urb->buf[i] != c->data[i]) {
+				diverged(rec, "data differs at byte %zu: "
+				         "%02x, expected %02x", i,
+				         urb->buf[i], c->data[i]);
+				return;
+			}
+		}
+	}
+
+	rec->stats->timed++;
+	rec->stats->capture_us += c->ts_us - rec->s.ts_us;
+	rec->stats->replay_us += now - urb->submitted;
+}
+
+static void free_urb(struct urb *urb)
+{
+	free(urb->buf);
+	free(urb);
+}
+
+static struct urb **queue_for(uint8_t ep, uint8_t dir)
+{
+	return &queues[ep][ep ? dir : 0];
+}
+
+/* Finish a URB: take it off its queue and compare it with the capture. */
+static void complete(struct urb *urb, int status, int64_t now)
+{
+	struct urb **q = queue_for(urb->t.ep, urb->dir);
+	struct record *rec = urb->rec;
+	const uint8_t *s = urb->t.setup;
+	uint16_t wValue = s[2] | s[3] << 8;
+	uint16_t wIndex = s[4] | s[5] << 8;
+
+	while (*q != urb)
+		q = &(*q)->next;
+	*q = urb->next;
+	urb->status = status;
+	rec->done = true;
+
+	/* Standard requests which reset the data toggles. */
+	if (urb->t.control && status == 0) {
+		if (s[0] == 0x00 && s[1] == 9 /* SET_CONFIGURATION */)
+			memset(host.toggle, 0, sizeof(host.toggle));
+		else if (s[0] == 0x02 && s[1] == 1 /* CLEAR_FEATURE */ &&
+		         wValue == 0 /* ENDPOINT_HALT */)
+			host.toggle[wIndex & 0xf][wIndex >> 7 & 1] = 0;
+	}
+
+	rec->stats->urbs++;
+	rec->stats->stack_ns += urb->stack_ns;
+	if (urb->stack_ns > rec->stats->stack_max_ns)
+		rec->stats->stack_max_ns = urb->stack_ns;
+	total_stack_ns += urb->stack_ns;
+
+	if (urb->expired)
+		;
+	else if (rec->has_c)
+		compare(urb, now);
+	else
+		incomplete++;
+	free_urb(urb);
+}
+
+static int status_from_sim(int res)
+{
+	switch (res) {
+	case SIM_STALL:
+		return -EPIPE;
+	case SIM_TIMEOUT:
+		return sim_sie_attached() ? -EPROTO : -ENODEV;
+	default:
+		return -EPROTO;
+	}
+}
+
+/* Run one transaction for the URB at the head of each queue. Returns
+ * true if any URB made progress. */
+static bool schedule(int64_t now)
+{
+	int ep, dir, res;
+	bool progress = false;
+
+	for (ep = 0; ep < 16; ep++) {
+		for (dir = 0; dir < 2; dir++) {
+			struct urb *urb = queues[ep][dir];
+			const uint8_t *s;
+			uint64_t start;
+			if (!urb)
+				continue;
+
+			/* SET_ADDRESS is the host controller's business. */
+			s = urb->t.setup;
+			if (urb->t.control && s[0] == 0x00 &&
+			    s[1] == 5 /* SET_ADDRESS */) {
+				complete(urb, 0, now);
+				progress = true;
+				continue;
+			}
+
+			if (urb->started < 0)
+				urb->started = now;
+			start = now_ns();
+			res = sim_host_step(&host, &urb->t);
+			urb->stack_ns += now_ns() - start;
+			if (res == SIM_NAK)
+				continue;
+
+			progress = true;
+			if (urb->t.overflow)
+				urb->status = -EOVERFLOW;
+
+			if (res != SIM_ACK)
+				complete(urb, urb->status ? urb->status :
+				         status_from_sim(res), now);
+			else if (urb->t.done)
+				complete(urb, urb->status, now);
+		}
+	}
+
+	return progress;
+}
+
+/* Unlink URBs at the time the capture shows them being unlinked, and
+ * those which have taken too long. URBs still pending at the end of the
+ * capture are dropped once it's over. */
+static void check_deadlines(int64_t now)
+{
+	int ep, dir;
+
+	for (ep = 0; ep < 16; ep++) {
+		for (dir = 0; dir < 2; dir++) {
+			struct urb *urb = queues[ep][dir], *next;
+			for (; urb; urb = next) {
+				const struct usbmon_event *c = &urb->rec->c;
+				next = urb->next;
+				if (!urb->rec->has_c) {
+					if (t_end + timeout_us <= now)
+						complete(urb, -ESHUTDOWN, now);
+				}
+				else if (is_unlink(c->status) &&
+				         c->ts_us - t0 <= now) {
+					complete(urb, -ENOENT, now);
+				}
+				else if (urb->started >= 0 &&
+				         urb->started + c->ts_us -
+				         urb->rec->s.ts_us + timeout_us <= now) {
+					diverged(urb->rec, "no completion "
+					         "after %lld ms",
+					         (long long) timeout_us / 1000);
+					urb->expired = true;
+					complete(urb, -ENOENT, now);
+				}
+			}
+		}
+	}
+}
+
+static bool pending(void)
+{
+	int ep, dir;
+
+	for (ep = 0; ep < 16; ep++) {
+		for (dir = 0; dir < 2; dir++) {
+			if (queues[ep][dir])
+				return true;
+		}
+	}
+	return false;
+}
+
+/* Drop every URB, as when the device goes away. */
+static void flush_queues(int64_t now)
+{
+	int ep, dir;
+
+	for (ep = 0; ep < 16; ep++) {
+		for (dir = 0; dir < 2; dir++) {
+			while (queues[ep][dir])
+				complete(queues[ep][dir], -ESHUTDOWN, now);
+		}
+	}
+}
+
+static int compare_completions(const void *a, const void *b)
+{
+	const struct record *ra = &records[*(const size_t *) a];
+	const struct record *rb = &records[*(const size_t *) b];
+
+	return ra->c.ts_us < rb->c.ts_us ? -1 : ra->c.ts_us > rb->c.ts_us;
+}
+
+/* Order the URBs by their completion in the capture, and find how many
+ * of them each URB has to wait for. */
+static int order_completions(void)
+{
+	size_t i, n = 0;
+
+	by_completion = malloc((num_records + 1) * sizeof(*by_completion));
+	if (!by_completion)
+		return -1;
+	for (i = 0; i < num_records; i++) {
+		if (records[i].has_c)
+			by_completion[n++] = i;
+	}
+	qsort(by_completion, n, sizeof(*by_completion), compare_completions);
+
+	for (i = 0; i < num_records; i++) {
+		size_t lo = 0, hi = n;
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if (records[by_completion[mid]].c.ts_us < records[i].s.ts_us)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		records[i].after = lo;
+	}
+
+	return 0;
+}
+
+/* Whether the URBs which completed before rec was submitted in the
+ * capture have completed in the replay. */
+static bool ready(const struct record *rec)
+{
+	while (num_completed < rec->after &&
+	       records[by_completion[num_completed]].done)
+		num_completed++;
+	return num_completed >= rec->after;
+}
+
+static int submit(struct record *rec, int64_t now)
+{
+	struct urb *urb, **q;
+	const struct usbmon_event *s = &rec->s;
+	uint8_t ep = s->ep & 0x7f;
+	size_t len = s->len;
+
+	urb = calloc(1, sizeof(*urb));
+	if (!urb)
+		return -1;
+	urb->rec = rec;
+	urb->dir = s->ep & 0x80 ? 1 : 0;
+	urb->submitted = now;
+	urb->started = -1;
+
+	if (s->xfer == USBMON_CONTROL) {
+		if (!s->setup_valid) {
+			rec->done = true;
+			free(urb);
+			return 0;
+		}
+		len = s->setup[6] | s->setup[7] << 8;
+		urb->dir = s->setup[0] >> 7;
+	}
+
+	/* OUT data may have been cut short by the capture. */
+	urb->buf = calloc(1, len ? len : 1);
+	if (!urb->buf) {
+		free(urb);
+		return -1;
+	}
+	if (!urb->dir) {
+		memcpy(urb->buf, s->data, MIN(s->data_len, len));
+		if (s->data_len < len)
+			truncated++;
+	}
+
+	if (s->xfer == USBMON_CONTROL)
+		sim_host_control_transfer(&urb->t, s->setup, urb->buf);
+	else
+		sim_host_data_transfer(&urb->t, ep, urb->dir, urb->buf, len);
+
+	q = queue_for(ep, urb->dir);
+	while (*q)
+		q = &(*q)->next;
+	*q = urb;
+	return 0;
+}
+
+/* Read the capture, pairing each submission with its completion. */
+static int load(const char *path, bool mmap_headers)
+{
+	struct usbmon_reader *r;
+	struct usbmon_event ev;
+	size_t *open = NULL, num_open = 0, alloc = 0, i;
+	int res;
+
+	r = usbmon_open(path, mmap_headers);
+	if (!r)
+		return -1;
+
+	while ((res = usbmon_read(r, &ev)) > 0) {
+		struct usbmon_event *copy;
+
+		if (ev.type == 'S') {
+			if (num_records == alloc) {
+				alloc = alloc ? alloc * 2 : 1024;
+				records = realloc(records, alloc * sizeof(*records));
+				open = realloc(open, alloc * sizeof(*open));
+				if (!records || !open)
+					goto nomem;
+			}
+			open[num_open++] = num_records;
+			memset(&records[num_records], 0, sizeof(*records));
+			copy = &records[num_records++].s;
+		}
+		else {
+			/* The most recent submission with the same tag and
+			 * endpoint. */
+			for (i = num_open; i > 0; i--) {
+				struct record *rec = &records[open[i-1]];
+				if (rec->s.id == ev.id && rec->s.ep == ev.ep &&
+				    rec->s.dev == ev.dev && rec->s.bus == ev.bus)
+					break;
+			}
+			if (i == 0)
+				continue;
+			copy = &records[open[i-1]].c;
+			records[open[i-1]].has_c = true;
+			memmove(&open[i-1], &open[i],
+			        (num_open - i) * sizeof(*open));
+			num_open--;
+		}
+
+		*copy = ev;
+		copy->data = malloc(ev.data_len ? ev.data_len : 1);
+		if (!copy->data)
+			goto nomem;
+		memcpy(copy->data, ev.data, ev.data_len);
+	}
+
+	printf("replay: %s: %s capture, %zu URBs\n",
+	       path, usbmon_format(r), num_records);
+	usbmon_close(r);
+	free(open);
+	return res;
+
+nomem:
+	fprintf(stderr, "replay: out of memory\n");
+	usbmon_close(r);
+	free(open);
+	return -1;
+}
+
+struct device {
+	uint16_t bus;
+	uint8_t dev;
+	unsigned int urbs;
+};
+
+static struct device devices[MAX_DEVICES];
+static size_t num_devices;
+
+static bool selected(const struct usbmon_event *s)
+{
+	size_t i;
+
+	for (i = 0; i < num_devices; i++) {
+		if (devices[i].bus == s->bus && devices[i].dev == s->dev)
+			return true;
+	}
+	return false;
+}
+
+static void add_device(uint16_t bus, uint8_t dev)
+{
+	struct usbmon_event s = { .bus = bus, .dev = dev };
+
+	if (!selected(&s) && num_devices < MAX_DEVICES) {
+		devices[num_devices].bus = bus;
+		devices[num_devices++].dev = dev;
+	}
+}
+
+/* Pick the devices to replay: those which the capture shows returning
+ * the simulated device's VID and PID (once for each time it was
+ * enumerated), or failing that, the one with the most URBs. Address 0 is
+ * always enumeration, and address 1 is usually a root hub. */
+static void select_devices(void)
+{
+	struct device busiest = { 0, 0, 0 };
+	size_t i, j;
+
+	for (i = 0; i < num_records; i++) {
+		const struct record *rec = &records[i];
+		const uint8_t *s = rec->s.setup;
+		if (rec->s.dev == 0 || !rec->has_c || rec->c.status != 0 ||
+		    !rec->s.setup_valid || rec->c.data_len < 12)
+			continue;
+		if (s[0] == 0x80 && s[1] == 6 /* GET_DESCRIPTOR */ &&
+		    s[3] == 1 /* DEVICE */ &&
+		    memcmp(rec->c.data + 8, device_desc + 8, 4) == 0)
+			add_device(rec->s.bus, rec->s.dev);
+	}
+	if (num_devices)
+		return;
+
+	for (i = 0; i < num_records; i++) {
+		const struct usbmon_event *s = &records[i].s;
+		struct device *d = NULL;
+		if (s->dev <= 1)
+			continue;
+		for (j = 0; j < num_devices; j++) {
+			if (devices[j].bus == s->bus && devices[j].dev == s->dev)
+				d = &devices[j];
+		}
+		if (!d && num_devices < MAX_DEVICES) {
+			d = &devices[num_devices++];
+			d->bus = s->bus;
+			d->dev = s->dev;
+			d->urbs = 0;
+		}
+		if (d && ++d->urbs > busiest.urbs)
+			busiest = *d;
+	}
+
+	num_devices = 0;
+	if (busiest.urbs) {
+		printf("replay: no device %04x:%04x in the capture; "
+		       "replaying %u-%u\n",
+		       device_desc[8] | device_desc[9] << 8,
+		       device_desc[10] | device_desc[11] << 8,
+		       busiest.bus, busiest.dev);
+		add_device(busiest.bus, busiest.dev);
+	}
+}
+
+/* Whether the device needs to be configured for the replay: it does if
+ * the capture, from record i on, uses an endpoint other than 0 before
+ * setting a configuration. */
+static bool needs_configuration(size_t i)
+{
+	const struct usbmon_event *first = &records[i].s;
+
+	for (; i < num_records; i++) {
+		const struct usbmon_event *s = &records[i].s;
+		if (!selected(s))
+			continue;
+		if (s->bus != first->bus || s->dev != first->dev)
+			return false;
+		if (s->setup_valid && s->setup[0] == 0x00 &&
+		    s->setup[1] == 9 /* SET_CONFIGURATION */)
+			return false;
+		if ((s->ep & 0x7f) != 0)
+			return true;
+	}
+	return false;
+}
+
+/* Bring the simulated device up for the captured device starting at
+ * record i. */
+static int prepare_device(size_t i, int config)
+{
+	if (enumerate() < 0) {
+		fprintf(stderr, "replay: device failed to enumerate\n");
+		return -1;
+	}
+	if (config < 0)
+		config = config_desc[5];
+	if (config && needs_configuration(i) && set_configuration(config) < 0) {
+		fprintf(stderr, "replay: SET_CONFIGURATION(%d) failed\n",
+		        config);
+		return -1;
+	}
+	return 0;
+}
+
+static void print_summary(int64_t replay_us)
+{
+	size_t i;
+
+	printf("%-24s %6s %8s %11s %11s %9s %9s\n", "transfer", "urbs",
+	       "diverged", "capture us", "replay us", "stack us", "stack max");
+	for (i = 0; i < num_categories; i++) {
+		const struct stats *s = &categories[i];
+		if (!s->urbs)
+			continue;
+		printf("%-24s %6u %8u", s->name, s->urbs, s->diverged);
+		if (s->timed)
+			printf(" %11.1f %11.1f", (double) s->capture_us / s->timed,
+			       (double) s->replay_us / s->timed);
+		else
+			printf(" %11s %11s", "-", "-");
+		printf(" %9.2f %9.2f\n", s->stack_ns / 1e3 / s->urbs,
+		       s->stack_max_ns / 1e3);
+	}
+
+	printf("replay: %u divergences", divergences);
+	if (incomplete)
+		printf(", %u URBs not completed in the capture", incomplete);
+	if (truncated)
+		printf(", %u OUT URBs with truncated data (zero filled)",
+		       truncated);
+	printf("\n");
+	printf("replay: %.3f ms in the stack, over %.3f ms of replay\n",
+	       total_stack_ns / 1e6, replay_us / 1e3);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [options] capture\n", prog);
+	fprintf(stderr, "  -d  [bus:]dev  Device in the capture to replay\n");
+	fprintf(stderr, "  -x  speed      Time scale (default 1, 0 to skip idle time)\n");
+	fprintf(stderr, "  -c  config     Configuration to set if the capture doesn't (0 for none)\n");
+	fprintf(stderr, "  -t  ms         Time a URB may run past its capture completion (default 1000)\n");
+	fprintf(stderr, "  -m             Raw binary capture has 64 byte (mmap) headers\n");
+	fprintf(stderr, "  -q             Only print the summary\n");
+}
+
+int main(int argc, char **argv)
+{
+	double speed = 1.0;
+	int config = -1, opt;
+	bool mmap_headers = false;
+	const char *dev_arg = NULL;
+	size_t next = 0, skipped = 0, i;
+	uint16_t cur_bus = 0;
+	int cur_dev = -1;
+	int64_t skip = 0, now = 0, sof = 0;
+	uint64_t start;
+
+	while ((opt = getopt(argc, argv, "d:x:c:t:mqh")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_arg = optarg;
+			break;
+		case 'x':
+			speed = strtod(optarg, NULL);
+			break;
+		case 'c':
+			config = strtol(optarg, NULL, 0);
+			break;
+		case 't':
+			timeout_us = strtoll(optarg, NULL, 0) * 1000;
+			break;
+		case 'm':
+			mmap_headers = true;
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || speed < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (sim_device_power_on() < 0 || enumerate() < 0) {
+		fprintf(stderr, "replay: device failed to enumerate\n");
+		return 1;
+	}
+	if (load(argv[optind], mmap_headers) < 0)
+		return 1;
+
+	if (dev_arg) {
+		unsigned int bus = 0, dev;
+		if (sscanf(dev_arg, "%u:%u", &bus, &dev) == 2)
+			add_device(bus, dev);
+		else if (sscanf(dev_arg, "%u", &dev) == 1) {
+			for (i = 0; i < num_records; i++) {
+				if (records[i].s.dev == dev)
+					add_device(records[i].s.bus, dev);
+			}
+		}
+	}
+	else {
+		select_devices();
+	}
+
+	/* Keep the selected device's URBs, in order. */
+	for (i = 0; i < num_records; i++) {
+		if (!selected(&records[i].s))
+			continue;
+		if (records[i].s.xfer == USBMON_ISO) {
+			skipped++;
+			continue;
+		}
+		records[next] = records[i];
+		records[next].stats = category(&records[next]);
+		next++;
+	}
+	num_records = next;
+	if (skipped)
+		printf("replay: %zu isochronous URBs skipped\n", skipped);
+	if (!num_records) {
+		fprintf(stderr, "replay: no URBs to replay\n");
+		return 1;
+	}
+
+	t0 = records[0].s.ts_us;
+	for (i = 0; i < num_records; i++) {
+		const struct record *rec = &records[i];
+		int64_t t = (rec->has_c ? rec->c.ts_us : rec->s.ts_us) - t0;
+		if (t > t_end)
+			t_end = t;
+	}
+	if (order_completions() < 0) {
+		fprintf(stderr, "replay: out of memory\n");
+		return 1;
+	}
+	next = 0;
+	start = now_ns();
+
+	while (next < num_records || pending()) {
+		int64_t target;
+
+		now = (int64_t) ((now_ns() - start) / 1e3 * (speed ? speed : 1)) +
+		      skip;
+		/* One SOF per frame, dropping frames if the replay has
+		 * fallen behind (as it can waiting for polled firmware). */
+		if (sof + 1000 <= now) {
+			sof = now - now % 1000;
+			sim_sie_sof();
+		}
+
+		/* Submit the URBs which are due. A new address in the
+		 * capture is the device being enumerated again. */
+		while (next < num_records &&
+		       records[next].s.ts_us - t0 <= now &&
+		       ready(&records[next])) {
+			struct record *rec = &records[next];
+			if (rec->s.bus != cur_bus || rec->s.dev != cur_dev) {
+				flush_queues(now);
+				if (prepare_device(next, config) < 0)
+					return 1;
+				cur_bus = rec->s.bus;
+				cur_dev = rec->s.dev;
+			}
+			if (submit(rec, now) < 0) {
+				fprintf(stderr, "replay: out of memory\n");
+				return 1;
+			}
+			next++;
+		}
+
+		check_deadlines(now);
+		if (schedule(now))
+			continue;
+
+		/* Everything was NAK'd or idle. Wait for the next frame or
+		 * the next URB, whichever comes first. */
+		target = sof + 1000;
+		if (!pending()) {
+			if (next == num_records)
+				break;
+			target = records[next].s.ts_us - t0;
+		}
+		else if (next < num_records && ready(&records[next])) {
+			target = MIN(target, records[next].s.ts_us - t0);
+		}
+		if (target <= now)
+			continue;
+
+		/* With -x 0, skip ahead if nothing is pending. URBs which
+		 * are pending wait in real time for the firmware. */
+		if (speed == 0 && !pending()) {
+			skip += target - now;
+		}
+		else {
+			struct timespec ts;
+			int64_t ns = (target - now) * 1000 / (speed ? speed : 1);
+			ts.tv_sec = ns / 1000000000;
+			ts.tv_nsec = ns % 1000000000;
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	print_summary(now);
+	sim_device_power_off();
+	return divergences ? 1 : 0;
+}
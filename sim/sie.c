@@ -0,0 +1,551 @@
+/*
+ *  M-Stack Host Simulation: Virtual SIE
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The Serial Interface Engine (SIE) of the simulated USB peripheral.
+ *
+ * Tokens from the host are handled the way the PIC's SIE handles them:
+ *
+ *  - A token is ignored (no handshake) unless the module is enabled, the
+ *    address matches UADDR, and the endpoint direction is enabled in UEPn.
+ *  - A token to a buffer descriptor (BD) which is not owned by the SIE
+ *    (UOWN clear) is NAK'd, as is every token while UCON.PKTDIS is set.
+ *  - A token to a BD with BSTALL set is STALL'd. STALLIF is set and the
+ *    BD is not changed (UOWN stays set).
+ *  - An OUT whose data PID doesn't match DTS on a BD with DTSEN set is
+ *    ACK'd but otherwise ignored (the host is retrying).
+ *  - On completion, the SIE writes PID and the byte count into the BD,
+ *    clears UOWN, pushes the endpoint and direction onto the 4-deep USTAT
+ *    FIFO, and sets TRNIF. A SETUP also sets UCON.PKTDIS.  Tokens are NAK'd
+ *    while the USTAT FIFO is full.
+ *
+ * Ping-pong buffering is not simulated (UCFG.PPB must be 0).
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <xc.h>
+#include "sim.h"
+
+/* Special Function Registers */
+volatile struct sim_uir_bits    UIRbits;
+volatile union sim_uie          sim_uie;
+volatile uint8_t                UEIR;
+volatile uint8_t                UEIE;
+volatile sim_uep_bits_t         UEPbits[16];
+volatile struct sim_ucon_bits   UCONbits;
+volatile struct sim_ucfg_bits   UCFGbits;
+volatile struct sim_ustat_bits  USTATbits;
+volatile uint8_t                UADDR;
+volatile uint8_t                UFRML;
+volatile uint8_t                UFRMH;
+volatile struct sim_usbint_bits USBINTbits;
+void * volatile                 UBDTP;
+
+/* The firmware's interrupt vector. This is defined by usb.c when it is
+ * built with USB_USE_INTERRUPTS. */
+extern void sim_usb_interrupt(void) __attribute__((weak));
+
+/* Work the simulated MCU has to do once the SIE is idle, such as a reset
+ * which the firmware requested from its interrupt handler. See device.c. */
+extern void sim_device_after_event(void) __attribute__((weak));
+
+/* The SIE's view of a buffer descriptor. This matches struct
+ * buffer_descriptor in usb_hal.h. */
+struct sim_bd {
+	uint8_t stat;
+	uint8_t cnt;
+	void *adr;
+};
+
+#define BD_UOWN   0x80
+#define BD_DTS    0x40
+#define BD_DTSEN  0x08
+#define BD_BSTALL 0x04
+#define BD_PID_MASK 0x3c
+#define BD_BC_MASK  0x03
+
+#define USTAT_FIFO_LEN 4
+
+struct ustat_entry {
+	uint8_t ep;
+	uint8_t dir;
+};
+
+static pthread_mutex_t sie_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t fifo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ustat_entry ustat_fifo[USTAT_FIFO_LEN];
+static uint8_t ustat_count; /* Entries, including the one in USTAT */
+static uint16_t frame_number;
+static void (*service_hook)(void);
+static unsigned int timeout_ms = 2000;
+static bool no_wait;
+static struct sim_sie_stats stats;
+
+static void lock_fifo(int *cancel_state)
+{
+	/* The firmware thread may be cancelled by a reset. Don't let that
+	 * happen while it holds the lock. */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, cancel_state);
+	pthread_mutex_lock(&fifo_lock);
+}
+
+static void unlock_fifo(int cancel_state)
+{
+	pthread_mutex_unlock(&fifo_lock);
+	pthread_setcancelstate(cancel_state, NULL);
+}
+
+/* Load USTAT from the head of the FIFO */
+static void load_ustat(void)
+{
+	USTATbits.ENDP = ustat_fifo[0].ep;
+	USTATbits.DIR = ustat_fifo[0].dir;
+	USTATbits.PPBI = 0;
+	UIRbits.TRNIF = 1;
+}
+
+static bool push_ustat(uint8_t ep, uint8_t dir)
+{
+	int state;
+	bool ret = false;
+
+	lock_fifo(&state);
+	if (ustat_count < USTAT_FIFO_LEN) {
+		ustat_fifo[ustat_count].ep = ep;
+		ustat_fifo[ustat_count].dir = dir;
+		if (ustat_count++ == 0)
+			load_ustat();
+		ret = true;
+	}
+	unlock_fifo(state);
+
+	return ret;
+}
+
+static bool ustat_fifo_full(void)
+{
+	return ustat_count >= USTAT_FIFO_LEN;
+}
+
+void sim_clear_trnif(void)
+{
+	int state;
+
+	lock_fifo(&state);
+	if (UIRbits.TRNIF && ustat_count > 0) {
+		ustat_count--;
+		memmove(ustat_fifo, ustat_fifo + 1,
+		        ustat_count * sizeof(ustat_fifo[0]));
+	}
+	UIRbits.TRNIF = 0;
+
+	/* The next transaction shows up in USTAT right away. */
+	if (ustat_count > 0)
+		load_ustat();
+	unlock_fifo(state);
+}
+
+void sim_clear_uir(void)
+{
+	UIRbits.URSTIF = 0;
+	UIRbits.UERRIF = 0;
+	UIRbits.SOFIF = 0;
+	UIRbits.IDLEIF = 0;
+	UIRbits.RESUMEIF = 0;
+	UIRbits.ATTACHIF = 0;
+	UIRbits.STALLIF = 0;
+	sim_clear_trnif();
+}
+
+void sim_sie_power_on(void)
+{
+	int state;
+
+	pthread_mutex_lock(&sie_lock);
+	memset((void*)&UIRbits, 0, sizeof(UIRbits));
+	sim_uie.reg = 0;
+	UEIR = 0;
+	UEIE = 0;
+	memset((void*)UEPbits, 0, sizeof(UEPbits));
+	memset((void*)&UCONbits, 0, sizeof(UCONbits));
+	memset((void*)&UCFGbits, 0, sizeof(UCFGbits));
+	memset((void*)&USTATbits, 0, sizeof(USTATbits));
+	UADDR = 0;
+	UFRML = 0;
+	UFRMH = 0;
+	memset((void*)&USBINTbits, 0, sizeof(USBINTbits));
+	UBDTP = NULL;
+
+	lock_fifo(&state);
+	ustat_count = 0;
+	unlock_fifo(state);
+	frame_number = 0;
+	pthread_mutex_unlock(&sie_lock);
+}
+
+void sim_sie_set_service_hook(void (*hook)(void))
+{
+	service_hook = hook;
+}
+
+void sim_sie_set_timeout_ms(unsigned int ms)
+{
+	timeout_ms = ms;
+}
+
+void sim_sie_set_no_wait(bool value)
+{
+	no_wait = value;
+}
+
+bool sim_sie_attached(void)
+{
+	return UCONbits.USBEN && UBDTP;
+}
+
+uint16_t sim_sie_frame_number(void)
+{
+	return frame_number;
+}
+
+const struct sim_sie_stats *sim_sie_get_stats(void)
+{
+	return &stats;
+}
+
+void sim_sie_clear_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Interrupt flags which are set, as a bitmap in UIE bit order. UERRIF is
+ * left out since usb.c doesn't service it. */
+static uint8_t pending_flags(void)
+{
+	return (UIRbits.URSTIF   ? 0x01 : 0) |
+	       (UIRbits.SOFIF    ? 0x04 : 0) |
+	       (UIRbits.TRNIF    ? 0x08 : 0) |
+	       (UIRbits.STALLIF  ? 0x80 : 0);
+}
+
+static uint8_t enabled_flags(void)
+{
+	return (UIEbits.URSTIE   ? 0x01 : 0) |
+	       (UIEbits.SOFIE    ? 0x04 : 0) |
+	       (UIEbits.TRNIE    ? 0x08 : 0) |
+	       (UIEbits.STALLIE  ? 0x80 : 0);
+}
+
+/* Let the firmware handle the interrupt flags which the SIE has set.
+ * Called with sie_lock held. */
+static int deliver(void)
+{
+	uint64_t deadline = now_ms() + timeout_ms;
+	unsigned int calls = 0;
+
+	__sync_synchronize();
+
+	while (1) {
+		uint8_t pending = pending_flags();
+
+		if (service_hook) {
+			if (!pending)
+				return 0;
+			if (++calls > USTAT_FIFO_LEN + 4)
+				return SIM_ERROR; /* Flags aren't being cleared */
+			service_hook();
+			continue;
+		}
+
+		if (sim_usb_interrupt) {
+			/* Interrupt-driven firmware. Flags which are not
+			 * enabled stay set until the firmware gets to them. */
+			pending &= enabled_flags();
+			if (!pending || !USBINTbits.USBIE)
+				return 0;
+			if (++calls > USTAT_FIFO_LEN + 4)
+				return SIM_ERROR;
+			USBINTbits.USBIF = 1;
+			stats.interrupts++;
+			sim_usb_interrupt();
+			__sync_synchronize();
+			continue;
+		}
+
+		/* Polled firmware. Wait for its main loop to call
+		 * usb_service(). */
+		if (!pending || no_wait)
+			return 0;
+		if (!UCONbits.USBEN)
+			return 0; /* Reset or detached while waiting */
+		if (now_ms() > deadline)
+			return SIM_ERROR;
+		sched_yield();
+		__sync_synchronize();
+	}
+}
+
+static struct sim_bd *get_bd(uint8_t ep, uint8_t dir)
+{
+	struct sim_bd *bdt = UBDTP;
+	return &bdt[ep * 2 + dir];
+}
+
+static size_t bd_length(const struct sim_bd *bd)
+{
+	return (bd->stat & BD_BC_MASK) << 8 | bd->cnt;
+}
+
+/* Hand a BD back to the CPU after a completed transaction. DTS (bit 6)
+ * is not written by the SIE. */
+static void complete_bd(struct sim_bd *bd, uint8_t pid, size_t len)
+{
+	bd->cnt = len & 0xff;
+	__sync_synchronize();
+	bd->stat = (bd->stat & BD_DTS) | pid << 2 | (len >> 8 & BD_BC_MASK);
+}
+
+/* Check whether a token is for us. Returns 0 if it is, or the result to
+ * give to the host. */
+static int check_token(uint8_t addr, uint8_t ep, uint8_t dir)
+{
+	if (!sim_sie_attached() || addr != UADDR || ep > 15)
+		return SIM_TIMEOUT;
+	if (dir == 0 && !UEPbits[ep].EPOUTEN)
+		return SIM_TIMEOUT;
+	if (dir == 1 && !UEPbits[ep].EPINEN)
+		return SIM_TIMEOUT;
+	if (UEPbits[ep].EPSTALL)
+		return SIM_STALL;
+	if (UCONbits.PKTDIS || ustat_fifo_full())
+		return SIM_NAK;
+
+	return 0;
+}
+
+static int finish(int res)
+{
+	switch (res) {
+	case SIM_ACK:
+		stats.acks++;
+		break;
+	case SIM_NAK:
+		stats.naks++;
+		break;
+	case SIM_STALL:
+		stats.stalls++;
+		break;
+	case SIM_TIMEOUT:
+		stats.timeouts++;
+		break;
+	}
+
+	pthread_mutex_unlock(&sie_lock);
+	if (sim_device_after_event)
+		sim_device_after_event();
+	return res;
+}
+
+static int stall(void)
+{
+	UIRbits.STALLIF = 1;
+	deliver();
+	return SIM_STALL;
+}
+
+int sim_sie_bus_reset(void)
+{
+	int res;
+	int state;
+
+	pthread_mutex_lock(&sie_lock);
+	stats.resets++;
+	if (!UCONbits.USBEN)
+		return finish(SIM_TIMEOUT);
+
+	UADDR = 0;
+	lock_fifo(&state);
+	ustat_count = 0;
+	UIRbits.TRNIF = 0;
+	unlock_fifo(state);
+
+	UIRbits.URSTIF = 1;
+	res = deliver();
+	return finish(res);
+}
+
+int sim_sie_sof(void)
+{
+	int res = SIM_ACK;
+
+	pthread_mutex_lock(&sie_lock);
+	stats.sofs++;
+	frame_number = (frame_number + 1) & 0x7ff;
+	UFRML = frame_number & 0xff;
+	UFRMH = frame_number >> 8;
+
+	if (UCONbits.USBEN) {
+		UIRbits.SOFIF = 1;
+		res = deliver();
+	}
+
+	pthread_mutex_unlock(&sie_lock);
+	if (sim_device_after_event)
+		sim_device_after_event();
+	return res;
+}
+
+void sim_sie_skip_frames(unsigned int count)
+{
+	pthread_mutex_lock(&sie_lock);
+	frame_number = (frame_number + count) & 0x7ff;
+	pthread_mutex_unlock(&sie_lock);
+}
+
+int sim_sie_setup(uint8_t addr, const uint8_t setup[8])
+{
+	struct sim_bd *bd;
+	int res;
+
+	pthread_mutex_lock(&sie_lock);
+	stats.setups++;
+
+	/* SETUP can't be NAK'd on the wire. Where the hardware has nowhere
+	 * to put it, it gives no handshake and the host retries. Here that
+	 * is reported as a NAK, which the host also retries. */
+	res = check_token(addr, 0, 0);
+	if (res == SIM_STALL)
+		res = 0; /* SETUP clears an endpoint stall */
+	if (res)
+		return finish(res);
+	if (UEPbits[0].EPCONDIS)
+		return finish(SIM_TIMEOUT);
+
+	bd = get_bd(0, 0);
+	__sync_synchronize();
+	if (!(bd->stat & BD_UOWN))
+		return finish(SIM_NAK);
+
+	/* A SETUP token clears a stall on the control endpoint. */
+	if (get_bd(0, 1)->stat & BD_BSTALL)
+		get_bd(0, 1)->stat = 0;
+	UEPbits[0].EPSTALL = 0;
+
+	if (bd_length(bd) < 8)
+		return finish(SIM_ERROR);
+
+	memcpy(bd->adr, setup, 8);
+	complete_bd(bd, 0x0d /* PID_SETUP */, 8);
+	UCONbits.PKTDIS = 1;
+	push_ustat(0, 0);
+
+	res = deliver();
+	return finish(res);
+}
+
+int sim_sie_out(uint8_t addr, uint8_t ep, uint8_t data_pid,
+                const uint8_t *data, size_t len)
+{
+	struct sim_bd *bd;
+	int res;
+
+	pthread_mutex_lock(&sie_lock);
+	stats.outs++;
+
+	res = check_token(addr, ep, 0);
+	if (res == SIM_STALL)
+		UIRbits.STALLIF = 1;
+	if (res)
+		return finish(res);
+
+	bd = get_bd(ep, 0);
+	__sync_synchronize();
+	if (!(bd->stat & BD_UOWN))
+		return finish(SIM_NAK);
+	if (bd->stat & BD_BSTALL)
+		return finish(stall());
+
+	/* Data toggle mismatch. ACK and drop. */
+	if ((bd->stat & BD_DTSEN) && !!(bd->stat & BD_DTS) != !!data_pid)
+		return finish(SIM_ACK);
+
+	if (len > bd_length(bd)) {
+		UIRbits.UERRIF = 1;
+		return finish(SIM_ERROR);
+	}
+
+	if (len)
+		memcpy(bd->adr, data, len);
+	complete_bd(bd, 0x01 /* PID_OUT */, len);
+	push_ustat(ep, 0);
+
+	res = deliver();
+	return finish(res);
+}
+
+int sim_sie_in(uint8_t addr, uint8_t ep, uint8_t *buf, size_t max_len,
+               size_t *len, uint8_t *data_pid)
+{
+	struct sim_bd *bd;
+	size_t bd_len;
+	int res;
+
+	pthread_mutex_lock(&sie_lock);
+	stats.ins++;
+	*len = 0;
+
+	res = check_token(addr, ep, 1);
+	if (res == SIM_STALL)
+		UIRbits.STALLIF = 1;
+	if (res)
+		return finish(res);
+
+	bd = get_bd(ep, 1);
+	__sync_synchronize();
+	if (!(bd->stat & BD_UOWN))
+		return finish(SIM_NAK);
+	if (bd->stat & BD_BSTALL)
+		return finish(stall());
+
+	bd_len = bd_length(bd);
+	if (bd_len > max_len) {
+		/* Babble */
+		return finish(SIM_ERROR);
+	}
+
+	if (bd_len)
+		memcpy(buf, bd->adr, bd_len);
+	*len = bd_len;
+	*data_pid = !!(bd->stat & BD_DTS);
+	complete_bd(bd, 0x09 /* PID_IN */, bd_len);
+	push_ustat(ep, 1);
+
+	res = deliver();
+	return finish(res);
+}
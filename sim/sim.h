@@ -0,0 +1,145 @@
+/*
+ *  M-Stack Host Simulation
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This is the host-side interface to the simulated device: the virtual
+ * SIE (sie.c), which takes tokens from the bus and moves them through the
+ * firmware's Buffer Descriptor Table the way the hardware does, the
+ * program memory model (flash.c), and the simulated MCU which runs the
+ * firmware (device.c).
+ *
+ * The firmware side (usb.c and the application) sees only the SFRs
+ * declared in sim/include/xc.h.
+ */
+
+#ifndef SIM_H__
+#define SIM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Result of a transaction, from the point of view of the host. */
+enum sim_result {
+	SIM_ACK = 0,
+	SIM_NAK = -1,
+	SIM_STALL = -2,
+	SIM_TIMEOUT = -3, /* No handshake: no device, or device not addressed */
+	SIM_ERROR = -4,   /* Babble, buffer overrun, or the firmware hung */
+};
+
+struct sim_sie_stats {
+	uint32_t setups;
+	uint32_t ins;
+	uint32_t outs;
+	uint32_t acks;
+	uint32_t naks;
+	uint32_t stalls;
+	uint32_t timeouts;
+	uint32_t sofs;
+	uint32_t resets;
+	uint32_t interrupts; /* Calls to the firmware's interrupt vector */
+};
+
+/* Virtual SIE
+ *
+ * Each function below runs one bus event to completion, including the
+ * firmware's handling of it: the interrupt vector is called (for
+ * firmware built with USB_USE_INTERRUPTS), the service hook is called,
+ * or the caller waits for the firmware's main loop to service the
+ * interrupt flags (polled firmware running in device.c).
+ *
+ * data_pid is 0 for DATA0 and 1 for DATA1.
+ */
+int sim_sie_bus_reset(void);
+int sim_sie_sof(void);
+int sim_sie_setup(uint8_t addr, const uint8_t setup[8]);
+int sim_sie_out(uint8_t addr, uint8_t ep, uint8_t data_pid,
+                const uint8_t *data, size_t len);
+int sim_sie_in(uint8_t addr, uint8_t ep, uint8_t *buf, size_t max_len,
+               size_t *len, uint8_t *data_pid);
+
+/* Let count frames pass without their SOFs reaching the firmware, as
+ * if it had been too busy to service them. The next sim_sie_sof()
+ * latches a frame number past the gap. */
+void sim_sie_skip_frames(unsigned int count);
+
+/* Put the SIE and all SFRs in their power-on state. */
+void sim_sie_power_on(void);
+
+/* Service hook. If set, it is called after each bus event until the
+ * interrupt flags are clear. Set it to usb_service() to run usb.c
+ * without a firmware main loop. */
+void sim_sie_set_service_hook(void (*hook)(void));
+
+/* Maximum time to wait for polled firmware to service an event. */
+void sim_sie_set_timeout_ms(unsigned int ms);
+
+/* Don't wait for polled firmware at all. The interrupt flags stay set,
+ * as on the hardware, until the caller next runs usb_service(). For
+ * callers which run the firmware's main loop themselves. */
+void sim_sie_set_no_wait(bool no_wait);
+
+bool sim_sie_attached(void);
+uint16_t sim_sie_frame_number(void);
+const struct sim_sie_stats *sim_sie_get_stats(void);
+void sim_sie_clear_stats(void);
+
+
+/* Program Memory
+ *
+ * Addresses are program counter (word) addresses, as used by the
+ * firmware. Each instruction is 24 bits wide and occupies two addresses.
+ * Busy time is the time the real part would have spent with NVMCON.WR
+ * set.
+ */
+struct sim_flash_stats {
+	uint32_t page_erases;
+	uint32_t row_writes;
+	uint32_t busy_us;
+};
+
+void sim_flash_erase_chip(void);
+uint32_t sim_flash_read(uint32_t address);
+void sim_flash_write(uint32_t address, uint32_t instruction);
+const struct sim_flash_stats *sim_flash_get_stats(void);
+void sim_flash_clear_stats(void);
+
+
+/* Simulated MCU
+ *
+ * sim_device_power_on() runs the firmware's main() (compiled with
+ * -Dmain=firmware_main) in its own thread, as after a power-on reset, and
+ * returns when the USB module has been enabled.  If the firmware resets
+ * itself (asm("reset")), it is run again with RCON.POR and RCON.BOR
+ * clear.  If it jumps to the application (sim_goto()), the device detaches
+ * from the bus, since there is no application in the simulation.
+ * sim_device_app_reset() stands in for the application resetting the
+ * device, and runs the firmware again as for asm("reset").
+ *
+ * bootloader_mailbox is the word of RAM which the bootloader's linker
+ * script reserves for the application to ask for the bootloader (see
+ * apps/bootloader/firmware/bootloader_mailbox.h). It's cleared at
+ * power-on, and kept over resets.
+ */
+int sim_device_power_on(void);
+void sim_device_power_off(void);
+int sim_device_app_reset(void);
+unsigned int sim_device_reset_count(void);
+uint32_t sim_device_app_address(void); /* 0 if not jumped to application */
+extern volatile uint32_t bootloader_mailbox;
+
+#endif /* SIM_H__ */
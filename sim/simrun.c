@@ -0,0 +1,417 @@
+/*
+ *  M-Stack Host Simulation: Script Runner
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Run scripted bus traffic against the simulated device.
+ *
+ * Each script starts with the device freshly powered on. Lines are one
+ * command each, with numbers in C notation and data as hex bytes. A data
+ * byte can be repeated with '*', as in "ff*64". '#' starts a comment.
+ *
+ *   power-on                    Power cycle the device
+ *   app-reset <mailbox>         The application sets bootloader_mailbox
+ *                               and resets the device
+ *   reset                       Bus reset
+ *   sof [count]                 Start of Frame(s)
+ *   skip-frames <count>         Frames whose SOFs the firmware misses
+ *   setup <8 bytes>             SETUP transaction
+ *   out <ep> <0|1> [data]       OUT transaction with DATA0 or DATA1
+ *   in <ep> [max_len]           IN transaction
+ *   control <bmRequestType> <bRequest> <wValue> <wIndex> <wLength> [data]
+ *                               Control transfer
+ *   bulk-out <ep> [data]        Bulk OUT transfer
+ *   bulk-in <ep> <len>          Bulk IN transfer
+ *   expect <data>               Data from the last IN must match
+ *   expect-length <n>           Length of the last transfer
+ *   expect-result <result>      Result of the last command: ack, nak,
+ *                               stall, timeout, or error
+ *   expect-flash <addr> <instruction...>
+ *                               Contents of program memory
+ *   expect-app <addr>           The firmware jumped to the application
+ *   expect-resets <n>           Number of software resets
+ *
+ * A failed control or bulk transfer is an error unless the next command
+ * is expect-result.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "sim.h"
+#include "host.h"
+
+#define MAX_DATA 4096
+
+static const char *results[] = {
+	"ack", "nak", "stall", "timeout", "error",
+};
+
+static struct sim_host host;
+static uint8_t data[MAX_DATA];
+static int data_len;
+static int last_result;
+static bool unchecked;
+static bool verbose;
+
+static const char *result_str(int res)
+{
+	if (res <= 0 && -res < (int) (sizeof(results) / sizeof(results[0])))
+		return results[-res];
+	return "ack";
+}
+
+static bool get_num(char **s, unsigned long *val)
+{
+	char *tok = strtok_r(NULL, " \t\r\n", s);
+	char *end;
+
+	if (!tok)
+		return false;
+	*val = strtoul(tok, &end, 0);
+	return *end == '\0';
+}
+
+/* Parse the rest of the line as hex bytes. Returns the number of bytes,
+ * or -1 on error. */
+static int get_data(char **s, uint8_t *buf, size_t max)
+{
+	char *tok;
+	size_t len = 0;
+
+	while ((tok = strtok_r(NULL, " \t\r\n", s))) {
+		unsigned long byte, count = 1;
+		char *end;
+
+		byte = strtoul(tok, &end, 16);
+		if (*end == '*')
+			count = strtoul(end + 1, &end, 0);
+		if (*end != '\0' || byte > 0xff || len + count > max)
+			return -1;
+		while (count--)
+			buf[len++] = byte;
+	}
+
+	return len;
+}
+
+static void print_data(const char *prefix, const uint8_t *buf, int len)
+{
+	int i;
+
+	fprintf(stderr, "%s", prefix);
+	for (i = 0; i < len; i++)
+		fprintf(stderr, "%s%02hhx", (i % 16 == 0 && i) ? "\n\t" : " ", buf[i]);
+	fprintf(stderr, "\n");
+}
+
+/* The firmware resets or jumps to the application on its own thread.
+ * Give it a moment to get there. */
+static void wait_for(uint32_t (*get)(void), uint32_t val)
+{
+	struct timespec ts = { 0, 1000000 };
+	int i;
+
+	for (i = 0; i < 1000 && get() != val; i++)
+		nanosleep(&ts, NULL);
+}
+
+static uint32_t reset_count(void)
+{
+	return sim_device_reset_count();
+}
+
+/* After a software reset from the polled firmware's own thread, the reset
+ * is counted before main() has run usb_init() again (or jumped to the
+ * application). */
+static uint32_t restarted(void)
+{
+	return sim_sie_attached() || sim_device_app_address();
+}
+
+static uint32_t flash_address;
+
+static uint32_t flash_at_address(void)
+{
+	return sim_flash_read(flash_address);
+}
+
+static void set_result(int res)
+{
+	last_result = res;
+	unchecked = (res < 0);
+	if (res >= 0)
+		data_len = res;
+}
+
+/* Returns an error message, or NULL on success. */
+static const char *run_command(char *line)
+{
+	static char msg[256];
+	uint8_t out[MAX_DATA];
+	unsigned long a, b, c, d, e;
+	char *s;
+	char *cmd = strtok_r(line, " \t\r\n", &s);
+	int len;
+
+	if (!cmd || cmd[0] == '#')
+		return NULL;
+
+	if (unchecked && strcmp(cmd, "expect-result") != 0) {
+		snprintf(msg, sizeof(msg), "previous command failed: %s",
+		         result_str(last_result));
+		return msg;
+	}
+
+	if (strcmp(cmd, "power-on") == 0) {
+		/* Starting the application instead of USB is fine;
+		 * expect-app checks for it. */
+		if (sim_device_power_on() < 0 && !sim_device_app_address())
+			return "device failed to start";
+		sim_host_init(&host);
+	}
+	else if (strcmp(cmd, "app-reset") == 0) {
+		/* The application puts mailbox in bootloader_mailbox and
+		 * resets the device. */
+		if (!get_num(&s, &a))
+			return "usage: app-reset <mailbox>";
+		if (!sim_device_app_address())
+			return "the application isn't running";
+		bootloader_mailbox = a;
+		if (sim_device_app_reset() < 0 && !sim_device_app_address())
+			return "device failed to start";
+		sim_host_init(&host);
+	}
+	else if (strcmp(cmd, "reset") == 0) {
+		set_result(sim_host_bus_reset(&host));
+		unchecked = false;
+	}
+	else if (strcmp(cmd, "sof") == 0) {
+		if (!get_num(&s, &a))
+			a = 1;
+		while (a--)
+			sim_sie_sof();
+	}
+	else if (strcmp(cmd, "skip-frames") == 0) {
+		if (!get_num(&s, &a))
+			return "usage: skip-frames <count>";
+		sim_sie_skip_frames(a);
+	}
+	else if (strcmp(cmd, "setup") == 0) {
+		if (get_data(&s, out, sizeof(out)) != 8)
+			return "setup needs 8 bytes";
+		set_result(sim_sie_setup(host.addr, out));
+		unchecked = false;
+	}
+	else if (strcmp(cmd, "out") == 0) {
+		if (!get_num(&s, &a) || !get_num(&s, &b))
+			return "usage: out <ep> <pid> [data]";
+		len = get_data(&s, out, sizeof(out));
+		if (len < 0)
+			return "bad data";
+		set_result(sim_sie_out(host.addr, a, b, out, len));
+		unchecked = false;
+	}
+	else if (strcmp(cmd, "in") == 0) {
+		size_t in_len;
+		uint8_t pid;
+		if (!get_num(&s, &a))
+			return "usage: in <ep> [max_len]";
+		if (!get_num(&s, &b))
+			b = 1023;
+		last_result = sim_sie_in(host.addr, a, data, b, &in_len, &pid);
+		data_len = in_len;
+	}
+	else if (strcmp(cmd, "control") == 0) {
+		if (!get_num(&s, &a) || !get_num(&s, &b) || !get_num(&s, &c) ||
+		    !get_num(&s, &d) || !get_num(&s, &e) || e > MAX_DATA)
+			return "usage: control <bmRequestType> <bRequest> <wValue> <wIndex> <wLength> [data]";
+		if (a & 0x80) {
+			set_result(sim_host_control(&host, a, b, c, d, data, e));
+		}
+		else {
+			len = get_data(&s, out, sizeof(out));
+			if (len < 0 || len != e)
+				return "data must be wLength bytes";
+			set_result(sim_host_control(&host, a, b, c, d, out, e));
+		}
+
+		/* Pick up the endpoint sizes from the configuration. */
+		if (last_result > 0 && a == 0x80 && b == 6 && c >> 8 == 2)
+			sim_host_parse_config(&host, data, last_result);
+	}
+	else if (strcmp(cmd, "bulk-out") == 0) {
+		if (!get_num(&s, &a))
+			return "usage: bulk-out <ep> [data]";
+		len = get_data(&s, out, sizeof(out));
+		if (len < 0)
+			return "bad data";
+		set_result(sim_host_out(&host, a, out, len));
+	}
+	else if (strcmp(cmd, "bulk-in") == 0) {
+		if (!get_num(&s, &a) || !get_num(&s, &b) || b > MAX_DATA)
+			return "usage: bulk-in <ep> <len>";
+		set_result(sim_host_in(&host, a, data, b));
+	}
+	else if (strcmp(cmd, "expect") == 0) {
+		len = get_data(&s, out, sizeof(out));
+		if (len < 0)
+			return "bad data";
+		if (len != data_len || memcmp(out, data, len) != 0) {
+			print_data("expected:", out, len);
+			print_data("got:     ", data, data_len);
+			return "data mismatch";
+		}
+	}
+	else if (strcmp(cmd, "expect-length") == 0) {
+		if (!get_num(&s, &a))
+			return "usage: expect-length <n>";
+		if (data_len != a) {
+			snprintf(msg, sizeof(msg), "expected length %lu, got %d",
+			         a, data_len);
+			return msg;
+		}
+	}
+	else if (strcmp(cmd, "expect-result") == 0) {
+		char *tok = strtok_r(NULL, " \t\r\n", &s);
+		if (!tok)
+			return "usage: expect-result <result>";
+		if (strcmp(tok, result_str(last_result)) != 0) {
+			snprintf(msg, sizeof(msg), "expected %s, got %s",
+			         tok, result_str(last_result));
+			return msg;
+		}
+		unchecked = false;
+	}
+	else if (strcmp(cmd, "expect-flash") == 0) {
+		if (!get_num(&s, &a))
+			return "usage: expect-flash <addr> <instruction...>";
+		while (get_num(&s, &b)) {
+			/* Rows are programmed by the firmware's main loop,
+			 * after the transfer which sent them. */
+			flash_address = a;
+			wait_for(flash_at_address, b);
+			if (sim_flash_read(a) != b) {
+				snprintf(msg, sizeof(msg),
+				         "flash at 0x%lx: expected 0x%06lx, got 0x%06x",
+				         a, b, sim_flash_read(a));
+				return msg;
+			}
+			a += 2;
+		}
+	}
+	else if (strcmp(cmd, "expect-app") == 0) {
+		if (!get_num(&s, &a))
+			return "usage: expect-app <addr>";
+		wait_for(sim_device_app_address, a);
+		if (sim_device_app_address() != a) {
+			snprintf(msg, sizeof(msg), "expected jump to 0x%lx, got 0x%x",
+			         a, sim_device_app_address());
+			return msg;
+		}
+	}
+	else if (strcmp(cmd, "expect-resets") == 0) {
+		if (!get_num(&s, &a))
+			return "usage: expect-resets <n>";
+		wait_for(reset_count, a);
+		wait_for(restarted, 1);
+		if (sim_device_reset_count() != a) {
+			snprintf(msg, sizeof(msg), "expected %lu resets, got %u",
+			         a, sim_device_reset_count());
+			return msg;
+		}
+	}
+	else {
+		return "unknown command";
+	}
+
+	return NULL;
+}
+
+static int run_script(const char *filename)
+{
+	char line[8192];
+	unsigned int lineno = 0;
+	const char *err = NULL;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		perror(filename);
+		return -1;
+	}
+
+	unchecked = false;
+	data_len = 0;
+	sim_flash_erase_chip();
+	if (sim_device_power_on() < 0) {
+		fprintf(stderr, "%s: device failed to start\n", filename);
+		fclose(fp);
+		return -1;
+	}
+	sim_host_init(&host);
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		if (verbose)
+			fprintf(stderr, "%s:%u: %s", filename, lineno, line);
+		err = run_command(line);
+		if (err)
+			break;
+	}
+
+	if (!err && unchecked)
+		err = "last command failed";
+
+	fclose(fp);
+	sim_device_power_off();
+
+	if (err) {
+		fprintf(stderr, "%s:%u: %s\n", filename, lineno, err);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int i, failed = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-v") == 0) {
+			verbose = true;
+			continue;
+		}
+
+		if (run_script(argv[i]) < 0) {
+			printf("FAIL: %s\n", argv[i]);
+			failed++;
+		}
+		else {
+			printf("PASS: %s\n", argv[i]);
+		}
+	}
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s [-v] script...\n", argv[0]);
+		return 1;
+	}
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,712 @@
+/*
+ *  M-Stack Host Simulation: USB/IP Server
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Export the simulated device over USB/IP, so that any USB/IP client can
+ * attach to it. With the Linux vhci-hcd driver loaded, for example:
+ *
+ *   ./unit_test_usbip &
+ *   usbip attach -r 127.0.0.1 -b 1-1
+ *
+ * The server is the device's host controller. URBs are queued per
+ * endpoint and run one transaction at a time, round-robin across the
+ * endpoints, so a NAK'd endpoint doesn't hold up the others and a client
+ * can keep several URBs outstanding on each endpoint. An SOF is sent for
+ * every millisecond of wall time while a client is attached.
+ *
+ * One client is served at a time. SET_ADDRESS is handled by the server,
+ * and a port reset from the client is a bus reset. If the firmware resets
+ * itself or leaves the bus, the connection is closed, as usbip-host does
+ * when its device is unplugged. Isochronous URBs are not supported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "sim.h"
+#include "host.h"
+
+#define MIN(X,Y) ((X)<(Y)?(X):(Y))
+
+#define USBIP_VERSION    0x0111
+#define OP_REQ_DEVLIST   0x8005
+#define OP_REP_DEVLIST   0x0005
+#define OP_REQ_IMPORT    0x8003
+#define OP_REP_IMPORT    0x0003
+
+#define USBIP_CMD_SUBMIT 1
+#define USBIP_CMD_UNLINK 2
+#define USBIP_RET_SUBMIT 3
+#define USBIP_RET_UNLINK 4
+
+#define USBIP_HEADER_LEN 48
+#define USBIP_DEVICE_LEN 312
+#define USBIP_ISO_DESC_LEN 16
+
+#define URB_SHORT_NOT_OK 0x0001
+#define URB_ZERO_PACKET  0x0040
+
+#define BUSID "1-1"
+#define BUSNUM 1
+#define DEVICE_ADDRESS 1
+#define USB_SPEED_FULL 2
+
+#define MAX_TRANSFER (1024 * 1024)
+#define MAX_CONFIG_LEN 1024
+#define MAX_INTERFACES 32
+
+struct urb {
+	struct urb *next;
+	uint32_t seqnum;
+	uint8_t dir;          /* 0=OUT, 1=IN, from the command */
+	uint32_t flags;
+	uint8_t *buf;
+	struct sim_transfer t;
+	int status;           /* Set when failing for a non-bus reason */
+};
+
+static struct sim_host host;
+static uint8_t device_desc[18];
+static uint8_t config_desc[MAX_CONFIG_LEN];
+static size_t config_len;
+static unsigned int enumerated_resets;
+
+/* URB queues, by endpoint and direction. Control transfers in either
+ * direction are queued on [0][0]. */
+static struct urb *queues[16][2];
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	v = htons(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return ntohs(v);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return ntohl(v);
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t res;
+
+	while (len) {
+		res = read(fd, p, len);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -1;
+		p += res;
+		len -= res;
+	}
+
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t res;
+
+	while (len) {
+		res = write(fd, p, len);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -1;
+		p += res;
+		len -= res;
+	}
+
+	return 0;
+}
+
+/* Send a reply and its data together, so the client gets them in one
+ * segment. */
+static int writev_all(int fd, struct iovec *iov, int count)
+{
+	ssize_t res;
+
+	while (count) {
+		res = writev(fd, iov, count);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -1;
+		while (count && (size_t) res >= iov->iov_len) {
+			res -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count) {
+			iov->iov_base = (uint8_t *) iov->iov_base + res;
+			iov->iov_len -= res;
+		}
+	}
+
+	return 0;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Reset the device, give it its address, and read its descriptors. */
+static int enumerate(void)
+{
+	int res;
+
+	enumerated_resets = sim_device_reset_count();
+	sim_host_init(&host);
+
+	res = sim_host_bus_reset(&host);
+	if (res == SIM_ACK)
+		res = sim_host_control(&host, 0x80, 6 /* GET_DESCRIPTOR */,
+		                       0x0100 /* DEVICE */, 0, device_desc, 8);
+	if (res >= 0)
+		res = sim_host_control(&host, 0x00, 5 /* SET_ADDRESS */,
+		                       DEVICE_ADDRESS, 0, NULL, 0);
+	if (res >= 0)
+		res = sim_host_control(&host, 0x80, 6 /* GET_DESCRIPTOR */,
+		                       0x0100 /* DEVICE */, 0,
+		                       device_desc, sizeof(device_desc));
+	if (res >= 0 && res != sizeof(device_desc))
+		return -1;
+	if (res >= 0)
+		res = sim_host_control(&host, 0x80, 6 /* GET_DESCRIPTOR */,
+		                       0x0200 /* CONFIGURATION */, 0,
+		                       config_desc, 9);
+	if (res == 9)
+		res = sim_host_control(&host, 0x80, 6 /* GET_DESCRIPTOR */,
+		                       0x0200 /* CONFIGURATION */, 0, config_desc,
+		                       MIN(config_desc[2] | config_desc[3] << 8,
+		                           sizeof(config_desc)));
+	if (res < 9)
+		return -1;
+
+	config_len = res;
+	sim_host_parse_config(&host, config_desc, config_len);
+	return 0;
+}
+
+/* Fill in a struct usbip_usb_device. Returns its length. */
+static size_t put_device(uint8_t *p)
+{
+	memset(p, 0, USBIP_DEVICE_LEN);
+	snprintf((char *) p, 256, "/sys/devices/mstack/usb%d/%s", BUSNUM, BUSID);
+	snprintf((char *) p + 256, 32, "%s", BUSID);
+	put32(p + 288, BUSNUM);
+	put32(p + 292, DEVICE_ADDRESS);
+	put32(p + 296, USB_SPEED_FULL);
+	put16(p + 300, device_desc[8] | device_desc[9] << 8);
+	put16(p + 302, device_desc[10] | device_desc[11] << 8);
+	put16(p + 304, device_desc[12] | device_desc[13] << 8);
+	p[306] = device_desc[4];  /* bDeviceClass */
+	p[307] = device_desc[5];  /* bDeviceSubClass */
+	p[308] = device_desc[6];  /* bDeviceProtocol */
+	p[309] = 0;               /* bConfigurationValue */
+	p[310] = device_desc[17]; /* bNumConfigurations */
+	p[311] = config_desc[4];  /* bNumInterfaces */
+
+	return USBIP_DEVICE_LEN;
+}
+
+/* Fill in the struct usbip_usb_interface list. Returns its length. */
+static size_t put_interfaces(uint8_t *p)
+{
+	size_t pos = 0, len = 0;
+
+	while (pos + 2 <= config_len && config_desc[pos] >= 2 &&
+	       len < MAX_INTERFACES * 4) {
+		/* Interface descriptor, alternate setting 0 */
+		if (config_desc[pos+1] == 4 && pos + 9 <= config_len &&
+		    config_desc[pos+3] == 0) {
+			p[len++] = config_desc[pos+5]; /* bInterfaceClass */
+			p[len++] = config_desc[pos+6]; /* bInterfaceSubClass */
+			p[len++] = config_desc[pos+7]; /* bInterfaceProtocol */
+			p[len++] = 0;
+		}
+		pos += config_desc[pos];
+	}
+
+	return len;
+}
+
+static int status_from_sim(int res)
+{
+	switch (res) {
+	case SIM_STALL:
+		return -EPIPE;
+	case SIM_TIMEOUT:
+		return sim_sie_attached() ? -EPROTO : -ENODEV;
+	default:
+		return -EPROTO;
+	}
+}
+
+static int send_ret_submit(int fd, struct urb *urb)
+{
+	uint8_t hdr[USBIP_HEADER_LEN];
+	struct iovec iov[2];
+
+	memset(hdr, 0, sizeof(hdr));
+	put32(hdr + 0, USBIP_RET_SUBMIT);
+	put32(hdr + 4, urb->seqnum);
+	put32(hdr + 20, urb->status);
+	put32(hdr + 24, urb->t.actual);
+	put32(hdr + 28, sim_sie_frame_number());
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = urb->buf;
+	iov[1].iov_len = urb->dir ? urb->t.actual : 0;
+	return writev_all(fd, iov, 2);
+}
+
+static void free_urb(struct urb *urb)
+{
+	free(urb->buf);
+	free(urb);
+}
+
+static struct urb **queue_for(uint8_t ep, uint8_t dir)
+{
+	return &queues[ep][ep ? dir : 0];
+}
+
+/* Finish the URB at the head of its queue and send it back. */
+static int complete(int fd, struct urb *urb, int status)
+{
+	struct urb **q = queue_for(urb->t.ep, urb->dir);
+	const uint8_t *s = urb->t.setup;
+	uint16_t wValue = s[2] | s[3] << 8;
+	uint16_t wIndex = s[4] | s[5] << 8;
+	int res;
+
+	*q = urb->next;
+	urb->status = status;
+
+	/* Standard requests which reset the data toggles. */
+	if (urb->t.control && status == 0) {
+		if (s[0] == 0x00 && s[1] == 9 /* SET_CONFIGURATION */)
+			memset(host.toggle, 0, sizeof(host.toggle));
+		else if (s[0] == 0x02 && s[1] == 1 /* CLEAR_FEATURE */ &&
+		         wValue == 0 /* ENDPOINT_HALT */)
+			host.toggle[wIndex & 0xf][wIndex >> 7 & 1] = 0;
+	}
+
+	res = send_ret_submit(fd, urb);
+	free_urb(urb);
+	return res;
+}
+
+/* Requests which the host controller or hub handles without passing them
+ * to the device. Returns true if the URB was one of them. */
+static bool local_request(struct urb *urb)
+{
+	const uint8_t *s = urb->t.setup;
+
+	if (!urb->t.control || urb->t.stage != SIM_STAGE_SETUP)
+		return false;
+
+	if (s[0] == 0x00 && s[1] == 5 /* SET_ADDRESS */) {
+		urb->t.done = true;
+		return true;
+	}
+
+	if (s[0] == 0x23 && s[1] == 3 /* SET_FEATURE */ &&
+	    s[2] == 4 /* PORT_RESET */) {
+		if (enumerate() < 0)
+			urb->status = -EPROTO;
+		urb->t.done = true;
+		return true;
+	}
+
+	return false;
+}
+
+/* Run one transaction for the URB at the head of each queue. Returns 1
+ * if any URB made progress, 0 if all were NAK'd or idle, and -1 if the
+ * connection failed. */
+static int schedule(int fd)
+{
+	int ep, dir, res, progress = 0;
+
+	for (ep = 0; ep < 16; ep++) {
+		for (dir = 0; dir < 2; dir++) {
+			struct urb *urb = queues[ep][dir];
+			if (!urb)
+				continue;
+
+			if (local_request(urb))
+				res = SIM_ACK;
+			else
+				res = sim_host_step(&host, &urb->t);
+			if (res == SIM_NAK)
+				continue;
+
+			progress = 1;
+			if (urb->t.overflow)
+				urb->status = -EOVERFLOW;
+			if (urb->t.done && urb->t.actual < urb->t.len &&
+			    (urb->flags & URB_SHORT_NOT_OK) && !urb->t.control)
+				urb->status = -EREMOTEIO;
+
+			if (res != SIM_ACK)
+				res = complete(fd, urb, urb->status ?
+				               urb->status : status_from_sim(res));
+			else if (urb->t.done)
+				res = complete(fd, urb, urb->status);
+			else
+				res = 0;
+			if (res < 0)
+				return -1;
+		}
+	}
+
+	return progress;
+}
+
+static int submit(int fd, const uint8_t *hdr)
+{
+	struct urb *urb, **q;
+	uint32_t ep = get32(hdr + 16);
+	uint32_t len = get32(hdr + 24);
+	uint32_t np = get32(hdr + 32);
+
+	if (len > MAX_TRANSFER || ep > 15)
+		return -1;
+
+	urb = calloc(1, sizeof(*urb));
+	if (!urb)
+		return -1;
+	urb->seqnum = get32(hdr + 4);
+	urb->dir = get32(hdr + 12) ? 1 : 0;
+	urb->flags = get32(hdr + 20);
+	urb->buf = malloc(len ? len : 1);
+	if (!urb->buf) {
+		free(urb);
+		return -1;
+	}
+
+	if (!urb->dir && read_all(fd, urb->buf, len) < 0)
+		goto fail;
+
+	/* Isochronous: skip the packet descriptors and fail the URB. */
+	if (np != 0 && np != 0xffffffff) {
+		uint8_t desc[USBIP_ISO_DESC_LEN];
+		while (np--) {
+			if (read_all(fd, desc, sizeof(desc)) < 0)
+				goto fail;
+		}
+		urb->status = -EINVAL;
+		urb->dir = 0;
+		if (send_ret_submit(fd, urb) < 0)
+			goto fail;
+		free_urb(urb);
+		return 0;
+	}
+
+	if (ep == 0) {
+		sim_host_control_transfer(&urb->t, hdr + 40, urb->buf);
+		urb->t.len = MIN(urb->t.len, len);
+	}
+	else {
+		sim_host_data_transfer(&urb->t, ep, urb->dir, urb->buf, len);
+		urb->t.zero_packet = urb->flags & URB_ZERO_PACKET;
+	}
+
+	q = queue_for(ep, urb->dir);
+	while (*q)
+		q = &(*q)->next;
+	*q = urb;
+	return 0;
+
+fail:
+	free_urb(urb);
+	return -1;
+}
+
+static int unlink_urb(int fd, const uint8_t *hdr)
+{
+	uint8_t ret[USBIP_HEADER_LEN];
+	uint32_t seqnum = get32(hdr + 20);
+	int ep, dir, status = 0;
+
+	for (ep = 0; ep < 16; ep++) {
+		for (dir = 0; dir < 2; dir++) {
+			struct urb **q = &queues[ep][dir];
+			while (*q && (*q)->seqnum != seqnum)
+				q = &(*q)->next;
+			if (*q) {
+				struct urb *urb = *q;
+				*q = urb->next;
+				free_urb(urb);
+				status = -ECONNRESET;
+			}
+		}
+	}
+
+	memset(ret, 0, sizeof(ret));
+	put32(ret + 0, USBIP_RET_UNLINK);
+	put32(ret + 4, get32(hdr + 4));
+	put32(ret + 20, status);
+	return write_all(fd, ret, sizeof(ret));
+}
+
+static int read_command(int fd)
+{
+	uint8_t hdr[USBIP_HEADER_LEN];
+
+	if (read_all(fd, hdr, sizeof(hdr)) < 0)
+		return -1;
+
+	switch (get32(hdr)) {
+	case USBIP_CMD_SUBMIT:
+		return submit(fd, hdr);
+	case USBIP_CMD_UNLINK:
+		return unlink_urb(fd, hdr);
+	default:
+		fprintf(stderr, "usbip: unknown command %u\n", get32(hdr));
+		return -1;
+	}
+}
+
+static void flush_queues(void)
+{
+	int ep, dir;
+
+	for (ep = 0; ep < 16; ep++) {
+		for (dir = 0; dir < 2; dir++) {
+			while (queues[ep][dir]) {
+				struct urb *urb = queues[ep][dir];
+				queues[ep][dir] = urb->next;
+				free_urb(urb);
+			}
+		}
+	}
+}
+
+/* Handle URBs for an imported device until the client disconnects or
+ * the device leaves the bus. */
+static void run_urbs(int fd)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	uint64_t last_sof = now_ms();
+	int busy = 0;
+
+	while (sim_sie_attached() &&
+	       sim_device_reset_count() == enumerated_resets) {
+		uint64_t now = now_ms();
+		if (now != last_sof) {
+			last_sof = now;
+			sim_sie_sof();
+		}
+
+		/* When every endpoint was NAK'd, wait for the next frame. */
+		if (poll(&pfd, 1, busy ? 0 : 1) < 0 && errno != EINTR)
+			break;
+		if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+			break;
+		if ((pfd.revents & POLLIN) && read_command(fd) < 0)
+			break;
+
+		busy = schedule(fd);
+		if (busy < 0)
+			break;
+	}
+
+	flush_queues();
+}
+
+/* Handle one client connection. Returns true if a device was imported. */
+static bool serve(int fd)
+{
+	uint8_t req[8], busid[32];
+	uint8_t rep[8 + 4 + USBIP_DEVICE_LEN + 4 * MAX_INTERFACES];
+	size_t len;
+	uint16_t code;
+
+	if (read_all(fd, req, sizeof(req)) < 0)
+		return false;
+	code = get16(req + 2);
+
+	put16(rep, USBIP_VERSION);
+	put32(rep + 4, 0);
+
+	if (code == OP_REQ_DEVLIST) {
+		put16(rep + 2, OP_REP_DEVLIST);
+		put32(rep + 8, 1);
+		len = 12;
+		len += put_device(rep + len);
+		len += put_interfaces(rep + len);
+		write_all(fd, rep, len);
+		return false;
+	}
+	else if (code == OP_REQ_IMPORT) {
+		if (read_all(fd, busid, sizeof(busid)) < 0)
+			return false;
+		busid[sizeof(busid) - 1] = '\0';
+
+		put16(rep + 2, OP_REP_IMPORT);
+		if (strcmp((char *) busid, BUSID) != 0 || enumerate() < 0) {
+			put32(rep + 4, 1);
+			write_all(fd, rep, 8);
+			return false;
+		}
+
+		len = 8;
+		len += put_device(rep + len);
+		if (write_all(fd, rep, len) < 0)
+			return false;
+
+		run_urbs(fd);
+		return true;
+	}
+
+	fprintf(stderr, "usbip: unknown operation 0x%04hx\n", code);
+	return false;
+}
+
+static int listen_on(const char *addr, unsigned short port)
+{
+	struct sockaddr_in sa;
+	socklen_t sa_len = sizeof(sa);
+	int fd, one = 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	if (inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
+		fprintf(stderr, "usbip: bad address %s\n", addr);
+		return -1;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0 ||
+	    listen(fd, 1) < 0 ||
+	    getsockname(fd, (struct sockaddr *) &sa, &sa_len) < 0) {
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+
+	printf("usbip: listening on %s port %hu\n", addr, ntohs(sa.sin_port));
+	fflush(stdout);
+	return fd;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-a address] [-p port] [-1]\n", prog);
+	fprintf(stderr, "  -a  Address to listen on (default 127.0.0.1)\n");
+	fprintf(stderr, "  -p  TCP port (default 3240, 0 to pick one)\n");
+	fprintf(stderr, "  -1  Exit when the first imported device is released\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *addr = "127.0.0.1";
+	unsigned short port = 3240;
+	bool once = false;
+	int opt, listen_fd;
+
+	while ((opt = getopt(argc, argv, "a:p:1h")) != -1) {
+		switch (opt) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			port = strtoul(optarg, NULL, 0);
+			break;
+		case '1':
+			once = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (sim_device_power_on() < 0 || enumerate() < 0) {
+		fprintf(stderr, "usbip: device failed to enumerate\n");
+		return 1;
+	}
+
+	listen_fd = listen_on(addr, port);
+	if (listen_fd < 0)
+		return 1;
+
+	while (1) {
+		int one = 1;
+		bool imported;
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			return 1;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		imported = serve(fd);
+		close(fd);
+		if (imported && once)
+			break;
+	}
+
+	close(listen_fd);
+	sim_device_power_off();
+	return 0;
+}
@@ -0,0 +1,426 @@
+/*
+ *  M-Stack Host Simulation: USB/IP Test Client
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Test the USB/IP server with the unit_test firmware. The server is
+ * started as a child process:
+ *
+ *   ./usbip_test [-n iterations] "./unit_test_usbip -p 0 -1"
+ *
+ * The device is listed and imported, then URBs are submitted the way
+ * vhci-hcd submits them: several at once, across endpoints, with some
+ * unlinked before they complete. Each iteration keeps two bulk INs, two
+ * bulk OUTs and a control transfer in flight together.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define USBIP_VERSION    0x0111
+#define OP_REQ_DEVLIST   0x8005
+#define OP_REQ_IMPORT    0x8003
+
+#define USBIP_CMD_SUBMIT 1
+#define USBIP_CMD_UNLINK 2
+#define USBIP_RET_SUBMIT 3
+#define USBIP_RET_UNLINK 4
+
+#define USBIP_HEADER_LEN 48
+#define USBIP_DEVICE_LEN 312
+
+#define VID 0xa0a0
+#define PID 0x0001
+
+#define MAX_PENDING 8
+
+struct reply {
+	uint32_t command;
+	uint32_t seqnum;
+	int32_t status;
+	int32_t actual;
+	uint8_t data[1024];
+};
+
+static unsigned short port;
+static uint32_t next_seqnum = 1;
+static uint8_t urb_is_in[65536]; /* By seqnum, so IN data can be read */
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	v = htons(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return ntohs(v);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return ntohl(v);
+}
+
+static void fail(const char *msg)
+{
+	fprintf(stderr, "usbip_test: %s\n", msg);
+	exit(1);
+}
+
+static void read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t res;
+
+	while (len) {
+		res = read(fd, p, len);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			fail("connection closed");
+		p += res;
+		len -= res;
+	}
+}
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+	if (write(fd, buf, len) != (ssize_t) len)
+		fail("write failed");
+}
+
+static int connect_server(void)
+{
+	struct sockaddr_in sa;
+	int fd, one = 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+		fail("unable to connect");
+
+	/* As the usbip tools do, so that URBs aren't held back while
+	 * earlier ones are unacknowledged. */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static void send_op(int fd, uint16_t code)
+{
+	uint8_t req[8];
+
+	put16(req, USBIP_VERSION);
+	put16(req + 2, code);
+	put32(req + 4, 0);
+	write_all(fd, req, sizeof(req));
+}
+
+static void check_device(const uint8_t *dev)
+{
+	if (strcmp((const char *) dev + 256, "1-1") != 0)
+		fail("wrong busid");
+	if (get16(dev + 300) != VID || get16(dev + 302) != PID)
+		fail("wrong VID/PID");
+}
+
+static void list_devices(void)
+{
+	uint8_t rep[12], dev[USBIP_DEVICE_LEN], intf[4];
+	int fd = connect_server();
+	int i;
+
+	send_op(fd, OP_REQ_DEVLIST);
+	read_all(fd, rep, sizeof(rep));
+	if (get32(rep + 4) != 0 || get32(rep + 8) != 1)
+		fail("expected one device");
+	read_all(fd, dev, sizeof(dev));
+	check_device(dev);
+	for (i = 0; i < dev[311]; i++)
+		read_all(fd, intf, sizeof(intf));
+	close(fd);
+}
+
+static int import_device(void)
+{
+	uint8_t busid[32], rep[8], dev[USBIP_DEVICE_LEN];
+	int fd = connect_server();
+
+	send_op(fd, OP_REQ_IMPORT);
+	memset(busid, 0, sizeof(busid));
+	strcpy((char *) busid, "1-1");
+	write_all(fd, busid, sizeof(busid));
+	read_all(fd, rep, sizeof(rep));
+	if (get32(rep + 4) != 0)
+		fail("import failed");
+	read_all(fd, dev, sizeof(dev));
+	check_device(dev);
+	return fd;
+}
+
+/* Submit a URB. ep has the direction in bit 7, as in an endpoint
+ * address. Returns the sequence number. */
+static uint32_t submit(int fd, uint8_t ep, const uint8_t *setup,
+                       const uint8_t *data, uint32_t len)
+{
+	uint8_t hdr[USBIP_HEADER_LEN + 1024];
+	uint32_t seqnum = next_seqnum++;
+	int in = (ep & 0x80) || (setup && (setup[0] & 0x80));
+
+	urb_is_in[seqnum & 0xffff] = in;
+
+	if (!in && len > sizeof(hdr) - USBIP_HEADER_LEN)
+		fail("OUT data too long");
+
+	memset(hdr, 0, USBIP_HEADER_LEN);
+	put32(hdr + 0, USBIP_CMD_SUBMIT);
+	put32(hdr + 4, seqnum);
+	put32(hdr + 8, 1 << 16 | 1);
+	put32(hdr + 12, in);
+	put32(hdr + 16, ep & 0xf);
+	put32(hdr + 24, len);
+	if (setup)
+		memcpy(hdr + 40, setup, 8);
+
+	/* One write for the whole PDU, as vhci-hcd does. */
+	if (!in && len)
+		memcpy(hdr + USBIP_HEADER_LEN, data, len);
+	write_all(fd, hdr, USBIP_HEADER_LEN + (in ? 0 : len));
+	return seqnum;
+}
+
+static uint32_t unlink_urb(int fd, uint32_t seqnum)
+{
+	uint8_t hdr[USBIP_HEADER_LEN];
+	uint32_t unlink_seqnum = next_seqnum++;
+
+	memset(hdr, 0, sizeof(hdr));
+	put32(hdr + 0, USBIP_CMD_UNLINK);
+	put32(hdr + 4, unlink_seqnum);
+	put32(hdr + 20, seqnum);
+	write_all(fd, hdr, sizeof(hdr));
+	return unlink_seqnum;
+}
+
+/* Read replies until the one for seqnum arrives. Replies for other URBs
+ * are kept in pending[] for later calls. */
+static struct reply pending[MAX_PENDING];
+static int num_pending;
+
+static void wait_reply(int fd, uint32_t seqnum, struct reply *r)
+{
+	uint8_t hdr[USBIP_HEADER_LEN];
+	int i;
+
+	for (i = 0; i < num_pending; i++) {
+		if (pending[i].seqnum == seqnum) {
+			*r = pending[i];
+			pending[i] = pending[--num_pending];
+			return;
+		}
+	}
+
+	while (1) {
+		struct reply *p;
+
+		read_all(fd, hdr, sizeof(hdr));
+		if (num_pending >= MAX_PENDING)
+			fail("too many replies");
+		p = &pending[num_pending];
+		p->command = get32(hdr);
+		p->seqnum = get32(hdr + 4);
+		p->status = get32(hdr + 20);
+		p->actual = 0;
+		if (p->command == USBIP_RET_SUBMIT) {
+			p->actual = get32(hdr + 24);
+			if (p->actual < 0 || p->actual > (int) sizeof(p->data))
+				fail("bad actual_length");
+			if (urb_is_in[p->seqnum & 0xffff])
+				read_all(fd, p->data, p->actual);
+		}
+		else if (p->command != USBIP_RET_UNLINK) {
+			fail("unknown reply");
+		}
+
+		if (p->seqnum == seqnum) {
+			*r = *p;
+			return;
+		}
+		num_pending++;
+	}
+}
+
+static void expect(int fd, uint32_t seqnum, int32_t status,
+                   const uint8_t *data, int32_t len, const char *what)
+{
+	struct reply r;
+
+	wait_reply(fd, seqnum, &r);
+	if (r.status != status) {
+		fprintf(stderr, "usbip_test: %s: status %d, expected %d\n",
+		        what, r.status, status);
+		exit(1);
+	}
+	if (data && (r.actual != len || memcmp(r.data, data, len) != 0)) {
+		fprintf(stderr, "usbip_test: %s: wrong data (%d bytes)\n",
+		        what, r.actual);
+		exit(1);
+	}
+}
+
+static void setup_packet(uint8_t *s, uint8_t bmRequestType, uint8_t bRequest,
+                         uint16_t wValue, uint16_t wIndex, uint16_t wLength)
+{
+	s[0] = bmRequestType;
+	s[1] = bRequest;
+	s[2] = wValue & 0xff;
+	s[3] = wValue >> 8;
+	s[4] = wIndex & 0xff;
+	s[5] = wIndex >> 8;
+	s[6] = wLength & 0xff;
+	s[7] = wLength >> 8;
+}
+
+static FILE *start_server(const char *cmd)
+{
+	char line[256];
+	FILE *fp = popen(cmd, "r");
+
+	if (!fp)
+		fail("unable to start server");
+	if (!fgets(line, sizeof(line), fp) ||
+	    sscanf(line, "usbip: listening on %*s port %hu", &port) != 1)
+		fail("server didn't start");
+	return fp;
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t setup[8], buf[512], expected[512];
+	uint32_t a, b, c, d, e;
+	struct reply r;
+	struct timespec t0, t1;
+	int iterations = 10;
+	int fd, i, opt;
+	FILE *server;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] server-command\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-n iterations] server-command\n", argv[0]);
+		return 1;
+	}
+
+	server = start_server(argv[optind]);
+
+	list_devices();
+	fd = import_device();
+
+	/* Enumeration, as far as the client does it. */
+	setup_packet(setup, 0x80, 6, 0x0100, 0, 64);
+	a = submit(fd, 0x80, setup, NULL, 64);
+	wait_reply(fd, a, &r);
+	if (r.status != 0 || r.actual != 18 ||
+	    (r.data[8] | r.data[9] << 8) != VID ||
+	    (r.data[10] | r.data[11] << 8) != PID)
+		fail("GET_DESCRIPTOR(DEVICE)");
+
+	setup_packet(setup, 0x00, 9, 1, 0, 0);
+	a = submit(fd, 0, setup, NULL, 0);
+	expect(fd, a, 0, NULL, 0, "SET_CONFIGURATION");
+
+	for (i = 0; i < (int) sizeof(expected); i++)
+		expected[i] = sizeof(expected) - i;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < iterations; i++) {
+		/* Two INs queued before the OUTs they echo, and a control
+		 * transfer alongside. */
+		a = submit(fd, 0x81, NULL, NULL, 64);
+		b = submit(fd, 0x81, NULL, NULL, 64);
+		memset(buf, i, 64);
+		buf[0] = 1; buf[1] = 2; buf[2] = 3; buf[3] = 4;
+		c = submit(fd, 0x01, NULL, buf, 4);
+		d = submit(fd, 0x01, NULL, buf, 64);
+		setup_packet(setup, 0xc3, 245, 0, 0, 512);
+		e = submit(fd, 0x80, setup, NULL, 512);
+
+		expect(fd, c, 0, NULL, 0, "bulk OUT");
+		expect(fd, d, 0, NULL, 0, "bulk OUT");
+		expect(fd, a, 0, buf, 4, "bulk IN");
+		expect(fd, b, 0, buf, 64, "bulk IN");
+		expect(fd, e, 0, expected, 512, "control IN");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	/* A bulk IN with nothing to send is NAK'd until it's unlinked. */
+	a = submit(fd, 0x81, NULL, NULL, 64);
+	b = unlink_urb(fd, a);
+	expect(fd, b, -ECONNRESET, NULL, 0, "unlink");
+
+	/* Unlinking a URB which has completed succeeds with status 0. */
+	setup_packet(setup, 0x00, 9, 1, 0, 0);
+	a = submit(fd, 0, setup, NULL, 0);
+	expect(fd, a, 0, NULL, 0, "SET_CONFIGURATION");
+	b = unlink_urb(fd, a);
+	expect(fd, b, 0, NULL, 0, "late unlink");
+
+	/* An unknown request is STALL'd, and the next one works. */
+	setup_packet(setup, 0xc0, 200, 0, 0, 8);
+	a = submit(fd, 0x80, setup, NULL, 8);
+	expect(fd, a, -EPIPE, NULL, 0, "unknown request");
+	setup_packet(setup, 0x80, 6, 0x0200, 0, 9);
+	a = submit(fd, 0x80, setup, NULL, 9);
+	expect(fd, a, 0, NULL, 0, "GET_DESCRIPTOR(CONFIGURATION)");
+
+	close(fd);
+	if (pclose(server) != 0)
+		fail("server failed");
+
+	printf("usbip_test: %d iterations, %.1f us each\n", iterations,
+	       ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) /
+	       1e3 / (iterations ? iterations : 1));
+	return 0;
+}
@@ -0,0 +1,693 @@
+/*
+ *  M-Stack Host Simulation: usbmon Captures
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The formats are described in the kernel's Documentation/usb/usbmon.rst
+ * and, for pcap and pcapng, at tcpdump.org and in the pcapng draft. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include "usbmon.h"
+
+#define MIN(X,Y) ((X)<(Y)?(X):(Y))
+
+#define MON_HDR_LEN 48
+#define MON_MMAP_HDR_LEN 64
+#define ISO_DESC_LEN 16
+
+#define LINKTYPE_USB_LINUX 189
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_BYTE_ORDER 0x1a2b3c4d
+#define PCAPNG_IDB 1
+#define PCAPNG_EPB 6
+
+#define MAX_INTERFACES 32
+#define MAX_RECORD (16 * 1024 * 1024)
+
+/* The text format's timestamps count microseconds modulo 4096 seconds. */
+#define TEXT_TS_WRAP 4096000000LL
+
+enum format {
+	FORMAT_TEXT,
+	FORMAT_BINARY,
+	FORMAT_PCAP,
+	FORMAT_PCAPNG,
+};
+
+struct usbmon_reader {
+	FILE *fp;
+	const char *path;
+	enum format format;
+	bool swap;             /* pcap(ng) written on the other byte order */
+	size_t hdr_len;        /* Binary and pcap: usbmon header length */
+
+	/* pcapng interfaces: header length for each, 0 if not usbmon */
+	size_t if_hdr_len[MAX_INTERFACES];
+	unsigned int num_interfaces;
+
+	/* Text */
+	char *line;
+	size_t line_size;
+	unsigned long line_num;
+	int64_t ts_prev;
+	int64_t ts_offset;
+
+	uint8_t *buf;
+	size_t buf_size;
+};
+
+struct usbmon_writer {
+	FILE *fp;
+	bool pcap;
+};
+
+static uint16_t swap16(uint16_t v)
+{
+	return v >> 8 | v << 8;
+}
+
+static uint32_t swap32(uint32_t v)
+{
+	return (uint32_t) swap16(v) << 16 | swap16(v >> 16);
+}
+
+/* Fields of pcap(ng) framing, in the capture's byte order. */
+static uint16_t get16(const struct usbmon_reader *r, const uint8_t *p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return r->swap ? swap16(v) : v;
+}
+
+static uint32_t get32(const struct usbmon_reader *r, const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return r->swap ? swap32(v) : v;
+}
+
+static int64_t get64(const struct usbmon_reader *r, const uint8_t *p)
+{
+	uint64_t lo = get32(r, p), hi = get32(r, p + 4);
+	return r->swap ? (int64_t) (lo << 32 | hi) : (int64_t) (hi << 32 | lo);
+}
+
+static bool grow(struct usbmon_reader *r, size_t len)
+{
+	uint8_t *buf;
+
+	if (len <= r->buf_size)
+		return true;
+	buf = realloc(r->buf, len);
+	if (!buf)
+		return false;
+	r->buf = buf;
+	r->buf_size = len;
+	return true;
+}
+
+static bool read_bytes(struct usbmon_reader *r, void *buf, size_t len)
+{
+	return fread(buf, 1, len, r->fp) == len;
+}
+
+static int bad(struct usbmon_reader *r, const char *what)
+{
+	if (r->format == FORMAT_TEXT)
+		fprintf(stderr, "%s:%lu: %s\n", r->path, r->line_num, what);
+	else
+		fprintf(stderr, "%s: %s at offset %ld\n",
+		        r->path, what, ftell(r->fp));
+	return -1;
+}
+
+/* Decode a usbmon binary header (struct mon_bin_hdr, with the rest of a
+ * struct mon_bin_mmap_hdr when hdr_len is 64) and its data, from len
+ * bytes at p. Binary headers are in the capturing machine's byte order,
+ * which is taken to be the same as the pcap framing's. */
+static int decode_binary(struct usbmon_reader *r, uint8_t *p, size_t len,
+                         size_t hdr_len, struct usbmon_event *ev)
+{
+	uint32_t len_cap, ndesc = 0;
+	size_t skip = hdr_len;
+
+	if (len < hdr_len)
+		return bad(r, "truncated usbmon header");
+
+	memset(ev, 0, sizeof(*ev));
+	ev->id = (uint64_t) get64(r, p + 0);
+	ev->type = p[8];
+	ev->xfer = p[9];
+	ev->ep = p[10];
+	ev->dev = p[11];
+	ev->bus = get16(r, p + 12);
+	ev->ts_us = get64(r, p + 16) * 1000000 + (int32_t) get32(r, p + 24);
+	ev->status = (int32_t) get32(r, p + 28);
+	ev->len = get32(r, p + 32);
+	len_cap = get32(r, p + 36);
+	if (p[14] == 0) {
+		ev->setup_valid = true;
+		memcpy(ev->setup, p + 40, 8);
+	}
+
+	if (ev->type != 'S' && ev->type != 'C' && ev->type != 'E')
+		return bad(r, "bad event type");
+	if (ev->xfer > USBMON_BULK)
+		return bad(r, "bad transfer type");
+
+	/* Isochronous descriptors come between the header and the data. */
+	if (hdr_len == MON_MMAP_HDR_LEN && ev->xfer == USBMON_ISO)
+		ndesc = get32(r, p + 60);
+	if (ndesc > (len - hdr_len) / ISO_DESC_LEN)
+		return bad(r, "truncated isochronous descriptors");
+	skip += ndesc * ISO_DESC_LEN;
+
+	ev->data = p + skip;
+	ev->data_len = p[15] == 0 ? MIN(len_cap, len - skip) : 0;
+	return 1;
+}
+
+static int read_binary(struct usbmon_reader *r, struct usbmon_event *ev)
+{
+	uint32_t len_cap, ndesc = 0;
+	size_t len;
+	int c;
+
+	c = getc(r->fp);
+	if (c == EOF)
+		return 0;
+	ungetc(c, r->fp);
+
+	if (!grow(r, r->hdr_len) || !read_bytes(r, r->buf, r->hdr_len))
+		return bad(r, "truncated usbmon header");
+
+	len_cap = get32(r, r->buf + 36);
+	if (r->hdr_len == MON_MMAP_HDR_LEN && r->buf[9] == USBMON_ISO)
+		ndesc = get32(r, r->buf + 60);
+	if (len_cap > MAX_RECORD || ndesc > MAX_RECORD / ISO_DESC_LEN)
+		return bad(r, "bad usbmon header");
+
+	len = r->hdr_len + ndesc * ISO_DESC_LEN + len_cap;
+	if (!grow(r, len) ||
+	    !read_bytes(r, r->buf + r->hdr_len, len - r->hdr_len))
+		return bad(r, "truncated data");
+
+	return decode_binary(r, r->buf, len, r->hdr_len, ev);
+}
+
+static int read_pcap(struct usbmon_reader *r, struct usbmon_event *ev)
+{
+	uint8_t rec[16];
+	uint32_t incl_len;
+	size_t n;
+
+	n = fread(rec, 1, sizeof(rec), r->fp);
+	if (n == 0)
+		return 0;
+	if (n != sizeof(rec))
+		return bad(r, "truncated record");
+
+	incl_len = get32(r, rec + 8);
+	if (incl_len > MAX_RECORD || !grow(r, incl_len) ||
+	    !read_bytes(r, r->buf, incl_len))
+		return bad(r, "truncated record");
+
+	return decode_binary(r, r->buf, incl_len, r->hdr_len, ev);
+}
+
+static int read_pcapng(struct usbmon_reader *r, struct usbmon_event *ev)
+{
+	uint8_t hdr[8];
+	uint32_t type, len;
+	size_t n;
+
+	while (1) {
+		n = fread(hdr, 1, sizeof(hdr), r->fp);
+		if (n == 0)
+			return 0;
+		if (n != sizeof(hdr))
+			return bad(r, "truncated block");
+
+		/* A section header can change the byte order. */
+		type = get32(r, hdr);
+		if (type == PCAPNG_SHB) {
+			uint8_t bom[4];
+			if (!read_bytes(r, bom, sizeof(bom)))
+				return bad(r, "truncated section header");
+			r->swap = false;
+			if (get32(r, bom) != PCAPNG_BYTE_ORDER)
+				r->swap = true;
+			if (get32(r, bom) != PCAPNG_BYTE_ORDER)
+				return bad(r, "bad section header");
+			r->num_interfaces = 0;
+			len = get32(r, hdr + 4);
+			if (len < 12 || len > MAX_RECORD || len % 4)
+				return bad(r, "bad block length");
+			if (fseek(r->fp, len - 12, SEEK_CUR) < 0)
+				return bad(r, "truncated section header");
+			continue;
+		}
+
+		len = get32(r, hdr + 4);
+		if (len < 12 || len > MAX_RECORD || len % 4)
+			return bad(r, "bad block length");
+		if (!grow(r, len - 8) || !read_bytes(r, r->buf, len - 8))
+			return bad(r, "truncated block");
+
+		if (type == PCAPNG_IDB) {
+			uint16_t linktype = get16(r, r->buf);
+			size_t hdr_len = 0;
+			if (linktype == LINKTYPE_USB_LINUX)
+				hdr_len = MON_HDR_LEN;
+			else if (linktype == LINKTYPE_USB_LINUX_MMAPPED)
+				hdr_len = MON_MMAP_HDR_LEN;
+			if (r->num_interfaces < MAX_INTERFACES)
+				r->if_hdr_len[r->num_interfaces++] = hdr_len;
+		}
+		else if (type == PCAPNG_EPB && len >= 32) {
+			uint32_t iface = get32(r, r->buf);
+			uint32_t cap_len = get32(r, r->buf + 12);
+			if (iface >= r->num_interfaces)
+				return bad(r, "packet for an unknown interface");
+			if (cap_len > len - 32)
+				return bad(r, "bad packet length");
+
+			/* Packets from other link types are skipped. The
+			 * usbmon header has the timestamp, so there's no
+			 * need for the block's. */
+			if (r->if_hdr_len[iface])
+				return decode_binary(r, r->buf + 20, cap_len,
+				                     r->if_hdr_len[iface], ev);
+		}
+	}
+}
+
+/* Parse hex digits into bytes. Returns the number of bytes, or -1. */
+static int parse_hex(const char *s, uint8_t *out, size_t max)
+{
+	size_t n = 0;
+
+	while (isxdigit((unsigned char) s[0]) && isxdigit((unsigned char) s[1])) {
+		unsigned int v;
+		if (n >= max)
+			return -1;
+		sscanf(s, "%2x", &v);
+		out[n++] = v;
+		s += 2;
+	}
+
+	return *s ? -1 : (int) n;
+}
+
+static int read_text(struct usbmon_reader *r, struct usbmon_event *ev)
+{
+	char *tok, *save, *end, addr[32];
+	unsigned long long tag, ts;
+	unsigned int a, b, c;
+	char type, xfer, dir;
+	ssize_t n;
+	int fields, pos;
+
+	do {
+		n = getline(&r->line, &r->line_size, r->fp);
+		if (n < 0)
+			return 0;
+		r->line_num++;
+		while (n && isspace((unsigned char) r->line[n-1]))
+			r->line[--n] = '\0';
+	} while (n == 0 || r->line[0] == '#');
+
+	memset(ev, 0, sizeof(*ev));
+	if (sscanf(r->line, "%llx %llu %c %31s %n",
+	           &tag, &ts, &type, addr, &pos) != 4)
+		return bad(r, "bad event");
+	if (type != 'S' && type != 'C' && type != 'E')
+		return bad(r, "bad event type");
+
+	/* Address: URB type and direction, then bus:dev:ep, or dev:ep in
+	 * the older 't' format. */
+	fields = sscanf(addr, "%c%c:%u:%u:%u", &xfer, &dir, &a, &b, &c);
+	if (fields == 5) {
+		ev->bus = a;
+		ev->dev = b;
+		ev->ep = c;
+	}
+	else if (fields == 4) {
+		ev->dev = a;
+		ev->ep = b;
+	}
+	else {
+		return bad(r, "bad address");
+	}
+
+	switch (xfer) {
+	case 'Z': ev->xfer = USBMON_ISO; break;
+	case 'I': ev->xfer = USBMON_INTERRUPT; break;
+	case 'C': ev->xfer = USBMON_CONTROL; break;
+	case 'B': ev->xfer = USBMON_BULK; break;
+	default: return bad(r, "bad transfer type");
+	}
+	if (dir == 'i')
+		ev->ep |= 0x80;
+	else if (dir != 'o')
+		return bad(r, "bad direction");
+
+	ev->id = tag;
+	ev->type = type;
+
+	/* The timestamp wraps; captures are taken to have no gaps of more
+	 * than half the wrap. */
+	if ((int64_t) ts + TEXT_TS_WRAP / 2 < r->ts_prev)
+		r->ts_offset += TEXT_TS_WRAP;
+	r->ts_prev = ts;
+	ev->ts_us = ts + r->ts_offset;
+
+	/* Setup packet or status */
+	tok = strtok_r(r->line + pos, " ", &save);
+	if (!tok)
+		return bad(r, "missing status");
+	if (strcmp(tok, "s") == 0) {
+		unsigned int v[5];
+		int i;
+		for (i = 0; i < 5; i++) {
+			tok = strtok_r(NULL, " ", &save);
+			if (!tok)
+				return bad(r, "truncated setup packet");
+			v[i] = strtoul(tok, &end, 16);
+			if (*end)
+				return bad(r, "bad setup packet");
+		}
+		ev->setup_valid = true;
+		ev->setup[0] = v[0];
+		ev->setup[1] = v[1];
+		ev->setup[2] = v[2];
+		ev->setup[3] = v[2] >> 8;
+		ev->setup[4] = v[3];
+		ev->setup[5] = v[3] >> 8;
+		ev->setup[6] = v[4];
+		ev->setup[7] = v[4] >> 8;
+		ev->status = -EINPROGRESS;
+	}
+	else {
+		/* Interrupt and isochronous add :interval and more. */
+		ev->status = strtol(tok, &end, 10);
+		if (end == tok || (*end && *end != ':'))
+			return bad(r, "bad status");
+	}
+
+	/* Isochronous events have descriptors here, which aren't
+	 * supported; keep only what's needed to report them. */
+	if (ev->xfer == USBMON_ISO)
+		return 1;
+
+	tok = strtok_r(NULL, " ", &save);
+	if (!tok)
+		return bad(r, "missing length");
+	ev->len = strtoul(tok, &end, 10);
+	if (*end)
+		return bad(r, "bad length");
+
+	/* Data tag: '=' and data words, or a character saying why there's
+	 * no data. */
+	tok = strtok_r(NULL, " ", &save);
+	if (!tok || strcmp(tok, "=") != 0)
+		return 1;
+
+	if (!grow(r, ev->len))
+		return bad(r, "out of memory");
+	ev->data = r->buf;
+	while ((tok = strtok_r(NULL, " ", &save))) {
+		int len = parse_hex(tok, r->buf + ev->data_len,
+		                    ev->len - ev->data_len);
+		if (len < 0)
+			return bad(r, "bad data");
+		ev->data_len += len;
+	}
+
+	return 1;
+}
+
+static bool is_text(const uint8_t *p, size_t len)
+{
+	while (len--) {
+		if (!isprint(*p) && !isspace(*p))
+			return false;
+		p++;
+	}
+	return true;
+}
+
+struct usbmon_reader *usbmon_open(const char *path, bool mmap_headers)
+{
+	struct usbmon_reader *r;
+	uint8_t magic[24];
+	size_t n;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->path = path;
+	r->fp = fopen(path, "rb");
+	if (!r->fp) {
+		perror(path);
+		free(r);
+		return NULL;
+	}
+
+	n = fread(magic, 1, sizeof(magic), r->fp);
+	rewind(r->fp);
+
+	if (n >= 4 && (get32(r, magic) == PCAPNG_SHB)) {
+		r->format = FORMAT_PCAPNG;
+	}
+	else if (n == sizeof(magic) &&
+	         (get32(r, magic) == PCAP_MAGIC ||
+	          get32(r, magic) == PCAP_MAGIC_NS ||
+	          swap32(get32(r, magic)) == PCAP_MAGIC ||
+	          swap32(get32(r, magic)) == PCAP_MAGIC_NS)) {
+		uint32_t linktype;
+
+		r->format = FORMAT_PCAP;
+		r->swap = get32(r, magic) != PCAP_MAGIC &&
+		          get32(r, magic) != PCAP_MAGIC_NS;
+		linktype = get32(r, magic + 20) & 0xffff;
+		if (linktype == LINKTYPE_USB_LINUX)
+			r->hdr_len = MON_HDR_LEN;
+		else if (linktype == LINKTYPE_USB_LINUX_MMAPPED)
+			r->hdr_len = MON_MMAP_HDR_LEN;
+		else {
+			fprintf(stderr, "%s: link type %u is not usbmon\n",
+			        path, linktype);
+			usbmon_close(r);
+			return NULL;
+		}
+		fseek(r->fp, sizeof(magic), SEEK_SET);
+	}
+	else if (n > 0 && is_text(magic, n)) {
+		r->format = FORMAT_TEXT;
+	}
+	else if (n > 0) {
+		/* The binary interface has no file header. Check that the
+		 * first event looks like one. */
+		r->format = FORMAT_BINARY;
+		r->hdr_len = mmap_headers ? MON_MMAP_HDR_LEN : MON_HDR_LEN;
+		if (n < 12 || (magic[8] != 'S' && magic[8] != 'C' &&
+		               magic[8] != 'E') || magic[9] > USBMON_BULK) {
+			fprintf(stderr, "%s: not a usbmon capture\n", path);
+			usbmon_close(r);
+			return NULL;
+		}
+	}
+
+	return r;
+}
+
+int usbmon_read(struct usbmon_reader *r, struct usbmon_event *ev)
+{
+	switch (r->format) {
+	case FORMAT_TEXT:
+		return read_text(r, ev);
+	case FORMAT_BINARY:
+		return read_binary(r, ev);
+	case FORMAT_PCAP:
+		return read_pcap(r, ev);
+	case FORMAT_PCAPNG:
+		return read_pcapng(r, ev);
+	}
+	return -1;
+}
+
+const char *usbmon_format(const struct usbmon_reader *r)
+{
+	static const char *names[] = {
+		[FORMAT_TEXT] = "text",
+		[FORMAT_BINARY] = "binary",
+		[FORMAT_PCAP] = "pcap",
+		[FORMAT_PCAPNG] = "pcapng",
+	};
+
+	return names[r->format];
+}
+
+void usbmon_close(struct usbmon_reader *r)
+{
+	if (!r)
+		return;
+	fclose(r->fp);
+	free(r->line);
+	free(r->buf);
+	free(r);
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static void put64(uint8_t *p, uint64_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+struct usbmon_writer *usbmon_create(const char *path)
+{
+	struct usbmon_writer *w;
+	size_t len = strlen(path);
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+	w->fp = fopen(path, "wb");
+	if (!w->fp) {
+		perror(path);
+		free(w);
+		return NULL;
+	}
+
+	w->pcap = len >= 5 && strcmp(path + len - 5, ".pcap") == 0;
+	if (w->pcap) {
+		uint8_t hdr[24];
+		put32(hdr + 0, PCAP_MAGIC);
+		put16(hdr + 4, 2);
+		put16(hdr + 6, 4);
+		put32(hdr + 8, 0);
+		put32(hdr + 12, 0);
+		put32(hdr + 16, MAX_RECORD);
+		put32(hdr + 20, LINKTYPE_USB_LINUX_MMAPPED);
+		fwrite(hdr, 1, sizeof(hdr), w->fp);
+	}
+
+	return w;
+}
+
+static void write_pcap(struct usbmon_writer *w, const struct usbmon_event *ev)
+{
+	uint8_t rec[16], hdr[MON_MMAP_HDR_LEN];
+	int64_t sec = ev->ts_us / 1000000;
+	int32_t usec = ev->ts_us % 1000000;
+
+	put32(rec + 0, sec);
+	put32(rec + 4, usec);
+	put32(rec + 8, sizeof(hdr) + ev->data_len);
+	put32(rec + 12, sizeof(hdr) + ev->data_len);
+
+	memset(hdr, 0, sizeof(hdr));
+	put64(hdr + 0, ev->id);
+	hdr[8] = ev->type;
+	hdr[9] = ev->xfer;
+	hdr[10] = ev->ep;
+	hdr[11] = ev->dev;
+	put16(hdr + 12, ev->bus);
+	hdr[14] = ev->setup_valid ? 0 : '-';
+	hdr[15] = ev->data_len ? 0 : (ev->type == 'S' && ev->ep & 0x80) ?
+	          '<' : '>';
+	put64(hdr + 16, sec);
+	put32(hdr + 24, usec);
+	put32(hdr + 28, ev->status);
+	put32(hdr + 32, ev->len);
+	put32(hdr + 36, ev->data_len);
+	if (ev->setup_valid)
+		memcpy(hdr + 40, ev->setup, 8);
+	if (ev->xfer == USBMON_INTERRUPT)
+		put32(hdr + 48, 1);  /* interval */
+
+	fwrite(rec, 1, sizeof(rec), w->fp);
+	fwrite(hdr, 1, sizeof(hdr), w->fp);
+	fwrite(ev->data, 1, ev->data_len, w->fp);
+}
+
+static void write_text(struct usbmon_writer *w, const struct usbmon_event *ev)
+{
+	static const char xfer[] = "ZICB";
+	const uint8_t *s = ev->setup;
+	uint32_t i;
+
+	fprintf(w->fp, "%08llx %llu %c %c%c:%u:%03u:%u",
+	        (unsigned long long) ev->id,
+	        (unsigned long long) (ev->ts_us % TEXT_TS_WRAP), ev->type,
+	        xfer[ev->xfer & 3], ev->ep & 0x80 ? 'i' : 'o',
+	        ev->bus, ev->dev, ev->ep & 0x7f);
+
+	if (ev->setup_valid)
+		fprintf(w->fp, " s %02x %02x %04x %04x %04x", s[0], s[1],
+		        s[2] | s[3] << 8, s[4] | s[5] << 8, s[6] | s[7] << 8);
+	else if (ev->xfer == USBMON_INTERRUPT)
+		fprintf(w->fp, " %d:1", ev->status);
+	else
+		fprintf(w->fp, " %d", ev->status);
+
+	fprintf(w->fp, " %u", ev->len);
+	if (ev->data_len) {
+		fprintf(w->fp, " =");
+		for (i = 0; i < ev->data_len; i++)
+			fprintf(w->fp, "%s%02x", i % 4 ? "" : " ", ev->data[i]);
+	}
+	else if (ev->len) {
+		fprintf(w->fp, " %c", ev->type == 'S' && ev->ep & 0x80 ?
+		        '<' : '>');
+	}
+	fprintf(w->fp, "\n");
+}
+
+void usbmon_write(struct usbmon_writer *w, const struct usbmon_event *ev)
+{
+	if (w->pcap)
+		write_pcap(w, ev);
+	else
+		write_text(w, ev);
+}
+
+void usbmon_finish(struct usbmon_writer *w)
+{
+	if (!w)
+		return;
+	fclose(w->fp);
+	free(w);
+}
@@ -0,0 +1,86 @@
+/*
+ *  M-Stack Host Simulation: usbmon Captures
+ *  Copyright (C) 2013 Signal 11 Software
+ *
+ *  M-Stack is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU Lesser General Public License as published by the
+ *  Free Software Foundation, version 3
+ *
+ *  M-Stack is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ *  License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Read and write captures of USB traffic made with Linux's usbmon, in any
+ * of the forms they're usually found in:
+ *
+ *   - The text interface (/sys/kernel/debug/usb/usbmon/Nu, or the older
+ *     Nt without bus numbers).
+ *   - The binary interface (/dev/usbmonN), as a stream of 48 byte event
+ *     headers each followed by its data. 64 byte (mmap interface)
+ *     headers can be read too, by asking for them.
+ *   - pcap and pcapng files, as written by tcpdump, dumpcap and
+ *     Wireshark, with link type LINKTYPE_USB_LINUX or
+ *     LINKTYPE_USB_LINUX_MMAPPED.
+ *
+ * Captures are written in the text format (with all of the data, where
+ * the kernel stops at 32 bytes), or as pcap with 64 byte headers.
+ */
+
+#ifndef SIM_USBMON_H__
+#define SIM_USBMON_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+enum usbmon_xfer {
+	USBMON_ISO = 0,
+	USBMON_INTERRUPT = 1,
+	USBMON_CONTROL = 2,
+	USBMON_BULK = 3,
+};
+
+struct usbmon_event {
+	uint64_t id;        /* URB tag, shared by its S and C events */
+	char type;          /* 'S'ubmission, 'C'allback or 'E'rror */
+	uint8_t xfer;       /* enum usbmon_xfer */
+	uint8_t ep;         /* Endpoint number, with 0x80 for IN */
+	uint8_t dev;
+	uint16_t bus;
+	int64_t ts_us;      /* Microseconds, from an arbitrary start */
+	int32_t status;     /* -EINPROGRESS for S, -errno or 0 for C */
+	uint32_t len;       /* S: transfer length. C: actual length */
+	bool setup_valid;
+	uint8_t setup[8];
+	uint32_t data_len;  /* Bytes of data in the capture, up to len */
+	uint8_t *data;
+};
+
+struct usbmon_reader;
+struct usbmon_writer;
+
+/* Open a capture. The format is detected from its contents, except that
+ * raw binary captures are taken to have 48 byte headers unless
+ * mmap_headers is set. Returns NULL (with a message on stderr) if the
+ * file can't be opened or isn't a usbmon capture. */
+struct usbmon_reader *usbmon_open(const char *path, bool mmap_headers);
+
+/* Read the next event. Its data belongs to the reader, and is valid
+ * until the next call. Returns 1 for an event, 0 at the end of the
+ * capture, or -1 (with a message on stderr) for a bad capture. */
+int usbmon_read(struct usbmon_reader *r, struct usbmon_event *ev);
+
+const char *usbmon_format(const struct usbmon_reader *r);
+void usbmon_close(struct usbmon_reader *r);
+
+/* Create a capture: pcap if path ends in .pcap, text otherwise. */
+struct usbmon_writer *usbmon_create(const char *path);
+void usbmon_write(struct usbmon_writer *w, const struct usbmon_event *ev);
+void usbmon_finish(struct usbmon_writer *w);
+
+#endif /* SIM_USBMON_H__ */
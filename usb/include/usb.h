@@ -287,6 +287,33 @@ int16_t UNKNOWN_GET_DESCRIPTOR_CALLBACK(const struct setup_packet *pkt, const vo
 void START_OF_FRAME_CALLBACK(void);
 #endif
 
+#ifdef ENDPOINT_WATCHDOG_CALLBACK
+/** @brief Callback for a stuck endpoint
+ *
+ * ENDPOINT_WATCHDOG_CALLBACK() is called by the endpoint watchdog (see @p
+ * USB_ENDPOINT_WATCHDOG) when an endpoint's buffer has been owned by the
+ * same party for longer than the configured limit.  If @p sie_owned is
+ * false, the buffer has been owned by the CPU, meaning the application has
+ * not re-armed an OUT endpoint or has not sent an IN buffer.  If @p
+ * sie_owned is true, the buffer has been owned by the SIE, meaning the
+ * host has not sent data to an OUT endpoint or has not read the data
+ * queued on an IN endpoint.  This is called from @p usb_service() when the
+ * SOF is handled.
+ *
+ * @param endpoint    The endpoint identifier of the affected endpoint
+ *                    (direction and number, e.g.: 0x81 means EP 1 IN).
+ * @param sie_owned   Whether the buffer is owned by the SIE (true) or the
+ *                    CPU (false).
+ * @returns
+ *   Return @p USB_WATCHDOG_IGNORE to take no action, @p USB_WATCHDOG_REARM
+ *   to give an OUT buffer back to the SIE or take an IN buffer back from
+ *   the SIE (dropping its data), or @p USB_WATCHDOG_HALT to halt the
+ *   endpoint, causing it to return STALL to the host until the host clears
+ *   the halt.
+ */
+int8_t ENDPOINT_WATCHDOG_CALLBACK(uint8_t endpoint, bool sie_owned);
+#endif
+
 #ifdef USB_RESET_CALLBACK
 /** @brief USB Reset Callback
  *
@@ -493,6 +520,50 @@ typedef void (*usb_ep0_data_stage_callback)(bool transfer_ok, void *context);
 void usb_start_receive_ep0_data_stage(char *buffer, size_t len,
 	usb_ep0_data_stage_callback callback, void *context);
 
+#ifdef USB_EP0_DATA_STAGE_PACKETS
+/** @brief Callback for each packet of an OUT data stage
+ *
+ * A callback of this type is passed to
+ * usb_start_receive_ep0_data_stage_packets(), and is called for each
+ * packet of the data stage as it is received.
+ *
+ * @param data      The packet's data. This is the endpoint's buffer, and is
+ *                  only valid until the callback returns.
+ * @param len       The number of bytes in the packet
+ * @param context   A pointer to application-provided context data
+ */
+typedef void (*usb_ep0_data_stage_packet_callback)(const unsigned char *data,
+	uint8_t len, void *context);
+
+/** @brief Start the data stage of an OUT control transfer, packet by packet
+ *
+ * Like usb_start_receive_ep0_data_stage(), but instead of collecting the
+ * data into a buffer, hand each packet to @p packet_callback as it
+ * arrives.  This lets the application take a data stage larger than it
+ * has memory for (up to the 64 KB that wLength allows), and work on the
+ * data as it comes in.  The next packet is NAK'd until @p packet_callback
+ * returns.  Once all the data has been received, and the STATUS stage has
+ * completed, @p callback is called as for
+ * usb_start_receive_ep0_data_stage().
+ *
+ * This is only available if @p USB_EP0_DATA_STAGE_PACKETS is defined in
+ * usb_config.h.
+ *
+ * @see UNKNOWN_SETUP_REQUEST_CALLBACK
+ *
+ * @param len              The number of bytes to expect, normally wLength
+ * @param packet_callback  A callback function to call for each packet.
+ *                         This parameter is mandatory.
+ * @param callback         A callback function to call when the transfer
+ *                         completes. This parameter is mandatory.
+ * @param context          A pointer to be passed to the callbacks. The USB
+ *                         stack does not dereference this pointer.
+ */
+void usb_start_receive_ep0_data_stage_packets(size_t len,
+	usb_ep0_data_stage_packet_callback packet_callback,
+	usb_ep0_data_stage_callback callback, void *context);
+#endif
+
 /** @brief Start the data stage of an IN control transfer
  *
  * Start the data stage of a control transfer for a transfer which has an IN
@@ -511,7 +582,10 @@ void usb_start_receive_ep0_data_stage(char *buffer, size_t len,
  *                   buffer capable of having an arbitrary lifetime.  Do not
  *                   use a stack variable for this buffer, and do not free
  *                   this buffer until the callback has been called.
- * @param len        The number of bytes to send
+ * @param len        The number of bytes to send. If this is less than the
+ *                   wLength of the request, the data stage is ended with a
+ *                   short or zero-length packet; if it is more, only wLength
+ *                   bytes are sent.
  * @param callback   A callback function to call when the transfer completes.
  *                   This parameter is mandatory. Once the callback is
  *                   called, the transfer is over, and the buffer can be
@@ -522,6 +596,291 @@ void usb_start_receive_ep0_data_stage(char *buffer, size_t len,
 void usb_send_data_stage(char *buffer, size_t len,
 	usb_ep0_data_stage_callback callback, void *context);
 
+#ifdef USB_EP0_DATA_STAGE_PACKETS
+/** @brief Callback for each packet of an IN data stage
+ *
+ * A callback of this type is passed to usb_send_data_stage_packets(), and
+ * is called for each packet of the data stage as it is needed.
+ *
+ * @param buf       The buffer to fill. This is the endpoint's buffer.
+ * @param len       The number of bytes to put in it
+ * @param context   A pointer to application-provided context data
+ */
+typedef void (*usb_ep0_data_stage_in_packet_callback)(unsigned char *buf,
+	uint8_t len, void *context);
+
+/** @brief Start the data stage of an IN control transfer, packet by packet
+ *
+ * Like usb_send_data_stage(), but instead of sending the data from a
+ * buffer, have @p packet_callback fill each packet, just before it is
+ * sent.  This lets the application send a data stage larger than it has
+ * memory for (up to the 64 KB that wLength allows), producing the data as
+ * it goes.  The first packet is filled before this function returns.
+ * Once the STATUS stage has completed, @p callback is called as for
+ * usb_send_data_stage().
+ *
+ * This is only available if @p USB_EP0_DATA_STAGE_PACKETS is defined in
+ * usb_config.h.
+ *
+ * @see UNKNOWN_SETUP_REQUEST_CALLBACK
+ *
+ * @param len              The number of bytes to send. As for
+ *                         usb_send_data_stage(), only up to wLength bytes
+ *                         are sent.
+ * @param packet_callback  A callback function to call for each packet.
+ *                         This parameter is mandatory.
+ * @param callback         A callback function to call when the transfer
+ *                         completes. This parameter is mandatory.
+ * @param context          A pointer to be passed to the callbacks. The USB
+ *                         stack does not dereference this pointer.
+ */
+void usb_send_data_stage_packets(size_t len,
+	usb_ep0_data_stage_in_packet_callback packet_callback,
+	usb_ep0_data_stage_callback callback, void *context);
+#endif
+
+/** @brief Defer the data stage of an IN control transfer
+ *
+ * Call this from @p UNKNOWN_SETUP_REQUEST_CALLBACK, in place of @p
+ * usb_send_data_stage(), for an IN control transfer whose data isn't
+ * ready yet, for example because it takes longer to work out than the
+ * host should be kept waiting inside the callback.  Endpoint 0 NAKs the
+ * data stage until the application calls @p usb_send_data_stage() (or @p
+ * usb_send_data_stage_packets()) from its main loop.
+ *
+ * If the host gives up on the transfer and sends another SETUP packet
+ * first, @p callback is called with @p transfer_ok set to false before the
+ * new request is handled, and the application must then not start the
+ * data stage.  On a bus reset, @p callback is not called.
+ *
+ * If @p USB_USE_INTERRUPTS is defined, the application has to disable the
+ * USB interrupt around checking that the transfer is still pending and
+ * calling @p usb_send_data_stage().
+ *
+ * @param callback   A callback function to call if the transfer is
+ *                   abandoned. This parameter is mandatory.
+ * @param context    A pointer to be passed to the callback. The USB stack
+ *                   does not dereference this pointer.
+ */
+void usb_defer_data_stage(usb_ep0_data_stage_callback callback, void *context);
+
+#ifdef USB_FRAME_SCHEDULER
+/** @defgroup frame_scheduler Frame Scheduler
+ *  @brief Run periodic application work synchronized to USB frames.
+ *
+ *  If @p USB_FRAME_SCHEDULER is defined in usb_config.h, the USB stack
+ *  keeps a table of up to @p USB_FRAME_SCHEDULER_MAX_TASKS tasks which are
+ *  run on Start-of-Frame (SOF) events.  Each task has a period (in frames)
+ *  and a phase, so that producers for interrupt or bulk endpoints can fill
+ *  their buffers just before the host is expected to poll for them.
+ *
+ *  Tasks can run either directly from @p usb_service() when the SOF is
+ *  handled (in interrupt context if @p USB_USE_INTERRUPTS is defined), or
+ *  be deferred and run from the application's main loop by calling @p
+ *  usb_run_frame_tasks().  Low-speed devices do not receive SOF packets,
+ *  and the frame scheduler will do nothing on them.
+ *
+ *  @addtogroup frame_scheduler
+ *  @{
+ */
+
+/** @brief Frame task callback definition
+ *
+ * This is the type of function which is registered with @p
+ * usb_add_frame_task().
+ *
+ * @param frame     The USB frame number (11 bits) from the most recent SOF
+ * @param context   The pointer passed to @p usb_add_frame_task()
+ */
+typedef void (*usb_frame_task_func)(uint16_t frame, void *context);
+
+/** Run the task from @p usb_service() at SOF time */
+#define USB_FRAME_TASK_ISR      0x0
+/** Run the task from @p usb_run_frame_tasks() */
+#define USB_FRAME_TASK_DEFERRED 0x1
+
+/** @brief Register a frame task
+ *
+ * Register a function to be called every @p period frames.  @p phase is
+ * the number of frames to skip before the first run, and can be used to
+ * stagger tasks which have the same period.  Call this function before @p
+ * usb_init() or with the USB interrupt disabled.
+ *
+ * @param func      The function to call
+ * @param context   A pointer to pass to @p func. The USB stack does not
+ *                  dereference this pointer.
+ * @param period    The number of frames between runs. Must be non-zero.
+ * @param phase     The number of frames to skip before the first run
+ * @param flags     @p USB_FRAME_TASK_ISR or @p USB_FRAME_TASK_DEFERRED
+ * @returns
+ *   Return a task handle (zero or greater), or -1 if the parameters are
+ *   invalid or there are no free task slots.
+ */
+int8_t usb_add_frame_task(usb_frame_task_func func, void *context,
+                          uint16_t period, uint16_t phase, uint8_t flags);
+
+/** @brief Unregister a frame task
+ *
+ * @param task   The task handle returned from @p usb_add_frame_task()
+ */
+void usb_remove_frame_task(int8_t task);
+
+/** @brief Run deferred frame tasks
+ *
+ * Call this function periodically from the application's main loop to run
+ * tasks which were registered with @p USB_FRAME_TASK_DEFERRED and which
+ * have become due.  A deferred task which becomes due again before it has
+ * been run is only run once, and the overrun is counted (see @p
+ * usb_get_frame_task_overruns()).
+ */
+void usb_run_frame_tasks(void);
+
+/** @brief Get the frame number of the most recent SOF
+ *
+ * @returns
+ *   Return the 11-bit USB frame number latched at the most recent SOF.
+ */
+uint16_t usb_get_frame_number(void);
+
+/** @brief Get the number of missed frames
+ *
+ * Return the number of frames which passed without their SOF being handled
+ * by @p usb_service(), as detected by gaps in the frame number.  This
+ * count is cleared by a bus reset.
+ */
+uint16_t usb_get_missed_frames(void);
+
+/** @brief Get the number of deferred task overruns
+ *
+ * Return the number of times a deferred task became due while its
+ * previous run was still pending in @p usb_run_frame_tasks().
+ *
+ * @param task   The task handle returned from @p usb_add_frame_task()
+ */
+uint16_t usb_get_frame_task_overruns(int8_t task);
+
+/* Doxygen end-of-group for frame_scheduler */
+/** @}*/
+#endif
+
+#ifdef USB_ENDPOINT_WATCHDOG
+/** @defgroup endpoint_watchdog Endpoint Watchdog
+ *  @brief Detect endpoints which have stopped moving data.
+ *
+ *  If @p USB_ENDPOINT_WATCHDOG is defined in usb_config.h, the USB stack
+ *  counts, for each endpoint other than endpoint zero, the number of SOF
+ *  frames during which the endpoint's buffer has stayed owned by the CPU or
+ *  by the SIE without a transaction completing.  When the count reaches @p
+ *  USB_ENDPOINT_WATCHDOG_CPU_FRAMES or @p USB_ENDPOINT_WATCHDOG_SIE_FRAMES
+ *  (which must also be defined in usb_config.h, set either to 0 to disable
+ *  that check), an incident is counted and @p ENDPOINT_WATCHDOG_CALLBACK
+ *  is called, if defined.  Only the endpoint directions which the
+ *  application has passed to @p usb_set_endpoint_watchdog() are checked,
+ *  so that directions which the application doesn't use (and whose
+ *  buffers stay with the CPU) don't fire.  Endpoints are only checked while
+ *  the device is configured and the endpoint is not halted.
+ *
+ *  @addtogroup endpoint_watchdog
+ *  @{
+ */
+
+/** Take no action on a stuck endpoint */
+#define USB_WATCHDOG_IGNORE 0
+/** Re-arm a stuck OUT endpoint, or reclaim a stuck IN endpoint's buffer */
+#define USB_WATCHDOG_REARM  1
+/** Halt a stuck endpoint */
+#define USB_WATCHDOG_HALT   2
+
+/** @brief Watch an endpoint direction
+ *
+ * Start or stop checking an endpoint direction with the endpoint watchdog.
+ * No endpoints are watched at power-up.  The setting is kept across bus
+ * resets.  Endpoint zero can't be watched.
+ *
+ * @param endpoint   The endpoint identifier (direction and number, e.g.:
+ *                   0x81 means EP 1 IN).
+ * @param watch      Whether to check the endpoint direction
+ */
+void usb_set_endpoint_watchdog(uint8_t endpoint, bool watch);
+
+/** @brief Get the number of watchdog incidents for an endpoint
+ *
+ * @param endpoint   The endpoint identifier (direction and number, e.g.:
+ *                   0x81 means EP 1 IN).
+ * @returns
+ *   Return the number of times the watchdog has fired for the endpoint
+ *   since power-up.
+ */
+uint16_t usb_get_endpoint_watchdog_incidents(uint8_t endpoint);
+
+/* Doxygen end-of-group for endpoint_watchdog */
+/** @}*/
+#endif
+
+#ifdef USB_BANDWIDTH_STATS
+/** @defgroup bandwidth_stats Bandwidth Statistics
+ *  @brief Per-frame bandwidth accounting
+ *
+ *  If @p USB_BANDWIDTH_STATS is defined in usb_config.h, the USB stack
+ *  totals the bytes moved on each endpoint between consecutive SOFs and
+ *  keeps statistics which can be used to tell whether the application is
+ *  keeping up with the 1 ms frame budget.  The USB stack does not send
+ *  these statistics to the host by itself.  An application can send them
+ *  from @p UNKNOWN_SETUP_REQUEST_CALLBACK in response to a vendor request
+ *  (see the unit test firmware for an example).
+ *
+ *  @addtogroup bandwidth_stats
+ *  @{
+ */
+
+/** Statistics for one endpoint direction
+ *
+ * @p in_not_ready_frames is an approximation.  The SIE doesn't report the
+ * NAKs it sends, so the USB stack counts the SOFs at which an IN endpoint
+ * had no buffer queued instead.  Only IN endpoints which the application
+ * has sent on (with @p usb_send_in_buffer()) since the last bus reset, and
+ * which are not halted, are counted.  A frame is counted whether or not the
+ * host polled the endpoint during it, and a buffer queued and read within
+ * one frame is not seen.
+ */
+struct usb_endpoint_bandwidth {
+	uint32_t total_bytes;  /**< Bytes moved since the stats were cleared */
+	uint16_t peak_bytes;   /**< Most bytes moved in a single frame */
+	uint16_t in_not_ready_frames; /**< IN only: frames which started
+	                                   with no data queued for the host */
+};
+
+/** Bandwidth statistics
+ *
+ * The average number of bytes per frame for an endpoint is @p total_bytes
+ * divided by @p frames.  All values are little-endian on supported
+ * platforms.
+ */
+struct usb_bandwidth_stats {
+	uint32_t frames; /**< SOFs handled since the stats were cleared */
+	/** Statistics for each endpoint. ep[n][0] is EP n OUT and ep[n][1]
+	 *  is EP n IN. */
+	struct usb_endpoint_bandwidth ep[NUM_ENDPOINT_NUMBERS+1][2];
+};
+
+/** @brief Get the bandwidth statistics
+ *
+ * The statistics are updated by @p usb_service(). If @p USB_USE_INTERRUPTS
+ * is defined, copy them with the USB interrupt disabled to get a
+ * consistent snapshot.
+ *
+ * @returns
+ *   Return a pointer to the USB stack's bandwidth statistics.
+ */
+const struct usb_bandwidth_stats *usb_get_bandwidth_stats(void);
+
+/** @brief Clear the bandwidth statistics */
+void usb_clear_bandwidth_stats(void);
+
+/* Doxygen end-of-group for bandwidth_stats */
+/** @}*/
+#endif
+
 
 /* Doxygen end-of-group for public_api */
 /** @}*/
@@ -35,6 +35,8 @@
 #ifdef __XC16__
 #pragma pack(push, 1)
 #elif __XC8
+#elif __linux__
+#pragma pack(push, 1)
 #else
 #error "Compiler not supported"
 #endif
@@ -250,6 +252,8 @@ struct string_descriptor {
 #ifdef __XC16__
 #pragma pack(pop)
 #elif __XC8
+#elif __linux__
+#pragma pack(pop)
 #else
 #error "Compiler not supported"
 #endif
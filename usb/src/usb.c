@@ -27,6 +27,8 @@
 #include <delays.h>
 #elif __XC8
 #include <xc.h>
+#elif __linux__
+#include <xc.h>
 #endif
 
 #include <string.h>
@@ -44,13 +46,24 @@
 #define EP_0_OUT_LEN EP_0_LEN
 #define EP_0_IN_LEN  EP_0_LEN
 
+/* Features which need the Start-of-Frame interrupt. */
+#if defined(START_OF_FRAME_CALLBACK) || \
+    defined(USB_FRAME_SCHEDULER) || \
+    defined(USB_ENDPOINT_WATCHDOG) || \
+    defined(USB_BANDWIDTH_STATS)
+#define USB_NEEDS_SOF_INTERRUPT
+#endif
+
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct endpoint_descriptor), 7);
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct hid_descriptor), 9);
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct interface_descriptor), 9);
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct configuration_descriptor), 9);
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct device_descriptor), 18);
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct setup_packet), 8);
+#ifndef __linux__
+/* On the host, BDnADR is a native pointer. */
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct buffer_descriptor), 4);
+#endif
 
 struct buffer_descriptor_pair {
 	struct buffer_descriptor ep_out;
@@ -76,6 +89,8 @@ static struct buffer_descriptor_pair bds[NUM_ENDPOINT_NUMBERS+1] BD_ATTR_TAG;
 	/* Buffers can go anywhere on PIC24 parts which are supported (so far). */
 #elif __XC8
 	/* Addresses are set by BD_ADDR and BUF_ADDR below. */
+#elif __linux__
+	/* Buffers can go anywhere on the host. */
 #else
 	#error compiler not supported
 #endif
@@ -145,6 +160,9 @@ struct ep_buf {
 
 #define EP_OUT_HALT_FLAG 0x1
 #define EP_IN_HALT_FLAG 0x2
+#define EP_IN_USED_FLAG 0x4 /* usb_send_in_buffer() called since reset */
+#define EP_OUT_UNCOUNTED_FLAG 0x8 /* Bandwidth stats: see count_ep_transaction() */
+#define EP_IN_UNCOUNTED_FLAG 0x10
 	uint8_t flags;
 };
 
@@ -221,21 +239,97 @@ static char   *ep0_data_stage_out_buffer;
 static size_t  ep0_data_stage_buf_remaining;
 static void   *ep0_data_stage_context;
 static uint8_t ep0_data_stage_direc; /*1=IN, 0=OUT, Same as USB spec.*/
+static uint16_t ep0_setup_wlength; /* wLength of the current SETUP */
+#ifdef USB_EP0_DATA_STAGE_PACKETS
+static usb_ep0_data_stage_packet_callback ep0_data_stage_packet_callback;
+static usb_ep0_data_stage_in_packet_callback ep0_data_stage_in_packet_callback;
+#endif
 
 static void reset_ep0_data_stage()
 {
 	ep0_data_stage_in_buffer = NULL;
 	ep0_data_stage_out_buffer = NULL;
 	ep0_data_stage_buf_remaining = 0;
+	control_need_zlp = 0;
+#ifdef USB_EP0_DATA_STAGE_PACKETS
+	ep0_data_stage_packet_callback = NULL;
+	ep0_data_stage_in_packet_callback = NULL;
+#endif
+
+	/* The callback is called once per transfer. Forget it so that the
+	   status stage of a later (standard) request doesn't call it again. */
+	ep0_data_stage_callback = NULL;
+	ep0_data_stage_context = NULL;
+
+	/* There's no need to reset ep0_data_stage_direc because no
+	   decisions are made based on it outside of a transfer. */
+}
+
+#ifdef USB_FRAME_SCHEDULER
+/* Frame scheduler. Each task has a countdown of SOFs to skip before it
+ * runs next. Slots with a NULL func are free. */
+struct frame_task {
+	usb_frame_task_func func;
+	void *context;
+	uint16_t period;
+	uint16_t countdown;
+	uint16_t overruns;
+	uint8_t flags;
+	bool pending;
+};
+
+static struct frame_task frame_tasks[USB_FRAME_SCHEDULER_MAX_TASKS];
+static uint16_t frame_number;
+static bool frame_number_valid;
+static uint16_t missed_frames;
+#endif
+
+#ifdef USB_ENDPOINT_WATCHDOG
+/* Endpoint watchdog. For each endpoint (besides zero) and direction, count
+ * the SOFs during which the buffer descriptor has stayed with the same
+ * owner (CPU or SIE) without a transaction completing. */
+struct ep_watchdog {
+	uint16_t frames;
+	uint16_t incidents;
+	bool uown;
+	bool watched; /* Set by usb_set_endpoint_watchdog() */
+};
 
-	/* There's no need to reset the following because no decisions are
-	   made based on them:
-	     ep0_data_stage_callback,
-	     ep0_data_stage_context,
-	     ep0_data_stage_direc
-	 */
+static struct ep_watchdog ep_watchdog[NUM_ENDPOINT_NUMBERS+1][2]; /* [ep][0=OUT,1=IN] */
+#endif
+
+#ifdef USB_BANDWIDTH_STATS
+/* Bytes moved on each endpoint since the last SOF. These are added to
+ * bandwidth_stats at each SOF. */
+static uint16_t frame_bytes[NUM_ENDPOINT_NUMBERS+1][2]; /* [ep][0=OUT,1=IN] */
+static struct usb_bandwidth_stats bandwidth_stats;
+
+static inline void count_frame_bytes(uint8_t ep, uint8_t dir, uint16_t len)
+{
+	frame_bytes[ep][dir] += len;
 }
 
+/* Count the bytes of a transaction on an endpoint other than zero, from
+ * its buffer descriptor. The UNCOUNTED flag is set when the buffer is
+ * given to the SIE. This is called when usb_service() handles the
+ * transaction, and also just before the application gives the buffer
+ * back to the SIE, since polled firmware can see the buffer returned,
+ * and re-arm it, before usb_service() gets to the transaction. */
+static void count_ep_transaction(uint8_t ep, uint8_t dir)
+{
+	uint8_t flag = dir? EP_IN_UNCOUNTED_FLAG: EP_OUT_UNCOUNTED_FLAG;
+
+	if (!(ep_buf[ep].flags & flag))
+		return;
+	if (dir? bds[ep].ep_in.STAT.UOWN: bds[ep].ep_out.STAT.UOWN)
+		return; /* Not done yet, or already re-armed and counted */
+
+	ep_buf[ep].flags &= ~flag;
+	count_frame_bytes(ep, dir,
+		dir? BDN_LENGTH(bds[ep].ep_in): BDN_LENGTH(bds[ep].ep_out));
+}
+#endif
+
 #define SERIAL(x)
 #define SERIAL_VAL(x)
 
@@ -281,7 +375,7 @@ void usb_init(void)
 	SFR_TRANSFER_IE = 1; /* USB Transfer Interrupt Enable */
 	SFR_STALL_IE = 1;    /* USB Stall Interrupt Enable */
 	SFR_RESET_IE = 1;    /* USB Reset Interrupt Enable */
-#ifdef START_OF_FRAME_CALLBACK
+#ifdef USB_NEEDS_SOF_INTERRUPT
 	SFR_SOF_IE = 1;      /* USB Start-Of-Frame Interrupt Enable */
 #endif
 #endif
@@ -301,6 +395,10 @@ void usb_init(void)
 	SFR_BD_ADDR_REG = w.hb;
 #endif
 
+#ifdef USB_NEEDS_SET_BD_ADDR_PTR
+	SFR_BD_ADDR_PTR = bds;
+#endif
+
 	/* These are the UEP/U1EP endpoint management registers. */
 	
 	/* Clear them all out. This is important because a bootloader
@@ -329,6 +427,17 @@ void usb_init(void)
 	g_configuration = 0;
 	for (i = 0; i <= NUM_ENDPOINT_NUMBERS; i++)
 		ep_buf[i].flags = 0;
+#ifdef USB_BANDWIDTH_STATS
+	/* The OUT endpoints are armed below. */
+	for (i = 1; i <= NUM_ENDPOINT_NUMBERS; i++)
+		ep_buf[i].flags = EP_OUT_UNCOUNTED_FLAG;
+#endif
+#ifdef USB_ENDPOINT_WATCHDOG
+	for (i = 0; i <= NUM_ENDPOINT_NUMBERS; i++) {
+		ep_watchdog[i][0].frames = 0;
+		ep_watchdog[i][1].frames = 0;
+	}
+#endif
 
 	memset(bds, 0x0, sizeof(bds));
 
@@ -364,6 +473,13 @@ void usb_init(void)
 
 	reset_ep0_data_stage();
 
+#ifdef USB_FRAME_SCHEDULER
+	/* The frame number restarts after a bus reset. Registered tasks
+	   are kept. */
+	frame_number_valid = 0;
+	missed_frames = 0;
+#endif
+
 #ifdef USB_USE_INTERRUPTS
 	SFR_USB_IE = 1;     /* USB Interrupt enable */
 #endif
@@ -403,6 +519,21 @@ static void send_zero_length_packet_ep0()
 	SET_BDN(bds[0].ep_in, BDNSTAT_UOWN|BDNSTAT_DTS|BDNSTAT_DTSEN, 0);
 }
 
+/* Put the next len bytes of an IN data stage in the EP 0 IN buffer,
+ * from the application's buffer or its packet callback. */
+static void fill_ep0_in_buffer(uint8_t len)
+{
+#ifdef USB_EP0_DATA_STAGE_PACKETS
+	if (ep0_data_stage_in_packet_callback) {
+		ep0_data_stage_in_packet_callback(ep_buf[0].in, len,
+		                                  ep0_data_stage_context);
+		return;
+	}
+#endif
+	memcpy_from_rom(ep_buf[0].in, ep0_data_stage_in_buffer, len);
+	ep0_data_stage_in_buffer += len;
+}
+
 /* Start Control Return
  *
  * Start the data stage of an IN control transfer. This is primarily used
@@ -424,11 +555,19 @@ static void start_control_return(const void *ptr, size_t len, size_t bytes_asked
 {
 	uint8_t bytes_to_send = MIN(len, EP_0_IN_LEN);
 	bytes_to_send = MIN(bytes_to_send, bytes_asked_for);
-	returning_short = len != bytes_asked_for;
-	memcpy_from_rom(ep_buf[0].in, ptr, bytes_to_send);
-	ep0_data_stage_in_buffer = ((char*)ptr) + bytes_to_send;
+	returning_short = len < bytes_asked_for;
+	ep0_data_stage_in_buffer = (char*) ptr;
+	if (bytes_to_send) /* ptr can be NULL for a zero-length data stage */
+		fill_ep0_in_buffer(bytes_to_send);
 	ep0_data_stage_buf_remaining = MIN(bytes_asked_for, len) - bytes_to_send;
 
+	/* If this full-length packet is the whole of a short return, it
+	   must be followed by a zero-length packet, as in handle_ep0_in(). */
+	if (ep0_data_stage_buf_remaining == 0 &&
+	    bytes_to_send == EP_0_IN_LEN &&
+	    returning_short)
+		control_need_zlp = 1;
+
 	/* Send back the first transaction */
 	bds[0].ep_in.STAT.BDnSTAT = 0;
 	SET_BDN(bds[0].ep_in,
@@ -650,7 +789,7 @@ static inline int8_t handle_standard_control_request()
 						/* Clear Endpoint Halt Feature.
 						   Clear the STALL on the affected endpoint. */
 						if (ep_dir) {
-							ep_buf[ep_num].flags &= ~(EP_IN_HALT_FLAG);
+							ep_buf[ep_num].flags &= ~(EP_IN_HALT_FLAG|EP_IN_UNCOUNTED_FLAG);
 							SET_BDN(bds[ep_num].ep_in, BDNSTAT_DTS, ep_buf[ep_num].in_len);
 						}
 						else {
@@ -688,19 +827,25 @@ static inline int8_t handle_standard_control_request()
 static inline void handle_ep0_setup()
 {
 	FAR struct setup_packet *setup = (struct setup_packet*) ep_buf[0].out;
-	ep0_data_stage_direc = setup->REQUEST.direction;
 	int8_t res;
 
-	if (ep0_data_stage_buf_remaining) {
-		/* A SETUP transaction has been received while waiting
-		 * for a DATA stage to complete; something is broken.
-		 * If this was an application-controlled transfer (and
-		 * there's a callback), notify the application of this. */
-		if (ep0_data_stage_callback)
-			ep0_data_stage_callback(0/*fail*/, ep0_data_stage_context);
+	/* A SETUP transaction has been received while waiting for a DATA
+	 * or STATUS stage to complete; the host has abandoned the previous
+	 * transfer. If it was an application-controlled transfer (and
+	 * there's a callback), notify the application of this. */
+	if (ep0_data_stage_callback)
+		ep0_data_stage_callback(0/*fail*/, ep0_data_stage_context);
 
-		reset_ep0_data_stage();
-	}
+	reset_ep0_data_stage();
+	addr_pending = 0;
+
+	/* Take the EP 0 IN buffer back from the SIE, in case it still holds
+	 * a packet from the abandoned transfer. PKTDIS is set, so the SIE
+	 * isn't using it. */
+	bds[0].ep_in.STAT.BDnSTAT = 0;
+
+	ep0_data_stage_direc = setup->REQUEST.direction;
+	ep0_setup_wlength = setup->wLength;
 
 	if (setup->REQUEST.type == REQUEST_TYPE_STANDARD) {
 		res = handle_standard_control_request();
@@ -785,11 +930,39 @@ static inline void handle_ep0_out()
 					reset_ep0_data_stage();
 				}
 				else {
-					/* The data stage has completed. Set up the status stage. */
+					/* The data stage has completed. Set up the status stage.
+					 * A short packet can end it before all the bytes
+					 * asked for have arrived, so nothing is pending now. */
+					ep0_data_stage_out_buffer = NULL;
+					ep0_data_stage_buf_remaining = 0;
+					send_zero_length_packet_ep0();
+				}
+			}
+		}
+#ifdef USB_EP0_DATA_STAGE_PACKETS
+		else if (ep0_data_stage_packet_callback) {
+			/* Hand each packet to the application as it arrives.
+			 * The next one is NAK'd until the callback returns. */
+			uint8_t bytes_to_pass = MIN(pkt_len, ep0_data_stage_buf_remaining);
+			ep0_data_stage_buf_remaining -= bytes_to_pass;
+			ep0_data_stage_packet_callback(ep_buf[0].out, bytes_to_pass,
+			                               ep0_data_stage_context);
+
+			if (pkt_len < EP_0_OUT_LEN || ep0_data_stage_buf_remaining == 0) {
+				if (bytes_to_pass < pkt_len) {
+					/* More data than wLength */
+					stall_ep0();
+					ep0_data_stage_callback(0/*false*/, ep0_data_stage_context);
+					reset_ep0_data_stage();
+				}
+				else {
+					ep0_data_stage_packet_callback = NULL;
+					ep0_data_stage_buf_remaining = 0;
 					send_zero_length_packet_ep0();
 				}
 			}
 		}
+#endif
 	}
 }
 
@@ -804,9 +977,8 @@ static inline void handle_ep0_in()
 		/* There's already a multi-transaction transfer in process. */
 		uint8_t bytes_to_send = MIN(ep0_data_stage_buf_remaining, EP_0_IN_LEN);
 
-		memcpy_from_rom(ep_buf[0].in, ep0_data_stage_in_buffer, bytes_to_send);
+		fill_ep0_in_buffer(bytes_to_send);
 		ep0_data_stage_buf_remaining -= bytes_to_send;
-		ep0_data_stage_in_buffer += bytes_to_send;
 
 		/* If we hit the end with a full-length packet, set up
 		   to send a zero-length packet at the next IN token, but only
@@ -819,9 +991,9 @@ static inline void handle_ep0_in()
 		usb_send_in_buffer(0, bytes_to_send);
 	}
 	else if (control_need_zlp) {
+		/* The callback (if any) is called from the STATUS stage. */
 		usb_send_in_buffer(0, 0);
 		control_need_zlp = 0;
-		reset_ep0_data_stage();
 	}
 	else {
 		if (ep0_data_stage_direc == 0/*OUT*/) {
@@ -836,6 +1008,189 @@ static inline void handle_ep0_in()
 	}
 }
 
+#ifdef USB_FRAME_SCHEDULER
+/* Handle a Start-of-Frame for the frame scheduler. The number of frames
+ * which have elapsed since the last handled SOF is taken from the frame
+ * number register, so SOFs which were missed (eg: because usb_service()
+ * wasn't called often enough) are detected and don't skew the schedule. */
+static void handle_frame_tasks(void)
+{
+	uint16_t frame;
+	uint16_t elapsed;
+	uint8_t i;
+
+	frame = SFR_USB_FRAME_NUM_L | ((uint16_t)(SFR_USB_FRAME_NUM_H & 0x07) << 8);
+
+	if (frame_number_valid) {
+		elapsed = (frame - frame_number) & 0x07ff;
+		if (elapsed == 0)
+			return; /* Same frame. Nothing to do. */
+		missed_frames += elapsed - 1;
+	}
+	else {
+		elapsed = 1;
+		frame_number_valid = 1;
+	}
+	frame_number = frame;
+
+	for (i = 0; i < USB_FRAME_SCHEDULER_MAX_TASKS; i++) {
+		struct frame_task *t = &frame_tasks[i];
+		uint16_t late;
+
+		if (!t->func)
+			continue;
+
+		if (t->countdown >= elapsed) {
+			t->countdown -= elapsed;
+			continue;
+		}
+
+		/* The task is due. If it became due during missed frames,
+		 * keep the next run aligned to the original schedule. */
+		late = elapsed - 1 - t->countdown;
+		t->countdown = t->period - 1 - (late % t->period);
+
+		if (t->flags & USB_FRAME_TASK_DEFERRED) {
+			if (t->pending)
+				t->overruns++;
+			t->pending = 1;
+		}
+		else
+			t->func(frame, t->context);
+	}
+}
+#endif
+
+#ifdef USB_ENDPOINT_WATCHDOG
+/* Return whether the watchdog limit (in frames) has been reached for an
+ * endpoint direction whose buffer descriptor has the ownership uown. A
+ * limit of zero disables checking for that owner. */
+static bool ep_watchdog_expired(const struct ep_watchdog *wd)
+{
+	uint16_t limit = wd->uown ? USB_ENDPOINT_WATCHDOG_SIE_FRAMES :
+	                            USB_ENDPOINT_WATCHDOG_CPU_FRAMES;
+	return limit && wd->frames == limit;
+}
+
+static void ep_watchdog_fire(uint8_t ep, uint8_t dir)
+{
+	struct ep_watchdog *wd = &ep_watchdog[ep][dir];
+	int8_t action = USB_WATCHDOG_IGNORE;
+
+	wd->incidents++;
+
+#ifdef ENDPOINT_WATCHDOG_CALLBACK
+	action = ENDPOINT_WATCHDOG_CALLBACK(ep | (dir? 0x80: 0), wd->uown);
+#endif
+
+	if (action == USB_WATCHDOG_HALT) {
+		/* Halt the endpoint as if the host had sent SET_FEATURE
+		 * (ENDPOINT_HALT), so the host sees a STALL right away
+		 * instead of waiting for a timeout. */
+		if (dir) {
+			ep_buf[ep].flags |= EP_IN_HALT_FLAG;
+			stall_ep_in(ep);
+		}
+		else {
+			ep_buf[ep].flags |= EP_OUT_HALT_FLAG;
+			stall_ep_out(ep);
+		}
+	}
+	else if (action == USB_WATCHDOG_REARM) {
+		if (dir && wd->uown) {
+			/* Take back an IN buffer which the host never read.
+			 * Its data is dropped. Keep the data toggle the
+			 * unsent packet had, so the next
+			 * usb_send_in_buffer() reuses it. UOWN is cleared in
+			 * a write of its own before the rest of the BD is
+			 * touched, as for EP 0. */
+			uint8_t dts = bds[ep].ep_in.STAT.DTS;
+			ep_buf[ep].flags &= ~EP_IN_UNCOUNTED_FLAG;
+			bds[ep].ep_in.STAT.BDnSTAT = 0;
+			SET_BDN(bds[ep].ep_in, dts? 0: BDNSTAT_DTS, ep_buf[ep].in_len);
+		}
+		else if (!dir && !wd->uown) {
+			/* Give back an OUT buffer which the application never
+			 * re-armed. Its data is dropped. */
+			usb_arm_out_endpoint(ep);
+		}
+	}
+}
+
+/* Called on each SOF. Endpoints are only checked in the CONFIGURED state,
+ * when the application has asked for them, and while they are not
+ * halted. */
+static void handle_endpoint_watchdog(void)
+{
+	uint8_t i, dir;
+
+	if (!g_configuration)
+		return;
+
+	for (i = 1; i <= NUM_ENDPOINT_NUMBERS; i++) {
+		for (dir = 0; dir < 2; dir++) {
+			struct ep_watchdog *wd = &ep_watchdog[i][dir];
+			bool uown;
+
+			if (!wd->watched ||
+			    ep_buf[i].flags & (dir? EP_IN_HALT_FLAG: EP_OUT_HALT_FLAG)) {
+				wd->frames = 0;
+				continue;
+			}
+
+			uown = dir? bds[i].ep_in.STAT.UOWN: bds[i].ep_out.STAT.UOWN;
+			if (uown != wd->uown) {
+				wd->uown = uown;
+				wd->frames = 0;
+				continue;
+			}
+
+			/* Count up to the limit and fire once. The count
+			 * restarts when the ownership changes or a
+			 * transaction completes. */
+			if (ep_watchdog_expired(wd))
+				continue;
+			wd->frames++;
+			if (ep_watchdog_expired(wd))
+				ep_watchdog_fire(i, dir);
+		}
+	}
+}
+#endif
+
+#ifdef USB_BANDWIDTH_STATS
+/* Called on each SOF. Fold the bytes moved during the frame which just
+ * ended into the statistics. */
+static void handle_bandwidth_stats(void)
+{
+	uint8_t i, dir;
+
+	bandwidth_stats.frames++;
+
+	for (i = 0; i <= NUM_ENDPOINT_NUMBERS; i++) {
+		for (dir = 0; dir < 2; dir++) {
+			struct usb_endpoint_bandwidth *bw = &bandwidth_stats.ep[i][dir];
+			uint16_t bytes = frame_bytes[i][dir];
+
+			bw->total_bytes += bytes;
+			if (bytes > bw->peak_bytes)
+				bw->peak_bytes = bytes;
+			frame_bytes[i][dir] = 0;
+		}
+
+		/* An IN endpoint which the application sends on, which is
+		 * not halted, and which isn't owned by the SIE at the SOF
+		 * has no data ready for the host.  The SIE doesn't report
+		 * the NAKs it sends, so this is as close as the firmware
+		 * can get to counting polls which found no data. */
+		if (i > 0 && g_configuration &&
+		    (ep_buf[i].flags & (EP_IN_USED_FLAG|EP_IN_HALT_FLAG)) == EP_IN_USED_FLAG &&
+		    !bds[i].ep_in.STAT.UOWN)
+			bandwidth_stats.ep[i][1].in_not_ready_frames++;
+	}
+}
+#endif
+
 /* checkUSB() is called repeatedly to check for USB interrupts
    and service USB requests */
 void usb_service(void)
@@ -863,6 +1218,9 @@ void usb_service(void)
 			/* An OUT or SETUP transaction has completed on
 			 * Endpoint 0.  Handle the data that was received.
 			 */
+#ifdef USB_BANDWIDTH_STATS
+			count_frame_bytes(0, 0, BDN_LENGTH(bds[0].ep_out));
+#endif
 			if (bds[0].ep_out.STAT.PID == PID_SETUP) {
 				handle_ep0_setup();
 			}
@@ -886,6 +1244,9 @@ void usb_service(void)
 			 * needs to be re-loaded with the next transaction's
 			 * data if there is any.
 			 */
+#ifdef USB_BANDWIDTH_STATS
+			count_frame_bytes(0, 1, BDN_LENGTH(bds[0].ep_in));
+#endif
 			handle_ep0_in();
 		}
 		else if (SFR_USB_STATUS_EP > 0 && SFR_USB_STATUS_EP <= NUM_ENDPOINT_NUMBERS) {
@@ -895,7 +1256,12 @@ void usb_service(void)
 				if (ep_buf[SFR_USB_STATUS_EP].flags & EP_IN_HALT_FLAG)
 					stall_ep_in(SFR_USB_STATUS_EP);
 				else {
-
+#ifdef USB_ENDPOINT_WATCHDOG
+					ep_watchdog[SFR_USB_STATUS_EP][1].frames = 0;
+#endif
+#ifdef USB_BANDWIDTH_STATS
+					count_ep_transaction(SFR_USB_STATUS_EP, 1);
+#endif
 				}
 			}
 			else {
@@ -904,7 +1270,12 @@ void usb_service(void)
 				if (ep_buf[SFR_USB_STATUS_EP].flags & EP_OUT_HALT_FLAG)
 					stall_ep_out(SFR_USB_STATUS_EP);
 				else {
-
+#ifdef USB_ENDPOINT_WATCHDOG
+					ep_watchdog[SFR_USB_STATUS_EP][0].frames = 0;
+#endif
+#ifdef USB_BANDWIDTH_STATS
+					count_ep_transaction(SFR_USB_STATUS_EP, 0);
+#endif
 				}
 			}
 		}
@@ -919,6 +1290,15 @@ void usb_service(void)
 	
 	/* Check for Start-of-Frame interrupt. */
 	if (SFR_USB_SOF_IF) {
+#ifdef USB_FRAME_SCHEDULER
+		handle_frame_tasks();
+#endif
+#ifdef USB_ENDPOINT_WATCHDOG
+		handle_endpoint_watchdog();
+#endif
+#ifdef USB_BANDWIDTH_STATS
+		handle_bandwidth_stats();
+#endif
 #ifdef START_OF_FRAME_CALLBACK
 		START_OF_FRAME_CALLBACK();
 #endif
@@ -945,6 +1325,12 @@ void usb_send_in_buffer(uint8_t endpoint, size_t len)
 {
 	if ((g_configuration > 0 || endpoint == 0) && !usb_in_endpoint_halted(endpoint)) {
 		uint8_t pid;
+#ifdef USB_BANDWIDTH_STATS
+		if (endpoint > 0) {
+			count_ep_transaction(endpoint, 1);
+			ep_buf[endpoint].flags |= EP_IN_USED_FLAG|EP_IN_UNCOUNTED_FLAG;
+		}
+#endif
 		pid = !bds[endpoint].ep_in.STAT.DTS;
 		bds[endpoint].ep_in.STAT.BDnSTAT = 0;
 
@@ -981,6 +1367,10 @@ bool usb_out_endpoint_has_data(uint8_t endpoint)
 void usb_arm_out_endpoint(uint8_t endpoint)
 {
 	uint8_t pid = !bds[endpoint].ep_out.STAT.DTS;
+#ifdef USB_BANDWIDTH_STATS
+	count_ep_transaction(endpoint, 0);
+	ep_buf[endpoint].flags |= EP_OUT_UNCOUNTED_FLAG;
+#endif
 	if (pid)
 		SET_BDN(bds[endpoint].ep_out,
 			BDNSTAT_UOWN|BDNSTAT_DTS|BDNSTAT_DTSEN,
@@ -1007,18 +1397,166 @@ void usb_start_receive_ep0_data_stage(char *buffer, size_t len,
 	ep0_data_stage_context = context;
 }
 
+#ifdef USB_EP0_DATA_STAGE_PACKETS
+void usb_start_receive_ep0_data_stage_packets(size_t len,
+	usb_ep0_data_stage_packet_callback packet_callback,
+	usb_ep0_data_stage_callback callback, void *context)
+{
+	reset_ep0_data_stage();
+
+	ep0_data_stage_callback = callback;
+	ep0_data_stage_packet_callback = packet_callback;
+	ep0_data_stage_buf_remaining = len;
+	ep0_data_stage_context = context;
+}
+#endif
+
 void usb_send_data_stage(char *buffer, size_t len,
 	usb_ep0_data_stage_callback callback, void *context)
 {
 	/* Start sending the first block. Subsequent blocks will be sent
-	   when IN tokens are received on endpoint zero. */
-	start_control_return(buffer, len, len);
+	   when IN tokens are received on endpoint zero. If the application
+	   returns less than wLength, the stack ends the data stage with a
+	   zero-length packet where one is needed. */
+#ifdef USB_EP0_DATA_STAGE_PACKETS
+	ep0_data_stage_in_packet_callback = NULL;
+#endif
+	start_control_return(buffer, len, ep0_setup_wlength);
+
+	ep0_data_stage_callback = callback;
+	ep0_data_stage_context = context;
+}
+
+#ifdef USB_EP0_DATA_STAGE_PACKETS
+void usb_send_data_stage_packets(size_t len,
+	usb_ep0_data_stage_in_packet_callback packet_callback,
+	usb_ep0_data_stage_callback callback, void *context)
+{
+	/* The first packet is filled by start_control_return(), so the
+	   callbacks have to be in place before it's called. */
+	ep0_data_stage_in_packet_callback = packet_callback;
+	ep0_data_stage_callback = callback;
+	ep0_data_stage_context = context;
+
+	start_control_return(NULL, len, ep0_setup_wlength);
+}
+#endif
 
+void usb_defer_data_stage(usb_ep0_data_stage_callback callback, void *context)
+{
+	/* Nothing is armed on EP 0 IN, so the SIE NAKs the data stage until
+	   usb_send_data_stage() is called. The callback is only called from
+	   here on if the host abandons the transfer with a new SETUP. */
 	ep0_data_stage_callback = callback;
 	ep0_data_stage_context = context;
 }
 
 
+#ifdef USB_BANDWIDTH_STATS
+const struct usb_bandwidth_stats *usb_get_bandwidth_stats(void)
+{
+	return &bandwidth_stats;
+}
+
+void usb_clear_bandwidth_stats(void)
+{
+	memset(&bandwidth_stats, 0, sizeof(bandwidth_stats));
+	memset(frame_bytes, 0, sizeof(frame_bytes));
+}
+#endif
+
+#ifdef USB_ENDPOINT_WATCHDOG
+void usb_set_endpoint_watchdog(uint8_t endpoint, bool watch)
+{
+	uint8_t ep = endpoint & 0x0f;
+	struct ep_watchdog *wd;
+
+	if (ep == 0 || ep > NUM_ENDPOINT_NUMBERS)
+		return;
+
+	wd = &ep_watchdog[ep][(endpoint & 0x80)? 1: 0];
+	wd->frames = 0;
+	wd->watched = watch;
+}
+
+uint16_t usb_get_endpoint_watchdog_incidents(uint8_t endpoint)
+{
+	uint8_t ep = endpoint & 0x0f;
+	if (ep > NUM_ENDPOINT_NUMBERS)
+		return 0;
+	return ep_watchdog[ep][(endpoint & 0x80)? 1: 0].incidents;
+}
+#endif
+
+#ifdef USB_FRAME_SCHEDULER
+int8_t usb_add_frame_task(usb_frame_task_func func, void *context,
+                          uint16_t period, uint16_t phase, uint8_t flags)
+{
+	int8_t i;
+
+	if (!func || period == 0)
+		return -1;
+
+	for (i = 0; i < USB_FRAME_SCHEDULER_MAX_TASKS; i++) {
+		struct frame_task *t = &frame_tasks[i];
+		if (t->func)
+			continue;
+
+		t->context = context;
+		t->period = period;
+		t->countdown = phase;
+		t->overruns = 0;
+		t->flags = flags;
+		t->pending = 0;
+
+		/* Setting func last makes the slot live. */
+		t->func = func;
+		return i;
+	}
+
+	return -1;
+}
+
+void usb_remove_frame_task(int8_t task)
+{
+	if (task >= 0 && task < USB_FRAME_SCHEDULER_MAX_TASKS)
+		frame_tasks[task].func = NULL;
+}
+
+void usb_run_frame_tasks(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < USB_FRAME_SCHEDULER_MAX_TASKS; i++) {
+		struct frame_task *t = &frame_tasks[i];
+		usb_frame_task_func func = t->func;
+
+		if (!func || !t->pending)
+			continue;
+
+		t->pending = 0;
+		func(frame_number, t->context);
+	}
+}
+
+uint16_t usb_get_frame_number(void)
+{
+	return frame_number;
+}
+
+uint16_t usb_get_missed_frames(void)
+{
+	return missed_frames;
+}
+
+uint16_t usb_get_frame_task_overruns(int8_t task)
+{
+	if (task < 0 || task >= USB_FRAME_SCHEDULER_MAX_TASKS)
+		return 0;
+	return frame_tasks[task].overruns;
+}
+#endif
+
 
 #ifdef USB_USE_INTERRUPTS
 #ifdef __XC16__
@@ -1032,6 +1570,14 @@ void _ISR __attribute((auto_psv)) _USB1Interrupt()
 #elif __XC8
 	/* On these systems, interupt handlers are shared. An interrupt
 	 * handler from the application must call usb_service(). */
+#elif __linux__
+
+/* The virtual SIE (sim/sie.c) calls this as the USB interrupt vector. */
+void sim_usb_interrupt(void)
+{
+	usb_service();
+}
+
 #else
 #error Compiler not supported yet
 #endif
@@ -64,6 +64,9 @@
 #define SFR_USB_STATUS_DIR       USTATbits.DIR
 #define SFR_USB_STATUS_PPBI      USTATbits.PPBI
 
+#define SFR_USB_FRAME_NUM_L      UFRML
+#define SFR_USB_FRAME_NUM_H      UFRMH
+
 #define CLEAR_ALL_USB_IF()       SFR_USB_INTERRUPT_FLAGS = 0 /*TODO TEST!*/
 #define CLEAR_USB_RESET_IF()     SFR_USB_RESET_IF = 0
 #define CLEAR_USB_STALL_IF()     SFR_USB_STALL_IF = 0
@@ -200,6 +203,9 @@ struct buffer_descriptor {
 #define SFR_USB_STATUS_DIR       USTATbits.DIR
 #define SFR_USB_STATUS_PPBI      USTATbits.PPBI
 
+#define SFR_USB_FRAME_NUM_L      UFRML
+#define SFR_USB_FRAME_NUM_H      UFRMH
+
 #define CLEAR_ALL_USB_IF()       SFR_USB_INTERRUPT_FLAGS = 0 /*TODO TEST!*/
 #define CLEAR_USB_RESET_IF()     SFR_USB_RESET_IF = 0
 #define CLEAR_USB_STALL_IF()     SFR_USB_STALL_IF = 0
@@ -339,6 +345,9 @@ struct buffer_descriptor {
 #define SFR_USB_STATUS_DIR       U1STATbits.DIR
 #define SFR_USB_STATUS_PPBI      U1STATbits.PPBI
 
+#define SFR_USB_FRAME_NUM_L      U1FRML
+#define SFR_USB_FRAME_NUM_H      U1FRMH
+
 #define SFR_USB_POWER            U1PWRCbits.USBPWR
 #define SFR_BD_ADDR_REG          U1BDTP1
 
@@ -409,6 +418,115 @@ struct buffer_descriptor {
 #define FAR
 #define memcpy_from_rom(x,y,z) memcpy(x,y,z);
 
+#elif __linux__
+
+/* Linux host, running against the virtual SIE in sim/. The SFRs are plain
+ * variables declared in sim/include/xc.h. */
+
+#define USB_NEEDS_SET_BD_ADDR_PTR
+
+#define BDNADR_TYPE              void *
+
+#define SET_PING_PONG_MODE(n)    UCFGbits.PPB = n
+
+#define SFR_USB_INTERRUPT_FLAGS  UIRbits
+#define SFR_USB_RESET_IF         UIRbits.URSTIF
+#define SFR_USB_STALL_IF         UIRbits.STALLIF
+#define SFR_USB_TOKEN_IF         UIRbits.TRNIF
+#define SFR_USB_SOF_IF           UIRbits.SOFIF
+#define SFR_USB_IF               USBINTbits.USBIF
+
+#define SFR_USB_INTERRUPT_EN     UIE
+#define SFR_TRANSFER_IE          UIEbits.TRNIE
+#define SFR_STALL_IE             UIEbits.STALLIE
+#define SFR_RESET_IE             UIEbits.URSTIE
+#define SFR_SOF_IE               UIEbits.SOFIE
+#define SFR_USB_IE               USBINTbits.USBIE
+
+#define SFR_USB_EXTENDED_INTERRUPT_EN UEIE
+
+#define SFR_EP_MGMT_TYPE         sim_uep_bits_t
+#define SFR_EP_MGMT(n)           UEPbits[n]
+#define SFR_EP_MGMT_HANDSHAKE    EPHSHK
+#define SFR_EP_MGMT_STALL        EPSTALL
+#define SFR_EP_MGMT_OUT_EN       EPOUTEN
+#define SFR_EP_MGMT_IN_EN        EPINEN
+#define SFR_EP_MGMT_CON_DIS      EPCONDIS /* disable control transfers */
+
+#define SFR_USB_ADDR             UADDR
+#define SFR_USB_EN               UCONbits.USBEN
+#define SFR_USB_PKT_DIS          UCONbits.PKTDIS
+
+#define SFR_USB_STATUS_EP        USTATbits.ENDP
+#define SFR_USB_STATUS_DIR       USTATbits.DIR
+#define SFR_USB_STATUS_PPBI      USTATbits.PPBI
+
+#define SFR_USB_FRAME_NUM_L      UFRML
+#define SFR_USB_FRAME_NUM_H      UFRMH
+
+#define SFR_BD_ADDR_PTR          UBDTP
+
+#define CLEAR_ALL_USB_IF()       sim_clear_uir()
+#define CLEAR_USB_RESET_IF()     SFR_USB_RESET_IF = 0
+#define CLEAR_USB_STALL_IF()     SFR_USB_STALL_IF = 0
+#define CLEAR_USB_TOKEN_IF()     sim_clear_trnif()
+#define CLEAR_USB_SOF_IF()       SFR_USB_SOF_IF = 0
+
+/* The buffer descriptor has the same layout as on the 8-bit parts, except
+ * that BDnADR is a native pointer. See the comment in the 8-bit section
+ * above for more information on buffer descriptors. */
+#define BDNSTAT_UOWN   0x80
+#define BDNSTAT_DTS    0x40
+#define BDNSTAT_DTSEN  0x08
+#define BDNSTAT_BSTALL 0x04
+#define BDNCNT_MASK    0x03ff /* 10 bits of BDnCNT in BDnSTAT_CNT */
+
+struct buffer_descriptor {
+	union {
+		struct {
+			/* When receiving from the SIE. (USB Mode) */
+			uint8_t BC8 : 1;
+			uint8_t BC9 : 1;
+			uint8_t PID : 4; /* See enum PID */
+			uint8_t reserved: 1;
+			uint8_t UOWN : 1;
+		};
+		struct {
+			/* When giving to the SIE (CPU Mode) */
+			uint8_t /*BC8*/ : 1;
+			uint8_t /*BC9*/ : 1;
+			uint8_t BSTALL : 1;
+			uint8_t DTSEN : 1;
+			uint8_t INCDIS : 1;
+			uint8_t KEN : 1;
+			uint8_t DTS : 1;
+			uint8_t /*UOWN*/ : 1;
+		};
+		uint8_t BDnSTAT;
+	} STAT;
+	uint8_t BDnCNT;
+	BDNADR_TYPE BDnADR;
+};
+
+#ifdef LARGE_EP
+#define SET_BDN(REG, FLAGS, CNT) do { REG.BDnCNT = (CNT); \
+           REG.STAT.BDnSTAT = (FLAGS) | ((CNT) & 0x300) >> 8; } while(0)
+#define BDN_LENGTH(REG) ( (REG.STAT.BDnSTAT & 0x03) << 8 | REG.BDnCNT )
+#else
+#define SET_BDN(REG, FLAGS, CNT) do { REG.BDnCNT = (CNT); \
+                                      REG.STAT.BDnSTAT = (FLAGS); } while(0)
+#define BDN_LENGTH(REG) (REG.BDnCNT)
+#endif
+
+#define BD_ADDR
+#define BUFFER_ADDR
+#define BD_ATTR_TAG
+#define XC8_BUFFER_ADDR_TAG
+
+/* Compiler stuff. Probably should be somewhere else. */
+#define FAR
+#define memcpy_from_rom(x,y,z) memcpy(x,y,z);
+
 #else
 	#error "Your architecture is not supported"
 #endif